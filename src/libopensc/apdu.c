@@ -24,9 +24,22 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <string.h>
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 #include "internal.h"
 
+#ifndef O_NOFOLLOW
+#define O_NOFOLLOW 0
+#endif
+
 /*********************************************************************/
 /*   low level APDU handling functions                               */
 /*********************************************************************/
@@ -170,19 +183,7 @@ static int sc_apdu2bytes(sc_context_t *ctx, const sc_apdu_t *apdu,
 
 void sc_apdu_log(sc_context_t *ctx, int level, const u8 *data, size_t len, int is_out)
 {
-	size_t blen = len * 5 + 128;
-	char   *buf = malloc(blen);
-	if (buf == NULL)
-		return;
-
-	sc_hex_dump(ctx, level, data, len, buf, blen);
-
-	sc_debug(ctx, level, "\n%s APDU data [%5u bytes] =====================================\n"
-		"%s"
-		"======================================================================\n",
-		is_out != 0 ? "Outgoing" : "Incoming", len,
-		buf);
-	free(buf);
+	sc_do_log_apdu(ctx, level, __FILE__, __LINE__, __FUNCTION__, data, len, is_out);
 }
 
 int sc_apdu_get_octets(sc_context_t *ctx, const sc_apdu_t *apdu, u8 **buf,
@@ -233,6 +234,206 @@ int sc_apdu_set_resp(sc_context_t *ctx, sc_apdu_t *apdu, const u8 *buf,
 	return SC_SUCCESS;
 }
 
+/*********************************************************************/
+/*   APDU trace recording                                            */
+/*********************************************************************/
+
+/* A trace file starts with SC_APDU_TRACE_MAGIC, followed by records of
+ *   type (1 byte), duration in microseconds (4 bytes),
+ *   length (2 bytes) and value of the first field,
+ *   length (2 bytes) and value of the second field,
+ * with all numbers big-endian. SC_APDU_TRACE_CONNECT records hold the
+ * reader name and the ATR, SC_APDU_TRACE_TRANSMIT records the command
+ * and the response including SW1 SW2. */
+
+static unsigned long sc_apdu_trace_now(void)
+{
+#ifndef _WIN32
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000000UL + tv.tv_usec;
+#else
+	return GetTickCount() * 1000UL;
+#endif
+}
+
+static void sc_apdu_trace_write(sc_context_t *ctx, int type, unsigned long usec,
+		const u8 *v1, size_t l1, const u8 *v2, size_t l2)
+{
+	u8 *rec, *p;
+
+	if (l1 > 0xFFFF || l2 > 0xFFFF)
+		return;
+	rec = malloc(9 + l1 + l2);
+	if (rec == NULL)
+		return;
+	p = rec;
+	*p++ = type;
+	*p++ = (usec >> 24) & 0xFF;
+	*p++ = (usec >> 16) & 0xFF;
+	*p++ = (usec >> 8) & 0xFF;
+	*p++ = usec & 0xFF;
+	*p++ = (l1 >> 8) & 0xFF;
+	*p++ = l1 & 0xFF;
+	memcpy(p, v1, l1);
+	p += l1;
+	*p++ = (l2 >> 8) & 0xFF;
+	*p++ = l2 & 0xFF;
+	memcpy(p, v2, l2);
+	p += l2;
+
+	/* one unbuffered fwrite() per record, so that the records of
+	 * other threads and processes do not interleave with it */
+	fwrite(rec, 1, p - rec, ctx->apdu_trace);
+	sc_mem_clear(rec, p - rec);
+	free(rec);
+}
+
+int sc_apdu_trace_open(sc_context_t *ctx, const char *filename)
+{
+	size_t magic = strlen(SC_APDU_TRACE_MAGIC);
+	char hdr[16];
+	FILE *f;
+#ifndef _WIN32
+	int fd;
+#endif
+
+	if (ctx->apdu_trace != NULL)
+		return SC_SUCCESS;
+#ifndef _WIN32
+	/* The trace holds card data: keep it private to the user, don't
+	 * follow symlinks, and append to the trace of other processes
+	 * rather than truncate it */
+	f = NULL;
+	fd = open(filename, O_RDWR | O_CREAT | O_APPEND | O_NOFOLLOW, 0600);
+	if (fd >= 0 && (f = fdopen(fd, "a+b")) == NULL)
+		close(fd);
+#else
+	f = fopen(filename, "a+b");
+#endif
+	if (f == NULL) {
+		sc_debug(ctx, SC_LOG_DEBUG_NORMAL, "cannot open APDU trace %s", filename);
+		return SC_ERROR_INTERNAL;
+	}
+	/* A record is written with one write(), in between those of
+	 * other processes */
+	setvbuf(f, NULL, _IONBF, 0);
+
+	if (fseek(f, 0, SEEK_END) != 0 || ftell(f) != 0) {
+		rewind(f);
+		if (fread(hdr, 1, magic, f) != magic || memcmp(hdr, SC_APDU_TRACE_MAGIC, magic) != 0) {
+			sc_debug(ctx, SC_LOG_DEBUG_NORMAL, "%s is not an APDU trace", filename);
+			fclose(f);
+			return SC_ERROR_INTERNAL;
+		}
+	} else {
+		fwrite(SC_APDU_TRACE_MAGIC, 1, magic, f);
+	}
+	ctx->apdu_trace = f;
+	return SC_SUCCESS;
+}
+
+void sc_apdu_trace_close(sc_context_t *ctx)
+{
+	if (ctx->apdu_trace != NULL)
+		fclose(ctx->apdu_trace);
+	ctx->apdu_trace = NULL;
+}
+
+void sc_apdu_trace_connect(sc_reader_t *reader)
+{
+	if (reader->ctx->apdu_trace == NULL)
+		return;
+	sc_apdu_trace_write(reader->ctx, SC_APDU_TRACE_CONNECT, 0,
+			(const u8 *) reader->name, reader->name ? strlen(reader->name) : 0,
+			reader->atr.value, reader->atr.len);
+}
+
+/* Commands whose data is blanked out in APDU traces: PIN values and
+ * key material. Replay matches them on the header only. */
+int sc_apdu_trace_secret_cmd(unsigned int ins)
+{
+	switch (ins) {
+	case 0x20:	/* VERIFY */
+	case 0x21:
+	case 0x24:	/* CHANGE REFERENCE DATA */
+	case 0x2C:	/* RESET RETRY COUNTER */
+	case 0x46:	/* GENERATE ASYMMETRIC KEY PAIR */
+	case 0x47:
+	case 0xDA:	/* PUT DATA */
+	case 0xDB:
+		return 1;
+	}
+	return 0;
+}
+
+/* Responses blanked out: plain values returned by PERFORM SECURITY
+ * OPERATION, i.e. deciphered data, including what is left of them
+ * for GET RESPONSE */
+static int sc_apdu_trace_secret_resp(sc_reader_t *reader, const sc_apdu_t *apdu)
+{
+	int secret;
+
+	if (apdu->ins == 0x2A)
+		secret = apdu->p1 == 0x80;
+	else if (apdu->ins == 0xC0)
+		secret = reader->trace_secret_resp;
+	else
+		secret = 0;
+	reader->trace_secret_resp = secret && apdu->sw1 == 0x61;
+	return secret;
+}
+
+static void sc_apdu_trace_transmit(sc_reader_t *reader, const sc_apdu_t *apdu,
+		unsigned long usec)
+{
+	sc_context_t *ctx = reader->ctx;
+	u8 *cmd = NULL, *resp;
+	size_t cmdlen, off, i;
+
+	if (sc_apdu_get_octets(ctx, apdu, &cmd, &cmdlen, SC_PROTO_RAW) != SC_SUCCESS)
+		return;
+	if (apdu->datalen > 0 && sc_apdu_trace_secret_cmd(apdu->ins)) {
+		/* the data follows the header and Lc, which takes three
+		 * bytes in an extended APDU */
+		off = 4 + ((apdu->cse & SC_APDU_EXT) ? 3 : 1);
+		for (i = 0; i < apdu->datalen && off + i < cmdlen; i++)
+			cmd[off + i] = 0xFF;
+	}
+	resp = malloc(apdu->resplen + 2);
+	if (resp != NULL) {
+		if (sc_apdu_trace_secret_resp(reader, apdu))
+			memset(resp, 0xFF, apdu->resplen);
+		else if (apdu->resplen)
+			memcpy(resp, apdu->resp, apdu->resplen);
+		resp[apdu->resplen] = apdu->sw1;
+		resp[apdu->resplen + 1] = apdu->sw2;
+		sc_apdu_trace_write(ctx, SC_APDU_TRACE_TRANSMIT, usec,
+				cmd, cmdlen, resp, apdu->resplen + 2);
+		sc_mem_clear(resp, apdu->resplen + 2);
+		free(resp);
+	}
+	sc_mem_clear(cmd, cmdlen);
+	free(cmd);
+}
+
+/** Hands the APDU to the reader driver, recording it if a trace is open */
+static int sc_reader_transmit(sc_reader_t *reader, sc_apdu_t *apdu)
+{
+	unsigned long start;
+	int r;
+
+	if (reader->ctx->apdu_trace == NULL)
+		return reader->ops->transmit(reader, apdu);
+
+	start = sc_apdu_trace_now();
+	r = reader->ops->transmit(reader, apdu);
+	if (r == SC_SUCCESS)
+		sc_apdu_trace_transmit(reader, apdu, sc_apdu_trace_now() - start);
+	return r;
+}
+
 /*********************************************************************/
 /*   higher level APDU transfer handling functions                   */
 /*********************************************************************/
@@ -391,7 +592,7 @@ static int do_single_transmit(sc_card_t *card, sc_apdu_t *apdu)
 	/* send APDU to the reader driver */
 	if (card->reader->ops->transmit == NULL)
 		return SC_ERROR_NOT_SUPPORTED;
-	r = card->reader->ops->transmit(card->reader, apdu);
+	r = sc_reader_transmit(card->reader, apdu);
 	if (r != 0) {
 		sc_debug(ctx, SC_LOG_DEBUG_NORMAL, "unable to transmit APDU");
 		return r;
@@ -417,7 +618,7 @@ static int do_single_transmit(sc_card_t *card, sc_apdu_t *apdu)
 			if (card->type == SC_CARD_TYPE_BELPIC_EID)
 				msleep(40);
 			/* re-transmit the APDU with new Le length */
-			r = card->reader->ops->transmit(card->reader, apdu);
+			r = sc_reader_transmit(card->reader, apdu);
 			if (r != SC_SUCCESS) {
 				sc_debug(ctx, SC_LOG_DEBUG_NORMAL, "unable to transmit APDU");
 				return r;
@@ -515,6 +716,54 @@ static int do_single_transmit(sc_card_t *card, sc_apdu_t *apdu)
 	return SC_SUCCESS;
 }
 
+/* Returns 1 if the (interindustry) command cannot change the
+ * currently selected file */
+static int sc_apdu_keeps_selection(const sc_apdu_t *apdu)
+{
+	if (apdu->cla & 0x80)
+		return 0;
+	switch (apdu->ins) {
+	case 0x20:	/* VERIFY */
+	case 0x22:	/* MANAGE SECURITY ENVIRONMENT */
+	case 0x2A:	/* PERFORM SECURITY OPERATION */
+	case 0x84:	/* GET CHALLENGE */
+	case 0x88:	/* INTERNAL AUTHENTICATE */
+	case 0xC0:	/* GET RESPONSE */
+	case 0xCA:	/* GET DATA */
+	case 0xCB:
+		return 1;
+	case 0xB0:	/* READ BINARY */
+	case 0xD6:	/* UPDATE BINARY */
+		/* P1 bit 8 set: short EF identifier in P1 selects the EF */
+		return (apdu->p1 & 0x80) == 0;
+	case 0xB1:
+	case 0xD7:
+		/* P1-P2 is a file identifier, 0000 means the current EF */
+		return apdu->p1 == 0 && apdu->p2 == 0;
+	case 0xB2:	/* READ RECORD */
+	case 0xB3:
+	case 0xDC:	/* UPDATE RECORD */
+	case 0xDD:
+		/* short EF identifier in P2 selects the EF */
+		return (apdu->p2 & 0xF8) == 0;
+	}
+	return 0;
+}
+
+/* Returns 1 if the (interindustry) command cannot change the
+ * current security environment */
+static int sc_apdu_keeps_security_env(const sc_apdu_t *apdu)
+{
+	if (apdu->cla & 0x80)
+		return 0;
+	switch (apdu->ins) {
+	case 0x22:	/* MANAGE SECURITY ENVIRONMENT */
+	case 0xA4:	/* SELECT */
+		return 0;
+	}
+	return 1;
+}
+
 int sc_transmit_apdu(sc_card_t *card, sc_apdu_t *apdu)
 {
 	int r = SC_SUCCESS;
@@ -538,6 +787,15 @@ int sc_transmit_apdu(sc_card_t *card, sc_apdu_t *apdu)
 		return r;
 	} 
 
+	if (!sc_apdu_keeps_selection(apdu))
+		sc_invalidate_selection(card);
+	/* Every SELECT passes here, including those drivers send
+	 * themselves; see sc_pin_state() */
+	if (apdu->ins == 0xA4)
+		card->login.select_count++;
+	if (!sc_apdu_keeps_security_env(apdu))
+		sc_invalidate_security_env(card);
+
 	if ((apdu->flags & SC_APDU_FLAGS_CHAINING) != 0) {
 		/* divide et impera: transmit APDU in chunks with Lc <= max_send_size
 		 * bytes using command chaining */
@@ -545,6 +803,10 @@ int sc_transmit_apdu(sc_card_t *card, sc_apdu_t *apdu)
 		const u8  *buf = apdu->data;
 		size_t    max_send_size = card->max_send_size > 0 ? card->max_send_size : 255;
 
+		/* a short APDU carries at most 255 bytes, whatever the card takes */
+		if ((apdu->cse & SC_APDU_EXT) == 0 && max_send_size > 255)
+			max_send_size = 255;
+
 		while (len != 0) {
 			size_t    plen;
 			sc_apdu_t tapdu;
@@ -367,7 +367,8 @@ const u8 *sc_asn1_skip_tag(sc_context_t *ctx, const u8 ** buf, size_t *buflen,
 	size_t len = *buflen, taglen;
 	unsigned int cla, tag;
 
-	if (sc_asn1_read_tag((const u8 **) &p, len, &cla, &tag, &taglen) != SC_SUCCESS)
+	if (sc_asn1_read_tag((const u8 **) &p, len, &cla, &tag, &taglen) != SC_SUCCESS
+			|| p == NULL)
 		return NULL;
 	switch (cla & 0xC0) {
 	case SC_ASN1_TAG_UNIVERSAL:
@@ -1028,22 +1029,47 @@ static const struct sc_asn1_entry c_asn1_p15_obj[5] = {
 	{ NULL, 0, 0, 0, NULL, NULL }
 };
 
+/* Decode the accessControlRules of a PKCS#15 object: one rule template
+ * is reused for each SEQUENCE, instead of one template per possible rule */
+static int asn1_decode_access_rules(sc_context_t *ctx, void *arg,
+				    const u8 *in, size_t len, int depth)
+{
+	struct sc_pkcs15_object *p15_obj = (struct sc_pkcs15_object *) arg;
+	struct sc_asn1_entry asn1_ac_rule[3];
+	const u8 *obj;
+	size_t objlen;
+	int r, ii;
+
+	if (len < 2)
+		return 0;
+	if (in[0] == 0 || in[0] == 0xFF)
+		return SC_ERROR_ASN1_END_OF_CONTENTS;
+
+	for (ii = 0; ii < SC_PKCS15_MAX_ACCESS_RULES; ii++) {
+		size_t access_mode_len = sizeof(p15_obj->access_rules[ii].access_mode);
+
+		obj = sc_asn1_skip_tag(ctx, &in, &len, SC_ASN1_TAG_SEQUENCE | SC_ASN1_CONS, &objlen);
+		if (obj == NULL)
+			break;
+		sc_copy_asn1_entry(c_asn1_access_control_rule, asn1_ac_rule);
+		sc_format_asn1_entry(asn1_ac_rule + 0, &p15_obj->access_rules[ii].access_mode, &access_mode_len, 0);
+		sc_format_asn1_entry(asn1_ac_rule + 1, &p15_obj->access_rules[ii].auth_id, NULL, 0);
+		r = asn1_decode(ctx, asn1_ac_rule, obj, objlen, NULL, NULL, 0, depth + 1);
+		if (r)
+			return r;
+	}
+	return 0;
+}
+
 static int asn1_decode_p15_object(sc_context_t *ctx, const u8 *in,
 				  size_t len, struct sc_asn1_pkcs15_object *obj,
 				  int depth)
 {
 	struct sc_pkcs15_object *p15_obj = obj->p15_obj;
 	struct sc_asn1_entry asn1_c_attr[6], asn1_p15_obj[5];
-	struct sc_asn1_entry asn1_ac_rules[SC_PKCS15_MAX_ACCESS_RULES + 1], asn1_ac_rule[SC_PKCS15_MAX_ACCESS_RULES][3];
 	size_t flags_len = sizeof(p15_obj->flags);
 	size_t label_len = sizeof(p15_obj->label);
-	size_t access_mode_len = sizeof(p15_obj->access_rules[0].access_mode);
-	int r, ii;
-
-	for (ii=0; ii<SC_PKCS15_MAX_ACCESS_RULES; ii++)
-		sc_copy_asn1_entry(c_asn1_access_control_rule, asn1_ac_rule[ii]);
-	sc_copy_asn1_entry(c_asn1_access_control_rules, asn1_ac_rules);
-
+	int r;
 
 	sc_copy_asn1_entry(c_asn1_com_obj_attr, asn1_c_attr);
 	sc_copy_asn1_entry(c_asn1_p15_obj, asn1_p15_obj);
@@ -1051,13 +1077,8 @@ static int asn1_decode_p15_object(sc_context_t *ctx, const u8 *in,
 	sc_format_asn1_entry(asn1_c_attr + 1, &p15_obj->flags, &flags_len, 0);
 	sc_format_asn1_entry(asn1_c_attr + 2, &p15_obj->auth_id, NULL, 0);
 	sc_format_asn1_entry(asn1_c_attr + 3, &p15_obj->user_consent, NULL, 0);
-
-	for (ii=0; ii<SC_PKCS15_MAX_ACCESS_RULES; ii++)   {
-		sc_format_asn1_entry(asn1_ac_rule[ii] + 0, &p15_obj->access_rules[ii].access_mode, &access_mode_len, 0);
-		sc_format_asn1_entry(asn1_ac_rule[ii] + 1, &p15_obj->access_rules[ii].auth_id, NULL, 0);
-		sc_format_asn1_entry(asn1_ac_rules + ii, asn1_ac_rule[ii], NULL, 0);
-	}
-	sc_format_asn1_entry(asn1_c_attr + 4, asn1_ac_rules, NULL, 0);
+	asn1_c_attr[4].type = SC_ASN1_CALLBACK;
+	sc_format_asn1_entry(asn1_c_attr + 4, asn1_decode_access_rules, p15_obj, 0);
 	
 	sc_format_asn1_entry(asn1_p15_obj + 0, asn1_c_attr, NULL, 0);
 	sc_format_asn1_entry(asn1_p15_obj + 1, obj->asn1_class_attr, NULL, 0);
@@ -1135,13 +1156,9 @@ static int asn1_decode_entry(sc_context_t *ctx,struct sc_asn1_entry *entry,
 
 	callback_func = parm;
 
-	sc_debug(ctx, SC_LOG_DEBUG_ASN1, "%*.*sdecoding '%s'\n", depth, depth, "", entry->name);
-
 	switch (entry->type) {
 	case SC_ASN1_STRUCT:
-		if (parm != NULL)
-			r = asn1_decode(ctx, (struct sc_asn1_entry *) parm, obj,
-				       objlen, NULL, NULL, 0, depth + 1);
+		/* structures are walked by asn1_decode() itself */
 		break;
 	case SC_ASN1_NULL:
 		break;
@@ -1156,11 +1173,8 @@ static int asn1_decode_entry(sc_context_t *ctx,struct sc_asn1_entry *entry,
 		break;
 	case SC_ASN1_INTEGER:
 	case SC_ASN1_ENUMERATED:
-		if (parm != NULL) {
+		if (parm != NULL)
 			r = sc_asn1_decode_integer(obj, objlen, (int *) entry->parm);
-			sc_debug(ctx, SC_LOG_DEBUG_ASN1, "%*.*sdecoding '%s' returned %d\n", depth, depth, "", 
-					entry->name, *((int *) entry->parm));
-		}
 		break;
 	case SC_ASN1_BIT_STRING_NI:
 	case SC_ASN1_BIT_STRING:
@@ -1307,91 +1321,223 @@ static int asn1_decode_entry(sc_context_t *ctx,struct sc_asn1_entry *entry,
 	return 0;
 }
 
-static int asn1_decode(sc_context_t *ctx, struct sc_asn1_entry *asn1,
-		       const u8 *in, size_t len, const u8 **newp, size_t *len_left,
-		       int choice, int depth)
+/* One template being decoded by asn1_decode() */
+struct asn1_decode_frame {
+	struct sc_asn1_entry *asn1;
+	int idx;
+	int choice;
+	const u8 *p;
+	size_t left;
+
+	/* header of the TLV at 'p', parsed once for all entries
+	 * probed at that position */
+	const u8 *hdr_at;
+	const u8 *hdr_obj;
+	unsigned int hdr_cla, hdr_tag;
+	size_t hdr_objlen;
+};
+
+#define SC_ASN1_MAX_DEPTH	32
+
+/* Returns 1 if the template tag 'tag_in' matches the parsed tag
+ * (cf. sc_asn1_skip_tag()) */
+static int asn1_tag_matches(unsigned int cla, unsigned int tag, unsigned int tag_in)
 {
-	int r, idx = 0;
-	const u8 *p = in, *obj;
-	struct sc_asn1_entry *entry = asn1;
-	size_t left = len, objlen;
+	static const unsigned int classes[4] = {
+		SC_ASN1_UNI, SC_ASN1_APP, SC_ASN1_CTX, SC_ASN1_PRV
+	};
 
-	sc_debug(ctx, SC_LOG_DEBUG_ASN1, "%*.*scalled, left=%u, depth %d%s\n",
-			       	depth, depth, "",
-				left, depth,
-				choice ? ", choice" : "");
+	if ((tag_in & SC_ASN1_CLASS_MASK) != classes[(cla & SC_ASN1_TAG_CLASS) >> 6])
+		return 0;
+	if (((cla & SC_ASN1_TAG_CONSTRUCTED) != 0) != ((tag_in & SC_ASN1_CONS) != 0))
+		return 0;
+	return (tag_in & SC_ASN1_TAG_MASK) == tag;
+}
 
-	if (left < 2) {
+/* Consume the next TLV of the frame if its tag matches, like
+ * sc_asn1_skip_tag() does */
+static const u8 *asn1_frame_skip_tag(struct asn1_decode_frame *f,
+				     unsigned int tag_in, size_t *objlen)
+{
+	const u8 *obj;
+
+	if (f->hdr_at != f->p) {
+		f->hdr_at = f->p;
+		f->hdr_obj = f->p;
+		if (sc_asn1_read_tag(&f->hdr_obj, f->left, &f->hdr_cla,
+				     &f->hdr_tag, &f->hdr_objlen) != SC_SUCCESS)
+			f->hdr_obj = NULL;
+		/* sc_asn1_read_tag() does not count the length octet */
+		else if (f->hdr_obj != NULL
+				&& f->hdr_objlen > f->left - (f->hdr_obj - f->p))
+			f->hdr_obj = NULL;
+	}
+	if (f->hdr_obj == NULL || !asn1_tag_matches(f->hdr_cla, f->hdr_tag, tag_in))
+		return NULL;
+	obj = f->hdr_obj;
+	f->left -= (obj - f->p) + f->hdr_objlen;
+	f->p = obj + f->hdr_objlen;
+	*objlen = f->hdr_objlen;
+	return obj;
+}
+
+/* Set up a frame for decoding 'asn1' from in/len.  Returns 1 if
+ * there is nothing to decode and all elements are optional. */
+static int asn1_frame_init(sc_context_t *ctx, struct asn1_decode_frame *f,
+			   struct sc_asn1_entry *asn1, const u8 *in, size_t len,
+			   int choice)
+{
+	f->asn1 = asn1;
+	f->idx = 0;
+	f->choice = choice;
+	f->p = in;
+	f->left = len;
+	f->hdr_at = NULL;
+
+	if (len < 2) {
 		while (asn1->name && (asn1->flags & SC_ASN1_OPTIONAL))
 			asn1++;
 		/* If all elements were optional, there's nothing
 		 * to complain about */
 		if (asn1->name == NULL)
-			return 0;
+			return 1;
 		sc_debug(ctx, SC_LOG_DEBUG_ASN1, "End of ASN.1 stream, "
 			      "non-optional field \"%s\" not found\n",
 			      asn1->name);
 		return SC_ERROR_ASN1_OBJECT_NOT_FOUND;
 	}
-	if (p[0] == 0 || p[0] == 0xFF || len == 0)
+	if (in[0] == 0 || in[0] == 0xFF)
 		return SC_ERROR_ASN1_END_OF_CONTENTS;
+	return 0;
+}
 
-	for (idx = 0; asn1[idx].name != NULL; idx++) {
-		entry = &asn1[idx];
+/*
+ * Decode 'in' according to the template 'asn1'.  Nested structures
+ * and CHOICEs are walked with an explicit stack of frames instead of
+ * recursion; every other element type is handed to asn1_decode_entry().
+ * Returns the index of the matching entry for a CHOICE, 0 otherwise.
+ */
+static int asn1_decode(sc_context_t *ctx, struct sc_asn1_entry *asn1,
+		       const u8 *in, size_t len, const u8 **newp, size_t *len_left,
+		       int choice, int depth)
+{
+	struct asn1_decode_frame stack[SC_ASN1_MAX_DEPTH], *f;
+	struct sc_asn1_entry *entry;
+	const u8 *obj;
+	size_t objlen;
+	int sp = 0, r;
+
+	r = asn1_frame_init(ctx, &stack[0], asn1, in, len, choice);
+	if (r == 1)
+		return 0;
+	if (r < 0)
+		return r;
 
-		sc_debug(ctx, SC_LOG_DEBUG_ASN1,
-			"Looking for '%s', tag 0x%x%s%s\n",
-			entry->name, entry->tag, choice? ", CHOICE" : "",
-			(entry->flags & SC_ASN1_OPTIONAL)? ", OPTIONAL": "");
+	for (;;) {
+		f = &stack[sp];
+		entry = &f->asn1[f->idx];
+
+		if (entry->name == NULL) {
+			if (f->choice) /* No match */
+				return SC_ERROR_ASN1_OBJECT_NOT_FOUND;
+			goto frame_done;
+		}
+
+		if (sp + 1 >= SC_ASN1_MAX_DEPTH
+				&& (entry->type == SC_ASN1_CHOICE || entry->type == SC_ASN1_STRUCT)) {
+			sc_debug(ctx, SC_LOG_DEBUG_ASN1, "ASN.1 template nested too deep at '%s'\n",
+				entry->name);
+			return SC_ERROR_INVALID_ASN1_OBJECT;
+		}
 
 		/* Special case CHOICE has no tag */
 		if (entry->type == SC_ASN1_CHOICE) {
-			r = asn1_decode(ctx,
+			r = asn1_frame_init(ctx, &stack[sp + 1],
 				(struct sc_asn1_entry *) entry->parm,
-				p, left, &p, &left, 1, depth + 1);
-			if (r >= 0)
-				r = 0;
-			goto decode_ok;
+				f->p, f->left, 1);
+			if (r < 0)
+				return r;
+			sp++;
+			if (r == 1)
+				goto frame_done;
+			continue;
 		}
 
-		obj = sc_asn1_skip_tag(ctx, &p, &left, entry->tag, &objlen);
+		obj = asn1_frame_skip_tag(f, entry->tag, &objlen);
 		if (obj == NULL) {
-			sc_debug(ctx, SC_LOG_DEBUG_ASN1, "not present\n");
-			if (choice)
-				continue;
-			if (entry->flags & SC_ASN1_OPTIONAL)
+			if (f->choice || (entry->flags & SC_ASN1_OPTIONAL)) {
+				f->idx++;
 				continue;
+			}
 			sc_debug(ctx, SC_LOG_DEBUG_ASN1, "mandatory ASN.1 object '%s' not found\n", entry->name);
-			if (left) {
+			if (f->left) {
 				u8 line[128], *linep = line;
 				size_t i;
 
 				line[0] = 0;
-				for (i = 0; i < 10 && i < left; i++) {
-					sprintf((char *) linep, "%02X ", p[i]);
+				for (i = 0; i < 10 && i < f->left; i++) {
+					sprintf((char *) linep, "%02X ", f->p[i]);
 					linep += 3;
 				}
 				sc_debug(ctx, SC_LOG_DEBUG_ASN1, "next tag: %s\n", line);
 			}
-			SC_FUNC_RETURN(ctx, SC_LOG_DEBUG_ASN1, SC_ERROR_ASN1_OBJECT_NOT_FOUND);
+			return SC_ERROR_ASN1_OBJECT_NOT_FOUND;
 		}
-		r = asn1_decode_entry(ctx, entry, obj, objlen, depth);
 
-decode_ok:
+		if (entry->type == SC_ASN1_STRUCT && entry->parm != NULL) {
+			r = asn1_frame_init(ctx, &stack[sp + 1],
+				(struct sc_asn1_entry *) entry->parm,
+				obj, objlen, 0);
+			if (r < 0) {
+				sc_debug(ctx, SC_LOG_DEBUG_ASN1, "decoding of ASN.1 object '%s' failed: %s\n",
+					entry->name, sc_strerror(r));
+				return r;
+			}
+			sp++;
+			if (r == 1)
+				goto frame_done;
+			continue;
+		}
+
+		r = asn1_decode_entry(ctx, entry, obj, objlen, depth + sp);
 		if (r)
 			return r;
-		if (choice)
-			break;
- 	}
- 	if (choice && asn1[idx].name == NULL) /* No match */
-		SC_FUNC_RETURN(ctx, SC_LOG_DEBUG_ASN1, SC_ERROR_ASN1_OBJECT_NOT_FOUND);
- 	if (newp != NULL)
-		*newp = p;
- 	if (len_left != NULL)
-		*len_left = left;
-	if (choice)
-		SC_FUNC_RETURN(ctx, SC_LOG_DEBUG_ASN1, idx);
-	SC_FUNC_RETURN(ctx, SC_LOG_DEBUG_ASN1, 0);
+		if (!f->choice) {
+			f->idx++;
+			continue;
+		}
+
+frame_done:
+		/* The template of stack[sp] is complete: pop it and finish
+		 * the entry of the enclosing template it was started for */
+		for (;;) {
+			if (sp == 0)
+				goto out;
+			sp--;
+			f = &stack[sp];
+			entry = &f->asn1[f->idx];
+			if (entry->type == SC_ASN1_CHOICE) {
+				/* a CHOICE consumes from the enclosing template */
+				f->p = stack[sp + 1].p;
+				f->left = stack[sp + 1].left;
+			} else
+				entry->flags |= SC_ASN1_PRESENT;
+			if (!f->choice) {
+				f->idx++;
+				break;
+			}
+		}
+	}
+
+out:
+	f = &stack[0];
+	if (newp != NULL)
+		*newp = f->p;
+	if (len_left != NULL)
+		*len_left = f->left;
+	if (f->choice)
+		return f->idx;
+	return 0;
 }
 
 int sc_asn1_decode(sc_context_t *ctx, struct sc_asn1_entry *asn1,
@@ -192,6 +192,11 @@ static int cardos_init(sc_card_t *card)
 		_sc_card_add_rsa_alg(card, 2048, flags, 0);
 	}
 
+	/* cardos_select_file() only adds parsing of the security attributes */
+	card->caps |= SC_CARD_CAP_ISO_SELECT;
+	/* and set_security_env() only sends MSE */
+	card->caps |= SC_CARD_CAP_SE_CACHE;
+
 	return 0;
 }
 
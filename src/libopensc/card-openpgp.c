@@ -26,9 +26,12 @@
 
 #include "config.h"
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <errno.h>
+#include <limits.h>
 
 #include "internal.h"
 #include "asn1.h"
@@ -119,6 +122,7 @@ struct do_info {
 static int		pgp_get_card_features(sc_card_t *card);
 static int		pgp_finish(sc_card_t *card);
 static void		pgp_iterate_blobs(struct blob *, int, void (*func)());
+static void		pgp_prefetch(sc_card_t *card);
 
 static int		pgp_get_blob(sc_card_t *card, struct blob *blob,
 				 unsigned int id, struct blob **ret);
@@ -242,6 +246,8 @@ struct pgp_priv_data {
 	struct do_info		*pgp_objects;
 
 	sc_security_env_t	sec_env;
+
+	int			use_file_cache;	/* keep public keys in the cache directory */
 };
 
 
@@ -270,6 +276,7 @@ pgp_init(sc_card_t *card)
 	struct do_info	*info;
 	int		r;
 	struct blob 	*child = NULL;
+	scconf_block	*conf_block;
 
 	priv = calloc (1, sizeof *priv);
 	if (!priv)
@@ -278,6 +285,10 @@ pgp_init(sc_card_t *card)
 
 	card->cla = 0x00;
 
+	conf_block = sc_get_conf_block(card->ctx, "card_driver", "openpgp", 1);
+	if (conf_block)
+		priv->use_file_cache = scconf_get_bool(conf_block, "use_file_caching", 0);
+
 	/* set pointer to correct list of card objects */
 	priv->pgp_objects = (card->type == SC_CARD_TYPE_OPENPGP_V2)
 				? pgp2_objects : pgp1_objects;
@@ -330,6 +341,9 @@ pgp_init(sc_card_t *card)
 		}
 	}
 
+	/* read the constructed DOs most data is found in */
+	pgp_prefetch(card);
+
 	/* get card_features from ATR & DOs */
 	pgp_get_card_features(card);
 
@@ -667,6 +681,37 @@ pgp_get_blob(sc_card_t *card, struct blob *blob, unsigned int id,
 }
 
 
+/*
+ * internal: read the Application Related Data and the Cardholder Related
+ * Data, which hold most of the DOs the card has, with one GET DATA each.
+ * Simple DOs that can also be read on their own, like the AID and the
+ * historical bytes, are then taken from them instead of from the card.
+ */
+static void
+pgp_prefetch(sc_card_t *card)
+{
+	struct pgp_priv_data *priv = DRVDATA(card);
+	static const unsigned int ids[] = { 0x006e, 0x0065 };
+	struct blob	*blob, *part, *child;
+	size_t		i;
+
+	for (i = 0; i < sizeof(ids) / sizeof(ids[0]); i++) {
+		if (pgp_get_blob(card, priv->mf, ids[i], &blob) < 0
+		 || pgp_enumerate_blob(card, blob) < 0)
+			continue;
+
+		for (part = blob->files; part != NULL; part = part->next) {
+			if (part->data == NULL)
+				continue;
+			for (child = priv->mf->files; child != NULL; child = child->next) {
+				if (child->id == part->id && child->data == NULL)
+					pgp_set_blob(child, part->data, part->len);
+			}
+		}
+	}
+}
+
+
 /* ABI: SELECT FILE */
 static int
 pgp_select_file(sc_card_t *card, const sc_path_t *path, sc_file_t **ret)
@@ -793,16 +838,122 @@ pgp_write_binary(sc_card_t *card, unsigned int idx,
 }
 
 
+/*
+ * internal: with use_file_caching, public keys read from the card are kept
+ * in the cache directory, in a file named after the AID of the card, which
+ * contains its serial number. The fingerprint of the key from the
+ * Application Related Data is stored with it, and the file is only used
+ * while it still matches, i.e. until a new key is generated or imported.
+ */
+static int
+pgp_pubkey_cache_name(sc_card_t *card, unsigned int tag, u8 *fpr,
+		char *buf, size_t bufsize)
+{
+	struct pgp_priv_data *priv = DRVDATA(card);
+	struct blob	*blob;
+	char		dir[PATH_MAX], aid[33];
+	size_t		i, slot;
+	int		r;
+
+	if (!priv->use_file_cache || priv->mf->file->namelen != 16)
+		return SC_ERROR_NOT_SUPPORTED;
+
+	/* key fingerprints: signature, decryption, authentication */
+	slot = (tag == 0xb600) ? 0 : (tag == 0xb800) ? 1 : 2;
+	if ((r = pgp_get_blob(card, priv->mf, 0x006e, &blob)) < 0
+	 || (r = pgp_get_blob(card, blob, 0x0073, &blob)) < 0
+	 || (r = pgp_get_blob(card, blob, 0x00c5, &blob)) < 0)
+		return r;
+	if (blob->data == NULL || blob->len < 60)
+		return SC_ERROR_NOT_SUPPORTED;
+	memcpy(fpr, blob->data + 20 * slot, 20);
+	for (i = 0; i < 20 && fpr[i] == 0; i++)
+		;
+	if (i == 20)	/* no key */
+		return SC_ERROR_NOT_SUPPORTED;
+
+	r = sc_get_cache_dir(card->ctx, dir, sizeof(dir));
+	if (r != SC_SUCCESS)
+		return r;
+	sc_bin_to_hex(priv->mf->file->name, 16, aid, sizeof(aid), 0);
+	r = snprintf(buf, bufsize, "%s/openpgp_%s_%04X", dir, aid, tag);
+	if (r < 0 || (size_t)r >= bufsize)
+		return SC_ERROR_BUFFER_TOO_SMALL;
+	return SC_SUCCESS;
+}
+
+
+/* internal: read a public key from the cache file, if it is still valid */
+static int
+pgp_pubkey_cache_get(const char *filename, const u8 *fpr, u8 *buf, size_t buf_len)
+{
+	FILE		*f;
+	u8		stored[20];
+	size_t		n = 0;
+
+	if ((f = fopen(filename, "rb")) == NULL)
+		return SC_ERROR_FILE_NOT_FOUND;
+	if (fread(stored, 1, sizeof(stored), f) == sizeof(stored)
+	 && memcmp(stored, fpr, sizeof(stored)) == 0)
+		n = fread(buf, 1, buf_len, f);
+	fclose(f);
+
+	return n > 0 ? (int) n : SC_ERROR_FILE_NOT_FOUND;
+}
+
+
+/* internal: write a public key to the cache file */
+static void
+pgp_pubkey_cache_put(sc_card_t *card, const char *filename, const u8 *fpr,
+		const u8 *buf, size_t buf_len)
+{
+	char		tmpname[PATH_MAX + 7];
+	FILE		*f;
+	int		fd, ok, r;
+
+	/* written aside and renamed, so readers never see part of it */
+	r = snprintf(tmpname, sizeof(tmpname), "%s.XXXXXX", filename);
+	if (r < 0 || (size_t)r >= sizeof(tmpname))
+		return;
+	fd = mkstemp(tmpname);
+	if (fd < 0 && errno == ENOENT && sc_make_cache_dir(card->ctx) == SC_SUCCESS) {
+		/* mkstemp() may have clobbered the template */
+		snprintf(tmpname, sizeof(tmpname), "%s.XXXXXX", filename);
+		fd = mkstemp(tmpname);
+	}
+	if (fd < 0)
+		return;
+	f = fdopen(fd, "wb");
+	if (f == NULL) {
+		close(fd);
+		remove(tmpname);
+		return;
+	}
+	ok = fwrite(fpr, 1, 20, f) == 20 && fwrite(buf, 1, buf_len, f) == buf_len;
+	if (fclose(f) != 0 || !ok || rename(tmpname, filename) != 0) {
+		sc_log(card->ctx, "cannot cache public key in %s", filename);
+		remove(tmpname);
+	}
+}
+
+
 /* internal: get public key from card: as DF + sub-wEFs */
 static int
 pgp_get_pubkey(sc_card_t *card, unsigned int tag, u8 *buf, size_t buf_len)
 {
 	sc_apdu_t	apdu;
-	u8		idbuf[2];
-	int		r;
+	u8		idbuf[2], fpr[20];
+	char		cache[PATH_MAX];
+	int		cacheable, r;
 
 	sc_log(card->ctx, "called, tag=%04x\n", tag);
 
+	cacheable = pgp_pubkey_cache_name(card, tag, fpr, cache, sizeof(cache)) == SC_SUCCESS;
+	if (cacheable && (r = pgp_pubkey_cache_get(cache, fpr, buf, buf_len)) > 0) {
+		sc_log(card->ctx, "public key read from %s", cache);
+		LOG_FUNC_RETURN(card->ctx, r);
+	}
+
 	sc_format_apdu(card, &apdu, SC_APDU_CASE_4, 0x47, 0x81, 0);
 	apdu.lc = 2;
 	apdu.data = ushort2bebytes(idbuf, tag);
@@ -817,6 +968,9 @@ pgp_get_pubkey(sc_card_t *card, unsigned int tag, u8 *buf, size_t buf_len)
 	r = sc_check_sw(card, apdu.sw1, apdu.sw2);
 	LOG_TEST_RET(card->ctx, r, "Card returned error");
 
+	if (cacheable)
+		pgp_pubkey_cache_put(card, cache, fpr, buf, apdu.resplen);
+
 	LOG_FUNC_RETURN(card->ctx, apdu.resplen);
 }
 
@@ -25,8 +25,10 @@
 #include "config.h"
 
 #include <ctype.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
 #ifdef ENABLE_OPENSSL
@@ -146,6 +148,8 @@ typedef struct piv_private_data {
 	int keysWithOffCardCerts;
 	char * offCardCertURL;
 	int pin_preference; /* set from Discovery object */ 
+	int use_file_cache; /* keep objects in the cache directory */
+	char file_cache_key[48]; /* from the CHUID, empty until known */
 } piv_private_data_t;
 
 #define PIV_DATA(card) ((piv_private_data_t*)card->drv_data)
@@ -419,15 +423,58 @@ static size_t put_tag_and_len(unsigned int tag, size_t len, u8 **ptr)
 	return i;
 }
 
+/*
+ * Read the rest of a response which the card announced with 61xx.
+ * The buffer is grown to the length of the object as soon as its
+ * BER header has arrived, or by what the card announces otherwise.
+ */
+static int piv_get_response(sc_card_t *card, sc_apdu_t *apdu,
+	u8 **buf, size_t *bufsize)
+{
+	size_t len = apdu->resplen, need = 0, le, size, bodylen;
+	unsigned int cla_out, tag_out;
+	const u8 *body;
+	u8 *p;
+	int r;
+
+	r = apdu->sw2 ? apdu->sw2 : 256;
+	while (r > 0) {
+		le = r;
+		if (need == 0 && len >= 8) {
+			body = *buf;
+			if (sc_asn1_read_tag(&body, 0xffff, &cla_out, &tag_out, &bodylen) == SC_SUCCESS
+					&& body != NULL)
+				need = body - *buf + bodylen;
+		}
+		if (*bufsize < len + le) {
+			size = need > len + le ? need : len + le;
+			p = realloc(*buf, size);
+			if (p == NULL)
+				return SC_ERROR_OUT_OF_MEMORY;
+			*buf = p;
+			*bufsize = size;
+		}
+		r = card->ops->get_response(card, &le, *buf + len);
+		if (r < 0)
+			return r;
+		len += le;
+	}
+
+	apdu->resplen = len;
+	apdu->sw1 = 0x90;
+	apdu->sw2 = 0x00;
+	return SC_SUCCESS;
+}
+
 /*
  * Send a command and receive data. There is always something to send. 
  * Used by  GET DATA, PUT DATA, GENERAL AUTHENTICATE 
  * and GENERATE ASYMMETRIC KEY PAIR.
- * GET DATA may call to get the first 128 bytes to get the lenght from the tag. 
  *
  * A caller may provide a buffer, and length to read. If not provided,
- * an internal 4096 byte buffer is used, and a copy is returned to the
- * caller. that need to be freed by the caller.   
+ * the response is read into an allocated buffer, sized from the
+ * length of the returned object, which is returned to the caller
+ * and needs to be freed by the caller.
  */
 
 static int piv_general_io(sc_card_t *card, int ins, int p1, int p2, 
@@ -436,9 +483,9 @@ static int piv_general_io(sc_card_t *card, int ins, int p1, int p2,
 {
 	int r;
 	sc_apdu_t apdu;
-	u8 rbufinitbuf[4096]; 
-	u8 *rbuf;
-	size_t rbuflen;
+	u8 *rbuf = NULL;
+	size_t rbuflen = 0;
+	int allocated = 0;
 	unsigned int cla_out, tag_out;
 	const u8 *body;
 	size_t bodylen;
@@ -449,23 +496,32 @@ static int piv_general_io(sc_card_t *card, int ins, int p1, int p2,
 	sc_debug(card->ctx, SC_LOG_DEBUG_NORMAL, "%02x %02x %02x %d : %d %d\n",
 		 ins, p1, p2, sendbuflen , card->max_send_size, card->max_recv_size);
 
-	rbuf = rbufinitbuf;
-	rbuflen = sizeof(rbufinitbuf);
-
 	/* if caller provided a buffer and length */
 	if (recvbuf && *recvbuf && recvbuflen && *recvbuflen) {
 		rbuf = *recvbuf;
 		rbuflen = *recvbuflen;
+	} else if (recvbuf) {
+		/* grown by piv_get_response() if the card has more */
+		rbuflen = 256;
+		rbuf = malloc(rbuflen);
+		if (rbuf == NULL)
+			SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_NORMAL, SC_ERROR_OUT_OF_MEMORY);
+		allocated = 1;
 	}
 
 	r = sc_lock(card);
-	if (r != SC_SUCCESS)
+	if (r != SC_SUCCESS) {
+		if (allocated)
+			free(rbuf);
 		SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_NORMAL, r);
+	}
 		
 	sc_format_apdu(card, &apdu, 
 			recvbuf ? SC_APDU_CASE_4_SHORT: SC_APDU_CASE_3_SHORT, 
 			ins, p1, p2);
 	apdu.flags |= SC_APDU_FLAGS_CHAINING;
+	if (allocated)
+		apdu.flags |= SC_APDU_FLAGS_NO_GET_RESP;
 
 	apdu.lc = sendbuflen;
 	apdu.datalen = sendbuflen;
@@ -486,6 +542,8 @@ static int piv_general_io(sc_card_t *card, int ins, int p1, int p2,
 
 	/* with new adpu.c and chaining, this actually reads the whole object */
 	r = sc_transmit_apdu(card, &apdu);
+	if (r == SC_SUCCESS && allocated && apdu.sw1 == 0x61)
+		r = piv_get_response(card, &apdu, &rbuf, &rbuflen);
 
 	sc_debug(card->ctx, SC_LOG_DEBUG_NORMAL,"DEE r=%d apdu.resplen=%d sw1=%02x sw2=%02x", 
 			r, apdu.resplen, apdu.sw1, apdu.sw2);
@@ -508,45 +566,41 @@ static int piv_general_io(sc_card_t *card, int ins, int p1, int p2,
 	 */  
 
 	
-	rbuflen = 0;  /* in case rseplen < 3  i.e. not parseable */
+	bodylen = 0;  /* in case rseplen < 3  i.e. not parseable */
 	if ( recvbuflen && recvbuf && apdu.resplen > 3) {
 		*recvbuflen = 0;
 		/* we should have all the tag data, so we have to tell sc_asn1_find_tag 
 		 * the buffer is bigger, so it will not produce "ASN1.tag too long!" */
 
 		body = rbuf;
-		if (sc_asn1_read_tag(&body, 0xffff, &cla_out, &tag_out, &bodylen) !=  SC_SUCCESS) 		{
+		if (sc_asn1_read_tag(&body, 0xffff, &cla_out, &tag_out, &bodylen) !=  SC_SUCCESS
+				|| body == NULL) {
 			/* only early beta cards had this problem */
 			sc_debug(card->ctx, SC_LOG_DEBUG_NORMAL, "***** received buffer tag MISSING ");
 			body = rbuf;
-			/* some readers/cards might return 6c 00 */ 
-			if (apdu.sw1 == 0x61  || apdu.sw2 == 0x6c ) 
-				bodylen = 12000;
-			else
-				bodylen = apdu.resplen;
+			bodylen = apdu.resplen;
 		}
 		
-		rbuflen = body - rbuf + bodylen;
-
-		/* if using internal buffer, alloc new one */
-		if (rbuf == rbufinitbuf) {
-			*recvbuf = malloc(rbuflen); 
-				sc_debug(card->ctx, SC_LOG_DEBUG_NORMAL, "DEE got buffer %p len %d",*recvbuf,  rbuflen);
-			if (*recvbuf == NULL) {
-				r = SC_ERROR_OUT_OF_MEMORY;
-				goto err;
-			}
-
-			memcpy(*recvbuf, rbuf, rbuflen); /* copy tag too */
+		bodylen += body - rbuf;
+		/* never return more than was received */
+		if (bodylen > apdu.resplen)
+			bodylen = apdu.resplen;
+
+		if (allocated) {
+			*recvbuf = rbuf;
+			rbuf = NULL;
+			sc_debug(card->ctx, SC_LOG_DEBUG_NORMAL, "DEE got buffer %p len %d",*recvbuf, bodylen);
 		}
 	} 
 
 	if (recvbuflen) { 
-		*recvbuflen =  rbuflen;
+		*recvbuflen =  bodylen;
 		r = *recvbuflen;
 	}
 
 err:
+	if (allocated && rbuf != NULL)
+		free(rbuf);
 	sc_unlock(card);
 	SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_NORMAL, r);
 }
@@ -844,7 +898,7 @@ static int piv_read_obj_from_file(sc_card_t * card, char * filename,
 		r = SC_ERROR_OUT_OF_MEMORY;
 		goto err;
 	}
-	memcpy(*buf, tagbuf, len); /* copy first or only part */
+	memcpy(*buf, tagbuf, len < rbuflen ? len : rbuflen); /* copy first or only part */
 	if (rbuflen > len) {
 		len = read(f, *buf + sizeof(tagbuf), rbuflen - sizeof(tagbuf)); /* read rest */  
 		if (len != rbuflen - sizeof(tagbuf)) {
@@ -862,6 +916,174 @@ err:
 	SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_NORMAL, r);
 }
 
+/*
+ * With use_file_caching, objects read from the card are also kept in
+ * the cache directory, so that the next process need not read the
+ * certificates again. The file names start with the GUID of the card
+ * and a hash of its CHUID, which is signed by the issuer and changes
+ * whenever the card is issued again. A kept object is only used once
+ * the start of the object on the card has been found the same, see
+ * piv_file_cache_check(). Compressed certificates are kept a second
+ * time, decompressed, in a file of their own.
+ */
+static int piv_file_cacheable(int enumtag)
+{
+	/* Public objects only: not the biometrics nor the printed
+	 * information, and not the CHUID which the names are made of */
+	switch (enumtag) {
+	case PIV_OBJ_CCC:
+	case PIV_OBJ_DISCOVERY:
+	case PIV_OBJ_HISTORY:
+		return 1;
+	}
+	return enumtag < PIV_OBJ_9B03 && (piv_objects[enumtag].flags & PIV_OBJECT_TYPE_CERT);
+}
+
+static int piv_get_cached_data(sc_card_t * card, int enumtag,
+			u8 **buf, size_t *buf_len);
+
+static int piv_file_cache_name(sc_card_t *card, int enumtag, int internal,
+	char *buf, size_t bufsize)
+{
+	piv_private_data_t * priv = PIV_DATA(card);
+	const u8 *body, *guid;
+	u8 *rbuf = NULL;
+	size_t rbuflen = 0, bodylen, guidlen = 0, i;
+	unsigned int h = 2166136261U; /* FNV-1a */
+	char dir[PATH_MAX];
+	int r;
+
+	if (!priv->use_file_cache || !piv_file_cacheable(enumtag))
+		return SC_ERROR_NOT_SUPPORTED;
+
+	if (priv->file_cache_key[0] == '\0') {
+		r = piv_get_cached_data(card, PIV_OBJ_CHUI, &rbuf, &rbuflen);
+		body = r > 0 ? sc_asn1_find_tag(card->ctx, rbuf, rbuflen, 0x53, &bodylen) : NULL;
+		if (body == NULL) {
+			sc_debug(card->ctx, SC_LOG_DEBUG_NORMAL, "no CHUID, objects are not cached");
+			priv->use_file_cache = 0;
+			return SC_ERROR_NOT_SUPPORTED;
+		}
+		guid = sc_asn1_find_tag(card->ctx, body, bodylen, 0x34, &guidlen);
+		if (guid == NULL || guidlen > 16)
+			guidlen = 0;
+		for (i = 0; i < rbuflen; i++)
+			h = (h ^ rbuf[i]) * 16777619U;
+
+		strcpy(priv->file_cache_key, "piv_");
+		for (i = 0; i < guidlen; i++)
+			sprintf(priv->file_cache_key + 4 + 2 * i, "%02X", guid[i]);
+		sprintf(priv->file_cache_key + 4 + 2 * guidlen, "_%08X", h);
+	}
+
+	r = sc_get_cache_dir(card->ctx, dir, sizeof(dir));
+	if (r != SC_SUCCESS)
+		return r;
+	r = snprintf(buf, bufsize, "%s/%s_%02X%02X%s", dir, priv->file_cache_key,
+			piv_objects[enumtag].containerid[0], piv_objects[enumtag].containerid[1],
+			internal ? "_cert" : "");
+	if (r < 0 || (size_t)r >= bufsize)
+		return SC_ERROR_BUFFER_TOO_SMALL;
+	return SC_SUCCESS;
+}
+
+static int piv_file_cache_get(sc_card_t *card, int enumtag, int internal,
+	u8 **buf, size_t *buf_len)
+{
+	char filename[PATH_MAX];
+
+	if (piv_file_cache_name(card, enumtag, internal, filename, sizeof(filename)) != SC_SUCCESS)
+		return 0;
+	return piv_read_obj_from_file(card, filename, buf, buf_len);
+}
+
+static void piv_file_cache_put(sc_card_t *card, int enumtag, int internal,
+	const u8 *buf, size_t buf_len)
+{
+	char filename[PATH_MAX], tmpname[PATH_MAX + 7];
+	FILE *f;
+	size_t n;
+	int fd, r;
+
+	if (piv_file_cache_name(card, enumtag, internal, filename, sizeof(filename)) != SC_SUCCESS)
+		return;
+
+	/* Written aside and renamed, so readers never see part of it */
+	r = snprintf(tmpname, sizeof(tmpname), "%s.XXXXXX", filename);
+	if (r < 0 || (size_t)r >= sizeof(tmpname))
+		return;
+	fd = mkstemp(tmpname);
+	if (fd < 0 && errno == ENOENT && sc_make_cache_dir(card->ctx) == SC_SUCCESS) {
+		/* mkstemp() may have clobbered the template */
+		snprintf(tmpname, sizeof(tmpname), "%s.XXXXXX", filename);
+		fd = mkstemp(tmpname);
+	}
+	if (fd < 0)
+		return;
+	f = fdopen(fd, "wb");
+	if (f == NULL) {
+		close(fd);
+		remove(tmpname);
+		return;
+	}
+	n = fwrite(buf, 1, buf_len, f);
+	if (fclose(f) != 0 || n != buf_len || rename(tmpname, filename) != 0) {
+		sc_debug(card->ctx, SC_LOG_DEBUG_NORMAL, "cannot cache object in %s", filename);
+		remove(tmpname);
+	}
+}
+
+static void piv_file_cache_drop(sc_card_t *card, int enumtag)
+{
+	char filename[PATH_MAX];
+
+	if (piv_file_cache_name(card, enumtag, 0, filename, sizeof(filename)) == SC_SUCCESS)
+		remove(filename);
+	if (piv_file_cache_name(card, enumtag, 1, filename, sizeof(filename)) == SC_SUCCESS)
+		remove(filename);
+}
+
+/*
+ * Whether an object kept in the cache directory is still the one on
+ * the card: the CHUID stays the same when a certificate is replaced.
+ * Only the first part of the object is read, which has its length and
+ * the start of the certificate, with its serial number and issuer.
+ */
+static int piv_file_cache_check(sc_card_t *card, int enumtag,
+	const u8 *buf, size_t buf_len)
+{
+	sc_apdu_t apdu;
+	u8 tagbuf[8], rbuf[256], *p;
+	int r;
+
+	p = tagbuf;
+	put_tag_and_len(0x5c, piv_objects[enumtag].tag_len, &p);
+	memcpy(p, piv_objects[enumtag].tag_value, piv_objects[enumtag].tag_len);
+	p += piv_objects[enumtag].tag_len;
+
+	sc_format_apdu(card, &apdu, SC_APDU_CASE_4_SHORT, 0xCB, 0x3F, 0xFF);
+	apdu.flags |= SC_APDU_FLAGS_NO_GET_RESP;
+	apdu.lc = p - tagbuf;
+	apdu.datalen = p - tagbuf;
+	apdu.data = tagbuf;
+	apdu.le = sizeof(rbuf);
+	apdu.resplen = sizeof(rbuf);
+	apdu.resp = rbuf;
+
+	r = sc_transmit_apdu(card, &apdu);
+	if (r != SC_SUCCESS)
+		return r;
+	if (apdu.sw1 != 0x61 && (apdu.sw1 != 0x90 || apdu.sw2 != 0x00))
+		return sc_check_sw(card, apdu.sw1, apdu.sw2);
+	/* All of the object when the card had no more */
+	if (apdu.sw1 == 0x90 && apdu.resplen != buf_len)
+		return SC_ERROR_OBJECT_NOT_VALID;
+	if (apdu.resplen == 0 || apdu.resplen > buf_len
+			|| memcmp(rbuf, buf, apdu.resplen) != 0)
+		return SC_ERROR_OBJECT_NOT_VALID;
+	return SC_SUCCESS;
+}
+
 /* the tag is the PIV_OBJ_*  */
 static int piv_get_data(sc_card_t * card, int enumtag, 
 			u8 **buf, size_t *buf_len)
@@ -883,48 +1105,11 @@ static int piv_get_data(sc_card_t * card, int enumtag,
 	memcpy(p, piv_objects[enumtag].tag_value, tag_len);
 	p += tag_len;
 
-	if (*buf_len == 1 && *buf == NULL) { /* we need to get the length */
-		u8 rbufinitbuf[8]; /* tag of 53 with 82 xx xx  will fit in 4 */
-		u8 *rbuf;
-		size_t rbuflen;
-		size_t bodylen;
-		unsigned int cla_out, tag_out;
-		const u8 *body;
-
-		sc_debug(card->ctx, SC_LOG_DEBUG_NORMAL,"get len of #%d", enumtag);
-		rbuf = rbufinitbuf;
-		rbuflen = sizeof(rbufinitbuf);
-		r = piv_general_io(card, 0xCB, 0x3F, 0xFF, tagbuf,  p - tagbuf,
-				&rbuf, &rbuflen);
-		if (r > 0) {
-			body = rbuf;
-			if (sc_asn1_read_tag(&body, 0xffff, &cla_out, &tag_out, &bodylen) !=  SC_SUCCESS) {
-				sc_debug(card->ctx, SC_LOG_DEBUG_NORMAL, "***** received buffer tag MISSING ");
-				r = SC_ERROR_FILE_NOT_FOUND;
-				goto err;
-			}
-		    *buf_len = r;
-		} else if ( r == 0) { 
-			r = SC_ERROR_FILE_NOT_FOUND;
-			goto err;
-		} else { 
-			goto err;
-		}
-	}
-sc_debug(card->ctx, SC_LOG_DEBUG_NORMAL,"get buffer for #%d len %d", enumtag, *buf_len);
-	if (*buf == NULL && *buf_len > 0) {
-		*buf = malloc(*buf_len);
-		if (*buf == NULL ) {
-			r = SC_ERROR_OUT_OF_MEMORY;
-			goto err;
-		}
-	}
-
+	/* The object is read in one pass: if no buffer is given,
+	 * piv_general_io() allocates one as large as the object */
 	r = piv_general_io(card, 0xCB, 0x3F, 0xFF, tagbuf,  p - tagbuf, 
 		buf, buf_len);
 
-err:
-
 	SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_NORMAL, r);
 }
 
@@ -977,10 +1162,25 @@ static int piv_get_cached_data(sc_card_t * card, int enumtag,
 		goto err;
 	} 
 
-	/* Not cached, try to get it, piv_get_data will allocate a buf */ 
-	sc_debug(card->ctx, SC_LOG_DEBUG_NORMAL,"get #%d",  enumtag);
-	rbuflen = 1; 
-	r = piv_get_data(card, enumtag, &rbuf, &rbuflen);
+	/* Not cached, see if it was kept in the cache directory, or try
+	 * to get it, piv_get_data will allocate a buf */ 
+	r = piv_file_cache_get(card, enumtag, 0, &rbuf, &rbuflen);
+	if (r > 0 && piv_file_cache_check(card, enumtag, rbuf, rbuflen) != SC_SUCCESS) {
+		sc_debug(card->ctx, SC_LOG_DEBUG_NORMAL,"#%d changed on the card", enumtag);
+		piv_file_cache_drop(card, enumtag);
+		free(rbuf);
+		rbuf = NULL;
+		r = 0;
+	}
+	if (r > 0) {
+		sc_debug(card->ctx, SC_LOG_DEBUG_NORMAL,"#%d from cache directory", enumtag);
+	} else {
+		sc_debug(card->ctx, SC_LOG_DEBUG_NORMAL,"get #%d",  enumtag);
+		rbuflen = 0;
+		r = piv_get_data(card, enumtag, &rbuf, &rbuflen);
+		if (r > 0)
+			piv_file_cache_put(card, enumtag, 0, rbuf, r);
+	}
 	if (r > 0) {
 		priv->obj_cache[enumtag].flags |= PIV_OBJ_CACHE_VALID;
 		priv->obj_cache[enumtag].obj_len = r;
@@ -1051,11 +1251,16 @@ static int piv_cache_internal_data(sc_card_t *card, int enumtag)
 	
 			if(compressed) {
 #ifdef ENABLE_ZLIB
-			size_t len;
+			size_t len = 0;
 			u8* newBuf = NULL;
-			if(SC_SUCCESS != sc_decompress_alloc(&newBuf, &len, tag, taglen, COMPRESSION_AUTO)) {
-				SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_NORMAL, SC_ERROR_OBJECT_NOT_VALID);
-			}      
+			if (piv_file_cache_get(card, enumtag, 1, &newBuf, &len) <= 0) {
+				newBuf = NULL;
+				len = 0;
+				if(SC_SUCCESS != sc_decompress_alloc(&newBuf, &len, tag, taglen, COMPRESSION_AUTO)) {
+					SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_NORMAL, SC_ERROR_OBJECT_NOT_VALID);
+				}
+				piv_file_cache_put(card, enumtag, 1, newBuf, len);
+			}
 			priv->obj_cache[enumtag].internal_obj_data = newBuf;
 			priv->obj_cache[enumtag].internal_obj_len = len;
 #else
@@ -1207,6 +1412,9 @@ static int piv_put_data(sc_card_t *card, int tag,
 	memcpy(p, buf, buf_len);
 	p += buf_len;
 
+	/* The copy in the cache directory is about to go stale */
+	piv_file_cache_drop(card, tag);
+
 	r = piv_general_io(card, 0xDB, 0x3F, 0xFF, 
 			sbuf, p - sbuf, NULL, NULL);
 
@@ -2521,6 +2729,7 @@ static int piv_init(sc_card_t *card)
 	unsigned long flags;
 	unsigned long ext_flags;
 	piv_private_data_t *priv;
+	scconf_block *conf_block;
 
 	SC_FUNC_CALLED(card->ctx, SC_LOG_DEBUG_VERBOSE);
 	priv = calloc(1, sizeof(piv_private_data_t));
@@ -2530,6 +2739,10 @@ static int piv_init(sc_card_t *card)
 	priv->aid_file = sc_file_new();
 	priv->selected_obj = -1;
 	priv->pin_preference = 0x80; /* 800-73-3 part 1, table 3 */
+
+	conf_block = sc_get_conf_block(card->ctx, "card_driver", "piv", 1);
+	if (conf_block)
+		priv->use_file_cache = scconf_get_bool(conf_block, "use_file_caching", 0);
 	
 	/* Some objects will only be present if Histroy object says so */
 	for (i=0; i < PIV_OBJ_LAST_ENUM -1; i++) {
@@ -2564,6 +2777,8 @@ static int piv_init(sc_card_t *card)
 	_sc_card_add_ec_alg(card, 384, flags, ext_flags);
 	
 	card->caps |= SC_CARD_CAP_RNG;
+	/* SP 800-73: VERIFY without data returns the PIN status */
+	card->caps |= SC_CARD_CAP_PIN_STATUS;
 
 	/* 
 	 * 800-73-3 cards may have a history object and/or a discovery object
@@ -217,6 +217,11 @@ static int setcos_init(sc_card_t *card)
 		}
 		break;
 	}
+
+	/* setcos_select_file() only adds parsing of the security attributes */
+	card->caps |= SC_CARD_CAP_ISO_SELECT;
+	/* and set_security_env() only sends MSE */
+	card->caps |= SC_CARD_CAP_SE_CACHE;
 	return 0;
 }
 
@@ -21,7 +21,10 @@
 #include "config.h"
 
 #include <assert.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <limits.h>
+#include <errno.h>
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
 #endif
@@ -55,6 +58,9 @@ void sc_format_apdu(sc_card_t *card, sc_apdu_t *apdu,
 	apdu->p2 = (u8) p2;
 }
 
+static struct sc_card_driver *lookup_atr_driver(sc_context_t *ctx, const struct sc_atr *atr);
+static void store_atr_driver(sc_context_t *ctx, const struct sc_atr *atr, struct sc_card_driver *drv);
+
 static sc_card_t * sc_card_new(sc_context_t *ctx)
 {
 	sc_card_t *card;
@@ -90,6 +96,7 @@ static void sc_card_free(sc_card_t *card)
 	sc_free_ef_atr(card);
 	if (card->ef_dir != NULL)
 		sc_file_free(card->ef_dir);
+	sc_invalidate_selection(card);
 	free(card->ops);
 	if (card->algorithms != NULL)
 		free(card->algorithms);
@@ -102,6 +109,146 @@ static void sc_card_free(sc_card_t *card)
 	free(card);
 }
 
+/* Binds card to drv if it recognises the card. Returns 1 if bound,
+ * 0 if the driver does not handle the card, or an error code */
+static int connect_driver(sc_card_t *card, struct sc_card_driver *drv)
+{
+	const struct sc_card_operations *ops = drv->ops;
+	int r;
+
+	if (ops == NULL || ops->match_card == NULL)
+		return 0;
+	/* Needed if match_card() needs to talk with the card (e.g. card-muscle) */
+	*card->ops = *ops;
+	if (ops->match_card(card) != 1)
+		return 0;
+	sc_debug(card->ctx, SC_LOG_DEBUG_MATCH, "matched: %s", drv->name);
+	memcpy(card->ops, ops, sizeof(struct sc_card_operations));
+	card->driver = drv;
+	r = ops->init(card);
+	if (r) {
+		sc_debug(card->ctx, SC_LOG_DEBUG_MATCH, "driver '%s' init() failed: %s", drv->name,
+		      sc_strerror(r));
+		card->driver = NULL;
+		if (r == SC_ERROR_INVALID_CARD)
+			return 0;
+		return r;
+	}
+	return 1;
+}
+
+/* Whether the card declares extended Lc and Le fields in the card
+ * capabilities of its historical bytes (ISO 7816-4, 8.1.1.2.7), or in
+ * those of EF.ATR if the driver has read it */
+static int card_declares_apdu_ext(sc_card_t *card)
+{
+	const u8 *hist = card->reader->atr_info.hist_bytes;
+	size_t len = card->reader->atr_info.hist_bytes_len, i;
+
+	if (card->ef_atr != NULL && (card->ef_atr->card_capabilities & 0x40))
+		return 1;
+	if (hist == NULL || len < 1 || (hist[0] != 0x00 && hist[0] != 0x80))
+		return 0;
+	/* compact-TLV objects, followed by a 3 byte status indicator
+	 * in category 00 */
+	if (hist[0] == 0x00) {
+		if (len < 4)
+			return 0;
+		len -= 3;
+	}
+	for (i = 1; i < len; i += 1 + (hist[i] & 0x0F)) {
+		if ((hist[i] & 0xF0) == 0x70 && (hist[i] & 0x0F) >= 3 && i + 3 < len)
+			return (hist[i + 3] & 0x40) != 0;
+	}
+	return 0;
+}
+
+#define APDU_EXT_DETECTED_CAP	0x01
+#define APDU_EXT_DETECTED_RECV	0x02
+#define APDU_EXT_DETECTED_SEND	0x04
+
+/* Use extended APDUs when both the card and the reader support them */
+static void detect_apdu_ext(sc_card_t *card)
+{
+	size_t max_send = 0, max_recv = SC_MAX_EXT_APDU_BUFFER_SIZE - 2;
+
+	if (!(card->reader->capabilities & SC_READER_CAP_APDU_EXT)
+			|| card->reader->active_protocol == SC_PROTO_T0)
+		return;
+
+	if (!(card->caps & SC_CARD_CAP_APDU_EXT)) {
+		if (!card_declares_apdu_ext(card))
+			return;
+		sc_log(card->ctx, "card and reader support extended APDUs");
+		card->caps |= SC_CARD_CAP_APDU_EXT;
+		card->apdu_ext_detected |= APDU_EXT_DETECTED_CAP;
+	}
+
+	/* The extended length information gives the sizes of the APDUs,
+	 * with the header, Lc and Le fields, and the status word */
+	if (card->ef_atr != NULL && card->ef_atr->max_command_apdu > 4 + 3 + 2 + 255)
+		max_send = card->ef_atr->max_command_apdu - (4 + 3 + 2);
+	if (max_send > SC_MAX_EXT_APDU_BUFFER_SIZE - 4 - 3 - 2)
+		max_send = SC_MAX_EXT_APDU_BUFFER_SIZE - 4 - 3 - 2;
+	if (card->ef_atr != NULL && card->ef_atr->max_response_apdu > 2
+			&& card->ef_atr->max_response_apdu - 2 < max_recv)
+		max_recv = card->ef_atr->max_response_apdu - 2;
+	/* The reader does not pass on anything longer, not even what the
+	 * driver has asked for */
+	if (card->reader->max_apdu_data != 0) {
+		size_t max_data = card->reader->max_apdu_data;
+
+		if (max_send > max_data)
+			max_send = max_data;
+		if (max_recv > max_data)
+			max_recv = max_data;
+		if (card->max_send_size > max_data)
+			card->max_send_size = max_data;
+		if (card->max_recv_size > max_data)
+			card->max_recv_size = max_data;
+	}
+
+	/* Only the ISO UPDATE and WRITE BINARY send extended APDUs; those
+	 * of the drivers may be limited to short ones */
+	if (card->max_send_size == 0 && max_send > 255
+			&& card->ops->update_binary == sc_get_iso7816_driver()->ops->update_binary
+			&& card->ops->write_binary == sc_get_iso7816_driver()->ops->write_binary) {
+		card->max_send_size = max_send;
+		card->apdu_ext_detected |= APDU_EXT_DETECTED_SEND;
+	}
+
+	/* Read whole files at once, unless the driver has a limit of its
+	 * own or its READ BINARY may not expect more than 256 bytes.
+	 * Without the extended length information, the size of the command
+	 * buffer of the card is not known, so writes are still split at
+	 * max_send_size */
+	if (card->max_recv_size == 0 && max_recv > 256
+			&& card->ops->read_binary == sc_get_iso7816_driver()->ops->read_binary) {
+		card->max_recv_size = max_recv;
+		card->apdu_ext_detected |= APDU_EXT_DETECTED_RECV;
+	}
+}
+
+/* The card has refused an extended APDU although it was thought to
+ * support them: go back to short APDUs, if sc_connect_card() had set
+ * them up on its own. Returns whether there was anything to undo */
+static int undo_apdu_ext(sc_card_t *card)
+{
+	unsigned int detected = card->apdu_ext_detected;
+
+	if (detected == 0)
+		return 0;
+	sc_log(card->ctx, "card refuses extended APDUs, using short ones");
+	if (detected & APDU_EXT_DETECTED_CAP)
+		card->caps &= ~SC_CARD_CAP_APDU_EXT;
+	if (detected & APDU_EXT_DETECTED_RECV)
+		card->max_recv_size = card->reader->driver->max_recv_size;
+	if (detected & APDU_EXT_DETECTED_SEND)
+		card->max_send_size = card->reader->driver->max_send_size;
+	card->apdu_ext_detected = 0;
+	return 1;
+}
+
 int sc_connect_card(sc_reader_t *reader, sc_card_t **card_out)
 {
 	sc_card_t *card;
@@ -128,6 +275,7 @@ int sc_connect_card(sc_reader_t *reader, sc_card_t **card_out)
 	card->ctx = ctx;
 
 	memcpy(&card->atr, &reader->atr, sizeof(card->atr));
+	sc_apdu_trace_connect(reader);
 
 	_sc_parse_atr(reader);
 
@@ -172,33 +320,38 @@ int sc_connect_card(sc_reader_t *reader, sc_card_t **card_out)
 			}
 		}
 	} else {
-		sc_debug(ctx, SC_LOG_DEBUG_MATCH, "matching built-in ATRs");
-		for (i = 0; ctx->card_drivers[i] != NULL; i++) {
+		struct sc_card_driver *cached = lookup_atr_driver(ctx, &card->atr);
+
+		/* A card with this ATR was bound before: try that driver
+		 * first and skip the probing of the ones before it */
+		if (cached != NULL) {
+			sc_debug(ctx, SC_LOG_DEBUG_MATCH, "trying cached driver: %s", cached->short_name);
+			r = connect_driver(card, cached);
+			if (r < 0)
+				goto err;
+			if (r == 0) {
+				sc_debug(ctx, SC_LOG_DEBUG_MATCH, "cached driver '%s' did not match", cached->short_name);
+				store_atr_driver(ctx, &card->atr, NULL);
+			}
+		}
+
+		if (card->driver == NULL)
+			sc_debug(ctx, SC_LOG_DEBUG_MATCH, "matching built-in ATRs");
+		for (i = 0; card->driver == NULL && ctx->card_drivers[i] != NULL; i++) {
 			struct sc_card_driver *drv = ctx->card_drivers[i];
-			const struct sc_card_operations *ops = drv->ops;
 
-			sc_debug(ctx, SC_LOG_DEBUG_MATCH, "trying driver: %s", drv->short_name);
-			if (ops == NULL || ops->match_card == NULL)
-				continue;
-			/* Needed if match_card() needs to talk with the card (e.g. card-muscle) */
-			*card->ops = *ops;
-			if (ops->match_card(card) != 1)
+			if (drv == cached)
 				continue;
-			sc_debug(ctx, SC_LOG_DEBUG_MATCH, "matched: %s", drv->name);
-			memcpy(card->ops, ops, sizeof(struct sc_card_operations));
-			card->driver = drv;
-			r = ops->init(card);
-			if (r) {
-				sc_debug(ctx, SC_LOG_DEBUG_MATCH, "driver '%s' init() failed: %s", drv->name,
-				      sc_strerror(r));
-				if (r == SC_ERROR_INVALID_CARD) {
-					card->driver = NULL;
-					continue;
-				}
+			sc_debug(ctx, SC_LOG_DEBUG_MATCH, "trying driver: %s", drv->short_name);
+			r = connect_driver(card, drv);
+			if (r < 0)
 				goto err;
-			}
-			break;
+			/* The default driver takes anything, don't let it shadow
+			 * a driver that may recognise the card later on */
+			if (r == 1 && strcmp(drv->short_name, "default") != 0)
+				store_atr_driver(ctx, &card->atr, drv);
 		}
+		r = 0;
 	}
 	if (card->driver == NULL) {
 		sc_debug(ctx, SC_LOG_DEBUG_MATCH, "unable to find driver for inserted card");
@@ -207,6 +360,9 @@ int sc_connect_card(sc_reader_t *reader, sc_card_t **card_out)
 	}
 	if (card->name == NULL)
 		card->name = card->driver->name;
+	if (card->ops->select_file == sc_get_iso7816_driver()->ops->select_file)
+		card->caps |= SC_CARD_CAP_ISO_SELECT;
+	detect_apdu_ext(card);
 	*card_out = card;
 
         /*  Override card limitations with reader limitations.
@@ -273,8 +429,8 @@ int sc_reset(sc_card_t *card, int do_cold_reset)
 
 	r = card->reader->ops->reset(card->reader, do_cold_reset);
 	/* invalidate cache */
-	memset(&card->cache, 0, sizeof(card->cache));
-	card->cache.valid = 0;
+	sc_invalidate_cache(card);
+	sc_invalidate_login_state(card);
 
 	r2 = sc_mutex_unlock(card->ctx, card->mutex);
 	if (r2 != SC_SUCCESS) {
@@ -301,13 +457,20 @@ int sc_lock(sc_card_t *card)
 			r = card->reader->ops->lock(card->reader);
 			if (r == SC_ERROR_CARD_RESET || r == SC_ERROR_READER_REATTACHED) {
 				/* invalidate cache */
-				memset(&card->cache, 0, sizeof(card->cache));
-				card->cache.valid = 0;
+				sc_invalidate_cache(card);
+				sc_invalidate_login_state(card);
 				r = card->reader->ops->lock(card->reader);
 			}
 		}
-		if (r == 0)
+		if (r == 0) {
 			card->cache.valid = 1;
+			card->login.lock_epoch++;
+			/* another application may have selected a
+			 * different file or set another security
+			 * environment since the lock was released */
+			sc_invalidate_selection(card);
+			sc_invalidate_security_env(card);
+		}
 	}
 	if (r == 0)
 		card->lock_count++;
@@ -337,8 +500,7 @@ int sc_unlock(sc_card_t *card)
 	if (--card->lock_count == 0) {
 #ifdef INVALIDATE_CARD_CACHE_IN_UNLOCK
 		/* invalidate cache */
-		memset(&card->cache, 0, sizeof(card->cache));
-		card->cache.valid = 0;
+		sc_invalidate_cache(card);
 		sc_log(card->ctx, "cache invalidated");
 #endif
 		/* release reader lock */
@@ -452,6 +614,10 @@ int sc_read_binary(sc_card_t *card, unsigned int idx,
 		LOG_FUNC_RETURN(card->ctx, bytes_read);
 	}
 	r = card->ops->read_binary(card, idx, buf, count, flags);
+	/* Retried with short APDUs, split by the loop above */
+	if ((r == SC_ERROR_WRONG_LENGTH || r == SC_ERROR_INS_NOT_SUPPORTED)
+			&& count > 256 && undo_apdu_ext(card))
+		r = sc_read_binary(card, idx, buf, count, flags);
 	LOG_FUNC_RETURN(card->ctx, r);
 }
 
@@ -495,6 +661,10 @@ int sc_write_binary(sc_card_t *card, unsigned int idx,
 	}
 
 	r = card->ops->write_binary(card, idx, buf, count, flags);
+	/* Retried with short APDUs, split by the loop above */
+	if ((r == SC_ERROR_WRONG_LENGTH || r == SC_ERROR_INS_NOT_SUPPORTED)
+			&& count > 255 && undo_apdu_ext(card))
+		r = sc_write_binary(card, idx, buf, count, flags);
 	LOG_FUNC_RETURN(card->ctx, r);
 }
 
@@ -538,6 +708,10 @@ int sc_update_binary(sc_card_t *card, unsigned int idx,
 	}
 
 	r = card->ops->update_binary(card, idx, buf, count, flags);
+	/* Retried with short APDUs, split by the loop above */
+	if ((r == SC_ERROR_WRONG_LENGTH || r == SC_ERROR_INS_NOT_SUPPORTED)
+			&& count > 255 && undo_apdu_ext(card))
+		r = sc_update_binary(card, idx, buf, count, flags);
 	LOG_FUNC_RETURN(card->ctx, r);
 }
 
@@ -557,6 +731,75 @@ int sc_erase_binary(struct sc_card *card, unsigned int offs, size_t count,  unsi
 }
 
 
+/* Select a file by absolute path, using what is known about the
+ * current selection: nothing is sent if the file is still selected,
+ * and files below the current DF are selected relative to it. */
+static int select_file_cached(sc_card_t *card, const sc_path_t *in_path, sc_file_t **file)
+{
+	struct sc_card_cache *cache = &card->cache;
+	sc_path_t rel_path;
+	size_t df_len = 0;
+	int r = SC_SUCCESS, relative = 0;
+
+	if (in_path->type != SC_PATH_TYPE_PATH || in_path->aid.len != 0
+			|| in_path->len < 2 || memcmp(in_path->value, "\x3F\x00", 2) != 0) {
+		r = card->ops->select_file(card, in_path, file);
+		sc_invalidate_selection(card);
+		return r;
+	}
+
+	/* The selection is only known for sure while the reader lock
+	 * has been held since it was made */
+	if (cache->valid && card->lock_count > 0 && cache->selected_path.len != 0) {
+		if (sc_compare_path(&cache->selected_path, in_path)) {
+			if (file == NULL) {
+				sc_log(card->ctx, "file already selected");
+				return SC_SUCCESS;
+			}
+			if (cache->selected_file != NULL) {
+				sc_log(card->ctx, "file already selected, using cached FCI");
+				sc_file_dup(file, cache->selected_file);
+				return *file != NULL ? SC_SUCCESS : SC_ERROR_OUT_OF_MEMORY;
+			}
+		}
+
+		if (cache->selected_type == SC_FILE_TYPE_DF)
+			df_len = cache->selected_path.len;
+		else if (cache->selected_type == SC_FILE_TYPE_WORKING_EF
+				|| cache->selected_type == SC_FILE_TYPE_INTERNAL_EF)
+			df_len = cache->selected_path.len - 2;
+
+		if (df_len != 0 && in_path->len > df_len
+				&& memcmp(in_path->value, cache->selected_path.value, df_len) == 0) {
+			memset(&rel_path, 0, sizeof(rel_path));
+			memcpy(rel_path.value, in_path->value + df_len, in_path->len - df_len);
+			rel_path.len = in_path->len - df_len;
+			rel_path.type = rel_path.len == 2 ? SC_PATH_TYPE_FILE_ID : SC_PATH_TYPE_FROM_CURRENT;
+			rel_path.index = in_path->index;
+			rel_path.count = in_path->count;
+			sc_log(card->ctx, "select relative to current DF: %s", sc_print_path(&rel_path));
+			r = card->ops->select_file(card, &rel_path, file);
+			relative = 1;
+		}
+	}
+	/* Fall back to the absolute path, unless the card has found
+	 * the file or told that it does not exist */
+	if (!relative || (r != SC_SUCCESS && r != SC_ERROR_FILE_NOT_FOUND))
+		r = card->ops->select_file(card, in_path, file);
+
+	sc_invalidate_selection(card);
+	if (r == SC_SUCCESS) {
+		cache->selected_path = *in_path;
+		if (file != NULL && *file != NULL) {
+			sc_file_dup(&cache->selected_file, *file);
+			if (cache->selected_file != NULL)
+				cache->selected_file->path = *in_path;
+			cache->selected_type = (*file)->type;
+		}
+	}
+	return r;
+}
+
 int sc_select_file(sc_card_t *card, const sc_path_t *in_path,  sc_file_t **file)
 {
 	int r;
@@ -589,7 +832,10 @@ int sc_select_file(sc_card_t *card, const sc_path_t *in_path,  sc_file_t **file)
 	}
 	if (card->ops->select_file == NULL)
 		LOG_FUNC_RETURN(card->ctx, SC_ERROR_NOT_SUPPORTED);
-	r = card->ops->select_file(card, in_path, file);
+	if (card->caps & SC_CARD_CAP_ISO_SELECT)
+		r = select_file_cached(card, in_path, file);
+	else
+		r = card->ops->select_file(card, in_path, file);
 	/* Remember file path */
 	if (r == 0 && file && *file)
 		(*file)->path = *in_path;
@@ -813,65 +1059,347 @@ sc_algorithm_info_t * sc_card_find_gostr3410_alg(sc_card_t *card,
 	return sc_card_find_alg(card, SC_ALGORITHM_GOSTR3410, key_length);
 }
 
+/* ATR tables are parsed into binary form once, the first time they are
+ * used, instead of formatting and re-parsing hex strings on every match */
+struct sc_atr_bin {
+	u8 atr[SC_MAX_ATR_SIZE];	/* already reduced with the mask */
+	u8 mask[SC_MAX_ATR_SIZE];
+	size_t len;			/* 0 if the entry is malformed */
+};
+
+struct sc_atr_table_bin {
+	const struct sc_atr_table *table;
+	struct sc_atr_bin *entries;
+	size_t count;
+	struct sc_atr_table_bin *next;
+};
+
+/* Driver that bound a card with a given ATR */
+struct sc_atr_driver {
+	struct sc_atr atr;
+	char name[32];
+	struct sc_atr_driver *next;
+};
+
+#define SC_ATR_DRIVER_CACHE_SIZE	64
+
+struct sc_atr_cache {
+	struct sc_atr_table_bin *tables;
+	struct sc_atr_driver *drivers;	/* most recently used first */
+	int persistent;			/* use_driver_caching */
+	int loaded;
+};
+
+static struct sc_atr_cache *get_atr_cache(sc_context_t *ctx)
+{
+	int i;
+
+	if (ctx->atr_cache == NULL) {
+		ctx->atr_cache = calloc(1, sizeof(struct sc_atr_cache));
+		if (ctx->atr_cache == NULL)
+			return NULL;
+		for (i = 0; ctx->conf_blocks[i] != NULL; i++)
+			ctx->atr_cache->persistent = scconf_get_bool(ctx->conf_blocks[i],
+					"use_driver_caching", ctx->atr_cache->persistent);
+	}
+	return ctx->atr_cache;
+}
+
+static int compile_atr_entry(const struct sc_atr_table *src, struct sc_atr_bin *dst)
+{
+	size_t atr_len = sizeof(dst->atr), mask_len = sizeof(dst->mask), i;
+
+	if (sc_hex_to_bin(src->atr, dst->atr, &atr_len) != 0)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	if (src->atrmask != NULL) {
+		if (sc_hex_to_bin(src->atrmask, dst->mask, &mask_len) != 0
+		 || mask_len != atr_len)
+			return SC_ERROR_INVALID_ARGUMENTS;
+	} else {
+		memset(dst->mask, 0xFF, sizeof(dst->mask));
+	}
+	for (i = 0; i < atr_len; i++)
+		dst->atr[i] &= dst->mask[i];
+	dst->len = atr_len;
+	return SC_SUCCESS;
+}
+
+/* Call with ctx->mutex held */
+static const struct sc_atr_table_bin *
+get_atr_table_bin(sc_context_t *ctx, const struct sc_atr_table *table)
+{
+	struct sc_atr_cache *cache = get_atr_cache(ctx);
+	struct sc_atr_table_bin *bin;
+	size_t i;
+
+	if (cache == NULL)
+		return NULL;
+	for (bin = cache->tables; bin != NULL; bin = bin->next)
+		if (bin->table == table)
+			return bin;
+
+	bin = calloc(1, sizeof(*bin));
+	if (bin == NULL)
+		return NULL;
+	for (bin->count = 0; table[bin->count].atr != NULL; bin->count++)
+		;
+	bin->entries = calloc(bin->count ? bin->count : 1, sizeof(*bin->entries));
+	if (bin->entries == NULL) {
+		free(bin);
+		return NULL;
+	}
+	for (i = 0; i < bin->count; i++) {
+		if (compile_atr_entry(&table[i], &bin->entries[i]) != SC_SUCCESS) {
+			sc_log(ctx, "ignoring malformed ATR table entry: %s - %s", table[i].atr,
+				table[i].atrmask ? table[i].atrmask : "(no mask)");
+			bin->entries[i].len = 0;
+		}
+	}
+	bin->table = table;
+	bin->next = cache->tables;
+	cache->tables = bin;
+	return bin;
+}
+
+/* Drops the binary form of a table that is about to change */
+static void forget_atr_table_bin(sc_context_t *ctx, const struct sc_atr_table *table)
+{
+	struct sc_atr_table_bin **bp, *bin;
+
+	if (ctx->atr_cache == NULL || table == NULL)
+		return;
+	sc_mutex_lock(ctx, ctx->mutex);
+	for (bp = &ctx->atr_cache->tables; (bin = *bp) != NULL; bp = &bin->next) {
+		if (bin->table == table) {
+			*bp = bin->next;
+			free(bin->entries);
+			free(bin);
+			break;
+		}
+	}
+	sc_mutex_unlock(ctx, ctx->mutex);
+}
+
 static int match_atr_table(sc_context_t *ctx, struct sc_atr_table *table, struct sc_atr *atr)
 {
-	u8 *card_atr_bin = atr->value;
-	size_t card_atr_bin_len = atr->len;
+	const struct sc_atr_table_bin *bin;
+	const struct sc_atr_bin *e;
 	char card_atr_hex[3 * SC_MAX_ATR_SIZE];
-	size_t card_atr_hex_len;
-	unsigned int i = 0;
+	size_t i, s;
+	int res = -1;
 
 	if (ctx == NULL || table == NULL || atr == NULL)
 		return -1;
-	sc_bin_to_hex(card_atr_bin, card_atr_bin_len, card_atr_hex, sizeof(card_atr_hex), ':');
-	card_atr_hex_len = strlen(card_atr_hex);
+	if (ctx->debug) {
+		sc_bin_to_hex(atr->value, atr->len, card_atr_hex, sizeof(card_atr_hex), ':');
+		sc_log(ctx, "ATR     : %s", card_atr_hex);
+	}
 
-	sc_log(ctx, "ATR     : %s", card_atr_hex);
+	sc_mutex_lock(ctx, ctx->mutex);
+	bin = get_atr_table_bin(ctx, table);
+	sc_mutex_unlock(ctx, ctx->mutex);
+	if (bin == NULL)
+		return -1;
 
-	for (i = 0; table[i].atr != NULL; i++) {
-		const char *tatr = table[i].atr;
-		const char *matr = table[i].atrmask;
-		size_t tatr_len = strlen(tatr);
-		u8 mbin[SC_MAX_ATR_SIZE], tbin[SC_MAX_ATR_SIZE];
-		size_t mbin_len, tbin_len, s, matr_len;
-		size_t fix_hex_len = card_atr_hex_len;
-		size_t fix_bin_len = card_atr_bin_len;
+	for (i = 0; i < bin->count; i++) {
+		e = &bin->entries[i];
+		if (e->len != atr->len)
+			continue;
+		for (s = 0; s < e->len; s++)
+			if ((atr->value[s] & e->mask[s]) != e->atr[s])
+				break;
+		if (s == e->len) {
+			sc_log(ctx, "ATR match: %s", table[i].atr);
+			res = (int)i;
+			break;
+		}
+	}
+	return res;
+}
 
-		sc_log(ctx, "ATR try : %s", tatr);
+static int atr_driver_cache_path(sc_context_t *ctx, char *buf, size_t len)
+{
+	char dir[PATH_MAX];
+	int r;
+
+	r = sc_get_cache_dir(ctx, dir, sizeof(dir));
+	if (r != SC_SUCCESS)
+		return r;
+	if (snprintf(buf, len, "%s/card_drivers", dir) >= (int)len)
+		return SC_ERROR_BUFFER_TOO_SMALL;
+	return SC_SUCCESS;
+}
 
-		if (tatr_len != fix_hex_len) {
-			sc_log(ctx, "ignored - wrong length");
+/* Call with ctx->mutex held. Lines are "<ATR in hex> <driver short name>" */
+static void load_atr_driver_cache(sc_context_t *ctx, struct sc_atr_cache *cache)
+{
+	char path[PATH_MAX], line[3 * SC_MAX_ATR_SIZE + 64], *name;
+	struct sc_atr_driver *entry, **tail = &cache->drivers;
+	unsigned int n = 0;
+	FILE *f;
+
+	cache->loaded = 1;
+	if (!cache->persistent || atr_driver_cache_path(ctx, path, sizeof(path)) != SC_SUCCESS)
+		return;
+	f = fopen(path, "r");
+	if (f == NULL)
+		return;
+	while (n < SC_ATR_DRIVER_CACHE_SIZE && fgets(line, sizeof(line), f) != NULL) {
+		line[strcspn(line, "\r\n")] = '\0';
+		name = strchr(line, ' ');
+		if (name == NULL || strlen(name + 1) >= sizeof(entry->name))
+			continue;
+		*name++ = '\0';
+		entry = calloc(1, sizeof(*entry));
+		if (entry == NULL)
+			break;
+		entry->atr.len = sizeof(entry->atr.value);
+		if (sc_hex_to_bin(line, entry->atr.value, &entry->atr.len) != 0 || entry->atr.len == 0) {
+			free(entry);
 			continue;
 		}
-		if (matr != NULL) {
-			sc_log(ctx, "ATR mask: %s", matr);
+		strcpy(entry->name, name);
+		*tail = entry;
+		tail = &entry->next;
+		n++;
+	}
+	fclose(f);
+	sc_log(ctx, "loaded %u cached card driver decisions", n);
+}
 
-			matr_len = strlen(matr);
-			if (tatr_len != matr_len)
-				continue;
-			tbin_len = sizeof(tbin);
-			sc_hex_to_bin(tatr, tbin, &tbin_len);
-			mbin_len = sizeof(mbin);
-			sc_hex_to_bin(matr, mbin, &mbin_len);
-			if (mbin_len != fix_bin_len) {
-				sc_log(ctx, "length of atr and atr mask do not match - ignored: %s - %s", tatr, matr); 
-				continue;
-			}
-			for (s = 0; s < tbin_len; s++) {
-				/* reduce tatr with mask */
-				tbin[s] = (tbin[s] & mbin[s]);
-				/* create copy of card_atr_bin masked) */
-				mbin[s] = (card_atr_bin[s] & mbin[s]);
+/* Call with ctx->mutex held */
+static void save_atr_driver_cache(sc_context_t *ctx, struct sc_atr_cache *cache)
+{
+	char path[PATH_MAX], tmpname[PATH_MAX + 7], hex[3 * SC_MAX_ATR_SIZE];
+	struct sc_atr_driver *entry;
+	FILE *f;
+	int fd, ok = 1, r;
+
+	if (!cache->persistent || atr_driver_cache_path(ctx, path, sizeof(path)) != SC_SUCCESS)
+		return;
+	/* written aside and renamed, so that other processes never read
+	 * a partly written cache */
+	r = snprintf(tmpname, sizeof(tmpname), "%s.XXXXXX", path);
+	if (r < 0 || (size_t)r >= sizeof(tmpname))
+		return;
+	fd = mkstemp(tmpname);
+	if (fd < 0 && errno == ENOENT && sc_make_cache_dir(ctx) == SC_SUCCESS) {
+		/* mkstemp() may have clobbered the template */
+		snprintf(tmpname, sizeof(tmpname), "%s.XXXXXX", path);
+		fd = mkstemp(tmpname);
+	}
+	if (fd < 0) {
+		sc_log(ctx, "unable to write card driver cache %s", path);
+		return;
+	}
+	f = fdopen(fd, "w");
+	if (f == NULL) {
+		close(fd);
+		remove(tmpname);
+		return;
+	}
+	for (entry = cache->drivers; entry != NULL && ok; entry = entry->next) {
+		sc_bin_to_hex(entry->atr.value, entry->atr.len, hex, sizeof(hex), ':');
+		ok = fprintf(f, "%s %s\n", hex, entry->name) > 0;
+	}
+	if (fclose(f) != 0 || !ok || rename(tmpname, path) != 0) {
+		sc_log(ctx, "unable to write card driver cache %s", path);
+		remove(tmpname);
+	}
+}
+
+/* Returns the driver that bound the last card with this ATR, if any */
+static struct sc_card_driver *lookup_atr_driver(sc_context_t *ctx, const struct sc_atr *atr)
+{
+	struct sc_atr_cache *cache;
+	struct sc_atr_driver *entry;
+	struct sc_card_driver *drv = NULL;
+	int i;
+
+	sc_mutex_lock(ctx, ctx->mutex);
+	cache = get_atr_cache(ctx);
+	if (cache != NULL && !cache->loaded)
+		load_atr_driver_cache(ctx, cache);
+	for (entry = cache ? cache->drivers : NULL; entry != NULL; entry = entry->next) {
+		if (entry->atr.len != atr->len || memcmp(entry->atr.value, atr->value, atr->len))
+			continue;
+		for (i = 0; ctx->card_drivers[i] != NULL; i++) {
+			if (!strcmp(ctx->card_drivers[i]->short_name, entry->name)) {
+				drv = ctx->card_drivers[i];
+				break;
 			}
-			if (memcmp(tbin, mbin, tbin_len) != 0)
-				continue;
-		} else {
-			if (strncasecmp(tatr, card_atr_hex, tatr_len) != 0)
-				continue;
 		}
-		return i;
+		break;
+	}
+	sc_mutex_unlock(ctx, ctx->mutex);
+	return drv;
+}
+
+/* Records (drv != NULL) or forgets the driver for an ATR */
+static void store_atr_driver(sc_context_t *ctx, const struct sc_atr *atr, struct sc_card_driver *drv)
+{
+	struct sc_atr_cache *cache;
+	struct sc_atr_driver *entry, **ep;
+	unsigned int n;
+
+	if (drv != NULL && strlen(drv->short_name) >= sizeof(entry->name))
+		return;
+	sc_mutex_lock(ctx, ctx->mutex);
+	cache = get_atr_cache(ctx);
+	if (cache == NULL)
+		goto out;
+	if (!cache->loaded)
+		load_atr_driver_cache(ctx, cache);
+
+	for (ep = &cache->drivers; (entry = *ep) != NULL; ep = &entry->next) {
+		if (entry->atr.len == atr->len && !memcmp(entry->atr.value, atr->value, atr->len)) {
+			*ep = entry->next;
+			break;
+		}
+	}
+	if (drv == NULL) {
+		if (entry == NULL)
+			goto out;
+		free(entry);
+	} else {
+		if (entry == NULL && (entry = calloc(1, sizeof(*entry))) == NULL)
+			goto out;
+		memcpy(&entry->atr, atr, sizeof(entry->atr));
+		strcpy(entry->name, drv->short_name);
+		entry->next = cache->drivers;
+		cache->drivers = entry;
+		/* Drop the least recently used ones */
+		for (n = 0, ep = &cache->drivers; *ep != NULL && n < SC_ATR_DRIVER_CACHE_SIZE; n++)
+			ep = &(*ep)->next;
+		while ((entry = *ep) != NULL) {
+			*ep = entry->next;
+			free(entry);
+		}
+	}
+	save_atr_driver_cache(ctx, cache);
+out:
+	sc_mutex_unlock(ctx, ctx->mutex);
+}
+
+void _sc_free_atr_cache(sc_context_t *ctx)
+{
+	struct sc_atr_cache *cache = ctx->atr_cache;
+	struct sc_atr_table_bin *bin;
+	struct sc_atr_driver *entry;
+
+	if (cache == NULL)
+		return;
+	while ((bin = cache->tables) != NULL) {
+		cache->tables = bin->next;
+		free(bin->entries);
+		free(bin);
 	}
-	return -1;
+	while ((entry = cache->drivers) != NULL) {
+		cache->drivers = entry->next;
+		free(entry);
+	}
+	free(cache);
+	ctx->atr_cache = NULL;
 }
 
 int _sc_match_atr(sc_card_t *card, struct sc_atr_table *table, int *type_out)
@@ -922,6 +1450,7 @@ int _sc_add_atr(sc_context_t *ctx, struct sc_card_driver *driver, struct sc_atr_
 {
 	struct sc_atr_table *map, *dst;
 
+	forget_atr_table_bin(ctx, driver->atr_map);
 	map = (struct sc_atr_table *) realloc(driver->atr_map,
 			(driver->natrs + 2) * sizeof(struct sc_atr_table));
 	if (!map)
@@ -957,6 +1486,7 @@ int _sc_free_atr(sc_context_t *ctx, struct sc_card_driver *driver)
 {
 	unsigned int i;
 
+	forget_atr_table_bin(ctx, driver->atr_map);
 	for (i = 0; i < driver->natrs; i++) {
 		struct sc_atr_table *src = &driver->atr_map[i];
 
@@ -997,6 +1527,33 @@ scconf_block *sc_get_conf_block(sc_context_t *ctx, const char *name1, const char
 	return conf_block;
 }
 
+void sc_invalidate_selection(struct sc_card *card)
+{
+	if (card->cache.selected_file != NULL)
+		sc_file_free(card->cache.selected_file);
+	card->cache.selected_file = NULL;
+	card->cache.selected_type = 0;
+	memset(&card->cache.selected_path, 0, sizeof(card->cache.selected_path));
+}
+
+void sc_invalidate_security_env(struct sc_card *card)
+{
+	card->cache.security_env_valid = 0;
+}
+
+void sc_invalidate_login_state(struct sc_card *card)
+{
+	sc_mem_clear(card->login.pins, sizeof(card->login.pins));
+	card->login.count = 0;
+}
+
+void sc_invalidate_cache(struct sc_card *card)
+{
+	sc_invalidate_selection(card);
+	memset(&card->cache, 0, sizeof(card->cache));
+	card->cache.valid = 0;
+}
+
 void sc_print_cache(struct sc_card *card)   {
 	struct sc_context *ctx = NULL;
 
@@ -109,63 +109,102 @@ int sc_decompress(u8* out, size_t* outLen, const u8* in, size_t inLen, int metho
 	}
 }
 
+/* Length of the BER object that starts the data, 0 if not known yet */
+static size_t ber_object_length(const u8 *buf, size_t len)
+{
+	size_t i, n, objlen;
+
+	if (len < 2 || (buf[0] & 0x1F) == 0x1F)
+		return 0;
+	if (!(buf[1] & 0x80))
+		return 2 + buf[1];
+	n = buf[1] & 0x7F;
+	if (n == 0 || n > 3 || len < 2 + n)
+		return 0;
+	for (objlen = 0, i = 0; i < n; i++)
+		objlen = (objlen << 8) | buf[2 + i];
+	return 2 + n + objlen;
+}
+
 static int sc_decompress_zlib_alloc(u8** out, size_t* outLen, const u8* in, size_t inLen, int gzip) {
-	/* Since uncompress does not offer a way to make it uncompress gzip... manually set it up */
 	z_stream gz;
+	u8 head[5], *buf, *p;
+	size_t size = *outLen, len = 0;
 	int err;
-	int window_size = 15;
-	const int startSize = inLen < 1024 ? 2048 : inLen * 2;
-	const int blockSize = inLen < 1024 ? 512 : inLen / 2;
-	int bufferSize = startSize;
-	if(gzip)
-		window_size += 0x20;
+
 	memset(&gz, 0, sizeof(gz));
-	
 	gz.next_in = (u8*)in;
 	gz.avail_in = inLen;
 
-	err = inflateInit2(&gz, window_size);
+	err = inflateInit2(&gz, gzip ? 15 + 0x20 : 15);
 	if(err != Z_OK) return zerr_to_opensc(err);
 
-	*outLen = 0;
-
-	while(1) {
-		/* Setup buffer... */
-		int num;
-		u8* buf = realloc(*out, bufferSize);
-		if(!buf) {
-			if(*out)
-				free(*out);
-			*out = NULL;
-			return Z_MEM_ERROR;
+	if(size == 0) {
+		/* Inflate the header of the object first, so that
+		 * the buffer can be allocated at its final size */
+		gz.next_out = head;
+		gz.avail_out = sizeof(head);
+		err = inflate(&gz, Z_SYNC_FLUSH);
+		if(err != Z_OK && err != Z_STREAM_END) {
+			inflateEnd(&gz);
+			return zerr_to_opensc(err);
 		}
-		*out = buf;
-		gz.next_out = buf + *outLen;
-		gz.avail_out = bufferSize - *outLen;
-
-		err = inflate(&gz, Z_FULL_FLUSH);
-		if(err != Z_STREAM_END && err != Z_OK) {
-			if(*out)
-				free(*out);
-			*out = NULL;
-			break;
-		}
-		num = bufferSize - *outLen - gz.avail_out;
-		if(num > 0) {
-			*outLen += num;
-			bufferSize += num + blockSize;
-		}
-		if(err == Z_STREAM_END) {
-			buf = realloc(buf, *outLen); /* Shrink it down, if it fails, just use old data */
-			if(buf) {
-				*out = buf;
+		len = sizeof(head) - gz.avail_out;
+		if(err == Z_STREAM_END)
+			size = len;
+		else
+			size = ber_object_length(head, len);
+		/* unknown: guess, and grow below */
+		if(size == 0 || size < len)
+			size = inLen < 512 ? 1024 : inLen * 2;
+	}
+
+	buf = malloc(size ? size : 1);
+	if(!buf) {
+		inflateEnd(&gz);
+		return SC_ERROR_OUT_OF_MEMORY;
+	}
+	memcpy(buf, head, len);
+
+	while(err != Z_STREAM_END) {
+		gz.next_out = buf + len;
+		gz.avail_out = size - len;
+		err = inflate(&gz, Z_NO_FLUSH);
+		len = size - gz.avail_out;
+		if(err == Z_BUF_ERROR && len == size) {
+			/* the expected size was too small */
+			p = realloc(buf, size * 2);
+			if(!p) {
+				err = Z_MEM_ERROR;
+				break;
 			}
+			buf = p;
+			size *= 2;
+			err = Z_OK;
+		} else if(err == Z_BUF_ERROR) {
+			/* truncated input */
+			err = Z_DATA_ERROR;
+			break;
+		} else if(err != Z_OK && err != Z_STREAM_END) {
 			break;
 		}
 	}
 	inflateEnd(&gz);
-	return zerr_to_opensc(err);
+
+	if(err != Z_STREAM_END) {
+		free(buf);
+		return zerr_to_opensc(err);
+	}
+	if(len < size) {
+		p = realloc(buf, len ? len : 1); /* Shrink it down, if it fails, just use old data */
+		if(p)
+			buf = p;
+	}
+	*out = buf;
+	*outLen = len;
+	return SC_SUCCESS;
 }
+
 int sc_decompress_alloc(u8** out, size_t* outLen, const u8* in, size_t inLen, int method) {
 	if(method == COMPRESSION_AUTO) {
 		method = detect_method(in, inLen);
@@ -28,7 +28,12 @@
 #define COMPRESSION_GZIP	2
 #define COMPRESSION_UNKNOWN (-1)
 
+/* Decompress into a buffer allocated at *out. *outLen is the expected
+ * size of the decompressed data, or 0 if not known: the buffer is then
+ * sized from the length of the ASN.1 object the data starts with (e.g.
+ * a certificate), and only grown if there is none. */
 int sc_decompress_alloc(u8** out, size_t* outLen, const u8* in, size_t inLen, int method);
+/* Decompress into the caller's buffer of *outLen bytes */
 int sc_decompress(u8* out, size_t* outLen, const u8* in, size_t inLen, int method);
 
 #endif
@@ -116,6 +116,7 @@ struct _sc_ctx_options {
 	struct _sc_driver_entry cdrv[SC_MAX_CARD_DRIVERS];
 	int ccount;
 	char *forced_card_driver;
+	int debug_async;
 };
 
 
@@ -196,20 +197,21 @@ static void set_defaults(sc_context_t *ctx, struct _sc_ctx_options *opts)
  */
 int sc_ctx_log_to_file(sc_context_t *ctx, const char* filename)
 {
-	/* Close any existing handles */
-	if (ctx->debug_file && (ctx->debug_file != stderr && ctx->debug_file != stdout))
-		fclose(ctx->debug_file);
+	FILE *file;
 
 	/* Handle special names */
 	if (!strcmp(filename, "stdout"))
-		ctx->debug_file = stdout;
+		file = stdout;
 	else if (!strcmp(filename, "stderr"))
-		ctx->debug_file = stderr;
-	else {
-		ctx->debug_file = fopen(filename, "a");
-		if (ctx->debug_file == NULL)
-			return SC_ERROR_INTERNAL;
-	}
+		file = stderr;
+	else
+		file = fopen(filename, "a");
+
+	/* Close any existing handles, after what is queued for them has
+	 * been written out */
+	sc_log_set_file(ctx, file);
+	if (file == NULL)
+		return SC_ERROR_INTERNAL;
 	return SC_SUCCESS;
 }
 
@@ -229,6 +231,13 @@ static int load_parameters(sc_context_t *ctx, scconf_block *block,
 	val = scconf_get_str(block, "debug_file", NULL);
 	if (val)
 		sc_ctx_log_to_file(ctx, val);
+	opts->debug_async = scconf_get_bool(block, "debug_async", opts->debug_async);
+
+	val = getenv("OPENSC_APDU_TRACE");
+	if (val == NULL)
+		val = scconf_get_str(block, "apdu_trace", NULL);
+	if (val)
+		sc_apdu_trace_open(ctx, val);
 
 	val = scconf_get_str(block, "force_card_driver", NULL);
 	if (val) {
@@ -623,6 +632,7 @@ int sc_context_create(sc_context_t **ctx_out, const sc_context_param_t *parm)
 {
 	sc_context_t		*ctx;
 	struct _sc_ctx_options	opts;
+	scconf_block		*conf_block;
 	int			r;
 
 	if (ctx_out == NULL || parm == NULL)
@@ -656,6 +666,8 @@ int sc_context_create(sc_context_t **ctx_out, const sc_context_param_t *parm)
 	}
 
 	process_config_file(ctx, &opts);
+	if (opts.debug_async && ctx->debug > 0 && sc_log_async_start(ctx) != SC_SUCCESS)
+		sc_debug(ctx, SC_LOG_DEBUG_NORMAL, "asynchronous logging not available");
 	sc_debug(ctx, SC_LOG_DEBUG_NORMAL, "==================================="); /* first thing in the log */
 	sc_debug(ctx, SC_LOG_DEBUG_NORMAL, "opensc version: %s", sc_get_version());
 
@@ -681,6 +693,12 @@ int sc_context_create(sc_context_t **ctx_out, const sc_context_param_t *parm)
 #elif defined(ENABLE_OPENCT)
 	ctx->reader_driver = sc_get_openct_driver();
 #endif
+	/* Emulated cards replace the hardware readers when configured */
+	conf_block = sc_get_conf_block(ctx, "reader_driver", "virtual", 1);
+	if (ctx->reader_driver == NULL
+	 || (conf_block != NULL && (scconf_find_list(conf_block, "card_image") != NULL
+	 || scconf_find_list(conf_block, "replay_trace") != NULL)))
+		ctx->reader_driver = sc_get_virtual_driver();
 
 	load_reader_driver_options(ctx);
 	ctx->reader_driver->ops->init(ctx);
@@ -751,6 +769,7 @@ int sc_release_context(sc_context_t *ctx)
 		if (drv->dll)
 			sc_dlclose(drv->dll);
 	}
+	_sc_free_atr_cache(ctx);
 	if (ctx->preferred_language != NULL)
 		free(ctx->preferred_language);
 	if (ctx->mutex != NULL) {
@@ -762,6 +781,8 @@ int sc_release_context(sc_context_t *ctx)
 	}
 	if (ctx->conf != NULL)
 		scconf_free(ctx->conf);
+	sc_log_async_stop(ctx);
+	sc_apdu_trace_close(ctx);
 	if (ctx->debug_file && (ctx->debug_file != stdout && ctx->debug_file != stderr))
 		fclose(ctx->debug_file);
 	if (ctx->app_name != NULL)
@@ -100,6 +100,24 @@ sc_parse_ef_atr_content(struct sc_card *card, unsigned char *buf, size_t buflen)
 		memcpy(ef_atr.allocation_oid.value, tag, taglen);
 	}
 
+	/* ISO 7816-4, 12.7.1: INTEGERs with the maximum numbers of bytes
+	 * in a command APDU and in a response APDU */
+	tag = sc_asn1_find_tag(ctx, buf, buflen, ISO7816_TAG_II_EXTENDED_LENGTH, &taglen);
+	if (tag)   {
+		const unsigned char *body;
+		size_t bodylen, i;
+
+		body = sc_asn1_find_tag(ctx, tag, taglen, 0x02, &bodylen);
+		for (i = 0; body && i < bodylen && i < 4; i++)
+			ef_atr.max_command_apdu = ef_atr.max_command_apdu << 8 | body[i];
+		if (body)
+			body = sc_asn1_find_tag(ctx, body + bodylen, taglen - (body + bodylen - tag), 0x02, &bodylen);
+		for (i = 0; body && i < bodylen && i < 4; i++)
+			ef_atr.max_response_apdu = ef_atr.max_response_apdu << 8 | body[i];
+		sc_log(ctx, "EF.ATR: max command/response APDU %i/%i",
+				ef_atr.max_command_apdu, ef_atr.max_response_apdu);
+	}
+
 	if (category == ISO7816_II_CATEGORY_TLV)   {
 		tag = sc_asn1_find_tag(ctx, buf, buflen, ISO7816_TAG_II_STATUS_SW, &taglen);
 		if (tag && taglen == 2)   {
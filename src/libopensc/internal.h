@@ -81,6 +81,7 @@ int _sc_parse_atr(struct sc_reader *reader);
 /* Add an ATR to the card driver's struct sc_atr_table */
 int _sc_add_atr(struct sc_context *ctx, struct sc_card_driver *driver, struct sc_atr_table *src);
 int _sc_free_atr(struct sc_context *ctx, struct sc_card_driver *driver);
+void _sc_free_atr_cache(struct sc_context *ctx);
 
 /**
  * Convert an unsigned long into 4 bytes in big endian order
@@ -127,6 +128,19 @@ int _sc_card_add_ec_alg(struct sc_card *card, unsigned int key_length,
 int sc_asn1_read_tag(const u8 ** buf, size_t buflen, unsigned int *cla_out,
 		     unsigned int *tag_out, size_t *taglen);
 
+/* Invalidate the card cache, including the selection state */
+void sc_invalidate_cache(struct sc_card *card);
+/* Forget the currently selected file, e.g. after an APDU which
+ * may have changed it */
+void sc_invalidate_selection(struct sc_card *card);
+/* Forget the current security environment */
+void sc_invalidate_security_env(struct sc_card *card);
+/* Forget which PIN references are verified, e.g. after a card reset */
+void sc_invalidate_login_state(struct sc_card *card);
+/* Forget the state of one PIN reference, e.g. when the card driver
+ * knows that the card has dropped it */
+void sc_invalidate_pin_state(struct sc_card *card, unsigned int type, int ref);
+
 /********************************************************************/
 /*                 pkcs1 padding/encoding functions                 */
 /********************************************************************/
@@ -245,11 +259,30 @@ int sc_apdu_set_resp(sc_context_t *ctx, sc_apdu_t *apdu, const u8 *buf,
  */
 void sc_apdu_log(sc_context_t *ctx, int level, const u8 *data, size_t len,
 	int is_outgoing);
+void sc_do_log_apdu(sc_context_t *ctx, int level, const char *file, int line, const char *func,
+	const u8 *data, size_t len, int is_outgoing);
+
+/* APDU trace files, see apdu.c */
+#define SC_APDU_TRACE_MAGIC	"OSCTRC01"
+#define SC_APDU_TRACE_CONNECT	'C'
+#define SC_APDU_TRACE_TRANSMIT	'T'
+
+int sc_apdu_trace_open(sc_context_t *ctx, const char *filename);
+void sc_apdu_trace_close(sc_context_t *ctx);
+void sc_apdu_trace_connect(sc_reader_t *reader);
+int sc_apdu_trace_secret_cmd(unsigned int ins);
+
+/* Asynchronous logging, see log.c */
+int sc_log_async_start(sc_context_t *ctx);
+void sc_log_async_stop(sc_context_t *ctx);
+/* Replaces and closes the debug file once queued messages are written */
+void sc_log_set_file(sc_context_t *ctx, FILE *file);
 
 extern struct sc_reader_driver *sc_get_pcsc_driver(void);
 extern struct sc_reader_driver *sc_get_ctapi_driver(void);
 extern struct sc_reader_driver *sc_get_openct_driver(void);
 extern struct sc_reader_driver *sc_get_cardmod_driver(void);
+extern struct sc_reader_driver *sc_get_virtual_driver(void);
 
 #ifdef __cplusplus
 }
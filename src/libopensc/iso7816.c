@@ -113,7 +113,6 @@ static int iso7816_read_binary(sc_card_t *card,
 {
 	sc_context_t *ctx = card->ctx;
 	sc_apdu_t apdu;
-	u8 recvbuf[SC_MAX_APDU_BUFFER_SIZE];
 	int r;
 
 	if (idx > 0x7fff) {
@@ -122,16 +121,16 @@ static int iso7816_read_binary(sc_card_t *card,
 	}
 
 	assert(count <= (card->max_recv_size > 0 ? card->max_recv_size : 256));
-	sc_format_apdu(card, &apdu, SC_APDU_CASE_2_SHORT, 0xB0, (idx >> 8) & 0x7F, idx & 0xFF);
+	/* extended Le when count exceeds 256 and the card supports it */
+	sc_format_apdu(card, &apdu, SC_APDU_CASE_2, 0xB0, (idx >> 8) & 0x7F, idx & 0xFF);
 	apdu.le = count;
 	apdu.resplen = count;
-	apdu.resp = recvbuf;
+	apdu.resp = buf;
 
 	r = sc_transmit_apdu(card, &apdu);
 	SC_TEST_RET(ctx, SC_LOG_DEBUG_NORMAL, r, "APDU transmit failed");
 	if (apdu.resplen == 0)
 		SC_FUNC_RETURN(ctx, SC_LOG_DEBUG_VERBOSE, sc_check_sw(card, apdu.sw1, apdu.sw2));
-	memcpy(buf, recvbuf, apdu.resplen);
 
 	r =  sc_check_sw(card, apdu.sw1, apdu.sw2);
 	if (r == SC_ERROR_FILE_END_REACHED)
@@ -269,7 +268,7 @@ static int iso7816_write_binary(sc_card_t *card,
 		return SC_ERROR_OFFSET_TOO_LARGE;
 	}
 
-	sc_format_apdu(card, &apdu, SC_APDU_CASE_3_SHORT, 0xD0,
+	sc_format_apdu(card, &apdu, SC_APDU_CASE_3, 0xD0,
 		       (idx >> 8) & 0x7F, idx & 0xFF);
 	apdu.lc = count;
 	apdu.datalen = count;
@@ -296,7 +295,7 @@ static int iso7816_update_binary(sc_card_t *card,
 		return SC_ERROR_OFFSET_TOO_LARGE;
 	}
 
-	sc_format_apdu(card, &apdu, SC_APDU_CASE_3_SHORT, 0xD6,
+	sc_format_apdu(card, &apdu, SC_APDU_CASE_3, 0xD6,
 		       (idx >> 8) & 0x7F, idx & 0xFF);
 	apdu.lc = count;
 	apdu.datalen = count;
@@ -468,7 +467,8 @@ static int iso7816_select_file(sc_card_t *card,
 	if (file_out != NULL) {
 		apdu.resp = buf;
 		apdu.resplen = sizeof(buf);
-		apdu.le = card->max_recv_size > 0 ? card->max_recv_size : 256;
+		/* short APDU: the FCI is never longer */
+		apdu.le = card->max_recv_size > 0 && card->max_recv_size < 256 ? card->max_recv_size : 256;
 	} else
 		apdu.cse = (apdu.lc == 0) ? SC_APDU_CASE_1 : SC_APDU_CASE_3_SHORT;
 
@@ -924,11 +924,18 @@ static int iso7816_build_pin_apdu(sc_card_t *card, sc_apdu_t *apdu,
 			p1 |= 0x01;
 		}
 		break;
+	case SC_PIN_CMD_GET_INFO:
+		/* VERIFY without data only returns the PIN status, but
+		 * some cards count it as an attempt or reject it */
+		if (!(card->caps & SC_CARD_CAP_PIN_STATUS))
+			return SC_ERROR_NOT_SUPPORTED;
+		ins = 0x20;
+		break;
 	default:
 		return SC_ERROR_NOT_SUPPORTED;
 	}
 
-	sc_format_apdu(card, apdu, SC_APDU_CASE_3_SHORT,
+	sc_format_apdu(card, apdu, len == 0 ? SC_APDU_CASE_1 : SC_APDU_CASE_3_SHORT,
 				ins, p1, data->pin_reference);
 
 	apdu->lc = len;
@@ -962,7 +969,7 @@ static int iso7816_pin_cmd(sc_card_t *card, struct sc_pin_cmd_data *data,
 	}
 	apdu = data->apdu;
 
-	if (!(data->flags & SC_PIN_CMD_USE_PINPAD)) {
+	if (!(data->flags & SC_PIN_CMD_USE_PINPAD) || data->cmd == SC_PIN_CMD_GET_INFO) {
 		/* Transmit the APDU to the card */
 		r = sc_transmit_apdu(card, apdu);
 
@@ -994,6 +1001,27 @@ static int iso7816_pin_cmd(sc_card_t *card, struct sc_pin_cmd_data *data,
 		data->apdu = NULL;
 
 	SC_TEST_RET(card->ctx, SC_LOG_DEBUG_NORMAL, r, "APDU transmit failed");
+	if (data->cmd == SC_PIN_CMD_GET_INFO) {
+		if (apdu->sw1 == 0x90 && apdu->sw2 == 0x00) {
+			data->pin1.logged_in = SC_PIN_STATE_LOGGED_IN;
+			data->pin1.tries_left = -1;
+			return SC_SUCCESS;
+		}
+		if (apdu->sw1 == 0x63 && (apdu->sw2 & 0xF0) == 0xC0) {
+			data->pin1.logged_in = SC_PIN_STATE_LOGGED_OUT;
+			data->pin1.tries_left = apdu->sw2 & 0x0F;
+			if (tries_left != NULL)
+				*tries_left = data->pin1.tries_left;
+			return SC_SUCCESS;
+		}
+		if (apdu->sw1 == 0x69 && apdu->sw2 == 0x83) {
+			data->pin1.logged_in = SC_PIN_STATE_LOGGED_OUT;
+			data->pin1.tries_left = 0;
+			if (tries_left != NULL)
+				*tries_left = 0;
+			return SC_SUCCESS;
+		}
+	}
 	if (apdu->sw1 == 0x63) {
 		if ((apdu->sw2 & 0xF0) == 0xC0 && tries_left != NULL)
 			*tries_left = apdu->sw2 & 0x0F;
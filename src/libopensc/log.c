@@ -43,6 +43,10 @@
 #include "internal.h"
 
 static void sc_do_log_va(sc_context_t *ctx, int level, const char *file, int line, const char *func, const char *format, va_list args);
+#ifdef HAVE_PTHREAD
+static int sc_log_queue(sc_context_t *ctx, int type, const char *file, int line, const char *func,
+		const void *data, size_t len);
+#endif
 
 void sc_do_log(sc_context_t *ctx, int level, const char *file, int line, const char *func, const char *format, ...)
 {
@@ -58,71 +62,407 @@ void sc_do_log_noframe(sc_context_t *ctx, int level, const char *format, va_list
 	sc_do_log_va(ctx, level, NULL, 0, NULL, format, args);
 }
 
-static void sc_do_log_va(sc_context_t *ctx, int level, const char *file, int line, const char *func, const char *format, va_list args)
+enum {
+	SC_LOG_RECORD_TEXT,
+	SC_LOG_RECORD_APDU_OUT,
+	SC_LOG_RECORD_APDU_IN
+};
+
+/* When and where a message was logged */
+struct sc_log_stamp {
+	unsigned long thread;
+	long sec, usec;
+};
+
+static void sc_log_stamp_now(struct sc_log_stamp *stamp)
 {
-	char	buf[1836], *p;
-	int	r;
-	size_t	left;
+#ifndef _WIN32
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	stamp->sec = tv.tv_sec;
+	stamp->usec = tv.tv_usec;
+	stamp->thread = (unsigned long)pthread_self();
+#else
+	/* the local time is taken when writing */
+	memset(stamp, 0, sizeof(*stamp));
+#endif
+}
+
+/* Writes one line: timestamp, source location and message. The line
+ * is put together first and written at once, so that lines logged by
+ * different threads do not get mixed up. */
+static void sc_log_write(sc_context_t *ctx, FILE *outf, const struct sc_log_stamp *stamp,
+		const char *file, int line, const char *func, const char *msg)
+{
+	char	prefix[256], local[4096], *buf = local;
+	size_t	plen, mlen, len;
 #ifdef _WIN32
 	SYSTEMTIME st;
+
+	GetLocalTime(&st);
+	snprintf(prefix, sizeof(prefix), "%i-%02i-%02i %02i:%02i:%02i.%03i ",
+			st.wYear, st.wMonth, st.wDay,
+			st.wHour, st.wMinute, st.wSecond, st.wMilliseconds);
 #else
 	struct tm *tm;
-	struct timeval tv;
 	char time_string[40];
+	time_t sec = (time_t)stamp->sec;
+
+	tm = localtime(&sec);
+	strftime(time_string, sizeof(time_string), "%H:%M:%S", tm);
+	snprintf(prefix, sizeof(prefix), "0x%lx %s.%03ld ", stamp->thread, time_string, stamp->usec / 1000);
 #endif
-	FILE		*outf = NULL;
-	int		n;
+	plen = strlen(prefix);
+	if (file != NULL)
+		snprintf(prefix + plen, sizeof(prefix) - plen, "[%s] %s:%d:%s: ",
+				ctx->app_name, file, line, func ? func : "");
+	plen = strlen(prefix);
+
+	mlen = strlen(msg);
+	if (plen + mlen + 1 > sizeof(local)) {
+		buf = malloc(plen + mlen + 1);
+		if (buf == NULL)
+			return;
+	}
+	memcpy(buf, prefix, plen);
+	memcpy(buf + plen, msg, mlen);
+	len = plen + mlen;
+	if (mlen == 0 || msg[mlen - 1] != '\n')
+		buf[len++] = '\n';
+	fwrite(buf, 1, len, outf);
+	if (buf != local)
+		free(buf);
+}
+
+static void sc_do_log_va(sc_context_t *ctx, int level, const char *file, int line, const char *func, const char *format, va_list args)
+{
+	char	buf[1836];
+	int	r;
+	struct sc_log_stamp stamp;
 
 	assert(ctx != NULL);
 
 	if (ctx->debug < level)
 		return;
 
-	p = buf;
-	left = sizeof(buf);
+	r = vsnprintf(buf, sizeof(buf), format, args);
+	if (r < 0)
+		return;
 
-#ifdef _WIN32
-	GetLocalTime(&st);
-	r = snprintf(p, left,
-			"%i-%02i-%02i %02i:%02i:%02i.%03i ",
-			st.wYear, st.wMonth, st.wDay,
-			st.wHour, st.wMinute, st.wSecond, st.wMilliseconds);
+#ifdef HAVE_PTHREAD
+	/* Everything but the message itself is formatted by the flusher */
+	if (sc_log_queue(ctx, SC_LOG_RECORD_TEXT, file, line, func, buf, strlen(buf) + 1) == SC_SUCCESS)
+		return;
+#endif
+
+	if (ctx->debug_file == NULL)
+		return;
+	sc_log_stamp_now(&stamp);
+	sc_log_write(ctx, ctx->debug_file, &stamp, file, line, func, buf);
+	fflush(ctx->debug_file);
+}
+
+static void sc_log_write_apdu(sc_context_t *ctx, FILE *outf, const struct sc_log_stamp *stamp,
+		const char *file, int line, const char *func, const u8 *data, size_t len, int is_out)
+{
+	size_t blen = len * 5 + 256;
+	char   *buf = malloc(blen);
+	int    n;
+
+	if (buf == NULL)
+		return;
+	n = snprintf(buf, blen, "\n%s APDU data [%5u bytes] =====================================\n",
+		is_out != 0 ? "Outgoing" : "Incoming", (unsigned int)len);
+	sc_hex_dump(ctx, 0, data, len, buf + n, blen - n);
+	strcat(buf, "======================================================================\n");
+	sc_log_write(ctx, outf, stamp, file, line, func, buf);
+	free(buf);
+}
+
+void sc_do_log_apdu(sc_context_t *ctx, int level, const char *file, int line, const char *func,
+		const u8 *data, size_t len, int is_out)
+{
+	struct sc_log_stamp stamp;
+
+	assert(ctx != NULL);
+
+	if (ctx->debug < level)
+		return;
+
+#ifdef HAVE_PTHREAD
+	/* Hex dumps are expensive, queue the raw bytes instead */
+	if (sc_log_queue(ctx, is_out ? SC_LOG_RECORD_APDU_OUT : SC_LOG_RECORD_APDU_IN,
+			file, line, func, data, len) == SC_SUCCESS)
+		return;
+#endif
+
+	if (ctx->debug_file == NULL)
+		return;
+	sc_log_stamp_now(&stamp);
+	sc_log_write_apdu(ctx, ctx->debug_file, &stamp, file, line, func, data, len, is_out);
+	fflush(ctx->debug_file);
+}
+
+static void sc_log_close_file(sc_context_t *ctx)
+{
+	if (ctx->debug_file && ctx->debug_file != stderr && ctx->debug_file != stdout)
+		fclose(ctx->debug_file);
+}
+
+#ifdef HAVE_PTHREAD
+/*
+ * Asynchronous logging (debug_async in opensc.conf).
+ *
+ * Callers only format the message itself and copy it, or the raw APDU,
+ * into a preallocated ring of records. A flusher thread adds timestamps
+ * and source locations, writes the records out and flushes the file
+ * once the ring is empty. When the ring is full, messages are dropped
+ * and counted rather than blocking the caller. The ring lives as long
+ * as the context; the log file is swapped under its lock.
+ */
+#define SC_LOG_RING_SIZE	1024
+#define SC_LOG_RECORD_DATA	1840
+
+struct sc_log_record {
+	struct sc_log_stamp stamp;
+	const char *file;	/* __FILE__ and __FUNCTION__ are static */
+	int line;
+	const char *func;
+	int type;
+	size_t len;
+	u8 data[SC_LOG_RECORD_DATA];
+};
+
+struct sc_log_ring {
+	pthread_mutex_t lock;
+	pthread_cond_t queued;
+	pthread_cond_t drained;
+	pthread_t flusher;
+#ifndef _WIN32
+	pid_t pid;		/* process the flusher runs in */
+#endif
+	unsigned int head, tail;	/* records written, records flushed */
+	unsigned int dropped;
+	int paused;		/* a caller writes to the file itself */
+	int stop;
+	struct sc_log_record records[SC_LOG_RING_SIZE];
+};
+
+/* After fork() the flusher thread is only there in the parent */
+static int sc_log_ring_owned(const struct sc_log_ring *ring)
+{
+#ifndef _WIN32
+	return ring->pid == getpid();
 #else
-	gettimeofday (&tv, NULL);
-	tm = localtime (&tv.tv_sec);
-	strftime (time_string, sizeof(time_string), "%H:%M:%S", tm);
-	r = snprintf(p, left, "0x%lx %s.%03ld ", (unsigned long)pthread_self(), time_string, tv.tv_usec / 1000);
+	return 1;
 #endif
-	p += r;
-	left -= r;
+}
 
-	if (file != NULL) {
-		r = snprintf(p, left, "[%s] %s:%d:%s: ", 
-			ctx->app_name, file, line, func ? func : "");
-		if (r < 0 || (unsigned int)r > sizeof(buf))
-			return;
-	} else {
-		r = 0;
-	}	
-	p += r;
-	left -= r;
+static int sc_log_queue(sc_context_t *ctx, int type, const char *file, int line, const char *func,
+		const void *data, size_t len)
+{
+	struct sc_log_ring *ring = ctx->log_ring;
+	struct sc_log_record *rec;
+	struct sc_log_stamp stamp;
 
-	r = vsnprintf(p, left, format, args);
-	if (r < 0)
+	if (ring == NULL || !sc_log_ring_owned(ring))
+		return SC_ERROR_NOT_SUPPORTED;
+
+	pthread_mutex_lock(&ring->lock);
+	if (ring->stop) {
+		pthread_mutex_unlock(&ring->lock);
+		return SC_ERROR_NOT_SUPPORTED;
+	}
+	if (len > SC_LOG_RECORD_DATA) {
+		/* Too big for a record: write it in order once the
+		 * flusher is done, and keep the flusher paused meanwhile.
+		 * Others go on queueing while the lock is released. */
+		while ((ring->head != ring->tail || ring->paused) && !ring->stop)
+			pthread_cond_wait(&ring->drained, &ring->lock);
+		if (ring->stop) {
+			pthread_mutex_unlock(&ring->lock);
+			return SC_ERROR_NOT_SUPPORTED;
+		}
+		ring->paused = 1;
+		pthread_mutex_unlock(&ring->lock);
+
+		if (ctx->debug_file != NULL) {
+			sc_log_stamp_now(&stamp);
+			if (type == SC_LOG_RECORD_TEXT)
+				sc_log_write(ctx, ctx->debug_file, &stamp, file, line, func, data);
+			else
+				sc_log_write_apdu(ctx, ctx->debug_file, &stamp, file, line, func,
+					data, len, type == SC_LOG_RECORD_APDU_OUT);
+			fflush(ctx->debug_file);
+		}
+
+		pthread_mutex_lock(&ring->lock);
+		ring->paused = 0;
+		pthread_cond_broadcast(&ring->drained);
+		if (ring->head != ring->tail)
+			pthread_cond_signal(&ring->queued);
+		pthread_mutex_unlock(&ring->lock);
+		return SC_SUCCESS;
+	}
+	if (ring->head - ring->tail >= SC_LOG_RING_SIZE) {
+		ring->dropped++;
+		pthread_mutex_unlock(&ring->lock);
+		return SC_SUCCESS;
+	}
+	rec = &ring->records[ring->head % SC_LOG_RING_SIZE];
+	sc_log_stamp_now(&rec->stamp);
+	rec->file = file;
+	rec->line = line;
+	rec->func = func;
+	rec->type = type;
+	rec->len = len;
+	memcpy(rec->data, data, len);
+	if (ring->head++ == ring->tail)
+		pthread_cond_signal(&ring->queued);
+	pthread_mutex_unlock(&ring->lock);
+	return SC_SUCCESS;
+}
+
+static void *sc_log_flusher(void *arg)
+{
+	sc_context_t *ctx = (sc_context_t *)arg;
+	struct sc_log_ring *ring = ctx->log_ring;
+	struct sc_log_record *rec;
+	unsigned int dropped;
+
+	pthread_mutex_lock(&ring->lock);
+	for (;;) {
+		while ((ring->head == ring->tail || ring->paused) && !ring->stop)
+			pthread_cond_wait(&ring->queued, &ring->lock);
+		if (ring->head == ring->tail)
+			break;
+
+		/* The record stays ours until tail moves past it */
+		rec = &ring->records[ring->tail % SC_LOG_RING_SIZE];
+		dropped = ring->dropped;
+		ring->dropped = 0;
+		pthread_mutex_unlock(&ring->lock);
+
+		if (ctx->debug_file != NULL) {
+			if (dropped)
+				fprintf(ctx->debug_file, "%u log messages dropped\n", dropped);
+			if (rec->type == SC_LOG_RECORD_TEXT)
+				sc_log_write(ctx, ctx->debug_file, &rec->stamp,
+					rec->file, rec->line, rec->func, (const char *)rec->data);
+			else
+				sc_log_write_apdu(ctx, ctx->debug_file, &rec->stamp,
+					rec->file, rec->line, rec->func, rec->data, rec->len,
+					rec->type == SC_LOG_RECORD_APDU_OUT);
+		}
+
+		pthread_mutex_lock(&ring->lock);
+		ring->tail++;
+		if (ring->head == ring->tail) {
+			if (ctx->debug_file != NULL)
+				fflush(ctx->debug_file);
+			pthread_cond_broadcast(&ring->drained);
+		}
+	}
+	pthread_mutex_unlock(&ring->lock);
+	return NULL;
+}
+
+int sc_log_async_start(sc_context_t *ctx)
+{
+	struct sc_log_ring *ring;
+
+	if (ctx->log_ring != NULL) {
+		if (sc_log_ring_owned(ctx->log_ring))
+			return SC_SUCCESS;
+		/* inherited through fork(): start over */
+		sc_log_async_stop(ctx);
+	}
+	ring = calloc(1, sizeof(*ring));
+	if (ring == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	pthread_mutex_init(&ring->lock, NULL);
+	pthread_cond_init(&ring->queued, NULL);
+	pthread_cond_init(&ring->drained, NULL);
+#ifndef _WIN32
+	ring->pid = getpid();
+#endif
+	ctx->log_ring = ring;
+	if (pthread_create(&ring->flusher, NULL, sc_log_flusher, ctx) != 0) {
+		ctx->log_ring = NULL;
+		pthread_cond_destroy(&ring->drained);
+		pthread_cond_destroy(&ring->queued);
+		pthread_mutex_destroy(&ring->lock);
+		free(ring);
+		return SC_ERROR_INTERNAL;
+	}
+	return SC_SUCCESS;
+}
+
+void sc_log_async_stop(sc_context_t *ctx)
+{
+	struct sc_log_ring *ring = ctx->log_ring;
+
+	if (ring == NULL)
 		return;
+	if (!sc_log_ring_owned(ring)) {
+		/* There is no flusher to stop in a child process, and
+		 * the state of the lock copied from the parent is not
+		 * known; records left in the ring are the parent's */
+		ctx->log_ring = NULL;
+		free(ring);
+		return;
+	}
+	pthread_mutex_lock(&ring->lock);
+	while (ring->paused)
+		pthread_cond_wait(&ring->drained, &ring->lock);
+	ring->stop = 1;
+	pthread_cond_signal(&ring->queued);
+	pthread_mutex_unlock(&ring->lock);
+	/* The flusher writes out what is left before it exits */
+	pthread_join(ring->flusher, NULL);
+
+	ctx->log_ring = NULL;
+	pthread_cond_destroy(&ring->drained);
+	pthread_cond_destroy(&ring->queued);
+	pthread_mutex_destroy(&ring->lock);
+	free(ring);
+}
 
-	outf = ctx->debug_file;
-	if (outf == NULL)
+void sc_log_set_file(sc_context_t *ctx, FILE *file)
+{
+	struct sc_log_ring *ring = ctx->log_ring;
+
+	if (ring == NULL || !sc_log_ring_owned(ring)) {
+		sc_log_close_file(ctx);
+		ctx->debug_file = file;
 		return;
+	}
+	/* Write out what is queued for the old file first. The flusher
+	 * only touches the file while the ring is not empty. */
+	pthread_mutex_lock(&ring->lock);
+	while ((ring->head != ring->tail || ring->paused) && !ring->stop)
+		pthread_cond_wait(&ring->drained, &ring->lock);
+	sc_log_close_file(ctx);
+	ctx->debug_file = file;
+	pthread_mutex_unlock(&ring->lock);
+}
+#else
+int sc_log_async_start(sc_context_t *ctx)
+{
+	return SC_ERROR_NOT_SUPPORTED;
+}
 
-	fprintf(outf, "%s", buf);
-	n = strlen(buf);
-	if (n == 0 || buf[n-1] != '\n')
-		fprintf(outf, "\n");
-	fflush(outf);
+void sc_log_async_stop(sc_context_t *ctx)
+{
+}
 
-	return;
+void sc_log_set_file(sc_context_t *ctx, FILE *file)
+{
+	sc_log_close_file(ctx);
+	ctx->debug_file = file;
 }
+#endif
 
 void _sc_debug(struct sc_context *ctx, int level, const char *format, ...)
 {	
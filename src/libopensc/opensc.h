@@ -234,6 +234,11 @@ struct sc_ef_atr {
 	struct sc_object_id allocation_oid;
 
 	unsigned status;
+
+	/* From the extended length information, 0 if not given:
+	 * maximum number of bytes in a command and a response APDU */
+	size_t max_command_apdu;
+	size_t max_response_apdu;
 };
 
 struct sc_card_cache {
@@ -243,6 +248,53 @@ struct sc_card_cache {
         struct sc_file *current_df;
 
 	int valid;
+
+	/* Last file selected through sc_select_file(), for cards
+	 * with SC_CARD_CAP_ISO_SELECT; selected_path.len is zero
+	 * when the current selection is unknown. */
+	struct sc_path selected_path;
+	struct sc_file *selected_file;
+	int selected_type;
+
+	/* Last security environment set through sc_set_security_env(),
+	 * for cards with SC_CARD_CAP_SE_CACHE */
+	struct sc_security_env security_env;
+	int security_env_num;
+	int security_env_valid;
+};
+
+/* Authentication state of a PIN reference, as far as it is known
+ * from the PIN commands sent through sc_pin_cmd() */
+struct sc_pin_login_state {
+	unsigned int type;
+	int reference;
+	int state;			/* SC_PIN_STATE_* */
+	unsigned int select_count;	/* value of select_count when learned */
+	unsigned int lock_epoch;	/* value of lock_epoch when learned */
+	/* Whether the card keeps this PIN verified across a SELECT, as
+	 * told by the last GET_INFO, and how many answers in a row agreed */
+	int kept_on_select;
+	unsigned int kept_samples;
+	/* SHA-256 of the PIN value verified, if has_digest: a VERIFY of
+	 * the same value in the same lock_epoch may be skipped. Only kept
+	 * when built with OpenSSL */
+	u8 digest[32];
+	int has_digest;
+};
+
+#define SC_MAX_PIN_LOGIN_STATES		8
+
+struct sc_card_login {
+	struct sc_pin_login_state pins[SC_MAX_PIN_LOGIN_STATES];
+	int count;
+
+	/* Number of SELECT commands sent through sc_transmit_apdu() */
+	unsigned int select_count;
+	/* Number of times sc_lock() has taken the reader lock: no
+	 * other application can have used the card in between */
+	unsigned int lock_epoch;
+	/* The card driver doesn't report the state on GET_INFO */
+	int no_state_info;
 };
 
 #define SC_PROTO_T0		0x00000001
@@ -270,6 +322,7 @@ struct sc_reader_driver {
 /* reader capabilities */
 #define SC_READER_CAP_DISPLAY	0x00000001
 #define SC_READER_CAP_PIN_PAD	0x00000002
+#define SC_READER_CAP_APDU_EXT	0x00000004	/* can transmit extended APDUs */
 
 typedef struct sc_reader {
 	struct sc_context *ctx;
@@ -288,6 +341,12 @@ typedef struct sc_reader {
 		int Fi, f, Di, N;
 		u8 FI, DI;
 	} atr_info;
+
+	/* APDU trace: the data to be fetched with GET RESPONSE is secret */
+	int trace_secret_resp;
+	/* Largest data field of an APDU that the reader can carry,
+	 * 0 if the reader does not tell */
+	size_t max_apdu_data;
 } sc_reader_t;
 
 /* This will be the new interface for handling PIN commands.
@@ -299,9 +358,18 @@ typedef struct sc_reader {
 #define SC_PIN_CMD_UNBLOCK	2
 #define SC_PIN_CMD_GET_INFO	3
 
+#define SC_PIN_STATE_UNKNOWN	-1
+#define SC_PIN_STATE_LOGGED_OUT 0
+#define SC_PIN_STATE_LOGGED_IN  1
+
 #define SC_PIN_CMD_USE_PINPAD		0x0001
 #define SC_PIN_CMD_NEED_PADDING 	0x0002
 #define SC_PIN_CMD_IMPLICIT_CHANGE	0x0004
+/* A VERIFY of a value that the card has accepted while it has stayed
+ * locked may be answered without the card. Only for repeated verifies
+ * within one operation: never for a re-authentication that the card
+ * must see, such as a context specific login. */
+#define SC_PIN_CMD_SKIP_VERIFIED	0x0008
 
 #define SC_PIN_ENCODING_ASCII	0
 #define SC_PIN_ENCODING_BCD	1
@@ -323,6 +391,7 @@ struct sc_pin_cmd_pin {
 	
 	int max_tries;	/* Used for signaling back from SC_PIN_CMD_GET_INFO */
 	int tries_left;	/* Used for signaling back from SC_PIN_CMD_GET_INFO */
+	int logged_in;	/* Used for signaling back from SC_PIN_CMD_GET_INFO */
 
 	struct sc_acl_entry acls[SC_MAX_SDO_ACLS];
 };
@@ -414,6 +483,23 @@ struct sc_reader_operations {
 #define SC_CARD_CAP_ONLY_RAW_HASH		0x00000040
 #define SC_CARD_CAP_ONLY_RAW_HASH_STRIPPED	0x00000080
 
+/* Card driver's select_file() is a plain ISO 7816-4 SELECT, so
+ * sc_select_file() may skip redundant selections and select
+ * files relative to the current DF. */
+#define SC_CARD_CAP_ISO_SELECT			0x00000100
+
+/* Card driver's set_security_env() only sends MANAGE SECURITY
+ * ENVIRONMENT, and the environment stays in effect until the next
+ * MSE or SELECT, so sc_set_security_env() may skip setting the
+ * same environment again. This only happens while the card stays
+ * locked in between, as with lock_login in the PKCS#11 module. */
+#define SC_CARD_CAP_SE_CACHE			0x00000200
+
+/* Card answers a VERIFY without data with the PIN status, and does
+ * not count it as an attempt, so the ISO 7816 pin_cmd() may use it
+ * for SC_PIN_CMD_GET_INFO. */
+#define SC_CARD_CAP_PIN_STATUS			0x00000400
+
 typedef struct sc_card {
 	struct sc_context *ctx;
 	struct sc_reader *reader;
@@ -425,6 +511,9 @@ typedef struct sc_card {
 	int cla;
 	size_t max_send_size; /* Max Lc supported by the card */
 	size_t max_recv_size; /* Max Le supported by the card */
+	/* What sc_connect_card() has set up for extended APDUs on its own,
+	 * undone if the card refuses them */
+	unsigned int apdu_ext_detected;
 
 	struct sc_app_info *app[SC_MAX_CARD_APPS];
 	int app_count;
@@ -444,6 +533,7 @@ typedef struct sc_card {
 	int max_pin_len;
 
 	struct sc_card_cache cache;
+	struct sc_card_login login;
 
 	sc_serial_number_t serialnr;
 
@@ -614,6 +704,9 @@ typedef struct sc_context {
 
 	struct sc_card_driver *card_drivers[SC_MAX_CARD_DRIVERS];
 	struct sc_card_driver *forced_driver;
+	struct sc_atr_cache *atr_cache;
+	struct sc_log_ring *log_ring;
+	FILE *apdu_trace;
 
 	sc_thread_context_t	*thread_ctx;
 	void *mutex;
@@ -999,6 +1092,19 @@ int sc_verify(sc_card_t *card, unsigned int type, int ref, const u8 *buf,
  */
 int sc_logout(sc_card_t *card);
 int sc_pin_cmd(sc_card_t *card, struct sc_pin_cmd_data *, int *tries_left);
+/**
+ * Tells whether a PIN reference is verified on the card.
+ * The state left by sc_pin_cmd() is used while no file has been
+ * selected since, or while the card is known to keep it across a
+ * SELECT; otherwise the card driver is asked with
+ * SC_PIN_CMD_GET_INFO, if it reports the state.
+ * @param  card  sc_card_t object
+ * @param  type  PIN type, usually SC_AC_CHV
+ * @param  ref   PIN reference
+ * @return SC_PIN_STATE_LOGGED_IN, SC_PIN_STATE_LOGGED_OUT or
+ *         SC_PIN_STATE_UNKNOWN
+ */
+int sc_pin_state(sc_card_t *card, unsigned int type, int ref);
 int sc_change_reference_data(sc_card_t *card, unsigned int type,
 			     int ref, const u8 *old, size_t oldlen,
 			     const u8 *newref, size_t newlen,
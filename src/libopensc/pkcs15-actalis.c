@@ -28,7 +28,7 @@
 #include <string.h>
 #include <stdio.h>
 #ifdef ENABLE_ZLIB
-#include <zlib.h>
+#include "libopensc/compression.h"
 #endif
 
 #include "common/compat_strlcpy.h"
@@ -214,28 +214,37 @@ static int sc_pkcs15emu_actalis_init(sc_pkcs15_card_t * p15card)
 
 		if (sc_select_file(card, &cpath, NULL) == SC_SUCCESS) {
 			unsigned char *compCert = NULL, *cert = NULL, size[2];
-			unsigned long compLen, len;
+			size_t compLen, len = 0;
 
 			sc_pkcs15_cert_info_t cert_info;
 			sc_pkcs15_object_t cert_obj;
 			memset(&cert_info, 0, sizeof(cert_info));
 			memset(&cert_obj, 0, sizeof(cert_obj));
 
-			sc_read_binary(card, 2, size, 2, 0);
-			compLen = (size[0] << 8) + size[1];
-			compCert = malloc(compLen * sizeof(unsigned char));
-			len = 3 * compLen;	/*Approximation of the uncompressed size */
-			cert = malloc(len * sizeof(unsigned char));
-
-			sc_read_binary(card, 4, compCert, compLen, 0);
-
-			if (uncompress(cert, &len,
-				compCert, compLen) != Z_OK)
-				return SC_ERROR_INTERNAL;
+			/* Decompressed by an earlier bind? */
+			cpath.count = -1;
+			if (sc_pkcs15_read_cached_file(p15card, &cpath, &cert, &len) != SC_SUCCESS) {
+				sc_read_binary(card, 2, size, 2, 0);
+				compLen = (size[0] << 8) + size[1];
+				compCert = malloc(compLen * sizeof(unsigned char));
+				if (compCert == NULL)
+					return SC_ERROR_OUT_OF_MEMORY;
+
+				sc_read_binary(card, 4, compCert, compLen, 0);
+
+				cert = NULL;
+				len = 0;
+				r = sc_decompress_alloc(&cert, &len, compCert, compLen, COMPRESSION_ZLIB);
+				free(compCert);
+				if (r != SC_SUCCESS)
+					return SC_ERROR_INTERNAL;
+
+				sc_pkcs15_cache_file(p15card, &cpath, cert, len);
+			}
+			free(cert);
 			cpath.index = 0;
 			cpath.count = len;
 
-			sc_pkcs15_cache_file(p15card, &cpath, cert, len);
 			id.value[0] = j + 1;
 			id.len = 1;
 			cert_info.id = id;
@@ -26,19 +26,25 @@
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
 #endif
+#include <sys/types.h>
 #include <sys/stat.h>
 #include <limits.h>
 #include <errno.h>
 #include <assert.h>
+#ifdef HAVE_SYS_MMAN_H
+#include <fcntl.h>
+#include <sys/mman.h>
+#endif
 
 #include "internal.h"
 #include "pkcs15.h"
 
-static int generate_cache_filename(struct sc_pkcs15_card *p15card,
-				   const sc_path_t *path,
-				   char *buf, size_t bufsize)
+#define SC_PKCS15_CACHE_KEY_SIZE	(SC_MAX_PATH_SIZE*2 + 256)
+
+static int generate_cache_key(struct sc_pkcs15_card *p15card,
+			      const sc_path_t *path,
+			      char *buf, size_t bufsize)
 {
-	char dir[PATH_MAX];
         char pathname[SC_MAX_PATH_SIZE*2+1];
 	int  r;
         const u8 *pathptr;
@@ -47,32 +53,564 @@ static int generate_cache_filename(struct sc_pkcs15_card *p15card,
 	if (path->type != SC_PATH_TYPE_PATH)
                 return SC_ERROR_INVALID_ARGUMENTS;
 	assert(path->len <= SC_MAX_PATH_SIZE);
-	r = sc_get_cache_dir(p15card->card->ctx, dir, sizeof(dir));
-	if (r)
-		return r;
 	pathptr = path->value;
 	pathlen = path->len;
 	if (pathlen > 2 && memcmp(pathptr, "\x3F\x00", 2) == 0) {
                 pathptr += 2;
 		pathlen -= 2;
 	}
+	pathname[0] = '\0';
 	for (i = 0; i < pathlen; i++)
 		sprintf(pathname + 2*i, "%02X", pathptr[i]);
 	if (p15card->tokeninfo->serial_number != NULL) {
 		if (p15card->tokeninfo->last_update != NULL)
-			r = snprintf(buf, bufsize, "%s/%s_%s_%s", dir,
+			r = snprintf(buf, bufsize, "%s_%s_%s",
 			     p15card->tokeninfo->serial_number, p15card->tokeninfo->last_update,
 			     pathname);
 		else
-			r = snprintf(buf, bufsize, "%s/%s_DATE_%s", dir,
+			r = snprintf(buf, bufsize, "%s_DATE_%s",
 			     p15card->tokeninfo->serial_number, pathname);
-		if (r < 0)
+		if (r < 0 || (size_t)r >= bufsize)
 			return SC_ERROR_BUFFER_TOO_SMALL;
 	} else
 		return SC_ERROR_INVALID_ARGUMENTS;
         return SC_SUCCESS;
 }
 
+#define CACHE_HASH_INIT			2166136261U
+
+/* FNV-1a; used for the key hash and for the entry checksum */
+static unsigned int cache_hash(unsigned int h, const u8 *data, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		h ^= data[i];
+		h *= 16777619U;
+	}
+	return h;
+}
+
+#ifdef HAVE_SYS_MMAN_H
+/*
+ * All cached files of one user live in a single store in the cache
+ * directory, which every process maps read-only:
+ *
+ *	header | index[count] | key0 data0 | key1 data1 | ...
+ *
+ * An entry is addressed by its key (serial, lastUpdate and path), so
+ * its content never changes once written; a checksum over key and data
+ * catches torn or corrupted entries.  Writers never touch the store in
+ * place: they build a new one in a temporary file and rename() it over
+ * the old one, so readers see a consistent store for as long as they
+ * keep their mapping.  Two concurrent writers may lose each other's new
+ * entry, which only costs one more read from the card later on.
+ */
+#define SC_PKCS15_CACHE_STORE		"pkcs15-cache.db"
+#define SC_PKCS15_CACHE_MAGIC		0x53435043	/* "SCPC" */
+#define SC_PKCS15_CACHE_VERSION		1
+#define SC_PKCS15_CACHE_MAX_ENTRIES	512
+#define SC_PKCS15_CACHE_MAX_SIZE	(4*1024*1024)
+
+struct cache_header {
+	unsigned int magic;
+	unsigned int version;
+	unsigned int count;
+	unsigned int size;
+};
+
+struct cache_index {
+	unsigned int key_hash;
+	unsigned int key_len;
+	unsigned int offset;
+	unsigned int data_len;
+	unsigned int checksum;
+};
+
+struct sc_pkcs15_file_cache {
+	u8 *map;
+	size_t map_len;
+	dev_t dev;
+	ino_t ino;
+	time_t mtime;
+};
+
+static int cache_store_filename(sc_context_t *ctx, char *buf, size_t bufsize)
+{
+	char dir[PATH_MAX];
+	int r;
+
+	r = sc_get_cache_dir(ctx, dir, sizeof(dir));
+	if (r)
+		return r;
+	r = snprintf(buf, bufsize, "%s/%s", dir, SC_PKCS15_CACHE_STORE);
+	if (r < 0 || (size_t)r >= bufsize)
+		return SC_ERROR_BUFFER_TOO_SMALL;
+	return SC_SUCCESS;
+}
+
+static const struct cache_index *cache_store_index(const u8 *map)
+{
+	return (const struct cache_index *) (map + sizeof(struct cache_header));
+}
+
+static unsigned int cache_store_count(const u8 *map)
+{
+	return ((const struct cache_header *) map)->count;
+}
+
+/* Sanity check header and index before the store is used */
+static int cache_store_check(const u8 *map, size_t map_len)
+{
+	const struct cache_header *hdr = (const struct cache_header *) map;
+	const struct cache_index *idx;
+	size_t i, end;
+
+	if (map_len < sizeof(*hdr))
+		return SC_ERROR_CORRUPTED_DATA;
+	if (hdr->magic != SC_PKCS15_CACHE_MAGIC
+			|| hdr->version != SC_PKCS15_CACHE_VERSION
+			|| hdr->size != map_len
+			|| hdr->count > SC_PKCS15_CACHE_MAX_ENTRIES
+			|| sizeof(*hdr) + hdr->count * sizeof(*idx) > map_len)
+		return SC_ERROR_CORRUPTED_DATA;
+	idx = cache_store_index(map);
+	for (i = 0; i < hdr->count; i++) {
+		end = (size_t)idx[i].offset + idx[i].key_len + idx[i].data_len;
+		if (idx[i].offset < sizeof(*hdr) || end > map_len)
+			return SC_ERROR_CORRUPTED_DATA;
+	}
+	return SC_SUCCESS;
+}
+
+static void cache_store_unmap(struct sc_pkcs15_file_cache *cache)
+{
+	if (cache->map != NULL)
+		munmap(cache->map, cache->map_len);
+	cache->map = NULL;
+	cache->map_len = 0;
+}
+
+/* Map the store, unless the mapping we hold is still the current file */
+static int cache_store_map(sc_context_t *ctx, struct sc_pkcs15_file_cache *cache)
+{
+	char fname[PATH_MAX];
+	struct stat stbuf;
+	void *map;
+	int fd, r;
+
+	r = cache_store_filename(ctx, fname, sizeof(fname));
+	if (r)
+		return r;
+	if (stat(fname, &stbuf) != 0) {
+		cache_store_unmap(cache);
+		return SC_ERROR_FILE_NOT_FOUND;
+	}
+	if (cache->map != NULL && cache->dev == stbuf.st_dev && cache->ino == stbuf.st_ino
+			&& cache->mtime == stbuf.st_mtime && cache->map_len == (size_t)stbuf.st_size)
+		return SC_SUCCESS;
+	cache_store_unmap(cache);
+
+	fd = open(fname, O_RDONLY);
+	if (fd < 0)
+		return SC_ERROR_FILE_NOT_FOUND;
+	if (fstat(fd, &stbuf) != 0 || stbuf.st_size <= 0) {
+		close(fd);
+		return SC_ERROR_FILE_NOT_FOUND;
+	}
+	map = mmap(NULL, (size_t)stbuf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return SC_ERROR_FILE_NOT_FOUND;
+	if (cache_store_check(map, (size_t)stbuf.st_size) != SC_SUCCESS) {
+		sc_debug(ctx, SC_LOG_DEBUG_NORMAL, "ignoring corrupted cache %s", fname);
+		munmap(map, (size_t)stbuf.st_size);
+		return SC_ERROR_FILE_NOT_FOUND;
+	}
+
+	cache->map = map;
+	cache->map_len = (size_t)stbuf.st_size;
+	cache->dev = stbuf.st_dev;
+	cache->ino = stbuf.st_ino;
+	cache->mtime = stbuf.st_mtime;
+	return SC_SUCCESS;
+}
+
+static int cache_entry_match(const u8 *map, const struct cache_index *e,
+			     const char *key, size_t key_len, unsigned int key_hash)
+{
+	return e->key_hash == key_hash && e->key_len == key_len
+		&& memcmp(map + e->offset, key, key_len) == 0;
+}
+
+static const struct cache_index *cache_store_lookup(const u8 *map,
+			const char *key, size_t key_len, unsigned int key_hash)
+{
+	const struct cache_index *idx = cache_store_index(map);
+	unsigned int i, count = cache_store_count(map);
+
+	for (i = 0; i < count; i++)
+		if (cache_entry_match(map, idx + i, key, key_len, key_hash))
+			return idx + i;
+	return NULL;
+}
+
+/* Find the entry of a key; its data stays valid while the store is mapped */
+static int cache_store_get(struct sc_pkcs15_card *p15card, const char *key,
+			   const u8 **data, size_t *data_len)
+{
+	sc_context_t *ctx = p15card->card->ctx;
+	struct sc_pkcs15_file_cache *cache;
+	const struct cache_index *e = NULL;
+	unsigned int key_hash;
+	size_t key_len;
+	int r;
+
+	key_len = strlen(key);
+	key_hash = cache_hash(CACHE_HASH_INIT, (const u8 *) key, key_len);
+
+	if (p15card->file_cache == NULL) {
+		p15card->file_cache = calloc(1, sizeof(struct sc_pkcs15_file_cache));
+		if (p15card->file_cache == NULL)
+			return SC_ERROR_OUT_OF_MEMORY;
+	}
+	cache = p15card->file_cache;
+
+	/* Entries never change, so a hit in the store we have already
+	 * mapped is good; only on a miss look for a newer store */
+	if (cache->map != NULL)
+		e = cache_store_lookup(cache->map, key, key_len, key_hash);
+	if (e == NULL) {
+		r = cache_store_map(ctx, cache);
+		if (r)
+			return r;
+		e = cache_store_lookup(cache->map, key, key_len, key_hash);
+		if (e == NULL)
+			return SC_ERROR_FILE_NOT_FOUND;
+	}
+	if (cache_hash(CACHE_HASH_INIT, cache->map + e->offset,
+				(size_t)e->key_len + e->data_len) != e->checksum) {
+		sc_debug(ctx, SC_LOG_DEBUG_NORMAL, "bad checksum of cached file %s", key);
+		return SC_ERROR_FILE_NOT_FOUND;
+	}
+	*data = cache->map + e->offset + e->key_len;
+	*data_len = e->data_len;
+	return SC_SUCCESS;
+}
+
+int sc_pkcs15_read_cached_file(struct sc_pkcs15_card *p15card,
+			       const sc_path_t *path,
+			       u8 **buf, size_t *bufsize)
+{
+	char key[SC_PKCS15_CACHE_KEY_SIZE];
+	size_t data_len, count, offset;
+	const u8 *data;
+	int r;
+
+	r = generate_cache_key(p15card, path, key, sizeof(key));
+	if (r != 0)
+		return r;
+	r = cache_store_get(p15card, key, &data, &data_len);
+	if (r != 0)
+		return r;
+
+	if (path->count < 0) {
+		count = data_len;
+		offset = 0;
+	} else {
+		count = path->count;
+		offset = path->index;
+		if (offset + count > data_len)
+			return SC_ERROR_FILE_NOT_FOUND; /* cache file bad? */
+	}
+	if (*buf == NULL) {
+		*buf = malloc(count ? count : 1);
+		if (*buf == NULL)
+			return SC_ERROR_OUT_OF_MEMORY;
+	} else
+		if (count > *bufsize)
+			return SC_ERROR_BUFFER_TOO_SMALL;
+	memcpy(*buf, data + offset, count);
+	*bufsize = count;
+	return 0;
+}
+
+static int cache_get(struct sc_pkcs15_card *p15card, const char *key,
+		     u8 **buf, size_t *bufsize)
+{
+	const u8 *data;
+	size_t data_len;
+	int r;
+
+	r = cache_store_get(p15card, key, &data, &data_len);
+	if (r != 0)
+		return r;
+	*buf = malloc(data_len ? data_len : 1);
+	if (*buf == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	memcpy(*buf, data, data_len);
+	*bufsize = data_len;
+	return 0;
+}
+
+static int cache_write(int fd, const void *buf, size_t len)
+{
+	const u8 *p = buf;
+	ssize_t n;
+
+	while (len > 0) {
+		n = write(fd, p, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return SC_ERROR_INTERNAL;
+		p += n;
+		len -= n;
+	}
+	return SC_SUCCESS;
+}
+
+/* Add or replace the entry of a key */
+static int cache_put(struct sc_pkcs15_card *p15card, const char *key,
+		     const u8 *buf, size_t bufsize)
+{
+	sc_context_t *ctx = p15card->card->ctx;
+	struct sc_pkcs15_file_cache cur;
+	struct cache_header hdr;
+	struct cache_index *idx = NULL;
+	const struct cache_index *old_idx = NULL;
+	char fname[PATH_MAX], tmpname[PATH_MAX + 7];
+	size_t key_len, total, offset, len;
+	unsigned int key_hash, i, first, old_count = 0, count;
+	int fd = -1, r;
+
+	if (bufsize > SC_PKCS15_CACHE_MAX_SIZE / 2)
+		return 0;
+	key_len = strlen(key);
+	key_hash = cache_hash(CACHE_HASH_INIT, (const u8 *) key, key_len);
+
+	r = cache_store_filename(ctx, fname, sizeof(fname));
+	if (r != 0)
+		return r;
+	r = snprintf(tmpname, sizeof(tmpname), "%s.XXXXXX", fname);
+	if (r < 0 || (size_t)r >= sizeof(tmpname))
+		return SC_ERROR_BUFFER_TOO_SMALL;
+
+	/* Merge into the current store on disk, which may be newer
+	 * than the one mapped by this card handle */
+	memset(&cur, 0, sizeof(cur));
+	if (cache_store_map(ctx, &cur) == SC_SUCCESS) {
+		old_count = cache_store_count(cur.map);
+		old_idx = cache_store_index(cur.map);
+	}
+
+	/* Keep the newest entries that fit besides the new one;
+	 * the oldest ones are at the start of the index */
+	total = key_len + bufsize;
+	count = 1;
+	for (first = old_count; first > 0; first--) {
+		const struct cache_index *e = old_idx + first - 1;
+
+		if (cache_entry_match(cur.map, e, key, key_len, key_hash))
+			continue;
+		len = (size_t)e->key_len + e->data_len;
+		if (count >= SC_PKCS15_CACHE_MAX_ENTRIES || total + len > SC_PKCS15_CACHE_MAX_SIZE)
+			break;
+		total += len;
+		count++;
+	}
+
+	idx = calloc(count, sizeof(struct cache_index));
+	if (idx == NULL) {
+		r = SC_ERROR_OUT_OF_MEMORY;
+		goto out;
+	}
+	offset = sizeof(hdr) + count * sizeof(struct cache_index);
+	for (i = first, count = 0; i < old_count; i++) {
+		if (cache_entry_match(cur.map, old_idx + i, key, key_len, key_hash))
+			continue;
+		idx[count] = old_idx[i];
+		idx[count].offset = offset;
+		offset += (size_t)old_idx[i].key_len + old_idx[i].data_len;
+		count++;
+	}
+	idx[count].key_hash = key_hash;
+	idx[count].key_len = key_len;
+	idx[count].offset = offset;
+	idx[count].data_len = bufsize;
+	idx[count].checksum = cache_hash(key_hash, buf, bufsize);
+	count++;
+
+	hdr.magic = SC_PKCS15_CACHE_MAGIC;
+	hdr.version = SC_PKCS15_CACHE_VERSION;
+	hdr.count = count;
+	hdr.size = offset + key_len + bufsize;
+
+	fd = mkstemp(tmpname);
+	/* If the cache directory does not exist, create it
+	 * and try again */
+	if (fd < 0 && errno == ENOENT) {
+		if ((r = sc_make_cache_dir(ctx)) < 0)
+			goto out;
+		/* mkstemp() may have clobbered the template */
+		snprintf(tmpname, sizeof(tmpname), "%s.XXXXXX", fname);
+		fd = mkstemp(tmpname);
+	}
+	if (fd < 0) {
+		r = 0;
+		goto out;
+	}
+
+	r = cache_write(fd, &hdr, sizeof(hdr));
+	if (r == SC_SUCCESS)
+		r = cache_write(fd, idx, count * sizeof(struct cache_index));
+	for (i = first; r == SC_SUCCESS && i < old_count; i++) {
+		if (cache_entry_match(cur.map, old_idx + i, key, key_len, key_hash))
+			continue;
+		r = cache_write(fd, cur.map + old_idx[i].offset,
+				(size_t)old_idx[i].key_len + old_idx[i].data_len);
+	}
+	if (r == SC_SUCCESS)
+		r = cache_write(fd, key, key_len);
+	if (r == SC_SUCCESS)
+		r = cache_write(fd, buf, bufsize);
+	if (close(fd) != 0 && r == SC_SUCCESS)
+		r = SC_ERROR_INTERNAL;
+	if (r == SC_SUCCESS && rename(tmpname, fname) != 0)
+		r = SC_ERROR_INTERNAL;
+	if (r != SC_SUCCESS) {
+		sc_debug(ctx, SC_LOG_DEBUG_NORMAL, "cannot update cache %s", fname);
+		unlink(tmpname);
+	}
+out:
+	if (idx != NULL)
+		free(idx);
+	cache_store_unmap(&cur);
+	return r;
+}
+
+/* Drop the entry of a key. The store is only rewritten if it has
+ * the entry: an empty one never decodes, so it replaces it */
+static void cache_remove(struct sc_pkcs15_card *p15card, const char *key)
+{
+	const u8 *data;
+	size_t data_len;
+
+	if (cache_store_get(p15card, key, &data, &data_len) == SC_SUCCESS && data_len > 0)
+		cache_put(p15card, key, (const u8 *) "", 0);
+}
+
+int sc_pkcs15_cache_file(struct sc_pkcs15_card *p15card,
+			 const sc_path_t *path,
+			 const u8 *buf, size_t bufsize)
+{
+	char key[SC_PKCS15_CACHE_KEY_SIZE];
+	int r;
+
+	r = generate_cache_key(p15card, path, key, sizeof(key));
+	if (r != 0)
+		return r;
+	return cache_put(p15card, key, buf, bufsize);
+}
+
+void sc_pkcs15_free_file_cache(struct sc_pkcs15_card *p15card)
+{
+	if (p15card->file_cache == NULL)
+		return;
+	cache_store_unmap(p15card->file_cache);
+	free(p15card->file_cache);
+	p15card->file_cache = NULL;
+}
+
+#else	/* HAVE_SYS_MMAN_H */
+
+static int generate_cache_filename(struct sc_pkcs15_card *p15card,
+				   const sc_path_t *path,
+				   char *buf, size_t bufsize)
+{
+	char dir[PATH_MAX];
+	char key[SC_PKCS15_CACHE_KEY_SIZE];
+	int  r;
+
+	r = generate_cache_key(p15card, path, key, sizeof(key));
+	if (r)
+		return r;
+	r = sc_get_cache_dir(p15card->card->ctx, dir, sizeof(dir));
+	if (r)
+		return r;
+	r = snprintf(buf, bufsize, "%s/%s", dir, key);
+	if (r < 0 || (size_t)r >= bufsize)
+		return SC_ERROR_BUFFER_TOO_SMALL;
+        return SC_SUCCESS;
+}
+
+/* Without the shared store, an entry is a file named after its key */
+static int cache_get(struct sc_pkcs15_card *p15card, const char *key,
+		     u8 **buf, size_t *bufsize)
+{
+	char dir[PATH_MAX], fname[PATH_MAX];
+	struct stat stbuf;
+	FILE *f;
+	size_t got;
+	int r;
+
+	r = sc_get_cache_dir(p15card->card->ctx, dir, sizeof(dir));
+	if (r)
+		return r;
+	r = snprintf(fname, sizeof(fname), "%s/%s", dir, key);
+	if (r < 0 || (size_t)r >= sizeof(fname))
+		return SC_ERROR_BUFFER_TOO_SMALL;
+	if (stat(fname, &stbuf) != 0)
+		return SC_ERROR_FILE_NOT_FOUND;
+	*buf = malloc(stbuf.st_size ? (size_t)stbuf.st_size : 1);
+	if (*buf == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	f = fopen(fname, "rb");
+	if (f == NULL) {
+		free(*buf);
+		return SC_ERROR_FILE_NOT_FOUND;
+	}
+	got = fread(*buf, 1, (size_t)stbuf.st_size, f);
+	fclose(f);
+	if (got != (size_t)stbuf.st_size) {
+		free(*buf);
+		return SC_ERROR_FILE_NOT_FOUND;
+	}
+	*bufsize = got;
+	return 0;
+}
+
+static int cache_put(struct sc_pkcs15_card *p15card, const char *key,
+		     const u8 *buf, size_t bufsize)
+{
+	char dir[PATH_MAX], fname[PATH_MAX];
+	FILE *f;
+	size_t c;
+	int r;
+
+	r = sc_get_cache_dir(p15card->card->ctx, dir, sizeof(dir));
+	if (r)
+		return r;
+	r = snprintf(fname, sizeof(fname), "%s/%s", dir, key);
+	if (r < 0 || (size_t)r >= sizeof(fname))
+		return SC_ERROR_BUFFER_TOO_SMALL;
+	f = fopen(fname, "wb");
+	if (f == NULL && errno == ENOENT) {
+		if ((r = sc_make_cache_dir(p15card->card->ctx)) < 0)
+			return r;
+		f = fopen(fname, "wb");
+	}
+	if (f == NULL)
+		return 0;
+	c = fwrite(buf, 1, bufsize, f);
+	fclose(f);
+	if (c != bufsize) {
+		unlink(fname);
+		return SC_ERROR_INTERNAL;
+	}
+	return 0;
+}
+
 int sc_pkcs15_read_cached_file(struct sc_pkcs15_card *p15card,
 			       const sc_path_t *path,
 			       u8 **buf, size_t *bufsize)
@@ -129,6 +667,20 @@ int sc_pkcs15_read_cached_file(struct sc_pkcs15_card *p15card,
 	return 0;
 }
 
+/* Drop the entry of a key */
+static void cache_remove(struct sc_pkcs15_card *p15card, const char *key)
+{
+	char dir[PATH_MAX], fname[PATH_MAX];
+	int r;
+
+	if (sc_get_cache_dir(p15card->card->ctx, dir, sizeof(dir)) != SC_SUCCESS)
+		return;
+	r = snprintf(fname, sizeof(fname), "%s/%s", dir, key);
+	if (r < 0 || (size_t)r >= sizeof(fname))
+		return;
+	unlink(fname);
+}
+
 int sc_pkcs15_cache_file(struct sc_pkcs15_card *p15card,
 			 const sc_path_t *path,
 			 const u8 *buf, size_t bufsize)
@@ -163,3 +715,315 @@ int sc_pkcs15_cache_file(struct sc_pkcs15_card *p15card,
 	}
         return 0;
 }
+
+void sc_pkcs15_free_file_cache(struct sc_pkcs15_card *p15card)
+{
+}
+#endif	/* HAVE_SYS_MMAN_H */
+
+/*
+ * Token snapshot: the files read while the objects of a token are
+ * enumerated (xDFs, certificates, public keys) are kept as a single
+ * cache entry, keyed by serial number and lastUpdate like the cached
+ * files, along with a hash of the ODF and TokenInfo they were read with.
+ * A later bind that finds the same ODF and TokenInfo takes these files
+ * from the snapshot instead of the card.
+ *
+ *	magic | version | check | count | file[count]
+ *	file: path type, len, value | aid len, value | index | count | data len, data
+ */
+#define SC_PKCS15_SNAPSHOT_MAGIC	0x53435353	/* "SCSS" */
+#define SC_PKCS15_SNAPSHOT_VERSION	1
+
+struct snapshot_file {
+	sc_path_t path;
+	u8 *data;
+	size_t len;
+	struct snapshot_file *next;
+};
+
+struct sc_pkcs15_snapshot {
+	unsigned int check;
+	struct snapshot_file *files;
+	int recording;		/* add files read from the card */
+	int dirty;		/* files were added since the restore */
+};
+
+static int generate_snapshot_key(struct sc_pkcs15_card *p15card, char *buf, size_t bufsize)
+{
+	sc_pkcs15_tokeninfo_t *ti = p15card->tokeninfo;
+	int r;
+
+	if (ti->serial_number == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	r = snprintf(buf, bufsize, "%s_%s_SNAPSHOT", ti->serial_number,
+			ti->last_update != NULL ? ti->last_update : "DATE");
+	if (r < 0 || (size_t)r >= bufsize)
+		return SC_ERROR_BUFFER_TOO_SMALL;
+	return SC_SUCCESS;
+}
+
+static void snapshot_put_u32(u8 *p, size_t v)
+{
+	p[0] = (v >> 24) & 0xFF;
+	p[1] = (v >> 16) & 0xFF;
+	p[2] = (v >> 8) & 0xFF;
+	p[3] = v & 0xFF;
+}
+
+static unsigned int snapshot_get_u32(const u8 *p)
+{
+	return ((unsigned int)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static int snapshot_path_equal(const sc_path_t *a, const sc_path_t *b)
+{
+	return a->type == b->type && a->len == b->len
+		&& a->index == b->index && a->count == b->count
+		&& a->aid.len == b->aid.len
+		&& memcmp(a->value, b->value, a->len) == 0
+		&& memcmp(a->aid.value, b->aid.value, a->aid.len) == 0;
+}
+
+static struct snapshot_file *snapshot_find(struct sc_pkcs15_snapshot *snap,
+					   const sc_path_t *path)
+{
+	struct snapshot_file *f;
+
+	for (f = snap->files; f != NULL; f = f->next)
+		if (snapshot_path_equal(&f->path, path))
+			return f;
+	return NULL;
+}
+
+static int snapshot_add(struct sc_pkcs15_snapshot *snap, const sc_path_t *path,
+			const u8 *data, size_t len)
+{
+	struct snapshot_file *f, **pp;
+
+	f = calloc(1, sizeof(*f));
+	if (f == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	f->data = malloc(len ? len : 1);
+	if (f->data == NULL) {
+		free(f);
+		return SC_ERROR_OUT_OF_MEMORY;
+	}
+	memcpy(f->data, data, len);
+	f->len = len;
+	f->path = *path;
+	/* keep the order of the reads */
+	for (pp = &snap->files; *pp != NULL; pp = &(*pp)->next)
+		;
+	*pp = f;
+	return SC_SUCCESS;
+}
+
+static void snapshot_free_files(struct sc_pkcs15_snapshot *snap)
+{
+	struct snapshot_file *f;
+
+	while ((f = snap->files) != NULL) {
+		snap->files = f->next;
+		sc_mem_clear(f->data, f->len);
+		free(f->data);
+		free(f);
+	}
+}
+
+static int snapshot_decode(struct sc_pkcs15_snapshot *snap, const u8 *buf, size_t len)
+{
+	const u8 *p = buf, *end = buf + len;
+	unsigned int count, i;
+	sc_path_t path;
+	size_t data_len;
+
+	if (len < 16 || snapshot_get_u32(p) != SC_PKCS15_SNAPSHOT_MAGIC
+			|| snapshot_get_u32(p + 4) != SC_PKCS15_SNAPSHOT_VERSION
+			|| snapshot_get_u32(p + 8) != snap->check)
+		return SC_ERROR_CORRUPTED_DATA;
+	count = snapshot_get_u32(p + 12);
+	p += 16;
+	for (i = 0; i < count; i++) {
+		memset(&path, 0, sizeof(path));
+		if (end - p < 2 || p[1] > SC_MAX_PATH_SIZE || end - p < 3 + p[1])
+			goto bad;
+		path.type = p[0];
+		path.len = p[1];
+		memcpy(path.value, p + 2, path.len);
+		p += 2 + path.len;
+		if (*p > SC_MAX_AID_SIZE || end - p < 1 + *p + 12)
+			goto bad;
+		path.aid.len = *p;
+		memcpy(path.aid.value, p + 1, path.aid.len);
+		p += 1 + path.aid.len;
+		path.index = snapshot_get_u32(p);
+		path.count = (int) snapshot_get_u32(p + 4);
+		data_len = snapshot_get_u32(p + 8);
+		p += 12;
+		if ((size_t)(end - p) < data_len)
+			goto bad;
+		if (snapshot_add(snap, &path, p, data_len) != SC_SUCCESS)
+			goto bad;
+		p += data_len;
+	}
+	if (p == end)
+		return SC_SUCCESS;
+bad:
+	snapshot_free_files(snap);
+	return SC_ERROR_CORRUPTED_DATA;
+}
+
+static u8 *snapshot_encode(struct sc_pkcs15_snapshot *snap, size_t *len)
+{
+	struct snapshot_file *f;
+	size_t total = 16;
+	unsigned int count = 0;
+	u8 *buf, *p;
+
+	for (f = snap->files; f != NULL; f = f->next, count++)
+		total += 2 + f->path.len + 1 + f->path.aid.len + 12 + f->len;
+	buf = p = malloc(total);
+	if (buf == NULL)
+		return NULL;
+	snapshot_put_u32(p, SC_PKCS15_SNAPSHOT_MAGIC);
+	snapshot_put_u32(p + 4, SC_PKCS15_SNAPSHOT_VERSION);
+	snapshot_put_u32(p + 8, snap->check);
+	snapshot_put_u32(p + 12, count);
+	p += 16;
+	for (f = snap->files; f != NULL; f = f->next) {
+		*p++ = f->path.type;
+		*p++ = f->path.len;
+		memcpy(p, f->path.value, f->path.len);
+		p += f->path.len;
+		*p++ = f->path.aid.len;
+		memcpy(p, f->path.aid.value, f->path.aid.len);
+		p += f->path.aid.len;
+		snapshot_put_u32(p, f->path.index);
+		snapshot_put_u32(p + 4, (unsigned int) f->path.count);
+		snapshot_put_u32(p + 8, f->len);
+		p += 12;
+		memcpy(p, f->data, f->len);
+		p += f->len;
+	}
+	*len = total;
+	return buf;
+}
+
+int sc_pkcs15_restore_snapshot(struct sc_pkcs15_card *p15card,
+			       const u8 *odf, size_t odf_len,
+			       const u8 *tokeninfo, size_t tokeninfo_len)
+{
+	sc_context_t *ctx = p15card->card->ctx;
+	struct sc_pkcs15_snapshot *snap;
+	char key[SC_PKCS15_CACHE_KEY_SIZE];
+	u8 *buf = NULL;
+	size_t len;
+	int r;
+
+	sc_pkcs15_free_snapshot(p15card);
+	r = generate_snapshot_key(p15card, key, sizeof(key));
+	if (r != SC_SUCCESS)
+		return r;
+	snap = calloc(1, sizeof(*snap));
+	if (snap == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	snap->check = cache_hash(cache_hash(CACHE_HASH_INIT, odf, odf_len),
+			tokeninfo, tokeninfo_len);
+	snap->recording = 1;
+	p15card->snapshot = snap;
+
+	r = cache_get(p15card, key, &buf, &len);
+	if (r != SC_SUCCESS) {
+		sc_debug(ctx, SC_LOG_DEBUG_NORMAL, "no snapshot of token %s", key);
+		return SC_SUCCESS;
+	}
+	r = snapshot_decode(snap, buf, len);
+	free(buf);
+	if (r != SC_SUCCESS)
+		sc_debug(ctx, SC_LOG_DEBUG_NORMAL, "snapshot of token %s is out of date", key);
+	else
+		sc_debug(ctx, SC_LOG_DEBUG_NORMAL, "restored snapshot of token %s", key);
+	return SC_SUCCESS;
+}
+
+int sc_pkcs15_read_snapshot_file(struct sc_pkcs15_card *p15card,
+				 const sc_path_t *path,
+				 u8 **buf, size_t *bufsize)
+{
+	struct snapshot_file *f;
+
+	if (p15card->snapshot == NULL)
+		return SC_ERROR_FILE_NOT_FOUND;
+	f = snapshot_find(p15card->snapshot, path);
+	if (f == NULL)
+		return SC_ERROR_FILE_NOT_FOUND;
+	*buf = malloc(f->len ? f->len : 1);
+	if (*buf == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	memcpy(*buf, f->data, f->len);
+	*bufsize = f->len;
+	return SC_SUCCESS;
+}
+
+void sc_pkcs15_snapshot_file(struct sc_pkcs15_card *p15card,
+			     const sc_path_t *path,
+			     const u8 *buf, size_t bufsize)
+{
+	struct sc_pkcs15_snapshot *snap = p15card->snapshot;
+
+	if (snap == NULL || !snap->recording || snapshot_find(snap, path) != NULL)
+		return;
+	if (snapshot_add(snap, path, buf, bufsize) == SC_SUCCESS)
+		snap->dirty = 1;
+}
+
+int sc_pkcs15_save_snapshot(struct sc_pkcs15_card *p15card)
+{
+	struct sc_pkcs15_snapshot *snap = p15card->snapshot;
+	char key[SC_PKCS15_CACHE_KEY_SIZE];
+	u8 *buf;
+	size_t len;
+	int r;
+
+	if (snap == NULL)
+		return SC_SUCCESS;
+	/* anything read from now on may be private */
+	snap->recording = 0;
+	if (!snap->dirty)
+		return SC_SUCCESS;
+	snap->dirty = 0;
+	r = generate_snapshot_key(p15card, key, sizeof(key));
+	if (r != SC_SUCCESS)
+		return r;
+	buf = snapshot_encode(snap, &len);
+	if (buf == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	r = cache_put(p15card, key, buf, len);
+	sc_mem_clear(buf, len);
+	free(buf);
+	sc_debug(p15card->card->ctx, SC_LOG_DEBUG_NORMAL, "saved snapshot of token %s: %s",
+			key, sc_strerror(r));
+	return r;
+}
+
+void sc_pkcs15_drop_snapshot(struct sc_pkcs15_card *p15card)
+{
+	char key[SC_PKCS15_CACHE_KEY_SIZE];
+
+	sc_pkcs15_free_snapshot(p15card);
+	/* Also without a snapshot of our own: another process using
+	 * snapshots may have stored one of this token */
+	if (p15card->tokeninfo != NULL
+			&& generate_snapshot_key(p15card, key, sizeof(key)) == SC_SUCCESS)
+		cache_remove(p15card, key);
+}
+
+void sc_pkcs15_free_snapshot(struct sc_pkcs15_card *p15card)
+{
+	if (p15card->snapshot == NULL)
+		return;
+	snapshot_free_files(p15card->snapshot);
+	free(p15card->snapshot);
+	p15card->snapshot = NULL;
+}
@@ -27,7 +27,7 @@
 #include <string.h>
 #include <stdio.h>
 #ifdef ENABLE_ZLIB
-#include <zlib.h>
+#include "compression.h"
 #endif
 
 #include "common/compat_strlcpy.h"
@@ -495,7 +495,7 @@ static int loadCertificate(sc_pkcs15_card_t * p15card, int i,
 			   const char *certPath, const char *certLabel)
 {
 	unsigned char *compCert = NULL, *cert = NULL, size[2];
-	unsigned long int compLen, len;
+	size_t compLen, len = 0;
 	sc_pkcs15_cert_info_t cert_info;
 	sc_pkcs15_object_t cert_obj;
 	sc_path_t cpath;
@@ -511,25 +511,34 @@ static int loadCertificate(sc_pkcs15_card_t * p15card, int i,
 	if (sc_select_file(card, &cpath, NULL) != SC_SUCCESS)
 		return SC_ERROR_WRONG_CARD;
 
-	sc_read_binary(card, 2, size, 2, 0);
-
-	compLen = (size[0] << 8) + size[1];
-	compCert = malloc(compLen * sizeof(unsigned char));
-	len = 4 * compLen;	/*Approximation of the uncompressed size */
-	cert = malloc(len * sizeof(unsigned char));
-
-	sc_read_binary(card, 4, compCert, compLen, 0);
+	/* Decompressed by an earlier bind? */
+	cpath.count = -1;
+	if (sc_pkcs15_read_cached_file(p15card, &cpath, &cert, &len) != SC_SUCCESS) {
+		sc_read_binary(card, 2, size, 2, 0);
+
+		compLen = (size[0] << 8) + size[1];
+		compCert = malloc(compLen * sizeof(unsigned char));
+		if (compCert == NULL)
+			return SC_ERROR_OUT_OF_MEMORY;
+
+		sc_read_binary(card, 4, compCert, compLen, 0);
+
+		cert = NULL;
+		len = 0;
+		r = sc_decompress_alloc(&cert, &len, compCert, compLen, COMPRESSION_ZLIB);
+		free(compCert);
+		if (r != SC_SUCCESS) {
+			sc_debug(p15card->card->ctx, SC_LOG_DEBUG_NORMAL, "Cannot decompress certificate: %s", sc_strerror(r));
+			return SC_ERROR_INTERNAL;
+		}
 
-	if ((r = uncompress(cert, &len, compCert, compLen)) != Z_OK) {
-		sc_debug(p15card->card->ctx, SC_LOG_DEBUG_NORMAL, "Zlib error: %d", r);
-		return SC_ERROR_INTERNAL;
+		sc_pkcs15_cache_file(p15card, &cpath, cert, len);
 	}
+	free(cert);
 
 	cpath.index = 0;
 	cpath.count = len;
 
-	sc_pkcs15_cache_file(p15card, &cpath, cert, len);
-
 	id.len=1;
 	id.value[0] = i + 1;
 
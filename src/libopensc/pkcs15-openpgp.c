@@ -103,11 +103,7 @@ sc_pkcs15emu_openpgp_init(sc_pkcs15_card_t *p15card)
 	string[r] = '\0';
 	set_string(&p15card->tokeninfo->preferred_language, string);
 
-	/* Get Application Related Data (006E) */
-	if ((r = sc_get_data(card, 0x006E, buffer, sizeof(buffer))) < 0)
-		goto failed;
-
-	/* TBD: extract algorithm info */
+	/* TBD: extract algorithm info from Application Related Data (006E) */
 
 	/* Get CHV status bytes:
 	 *  00:		??
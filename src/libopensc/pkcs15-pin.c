@@ -214,16 +214,10 @@ static int _validate_pin(struct sc_pkcs15_card *p15card,
 	return SC_SUCCESS;
 }
 
-/*
- * Verify a PIN.
- *
- * If the code given to us has zero length, this means we
- * should ask the card reader to obtain the PIN from the
- * reader's PIN pad
- */
-int sc_pkcs15_verify_pin(struct sc_pkcs15_card *p15card,
+static int pkcs15_verify_pin(struct sc_pkcs15_card *p15card,
 			 struct sc_pkcs15_object *pin_obj,
-			 const unsigned char *pincode, size_t pinlen)
+			 const unsigned char *pincode, size_t pinlen,
+			 unsigned int flags)
 {
 	struct sc_context *ctx = p15card->card->ctx;
 	struct sc_pkcs15_auth_info *auth_info = (struct sc_pkcs15_auth_info *)pin_obj->data;
@@ -255,6 +249,7 @@ int sc_pkcs15_verify_pin(struct sc_pkcs15_card *p15card,
 	/* Initialize arguments */
 	memset(&data, 0, sizeof(data));
 	data.cmd = SC_PIN_CMD_VERIFY;
+	data.flags = flags;
 	data.pin_type = auth_info->auth_method;
 	data.pin_reference = auth_info->attrs.pin.reference;
 	data.pin1.min_length = auth_info->attrs.pin.min_length;
@@ -296,6 +291,31 @@ out:
 	SC_FUNC_RETURN(ctx, SC_LOG_DEBUG_NORMAL, r);
 }
 
+/*
+ * Verify a PIN.
+ *
+ * If the code given to us has zero length, this means we
+ * should ask the card reader to obtain the PIN from the
+ * reader's PIN pad
+ */
+int sc_pkcs15_verify_pin(struct sc_pkcs15_card *p15card,
+			 struct sc_pkcs15_object *pin_obj,
+			 const unsigned char *pincode, size_t pinlen)
+{
+	return pkcs15_verify_pin(p15card, pin_obj, pincode, pinlen, 0);
+}
+
+/*
+ * Verify a PIN, unless the card has accepted the same value while it
+ * has stayed locked, see SC_PIN_CMD_SKIP_VERIFIED.
+ */
+int sc_pkcs15_verify_pin_once(struct sc_pkcs15_card *p15card,
+			 struct sc_pkcs15_object *pin_obj,
+			 const unsigned char *pincode, size_t pinlen)
+{
+	return pkcs15_verify_pin(p15card, pin_obj, pincode, pinlen, SC_PIN_CMD_SKIP_VERIFIED);
+}
+
 /*
  * Change a PIN.
  */
@@ -515,6 +535,7 @@ void sc_pkcs15_pincache_add(struct sc_pkcs15_card *p15card, struct sc_pkcs15_obj
 
 	/* If the PIN protects an object with user consent, don't cache it */
 
+	sc_pkcs15_decode_df_entries(p15card, NULL);
 	obj = p15card->obj_list;
 	while (obj != NULL) {
 		/* Compare 'sc_pkcs15_object.auth_id' with 'sc_pkcs15_pin_info.auth_id'.
@@ -547,6 +568,7 @@ void sc_pkcs15_pincache_add(struct sc_pkcs15_card *p15card, struct sc_pkcs15_obj
 int sc_pkcs15_pincache_revalidate(struct sc_pkcs15_card *p15card, const sc_pkcs15_object_t *obj)
 {
 	struct sc_context *ctx = p15card->card->ctx;
+	struct sc_pkcs15_auth_info *auth_info;
 	sc_pkcs15_object_t *pin_obj;
 	int r;
 
@@ -575,6 +597,12 @@ int sc_pkcs15_pincache_revalidate(struct sc_pkcs15_card *p15card, const sc_pkcs1
 	if (!pin_obj->content.value || !pin_obj->content.len)
 		return SC_ERROR_SECURITY_STATUS_NOT_SATISFIED;
 
+	/* The card does not have the PIN verified, whatever was known
+	 * of its state: make sure that the VERIFY is sent */
+	auth_info = (struct sc_pkcs15_auth_info *)pin_obj->data;
+	if (auth_info->auth_type == SC_PKCS15_PIN_AUTH_TYPE_PIN)
+		sc_invalidate_pin_state(p15card->card, auth_info->auth_method, auth_info->attrs.pin.reference);
+
 	pin_obj->usage_counter++;
 	r = sc_pkcs15_verify_pin(p15card, pin_obj, pin_obj->content.value, pin_obj->content.len);
 	if (r != SC_SUCCESS) {
@@ -588,6 +616,35 @@ int sc_pkcs15_pincache_revalidate(struct sc_pkcs15_card *p15card, const sc_pkcs1
 	SC_FUNC_RETURN(ctx, SC_LOG_DEBUG_VERBOSE, SC_SUCCESS);
 }
 
+/* Verify the cached PIN of an object again before the object is used,
+ * when the card is known to have lost the PIN verification (e.g. on
+ * a SELECT). This saves the operation that would fail otherwise, and
+ * counts against pin_cache_counter like any revalidation. Call it
+ * before setting the security environment, which a VERIFY may reset. */
+void sc_pkcs15_pincache_check(struct sc_pkcs15_card *p15card, const sc_pkcs15_object_t *obj)
+{
+	struct sc_context *ctx = p15card->card->ctx;
+	struct sc_pkcs15_auth_info *auth_info;
+	sc_pkcs15_object_t *pin_obj;
+
+	if (!p15card->opts.use_pin_cache || obj->user_consent)
+		return;
+
+	if (sc_pkcs15_find_pin_by_auth_id(p15card, &obj->auth_id, &pin_obj) != SC_SUCCESS)
+		return;
+	if (!pin_obj->content.value || !pin_obj->content.len)
+		return;
+
+	auth_info = (struct sc_pkcs15_auth_info *)pin_obj->data;
+	if (auth_info->auth_type != SC_PKCS15_PIN_AUTH_TYPE_PIN)
+		return;
+	if (sc_pin_state(p15card->card, auth_info->auth_method, auth_info->attrs.pin.reference) != SC_PIN_STATE_LOGGED_OUT)
+		return;
+
+	sc_debug(ctx, SC_LOG_DEBUG_NORMAL, "PIN(%s) not verified any more", pin_obj->label);
+	sc_pkcs15_pincache_revalidate(p15card, obj);
+}
+
 void sc_pkcs15_pincache_clear(struct sc_pkcs15_card *p15card)
 {
 	struct sc_pkcs15_object *objs[32];
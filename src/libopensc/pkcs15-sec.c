@@ -144,6 +144,8 @@ int sc_pkcs15_decipher(struct sc_pkcs15_card *p15card,
 		}
 	}
 
+	sc_pkcs15_pincache_check(p15card, obj);
+
 	r = sc_set_security_env(p15card->card, &senv, 0);
 	if (r < 0) {
 		sc_unlock(p15card->card);
@@ -364,6 +366,8 @@ int sc_pkcs15_compute_signature(struct sc_pkcs15_card *p15card,
 		}
 	}
 
+	sc_pkcs15_pincache_check(p15card, obj);
+
 	r = sc_set_security_env(p15card->card, &senv, 0);
 	if (r < 0) {
 		sc_unlock(p15card->card);
@@ -572,6 +572,8 @@ void sc_pkcs15_card_free(struct sc_pkcs15_card *p15card)
 		sc_file_free(p15card->file_odf);
 	if (p15card->file_unusedspace != NULL)
 		sc_file_free(p15card->file_unusedspace);
+	sc_pkcs15_free_file_cache(p15card);
+	sc_pkcs15_free_snapshot(p15card);
 	p15card->magic = 0;
 	if (p15card->tokeninfo->label != NULL)
 		free(p15card->tokeninfo->label);
@@ -636,6 +638,7 @@ void sc_pkcs15_card_clear(sc_pkcs15_card_t *p15card)
 		sc_file_free(p15card->file_unusedspace);
 		p15card->file_unusedspace = NULL;
 	}
+	sc_pkcs15_free_snapshot(p15card);
 	if (p15card->tokeninfo->label != NULL) {
 		free(p15card->tokeninfo->label);
 		p15card->tokeninfo->label = NULL;
@@ -718,8 +721,8 @@ static int sc_pkcs15_bind_internal(sc_pkcs15_card_t *p15card, struct sc_aid *aid
 	sc_pkcs15_tokeninfo_t tokeninfo;
 	sc_pkcs15_df_t *df;
 	const sc_app_info_t *info = NULL;
-	unsigned char *buf = NULL;
-	size_t len;
+	unsigned char *buf = NULL, *odf = NULL;
+	size_t len, odf_len = 0;
 	int    err, ok = 0;
 
 	LOG_FUNC_CALLED(ctx);
@@ -819,7 +822,9 @@ static int sc_pkcs15_bind_internal(sc_pkcs15_card_t *p15card, struct sc_aid *aid
 		sc_log(ctx, "Unable to parse ODF");
 		goto end;
 	}
-	free(buf);
+	/* kept to validate the token snapshot */
+	odf = buf;
+	odf_len = len;
 	buf = NULL;
 
 	sc_log(ctx, "The following DFs were found:");
@@ -850,8 +855,10 @@ static int sc_pkcs15_bind_internal(sc_pkcs15_card_t *p15card, struct sc_aid *aid
 		goto end;
 	}
 	buf = malloc(len);
-	if(buf == NULL)
-		return SC_ERROR_OUT_OF_MEMORY;
+	if(buf == NULL) {
+		err = SC_ERROR_OUT_OF_MEMORY;
+		goto end;
+	}
 
 	err = sc_read_binary(card, 0, buf, len, 0);
 	if (err < 0)
@@ -861,8 +868,9 @@ static int sc_pkcs15_bind_internal(sc_pkcs15_card_t *p15card, struct sc_aid *aid
 		goto end;
 	}
 
+	len = err;
 	memset(&tokeninfo, 0, sizeof(tokeninfo));
-	err = sc_pkcs15_parse_tokeninfo(ctx, &tokeninfo, buf, (size_t)err);
+	err = sc_pkcs15_parse_tokeninfo(ctx, &tokeninfo, buf, len);
 	if (err != SC_SUCCESS)
 		goto end;
 
@@ -879,10 +887,15 @@ static int sc_pkcs15_bind_internal(sc_pkcs15_card_t *p15card, struct sc_aid *aid
 		sc_log(ctx, "p15card->tokeninfo->serial_number %s", p15card->tokeninfo->serial_number);
 	}
 
+	if (p15card->opts.use_snapshot)
+		sc_pkcs15_restore_snapshot(p15card, odf, odf_len, buf, len);
+
 	ok = 1;
 end:
 	if(buf != NULL)
 		free(buf);
+	if (odf != NULL)
+		free(odf);
 	if (!ok) {
 		sc_pkcs15_card_clear(p15card);
 		return err;
@@ -908,6 +921,7 @@ int sc_pkcs15_bind(sc_card_t *card, struct sc_aid *aid, struct sc_pkcs15_card **
 
 	p15card->card = card;
 	p15card->opts.use_file_cache = 0;
+	p15card->opts.use_snapshot = 0;
 	p15card->opts.use_pin_cache = 1;
 	p15card->opts.pin_cache_counter = 10;
 
@@ -915,11 +929,13 @@ int sc_pkcs15_bind(sc_card_t *card, struct sc_aid *aid, struct sc_pkcs15_card **
 
 	if (conf_block) {
 		p15card->opts.use_file_cache = scconf_get_bool(conf_block, "use_file_caching", p15card->opts.use_file_cache);
+		p15card->opts.use_snapshot = scconf_get_bool(conf_block, "use_token_snapshot", p15card->opts.use_snapshot);
 		p15card->opts.use_pin_cache = scconf_get_bool(conf_block, "use_pin_caching", p15card->opts.use_pin_cache);
 		p15card->opts.pin_cache_counter = scconf_get_int(conf_block, "pin_cache_counter", p15card->opts.pin_cache_counter);
 	}
-	sc_log(ctx, "PKCS#15 options: use_file_cache=%d use_pin_cache=%d pin_cache_counter=%d",
-	         p15card->opts.use_file_cache, p15card->opts.use_pin_cache, p15card->opts.pin_cache_counter);
+	sc_log(ctx, "PKCS#15 options: use_file_cache=%d use_snapshot=%d use_pin_cache=%d pin_cache_counter=%d",
+	         p15card->opts.use_file_cache, p15card->opts.use_snapshot,
+	         p15card->opts.use_pin_cache, p15card->opts.pin_cache_counter);
 
 	r = sc_lock(card);
 	if (r) {
@@ -974,6 +990,302 @@ int sc_pkcs15_unbind(struct sc_pkcs15_card *p15card)
 	return 0;
 }
 
+/*
+ * An xDF is read once and skimmed into an index of its entries, with the
+ * ID and label of each; entries are decoded into objects only when a
+ * search may match them.  Decoded objects are appended to obj_list in
+ * the order they are decoded.
+ */
+struct sc_pkcs15_df_entry {
+	size_t offset, len;
+	const u8 *id;		/* NULL if unknown */
+	size_t id_len;
+	const u8 *label;	/* NULL if unknown */
+	size_t label_len;
+	int decoded;
+	struct sc_pkcs15_object *obj;
+	size_t next;		/* next entry in the hash chain, plus one */
+};
+
+struct sc_pkcs15_df_index {
+	u8 *buf;
+	size_t buflen;
+	struct sc_pkcs15_df_entry *entries;
+	size_t count, pending;
+	size_t *buckets;	/* entry with a known ID, plus one */
+	size_t nbuckets;
+	size_t unknown;		/* chain of entries with an unknown ID */
+};
+
+/* FNV-1a */
+static unsigned int df_index_hash(const u8 *data, size_t len)
+{
+	unsigned int h = 2166136261U;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		h ^= data[i];
+		h *= 16777619U;
+	}
+	return h;
+}
+
+static void df_index_free(struct sc_pkcs15_df_index *index)
+{
+	if (index == NULL)
+		return;
+	free(index->buf);
+	free(index->entries);
+	free(index->buckets);
+	free(index);
+}
+
+/* Read the next TLV; returns its value, or NULL at the end of the data */
+static const u8 *df_index_next_tlv(const u8 **buf, size_t *buflen,
+				   unsigned int *cla, unsigned int *tag, size_t *len)
+{
+	const u8 *p = *buf, *obj = *buf;
+
+	if (sc_asn1_read_tag(&obj, *buflen, cla, tag, len) != SC_SUCCESS || obj == NULL)
+		return NULL;
+	/* sc_asn1_read_tag() does not count the length octet */
+	if (*len > *buflen - (obj - p))
+		return NULL;
+	*buflen -= (obj - p) + *len;
+	*buf = obj + *len;
+	return obj;
+}
+
+/* Record label and ID of an entry: the label is the first element of
+ * commonObjectAttributes, the ID the first one of classAttributes */
+static void df_index_skim_entry(struct sc_pkcs15_df *df, struct sc_pkcs15_df_entry *e,
+				const u8 *in, size_t len)
+{
+	const u8 *seq, *p, *obj;
+	size_t seqlen, objlen;
+	unsigned int cla, tag;
+
+	seq = df_index_next_tlv(&in, &len, &cla, &tag, &seqlen);
+	if (seq == NULL || cla != (SC_ASN1_TAG_UNIVERSAL | SC_ASN1_TAG_CONSTRUCTED)
+			|| tag != SC_ASN1_TAG_SEQUENCE)
+		return;
+	p = seq;
+	obj = df_index_next_tlv(&p, &seqlen, &cla, &tag, &objlen);
+	if (obj == NULL || cla != SC_ASN1_TAG_UNIVERSAL || tag != SC_ASN1_TAG_UTF8STRING) {
+		/* no label */
+		e->label = (const u8 *) "";
+		e->label_len = 0;
+	} else if (objlen < SC_PKCS15_MAX_LABEL_SIZE && memchr(obj, 0, objlen) == NULL) {
+		e->label = obj;
+		e->label_len = objlen;
+	}
+
+	/* data objects do not have an ID in their class attributes */
+	if (df->type == SC_PKCS15_DODF)
+		return;
+	seq = df_index_next_tlv(&in, &len, &cla, &tag, &seqlen);
+	if (seq == NULL || cla != (SC_ASN1_TAG_UNIVERSAL | SC_ASN1_TAG_CONSTRUCTED)
+			|| tag != SC_ASN1_TAG_SEQUENCE)
+		return;
+	obj = df_index_next_tlv(&seq, &seqlen, &cla, &tag, &objlen);
+	if (obj == NULL || cla != SC_ASN1_TAG_UNIVERSAL || tag != SC_ASN1_TAG_OCTET_STRING)
+		return;
+	e->id = obj;
+	e->id_len = objlen > SC_PKCS15_MAX_ID_SIZE ? SC_PKCS15_MAX_ID_SIZE : objlen;
+}
+
+/* Index the entries of a DF file; takes over buf */
+static int df_index_build(struct sc_pkcs15_df *df, u8 *buf, size_t buflen,
+			  struct sc_pkcs15_df_index **out)
+{
+	struct sc_pkcs15_df_index *index;
+	struct sc_pkcs15_df_entry *e;
+	const u8 *p = buf, *obj;
+	size_t left = buflen, objlen, size = 0, i, *head;
+	unsigned int cla, tag;
+
+	index = calloc(1, sizeof(struct sc_pkcs15_df_index));
+	if (index == NULL) {
+		free(buf);
+		return SC_ERROR_OUT_OF_MEMORY;
+	}
+	index->buf = buf;
+	index->buflen = buflen;
+
+	while (left >= 2 && *p != 0x00 && *p != 0xFF) {
+		const u8 *start = p;
+
+		obj = df_index_next_tlv(&p, &left, &cla, &tag, &objlen);
+		if (obj == NULL)
+			break;
+		if (index->count == size) {
+			struct sc_pkcs15_df_entry *tmp;
+
+			size = size ? size * 2 : 16;
+			tmp = realloc(index->entries, size * sizeof(*tmp));
+			if (tmp == NULL) {
+				df_index_free(index);
+				return SC_ERROR_OUT_OF_MEMORY;
+			}
+			index->entries = tmp;
+		}
+		e = &index->entries[index->count++];
+		memset(e, 0, sizeof(*e));
+		e->offset = start - buf;
+		e->len = p - start;
+		df_index_skim_entry(df, e, obj, objlen);
+	}
+	index->pending = index->count;
+
+	for (index->nbuckets = 16; index->nbuckets < index->count; )
+		index->nbuckets *= 2;
+	index->buckets = calloc(index->nbuckets, sizeof(size_t));
+	if (index->buckets == NULL) {
+		df_index_free(index);
+		return SC_ERROR_OUT_OF_MEMORY;
+	}
+	/* Chain backwards, so each chain lists its entries in file order */
+	for (i = index->count; i-- > 0; ) {
+		e = &index->entries[i];
+		if (e->id != NULL)
+			head = &index->buckets[df_index_hash(e->id, e->id_len) & (index->nbuckets - 1)];
+		else
+			head = &index->unknown;
+		e->next = *head;
+		*head = i + 1;
+	}
+
+	*out = index;
+	return SC_SUCCESS;
+}
+
+/* Returns 0 if the entry certainly does not match the search key */
+static int df_index_may_match(const struct sc_pkcs15_df_entry *e,
+			      const struct sc_pkcs15_search_key *sk)
+{
+	if (sk == NULL)
+		return 1;
+	if (sk->id && e->id != NULL
+			&& (e->id_len != sk->id->len || memcmp(e->id, sk->id->value, e->id_len) != 0))
+		return 0;
+	if (sk->app_label && sk->label && e->label != NULL
+			&& (e->label_len != strlen(sk->label) || memcmp(e->label, sk->label, e->label_len) != 0))
+		return 0;
+	return 1;
+}
+
+static int df_index_decode_entry(struct sc_pkcs15_card *p15card, struct sc_pkcs15_df *df,
+				 size_t idx)
+{
+	sc_context_t *ctx = p15card->card->ctx;
+	struct sc_pkcs15_df_index *index = df->index;
+	struct sc_pkcs15_df_entry *e = &index->entries[idx];
+	struct sc_pkcs15_object *obj;
+	const u8 *p = index->buf + e->offset;
+	size_t len = e->len;
+	int (* func)(struct sc_pkcs15_card *, struct sc_pkcs15_object *,
+		     const u8 **nbuf, size_t *nbufsize) = NULL;
+	int r;
+
+	switch (df->type) {
+	case SC_PKCS15_PRKDF:
+		func = sc_pkcs15_decode_prkdf_entry;
+		break;
+	case SC_PKCS15_PUKDF:
+		func = sc_pkcs15_decode_pukdf_entry;
+		break;
+	case SC_PKCS15_CDF:
+	case SC_PKCS15_CDF_TRUSTED:
+	case SC_PKCS15_CDF_USEFUL:
+		func = sc_pkcs15_decode_cdf_entry;
+		break;
+	case SC_PKCS15_DODF:
+		func = sc_pkcs15_decode_dodf_entry;
+		break;
+	case SC_PKCS15_AODF:
+		func = sc_pkcs15_decode_aodf_entry;
+		break;
+	default:
+		return SC_ERROR_INVALID_ARGUMENTS;
+	}
+
+	e->decoded = 1;
+	index->pending--;
+
+	obj = calloc(1, sizeof(struct sc_pkcs15_object));
+	if (obj == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	r = func(p15card, obj, &p, &len);
+	if (r) {
+		free(obj);
+		sc_log(ctx, "%s: Error decoding DF entry %u", sc_strerror(r), (unsigned) idx);
+		return r;
+	}
+	obj->df = df;
+	e->obj = obj;
+	/* Appended, so that callers can take the tail of obj_list as the
+	 * objects found since they last looked (see C_Login) */
+	sc_pkcs15_add_object(p15card, obj);
+	return SC_SUCCESS;
+}
+
+/* Decode the pending entries of a DF which may match the search key */
+static void df_index_decode(struct sc_pkcs15_card *p15card, struct sc_pkcs15_df *df,
+			    const struct sc_pkcs15_search_key *sk)
+{
+	struct sc_pkcs15_df_index *index = df->index;
+	size_t i;
+
+	if (index == NULL || index->pending == 0)
+		return;
+
+	if (sk != NULL && sk->id != NULL) {
+		size_t chains[2];
+		int c;
+
+		chains[0] = index->buckets[df_index_hash(sk->id->value, sk->id->len)
+						& (index->nbuckets - 1)];
+		chains[1] = index->unknown;
+		for (c = 0; c < 2; c++)
+			for (i = chains[c]; i != 0; i = index->entries[i - 1].next)
+				if (!index->entries[i - 1].decoded
+						&& df_index_may_match(&index->entries[i - 1], sk))
+					df_index_decode_entry(p15card, df, i - 1);
+		return;
+	}
+
+	for (i = 0; i < index->count && index->pending; i++)
+		if (!index->entries[i].decoded && df_index_may_match(&index->entries[i], sk))
+			df_index_decode_entry(p15card, df, i);
+}
+
+/* Forget a removed object, so it's not handed out as decoded entry */
+static void df_index_forget(struct sc_pkcs15_df_index *index, struct sc_pkcs15_object *obj)
+{
+	size_t i;
+
+	for (i = 0; i < index->count; i++) {
+		if (index->entries[i].obj == obj) {
+			index->entries[i].obj = NULL;
+			return;
+		}
+	}
+}
+
+int sc_pkcs15_decode_df_entries(struct sc_pkcs15_card *p15card,
+				struct sc_pkcs15_df *df)
+{
+	if (df != NULL) {
+		df_index_decode(p15card, df, NULL);
+		return SC_SUCCESS;
+	}
+	for (df = p15card->df_list; df != NULL; df = df->next)
+		df_index_decode(p15card, df, NULL);
+	return SC_SUCCESS;
+}
+
+static int compare_obj_key(struct sc_pkcs15_object *, void *);
+
 static int
 __sc_pkcs15_search_objects(sc_pkcs15_card_t *p15card,
 			unsigned int class_mask, unsigned int type,
@@ -981,6 +1293,7 @@ __sc_pkcs15_search_objects(sc_pkcs15_card_t *p15card,
 			void *func_arg,
 			sc_pkcs15_object_t **ret, size_t ret_size)
 {
+	const struct sc_pkcs15_search_key *sk = NULL;
 	sc_pkcs15_object_t *obj;
 	sc_pkcs15_df_t	*df;
 	unsigned int	df_mask = 0;
@@ -1011,16 +1324,23 @@ __sc_pkcs15_search_objects(sc_pkcs15_card_t *p15card,
 	if (class_mask & SC_PKCS15_SEARCH_CLASS_AUTH)
 		df_mask |= (1 << SC_PKCS15_AODF);
 
+	/* Searches by ID or name only need the DF entries which may
+	 * match; everything else needs all of them */
+	if (func == compare_obj_key)
+		sk = (const struct sc_pkcs15_search_key *) func_arg;
+	if (sk != NULL && sk->id == NULL && !(sk->app_label && sk->label))
+		sk = NULL;
+
 	/* Make sure all the DFs we want to search have been
 	 * enumerated. */
 	for (df = p15card->df_list; df != NULL; df = df->next) {
 		if (!(df_mask & (1 << df->type)))
 			continue;
-		if (df->enumerated)
-			continue;
 		/* Enumerate the DF's, so p15card->obj_list is
 		 * populated. */
-		r = sc_pkcs15_parse_df(p15card, df);
+		if (!df->enumerated)
+			r = sc_pkcs15_parse_df(p15card, df);
+		df_index_decode(p15card, df, sk);
 	}
 
 	/* And now loop over all objects */
@@ -1457,6 +1777,8 @@ void sc_pkcs15_remove_object(struct sc_pkcs15_card *p15card,
 	if (!obj)
 		return;
 
+	if (obj->df != NULL && obj->df->index != NULL)
+		df_index_forget(obj->df->index, obj);
 	if (obj->prev == NULL)
 		p15card->obj_list = obj->next;
 	else
@@ -1525,6 +1847,7 @@ void sc_pkcs15_remove_df(struct sc_pkcs15_card *p15card,
 		obj->prev->next = obj->next;
 	if (obj->next != NULL)
 		obj->next->prev = obj->prev;
+	df_index_free(obj->index);
 	free(obj);
 }
 
@@ -1567,6 +1890,8 @@ int sc_pkcs15_encode_df(sc_context_t *ctx,
 		*bufsize_out = 0;
 		return 0;
 	}
+	/* Entries not decoded yet would be lost otherwise */
+	sc_pkcs15_decode_df_entries(p15card, df);
 	for (obj = p15card->obj_list; obj != NULL; obj = obj->next) {
 		if (obj->df != df)
 			continue;
@@ -1592,12 +1917,8 @@ int sc_pkcs15_parse_df(struct sc_pkcs15_card *p15card,
 {
 	sc_context_t *ctx = p15card->card->ctx;
 	u8 *buf;
-	const u8 *p;
 	size_t bufsize;
 	int r;
-	struct sc_pkcs15_object *obj = NULL;
-	int (* func)(struct sc_pkcs15_card *, struct sc_pkcs15_object *,
-		     const u8 **nbuf, size_t *nbufsize) = NULL;
 
 	sc_log(ctx, "called; path=%s, type=%d, enum=%d", 
 			sc_print_path(&df->path), df->type, df->enumerated);
@@ -1612,67 +1933,27 @@ int sc_pkcs15_parse_df(struct sc_pkcs15_card *p15card,
 
 	switch (df->type) {
 	case SC_PKCS15_PRKDF:
-		func = sc_pkcs15_decode_prkdf_entry;
-		break;
 	case SC_PKCS15_PUKDF:
-		func = sc_pkcs15_decode_pukdf_entry;
-		break;
 	case SC_PKCS15_CDF:
 	case SC_PKCS15_CDF_TRUSTED:
 	case SC_PKCS15_CDF_USEFUL:
-		func = sc_pkcs15_decode_cdf_entry;
-		break;
 	case SC_PKCS15_DODF:
-		func = sc_pkcs15_decode_dodf_entry;
-		break;
 	case SC_PKCS15_AODF:
-		func = sc_pkcs15_decode_aodf_entry;
 		break;
-	}
-	if (func == NULL) {
+	default:
 		sc_log(ctx, "unknown DF type: %d", df->type);
 		LOG_FUNC_RETURN(ctx, SC_ERROR_INVALID_ARGUMENTS);
 	}
 	r = sc_pkcs15_read_file(p15card, &df->path, &buf, &bufsize);
 	LOG_TEST_RET(ctx, r, "pkcs15 read file failed");
 
-	p = buf;
-	sc_log(ctx, "bufsize %i; first tag 0x%X", bufsize, *p);
-	while (bufsize && *p != 0x00) {
-		
-		obj = calloc(1, sizeof(struct sc_pkcs15_object));
-		if (obj == NULL) {
-			r = SC_ERROR_OUT_OF_MEMORY;
-			goto ret;
-		}
-		r = func(p15card, obj, &p, &bufsize);
-		sc_log(ctx, "rv %i", r);
-		if (r) {
-			free(obj);
-			if (r == SC_ERROR_ASN1_END_OF_CONTENTS) {
-				r = 0;
-				break;
-			}
-			sc_log(ctx, "%s: Error decoding DF entry", sc_strerror(r));
-			goto ret;
-		}
+	sc_log(ctx, "bufsize %i; first tag 0x%X", bufsize, bufsize ? *buf : 0);
+	/* The entries are decoded as searches need them */
+	r = df_index_build(df, buf, bufsize, &df->index);
+	if (r == SC_SUCCESS)
+		sc_log(ctx, "%u entries", (unsigned) df->index->count);
 
-		obj->df = df;
-		r = sc_pkcs15_add_object(p15card, obj);
-		if (r) {
-			if (obj->data)
-				free(obj->data);
-			free(obj);
-			sc_log(ctx, "%s: Error adding object", sc_strerror(r));
-			goto ret;
-		}
-	};
-
-	if (r > 0)
-		r = 0;
-ret:
 	df->enumerated = 1;
-	free(buf);
 	LOG_FUNC_RETURN(ctx, r);
 }
 
@@ -1865,6 +2146,14 @@ int sc_pkcs15_read_file(struct sc_pkcs15_card *p15card,
 			in_path->index, in_path->count);
 
 	r = -1; /* file state: not in cache */
+	if (p15card->snapshot != NULL) {
+		r = sc_pkcs15_read_snapshot_file(p15card, in_path, &data, &len);
+		if (r == SC_SUCCESS) {
+			*buf = data;
+			*buflen = len;
+			LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+		}
+	}
 	if (p15card->opts.use_file_cache) {
 		r = sc_pkcs15_read_cached_file(p15card, in_path, &data, &len);
 	}
@@ -1939,6 +2228,7 @@ int sc_pkcs15_read_file(struct sc_pkcs15_card *p15card,
 
 		sc_file_free(file);
 	}
+	sc_pkcs15_snapshot_file(p15card, in_path, data, len);
 	*buf = data;
 	*buflen = len;
 	LOG_FUNC_RETURN(ctx, SC_SUCCESS);
@@ -459,6 +459,7 @@ typedef struct sc_pkcs15_object sc_pkcs15_object_t;
 #define SC_PKCS15_DF_TYPE_COUNT		9
 
 struct sc_pkcs15_card;
+struct sc_pkcs15_df_index;
 
 struct sc_pkcs15_df {
 	struct sc_path path;
@@ -467,6 +468,9 @@ struct sc_pkcs15_df {
 	int enumerated;
 
 	struct sc_pkcs15_df *next, *prev;
+
+	/* entries of the parsed DF file not all decoded yet, or NULL */
+	struct sc_pkcs15_df_index *index;
 };
 typedef struct sc_pkcs15_df sc_pkcs15_df_t;
 
@@ -524,6 +528,7 @@ typedef struct sc_pkcs15_card {
 
 	struct sc_pkcs15_card_opts {
 		int use_file_cache;
+		int use_snapshot;
 		int use_pin_cache;
 		int pin_cache_counter;
 	} opts;
@@ -535,6 +540,8 @@ typedef struct sc_pkcs15_card {
 
 	struct sc_pkcs15_operations ops;
 
+	struct sc_pkcs15_file_cache *file_cache;	/* mapped file cache store */
+	struct sc_pkcs15_snapshot *snapshot;		/* files of the token snapshot */
 } sc_pkcs15_card_t;
 
 /* flags suitable for sc_pkcs15_tokeninfo_t */
@@ -668,6 +675,9 @@ int sc_pkcs15_find_pubkey_by_id(struct sc_pkcs15_card *card,
 int sc_pkcs15_verify_pin(struct sc_pkcs15_card *card,
 			 struct sc_pkcs15_object *pin_obj,
 			 const u8 *pincode, size_t pinlen);
+int sc_pkcs15_verify_pin_once(struct sc_pkcs15_card *card,
+			 struct sc_pkcs15_object *pin_obj,
+			 const u8 *pincode, size_t pinlen);
 int sc_pkcs15_change_pin(struct sc_pkcs15_card *card,
 			 struct sc_pkcs15_object *pin_obj,
 			 const u8 *oldpincode, size_t oldpinlen,
@@ -694,6 +704,8 @@ void sc_pkcs15_pincache_add(struct sc_pkcs15_card *, struct sc_pkcs15_object *,
 int sc_pkcs15_pincache_revalidate(struct sc_pkcs15_card *p15card, 
 			const sc_pkcs15_object_t *obj);
 void sc_pkcs15_pincache_clear(struct sc_pkcs15_card *p15card);
+void sc_pkcs15_pincache_check(struct sc_pkcs15_card *p15card,
+			       const sc_pkcs15_object_t *obj);
 
 int sc_pkcs15_encode_dir(struct sc_context *ctx,
 			struct sc_pkcs15_card *card,
@@ -729,6 +741,10 @@ int sc_pkcs15_encode_aodf_entry(struct sc_context *ctx,
 
 int sc_pkcs15_parse_df(struct sc_pkcs15_card *p15card,
 		       struct sc_pkcs15_df *df);
+/* Decode the remaining entries of an enumerated DF, or of all DFs if
+ * df is NULL, so that p15card->obj_list holds all of their objects */
+int sc_pkcs15_decode_df_entries(struct sc_pkcs15_card *p15card,
+				struct sc_pkcs15_df *df);
 int sc_pkcs15_read_df(struct sc_pkcs15_card *p15card,
 		      struct sc_pkcs15_df *df);
 int sc_pkcs15_decode_cdf_entry(struct sc_pkcs15_card *p15card,
@@ -791,6 +807,22 @@ int sc_pkcs15_read_cached_file(struct sc_pkcs15_card *p15card,
 int sc_pkcs15_cache_file(struct sc_pkcs15_card *p15card,
 			 const struct sc_path *path,
 			 const u8 *buf, size_t bufsize);
+void sc_pkcs15_free_file_cache(struct sc_pkcs15_card *p15card);
+
+/* Token snapshot: the files read while enumerating the objects,
+ * stored per token after sc_pkcs15_save_snapshot() */
+int sc_pkcs15_restore_snapshot(struct sc_pkcs15_card *p15card,
+			       const u8 *odf, size_t odf_len,
+			       const u8 *tokeninfo, size_t tokeninfo_len);
+int sc_pkcs15_read_snapshot_file(struct sc_pkcs15_card *p15card,
+				 const struct sc_path *path,
+				 u8 **buf, size_t *bufsize);
+void sc_pkcs15_snapshot_file(struct sc_pkcs15_card *p15card,
+			     const struct sc_path *path,
+			     const u8 *buf, size_t bufsize);
+int sc_pkcs15_save_snapshot(struct sc_pkcs15_card *p15card);
+void sc_pkcs15_drop_snapshot(struct sc_pkcs15_card *p15card);
+void sc_pkcs15_free_snapshot(struct sc_pkcs15_card *p15card);
 
 /* PKCS #15 ID handling functions */
 int sc_pkcs15_compare_id(const struct sc_pkcs15_id *id1,
@@ -48,6 +48,8 @@
 struct pcsc_global_private_data {
 	SCARDCONTEXT pcsc_ctx;
 	SCARDCONTEXT pcsc_wait_ctx;
+	void *wait_lock;	/* protects pcsc_wait_ctx and cancel_pending */
+	int cancel_pending;
 	int enable_pinpad;
 	int connect_exclusive;
 	DWORD disconnect_action;
@@ -74,6 +76,7 @@ struct pcsc_global_private_data {
 
 struct pcsc_private_data {
 	struct pcsc_global_private_data *gpriv;
+	SCARDCONTEXT pcsc_card_ctx;
 	SCARDHANDLE pcsc_card;
 	SCARD_READERSTATE reader_state;
 	DWORD verify_ioctl;
@@ -436,6 +439,7 @@ static int pcsc_reconnect(sc_reader_t * reader, DWORD action)
 static int pcsc_connect(sc_reader_t *reader)
 {
 	DWORD active_proto, tmp, protocol = SCARD_PROTOCOL_T0 | SCARD_PROTOCOL_T1;
+	SCARDCONTEXT card_ctx;
 	SCARDHANDLE card_handle;
 	LONG rv;
 	struct pcsc_private_data *priv = GET_PRIV_DATA(reader);
@@ -450,14 +454,25 @@ static int pcsc_connect(sc_reader_t *reader)
 	if (!(reader->flags & SC_READER_CARD_PRESENT))
 		SC_FUNC_RETURN(reader->ctx, SC_LOG_DEBUG_VERBOSE, SC_ERROR_CARD_NOT_PRESENT);
 
-	
-	rv = priv->gpriv->SCardConnect(priv->gpriv->pcsc_ctx, reader->name,
+	/* Talk to the card on a context of its own: the resource manager
+	 * client serializes calls per context, and the cards in different
+	 * readers should be usable from different threads at once */
+	if (priv->pcsc_card_ctx == -1) {
+		rv = priv->gpriv->SCardEstablishContext(SCARD_SCOPE_USER, NULL, NULL, &card_ctx);
+		if (rv == SCARD_S_SUCCESS)
+			priv->pcsc_card_ctx = card_ctx;
+		else
+			PCSC_TRACE(reader, "SCardEstablishContext failed, using the shared context", rv);
+	}
+	card_ctx = priv->pcsc_card_ctx != -1 ? priv->pcsc_card_ctx : priv->gpriv->pcsc_ctx;
+
+	rv = priv->gpriv->SCardConnect(card_ctx, reader->name,
 			  priv->gpriv->connect_exclusive ? SCARD_SHARE_EXCLUSIVE : SCARD_SHARE_SHARED,
 			  protocol, &card_handle, &active_proto);
 #ifdef __APPLE__
 	if (rv == (LONG)SCARD_E_SHARING_VIOLATION) {
 		sleep(1); /* Try again to compete with Tokend probes */
-		rv = priv->gpriv->SCardConnect(priv->gpriv->pcsc_ctx, reader->name,
+		rv = priv->gpriv->SCardConnect(card_ctx, reader->name,
 			  priv->gpriv->connect_exclusive ? SCARD_SHARE_EXCLUSIVE : SCARD_SHARE_SHARED,
 			  protocol, &card_handle, &active_proto);
 	}
@@ -561,6 +576,8 @@ static int pcsc_release(sc_reader_t *reader)
 {
 	struct pcsc_private_data *priv = GET_PRIV_DATA(reader);
 
+	if (priv->pcsc_card_ctx != -1)
+		priv->gpriv->SCardReleaseContext(priv->pcsc_card_ctx);
 	free(priv);
 	return SC_SUCCESS;
 }
@@ -589,13 +606,18 @@ static int pcsc_cancel(sc_context_t *ctx)
 	struct pcsc_global_private_data *gpriv = (struct pcsc_global_private_data *)ctx->reader_drv_data;
 
 	SC_FUNC_CALLED(ctx, SC_LOG_DEBUG_NORMAL);
+
+	if (!gpriv)
+		return SC_ERROR_NO_READERS_FOUND;
 #ifndef _WIN32
-	if (gpriv->pcsc_wait_ctx != -1) {
+	/* The waiting thread releases the context once it sees the cancel.
+	 * A cancel that comes before the wait has started is kept pending
+	 * for the next wait. */
+	sc_mutex_lock(ctx, gpriv->wait_lock);
+	gpriv->cancel_pending = 1;
+	if (gpriv->pcsc_wait_ctx != -1)
 		rv = gpriv->SCardCancel(gpriv->pcsc_wait_ctx);
-		if (rv == SCARD_S_SUCCESS)
-			 /* Also close and clear the waiting context */
-			 rv = gpriv->SCardReleaseContext(gpriv->pcsc_wait_ctx);
-	}
+	sc_mutex_unlock(ctx, gpriv->wait_lock);
 #else
 	rv = gpriv->SCardCancel(gpriv->pcsc_ctx);
 #endif
@@ -638,6 +660,11 @@ static int pcsc_init(sc_context_t *ctx)
 	gpriv->pcsc_ctx = -1;
 	gpriv->pcsc_wait_ctx = -1;
 
+	ret = sc_mutex_create(ctx, &gpriv->wait_lock);
+	if (ret != SC_SUCCESS)
+		goto out;
+	ret = SC_ERROR_INTERNAL;
+
 	conf_block = sc_get_conf_block(ctx, "reader_driver", "pcsc", 1);
 	if (conf_block) {
 		gpriv->connect_exclusive =
@@ -723,6 +750,8 @@ out:
 	if (gpriv != NULL) {
 		if (gpriv->dlhandle != NULL)
 			sc_dlclose(gpriv->dlhandle);
+		if (gpriv->wait_lock != NULL)
+			sc_mutex_destroy(ctx, gpriv->wait_lock);
 		free(gpriv);
 	}
 
@@ -736,16 +765,25 @@ static int pcsc_finish(sc_context_t *ctx)
 	SC_FUNC_CALLED(ctx, SC_LOG_DEBUG_NORMAL);
 
 	if (gpriv) {
+#ifndef _WIN32
+		if (gpriv->pcsc_wait_ctx != -1)
+			gpriv->SCardReleaseContext(gpriv->pcsc_wait_ctx);
+#endif
 		if (gpriv->pcsc_ctx != -1)
 			gpriv->SCardReleaseContext(gpriv->pcsc_ctx);
 		if (gpriv->dlhandle != NULL)
 			sc_dlclose(gpriv->dlhandle);
+		if (gpriv->wait_lock != NULL)
+			sc_mutex_destroy(ctx, gpriv->wait_lock);
 		free(gpriv);
 	}
 
 	return SC_SUCCESS;
 }
 
+static int part10_find_property_by_tag(unsigned char buffer[], int length,
+	int tag_searched);
+
 static void detect_reader_features(sc_reader_t *reader, SCARDHANDLE card_handle) {
 	sc_context_t *ctx = reader->ctx;
 	struct pcsc_global_private_data *gpriv = (struct pcsc_global_private_data *) ctx->reader_drv_data;
@@ -855,6 +893,23 @@ static void detect_reader_features(sc_reader_t *reader, SCARDHANDLE card_handle)
 				sc_debug(ctx, SC_LOG_DEBUG_NORMAL, "Returned PIN properties structure has bad length (%d/%d)", rcount, sizeof(PIN_PROPERTIES_STRUCTURE));
 		}
 	}
+
+	/* Detect extended APDU support: the reader tells the maximum size
+	 * of the data of an APDU, 0 if it only takes short ones */
+	if (priv->get_tlv_properties) {
+		rcount = sizeof(rbuf);
+		rv = gpriv->SCardControl(card_handle, priv->get_tlv_properties, NULL, 0, rbuf, sizeof(rbuf), &rcount);
+		if (rv == SCARD_S_SUCCESS) {
+			int max_data = part10_find_property_by_tag(rbuf, rcount,
+					PCSCv2_PART10_PROPERTY_dwMaxAPDUDataSize);
+
+			if (max_data > 256) {
+				sc_debug(ctx, SC_LOG_DEBUG_NORMAL, "Reader supports extended APDUs (%d bytes)", max_data);
+				reader->capabilities |= SC_READER_CAP_APDU_EXT;
+				reader->max_apdu_data = max_data;
+			}
+		}
+	}
 }
 
 static int pcsc_detect_readers(sc_context_t *ctx)
@@ -964,6 +1019,7 @@ static int pcsc_detect_readers(sc_context_t *ctx)
 			goto err1;
 		}
 		priv->gpriv = gpriv;
+		priv->pcsc_card_ctx = -1;
 		if (_sc_add_reader(ctx, reader)) {
 			ret = SC_SUCCESS;	/* silent ignore */
 			goto err1;
@@ -1046,6 +1102,9 @@ static int pcsc_wait_for_event(sc_context_t *ctx, unsigned int event_mask, sc_re
 		SC_FUNC_RETURN(ctx, SC_LOG_DEBUG_VERBOSE, SC_SUCCESS);
 	}
 
+	if (!gpriv)
+		SC_FUNC_RETURN(ctx, SC_LOG_DEBUG_VERBOSE, SC_ERROR_NO_READERS_FOUND);
+
 	if (reader_states == NULL || *reader_states == NULL) {
 		rgReaderStates = calloc(sc_ctx_get_reader_count(ctx) + 2, sizeof(SCARD_READERSTATE));
 		if (!rgReaderStates)
@@ -1075,14 +1134,23 @@ static int pcsc_wait_for_event(sc_context_t *ctx, unsigned int event_mask, sc_re
 	}
 #ifndef _WIN32
 	/* Establish a new context, assuming that it is called from a different thread with pcsc-lite */
+	sc_mutex_lock(ctx, gpriv->wait_lock);
+	if (gpriv->cancel_pending) {
+		gpriv->cancel_pending = 0;
+		sc_mutex_unlock(ctx, gpriv->wait_lock);
+		r = SC_ERROR_EVENT_TIMEOUT;
+		goto out;
+	}
 	if (gpriv->pcsc_wait_ctx == -1) {
 		rv = gpriv->SCardEstablishContext(SCARD_SCOPE_USER, NULL, NULL, &gpriv->pcsc_wait_ctx);
 		if (rv != SCARD_S_SUCCESS) {
+			sc_mutex_unlock(ctx, gpriv->wait_lock);
 			PCSC_LOG(ctx, "SCardEstablishContext(wait) failed", rv);
 			r = pcsc_to_opensc_error(rv);
 			goto out;
 		}
 	}
+	sc_mutex_unlock(ctx, gpriv->wait_lock);
 #else
 	gpriv->pcsc_wait_ctx = gpriv->pcsc_ctx;
 #endif
@@ -1183,6 +1251,13 @@ static int pcsc_wait_for_event(sc_context_t *ctx, unsigned int event_mask, sc_re
 
 		if (rv == (LONG) SCARD_E_CANCELLED) {
 			/* C_Finalize was called, events don't matter */
+#ifndef _WIN32
+			sc_mutex_lock(ctx, gpriv->wait_lock);
+			gpriv->cancel_pending = 0;
+			gpriv->SCardReleaseContext(gpriv->pcsc_wait_ctx);
+			gpriv->pcsc_wait_ctx = -1;
+			sc_mutex_unlock(ctx, gpriv->wait_lock);
+#endif
 			r = SC_ERROR_EVENT_TIMEOUT;
 			goto out;
 		}
@@ -1841,6 +1916,7 @@ int cardmod_use_reader(sc_context_t *ctx, void * pcsc_context_handle, void * pcs
 			goto err1;
 		}
 		priv->gpriv = gpriv;
+		priv->pcsc_card_ctx = -1;
 		
 		/* attempt to detect protocol in use T0/T1/RAW */
 		rv = priv->gpriv->SCardStatus(card_handle, NULL, &readers_len,
@@ -0,0 +1,1374 @@
+/*
+ * reader-virtual.c: Reader driver for emulated cards
+ *
+ * The reader presents an in-process ISO 7816-4 card whose file system,
+ * PINs and keys are loaded from a card image (an scconf file), so that
+ * the complete stack can be exercised and benchmarked without hardware.
+ * The emulated card speaks the MyEID dialect of the ISO commands, which
+ * lets the existing MyEID card driver and the PKCS#15 layer bind to it.
+ *
+ * Alternatively a reader replays an APDU trace recorded by apdu.c, which
+ * measures the host side of a session independently of the card.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+#ifdef ENABLE_OPENSSL
+#include <openssl/bn.h>
+#include <openssl/ec.h>
+#include <openssl/ecdsa.h>
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/rand.h>
+#include <openssl/rsa.h>
+#endif
+
+#include "internal.h"
+
+/* Default ATR: MyEID, so that card-myeid.c picks up the card */
+#define VIRTUAL_DEFAULT_ATR	"3B:F5:18:00:00:81:31:FE:45:4D:79:45:49:44:9A"
+#define VIRTUAL_MAX_PINS	14
+
+/* File types as reported in tag 82 of the FCP */
+#define VFILE_DF		0x38
+#define VFILE_EF		0x01
+#define VFILE_KEY		0x11
+
+/* Access condition nibbles, as in the MyEID security attribute */
+#define VAC_ALWAYS		0x0
+#define VAC_NEVER		0xF
+
+struct vfile {
+	struct vfile	*parent, *children, *next;
+	unsigned int	id;
+	int		type;
+	u8		name[16];
+	size_t		namelen;
+	u8		*data;
+	size_t		size;
+	/* MyEID security attribute: READ/UPDATE/DELETE for EFs,
+	 * CRYPTO/UPDATE/DELETE/GENERATE for keys */
+	u8		acl[3];
+	int		key_ref;
+	void		*key;		/* EVP_PKEY */
+};
+
+struct vpin {
+	int		ref;
+	u8		value[16];
+	size_t		len;
+	u8		puk[16];
+	size_t		puk_len;
+	int		tries, max_tries;
+};
+
+/* Replayed APDU trace */
+struct vtrace_rec {
+	int		type;
+	unsigned long	usec;
+	const u8	*v1, *v2;
+	size_t		l1, l2;
+};
+
+struct vtrace {
+	u8		*buf;
+	struct vtrace_rec *recs;
+	size_t		count, next;
+	int		timing;
+	unsigned long	replayed, missed;
+};
+
+struct driver_data {
+	char		*image;
+	struct vtrace	*trace;
+	struct vfile	*mf, *cur_df, *cur_ef;
+	struct vpin	pins[VIRTUAL_MAX_PINS];
+	int		npins;
+	unsigned int	verified;	/* bit n set: PIN n verified */
+	unsigned long	latency;	/* microseconds per APDU */
+	unsigned long	crypto_latency;	/* extra microseconds per PSO */
+	u8		serial[8];
+
+	/* current security environment */
+	int		se_op;
+	u8		se_alg;
+	struct vfile	*se_key;
+	u8		crgram[128];	/* first half of a split cryptogram */
+	size_t		crgram_len;
+};
+
+static struct sc_reader_operations virtual_ops;
+
+static struct sc_reader_driver virtual_reader_driver = {
+	"Virtual card reader",
+	"virtual",
+	&virtual_ops,
+	0, 0, NULL
+};
+
+static void virtual_delay(unsigned long usec)
+{
+	if (usec == 0)
+		return;
+#ifndef _WIN32
+	usleep(usec);
+#else
+	Sleep((usec + 999) / 1000);
+#endif
+}
+
+static void vfile_free(struct vfile *file)
+{
+	struct vfile *child, *next;
+
+	if (file == NULL)
+		return;
+	for (child = file->children; child != NULL; child = next) {
+		next = child->next;
+		vfile_free(child);
+	}
+#ifdef ENABLE_OPENSSL
+	if (file->key)
+		EVP_PKEY_free((EVP_PKEY *) file->key);
+#endif
+	if (file->data) {
+		sc_mem_clear(file->data, file->size);
+		free(file->data);
+	}
+	free(file);
+}
+
+/*
+ * Card image loading
+ */
+
+/* Concatenates all values of a list item, so that long contents can be
+ * split over several quoted strings */
+static int image_get_hex(const scconf_block *blk, const char *option,
+		u8 **out, size_t *outlen)
+{
+	const scconf_list *list = scconf_find_list(blk, option), *l;
+	size_t len = 0, n;
+	u8 *buf;
+
+	*out = NULL;
+	*outlen = 0;
+	if (list == NULL)
+		return 0;
+	for (l = list; l != NULL; l = l->next)
+		len += strlen(l->data) / 2 + 1;
+	if ((buf = malloc(len)) == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	for (l = list, len = 0; l != NULL; l = l->next) {
+		n = strlen(l->data) / 2 + 1;
+		if (sc_hex_to_bin(l->data, buf + len, &n) != 0) {
+			free(buf);
+			return SC_ERROR_INVALID_DATA;
+		}
+		len += n;
+	}
+	*out = buf;
+	*outlen = len;
+	return 0;
+}
+
+static int image_read_file(const char *path, u8 **out, size_t *outlen)
+{
+	FILE *fp;
+	u8 *buf = NULL, *tmp;
+	size_t len = 0, n;
+
+	if ((fp = fopen(path, "rb")) == NULL)
+		return SC_ERROR_FILE_NOT_FOUND;
+	do {
+		tmp = realloc(buf, len + 4096);
+		if (tmp == NULL) {
+			free(buf);
+			fclose(fp);
+			return SC_ERROR_OUT_OF_MEMORY;
+		}
+		buf = tmp;
+		n = fread(buf + len, 1, 4096, fp);
+		len += n;
+	} while (n == 4096);
+	fclose(fp);
+	*out = buf;
+	*outlen = len;
+	return 0;
+}
+
+/* "never", "always" or a PIN reference */
+static u8 image_get_ac(const scconf_block *blk, const char *option, u8 def)
+{
+	const char *str = scconf_get_str(blk, option, NULL);
+
+	if (str == NULL)
+		return def;
+	if (!strcmp(str, "never"))
+		return VAC_NEVER;
+	if (!strcmp(str, "always") || !strcmp(str, "none"))
+		return VAC_ALWAYS;
+	return atoi(str) & 0x0F;
+}
+
+static int image_load_key(sc_reader_t *reader, struct vfile *file,
+		const char *path)
+{
+#ifdef ENABLE_OPENSSL
+	EVP_PKEY *pkey;
+	FILE *fp;
+
+	if ((fp = fopen(path, "r")) == NULL) {
+		sc_debug(reader->ctx, SC_LOG_DEBUG_NORMAL, "cannot open key file %s", path);
+		return SC_ERROR_FILE_NOT_FOUND;
+	}
+	pkey = PEM_read_PrivateKey(fp, NULL, NULL, NULL);
+	fclose(fp);
+	if (pkey == NULL) {
+		sc_debug(reader->ctx, SC_LOG_DEBUG_NORMAL, "cannot parse key file %s", path);
+		return SC_ERROR_INVALID_DATA;
+	}
+	file->key = pkey;
+	file->size = EVP_PKEY_bits(pkey);
+	return 0;
+#else
+	sc_debug(reader->ctx, SC_LOG_DEBUG_NORMAL,
+		"key %s ignored: built without OpenSSL", path);
+	return 0;
+#endif
+}
+
+static int image_load_df(sc_reader_t *reader, struct vfile *df,
+		const scconf_block *blk);
+
+static int image_load_file(sc_reader_t *reader, struct vfile *parent,
+		const char *kind, const scconf_block *blk)
+{
+	struct vfile *file, **pp;
+	const char *str;
+	size_t size;
+	u8 *data = NULL;
+	size_t datalen = 0;
+	int r;
+
+	if (blk->name == NULL || blk->name->data == NULL)
+		return SC_ERROR_INVALID_DATA;
+	if ((file = calloc(1, sizeof(*file))) == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	file->parent = parent;
+	file->id = strtoul(blk->name->data, NULL, 16) & 0xFFFF;
+	for (pp = &parent->children; *pp != NULL; pp = &(*pp)->next)
+		;
+	*pp = file;
+
+	if (!strcmp(kind, "DF")) {
+		file->type = VFILE_DF;
+		file->acl[0] = (image_get_ac(blk, "create", VAC_ALWAYS) << 4)
+			| image_get_ac(blk, "create", VAC_ALWAYS);
+		file->acl[1] = image_get_ac(blk, "delete", VAC_ALWAYS) << 4;
+		r = image_get_hex(blk, "aid", &data, &datalen);
+		if (r == 0 && datalen > sizeof(file->name))
+			r = SC_ERROR_INVALID_DATA;
+		if (r < 0) {
+			free(data);
+			return r;
+		}
+		if (data != NULL)
+			memcpy(file->name, data, datalen);
+		file->namelen = datalen;
+		free(data);
+		return image_load_df(reader, file, blk);
+	}
+
+	if ((str = scconf_get_str(blk, "key", NULL)) != NULL) {
+		file->type = VFILE_KEY;
+		file->key_ref = scconf_get_int(blk, "reference", 0);
+		file->acl[0] = (image_get_ac(blk, "crypto", VAC_ALWAYS) << 4)
+			| image_get_ac(blk, "update", VAC_NEVER);
+		file->acl[1] = (image_get_ac(blk, "delete", VAC_NEVER) << 4)
+			| image_get_ac(blk, "generate", VAC_NEVER);
+		return image_load_key(reader, file, str);
+	}
+
+	file->type = VFILE_EF;
+	file->acl[0] = (image_get_ac(blk, "read", VAC_ALWAYS) << 4)
+		| image_get_ac(blk, "update", VAC_NEVER);
+	file->acl[1] = image_get_ac(blk, "delete", VAC_NEVER) << 4;
+	if ((str = scconf_get_str(blk, "file", NULL)) != NULL)
+		r = image_read_file(str, &data, &datalen);
+	else
+		r = image_get_hex(blk, "data", &data, &datalen);
+	if (r < 0) {
+		sc_debug(reader->ctx, SC_LOG_DEBUG_NORMAL,
+			"cannot load contents of EF %04X", file->id);
+		return r;
+	}
+
+	/* the file is allocated at its full size, the rest reads as zero */
+	size = scconf_get_int(blk, "size", datalen);
+	if (size < datalen)
+		size = datalen;
+	file->size = size;
+	file->data = calloc(1, size ? size : 1);
+	if (file->data == NULL) {
+		free(data);
+		return SC_ERROR_OUT_OF_MEMORY;
+	}
+	if (datalen)
+		memcpy(file->data, data, datalen);
+	free(data);
+	return 0;
+}
+
+static int image_load_df(sc_reader_t *reader, struct vfile *df,
+		const scconf_block *blk)
+{
+	const scconf_item *item;
+	int r;
+
+	for (item = blk->items; item != NULL; item = item->next) {
+		if (item->type != SCCONF_ITEM_TYPE_BLOCK)
+			continue;
+		if (strcmp(item->key, "DF") && strcmp(item->key, "EF"))
+			continue;
+		r = image_load_file(reader, df, item->key, item->value.block);
+		if (r < 0)
+			return r;
+	}
+	return 0;
+}
+
+static int image_load_pins(sc_reader_t *reader, const scconf_block *root)
+{
+	struct driver_data *data = (struct driver_data *) reader->drv_data;
+	scconf_block **blocks;
+	const char *str;
+	char *end;
+	long ref;
+	int i;
+
+	blocks = scconf_find_blocks(NULL, root, "pin", NULL);
+	if (blocks == NULL)
+		return 0;
+	for (i = 0; blocks[i] != NULL && data->npins < VIRTUAL_MAX_PINS; i++) {
+		struct vpin *pin = &data->pins[data->npins];
+
+		if (blocks[i]->name == NULL)
+			continue;
+		/* The reference is also the access condition nibble of
+		 * the ACLs, where 0 is "always" and 15 "never" */
+		ref = strtol(blocks[i]->name->data, &end, 0);
+		if (*end != '\0' || ref < 1 || ref > VIRTUAL_MAX_PINS) {
+			sc_debug(reader->ctx, SC_LOG_DEBUG_NORMAL, "invalid PIN reference '%s' in %s",
+				blocks[i]->name->data, data->image);
+			free(blocks);
+			return SC_ERROR_INVALID_DATA;
+		}
+		pin->ref = (int)ref;
+		str = scconf_get_str(blocks[i], "value", "");
+		pin->len = strlen(str) > sizeof(pin->value) ? sizeof(pin->value) : strlen(str);
+		memcpy(pin->value, str, pin->len);
+		str = scconf_get_str(blocks[i], "puk", "");
+		pin->puk_len = strlen(str) > sizeof(pin->puk) ? sizeof(pin->puk) : strlen(str);
+		memcpy(pin->puk, str, pin->puk_len);
+		pin->max_tries = scconf_get_int(blocks[i], "tries", 3);
+		pin->tries = pin->max_tries;
+		data->npins++;
+	}
+	free(blocks);
+	return 0;
+}
+
+static int virtual_load_image(sc_reader_t *reader)
+{
+	struct driver_data *data = (struct driver_data *) reader->drv_data;
+	scconf_context *conf;
+	const scconf_block *root, *mf;
+	u8 *buf = NULL;
+	size_t len;
+	int r;
+
+	conf = scconf_new(data->image);
+	if (conf == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	if (scconf_parse(conf) <= 0) {
+		sc_debug(reader->ctx, SC_LOG_DEBUG_NORMAL, "cannot parse card image %s: %s",
+			data->image, conf->errmsg ? conf->errmsg : "");
+		scconf_free(conf);
+		return SC_ERROR_INVALID_DATA;
+	}
+	root = conf->root;
+
+	len = sizeof(reader->atr.value);
+	r = sc_hex_to_bin(scconf_get_str(root, "atr", VIRTUAL_DEFAULT_ATR),
+			reader->atr.value, &len);
+	if (r < 0)
+		goto out;
+	reader->atr.len = len;
+
+	data->latency = scconf_get_int(root, "latency", 0);
+	data->crypto_latency = scconf_get_int(root, "crypto_latency", 0);
+	r = image_get_hex(root, "serial", &buf, &len);
+	if (r < 0)
+		goto out;
+	if (buf != NULL)
+		memcpy(data->serial, buf, len > sizeof(data->serial) ? sizeof(data->serial) : len);
+	free(buf);
+
+	r = image_load_pins(reader, root);
+	if (r < 0)
+		goto out;
+
+	data->mf = calloc(1, sizeof(struct vfile));
+	if (data->mf == NULL) {
+		r = SC_ERROR_OUT_OF_MEMORY;
+		goto out;
+	}
+	data->mf->id = 0x3F00;
+	data->mf->type = VFILE_DF;
+	mf = scconf_find_block(conf, NULL, "DF");
+	if (mf != NULL)
+		r = image_load_df(reader, data->mf, mf);
+out:
+	scconf_free(conf);
+	return r;
+}
+
+/*
+ * Card emulation
+ */
+
+static struct vfile *vfile_child(struct vfile *df, unsigned int id, int type)
+{
+	struct vfile *f;
+
+	for (f = df->children; f != NULL; f = f->next)
+		if (f->id == id && (type == 0 || (type == VFILE_DF) == (f->type == VFILE_DF)))
+			return f;
+	return NULL;
+}
+
+static struct vfile *vfile_find_name(struct vfile *df, const u8 *name, size_t len)
+{
+	struct vfile *f, *r;
+
+	if (df->namelen == len && memcmp(df->name, name, len) == 0)
+		return df;
+	for (f = df->children; f != NULL; f = f->next) {
+		if (f->type == VFILE_DF && (r = vfile_find_name(f, name, len)) != NULL)
+			return r;
+	}
+	return NULL;
+}
+
+/* Key files are looked up by FID in the current DF first, then anywhere */
+static struct vfile *vfile_find_key(struct vfile *df, unsigned int id, int ref)
+{
+	struct vfile *f, *r;
+
+	for (f = df->children; f != NULL; f = f->next) {
+		if (f->type != VFILE_KEY)
+			continue;
+		if ((id && f->id == id) || (!id && f->key_ref == ref))
+			return f;
+	}
+	for (f = df->children; f != NULL; f = f->next) {
+		if (f->type == VFILE_DF && (r = vfile_find_key(f, id, ref)) != NULL)
+			return r;
+	}
+	return NULL;
+}
+
+static struct vpin *virtual_find_pin(struct driver_data *data, int ref)
+{
+	int i;
+
+	for (i = 0; i < data->npins; i++)
+		if (data->pins[i].ref == ref)
+			return &data->pins[i];
+	return NULL;
+}
+
+static int virtual_ac_ok(struct driver_data *data, u8 ac)
+{
+	if (ac == VAC_ALWAYS)
+		return 1;
+	if (ac == VAC_NEVER)
+		return 0;
+	return (data->verified >> ac) & 1;
+}
+
+static size_t virtual_encode_fcp(struct vfile *file, u8 *out)
+{
+	u8 *p = out + 2;
+	size_t size = file->size;
+
+	*p++ = 0x80;
+	*p++ = 0x02;
+	*p++ = (size >> 8) & 0xFF;
+	*p++ = size & 0xFF;
+	*p++ = 0x82;
+	*p++ = 0x01;
+	*p++ = file->type;
+	*p++ = 0x83;
+	*p++ = 0x02;
+	*p++ = (file->id >> 8) & 0xFF;
+	*p++ = file->id & 0xFF;
+	if (file->namelen) {
+		*p++ = 0x84;
+		*p++ = file->namelen;
+		memcpy(p, file->name, file->namelen);
+		p += file->namelen;
+	}
+	*p++ = 0x86;
+	*p++ = 0x03;
+	memcpy(p, file->acl, 3);
+	p += 3;
+	/* life cycle: operational, so that the MyEID driver verifies PINs */
+	*p++ = 0x8A;
+	*p++ = 0x01;
+	*p++ = 0x07;
+	out[0] = 0x62;
+	out[1] = p - out - 2;
+	return p - out;
+}
+
+static unsigned int virtual_select(struct driver_data *data, const sc_apdu_t *apdu,
+		u8 *out, size_t *outlen)
+{
+	struct vfile *file = NULL, *df = data->cur_df;
+	const u8 *d = apdu->data;
+	size_t i, len = apdu->datalen;
+	unsigned int id = len >= 2 ? (d[0] << 8) | d[1] : 0;
+
+	switch (apdu->p1) {
+	case 0x00:
+		if (len == 0 || id == 0x3F00)
+			file = data->mf;
+		else if (len != 2)
+			return 0x6A87;
+		else if ((file = vfile_child(df, id, 0)) != NULL)
+			;
+		else if (df->id == id)
+			file = df;
+		else if (df->parent != NULL && df->parent->id == id)
+			file = df->parent;
+		else if (df->parent != NULL)
+			file = vfile_child(df->parent, id, VFILE_DF);
+		break;
+	case 0x01:
+	case 0x02:
+		if (len != 2)
+			return 0x6A87;
+		file = vfile_child(df, id, apdu->p1 == 0x01 ? VFILE_DF : VFILE_EF);
+		break;
+	case 0x03:
+		file = df->parent != NULL ? df->parent : df;
+		break;
+	case 0x04:
+		file = vfile_find_name(data->mf, d, len);
+		break;
+	case 0x08:
+	case 0x09:
+		if (len == 0 || (len & 1))
+			return 0x6A87;
+		file = apdu->p1 == 0x08 ? data->mf : df;
+		for (i = 0; i < len && file != NULL; i += 2) {
+			if (file->type != VFILE_DF)
+				file = NULL;
+			else
+				file = vfile_child(file, (d[i] << 8) | d[i + 1], 0);
+		}
+		break;
+	default:
+		return 0x6A86;
+	}
+	if (file == NULL)
+		return 0x6A82;
+
+	if (file->type == VFILE_DF) {
+		data->cur_df = file;
+		data->cur_ef = NULL;
+	} else {
+		data->cur_df = file->parent;
+		data->cur_ef = file;
+	}
+	if ((apdu->p2 & 0x0C) != 0x0C)
+		*outlen = virtual_encode_fcp(file, out);
+	return 0x9000;
+}
+
+static unsigned int virtual_read_binary(struct driver_data *data, const sc_apdu_t *apdu,
+		u8 *out, size_t *outlen)
+{
+	struct vfile *file = data->cur_ef;
+	size_t offset = ((apdu->p1 & 0x7F) << 8) | apdu->p2, n;
+
+	if (apdu->p1 & 0x80)
+		return 0x6A81;
+	if (file == NULL || file->type != VFILE_EF)
+		return 0x6986;
+	if (!virtual_ac_ok(data, file->acl[0] >> 4))
+		return 0x6982;
+	if (offset >= file->size)
+		return 0x6B00;
+	n = file->size - offset;
+	if (n > apdu->le)
+		n = apdu->le;
+	memcpy(out, file->data + offset, n);
+	*outlen = n;
+	return 0x9000;
+}
+
+static unsigned int virtual_update_binary(struct driver_data *data, const sc_apdu_t *apdu)
+{
+	struct vfile *file = data->cur_ef;
+	size_t offset = ((apdu->p1 & 0x7F) << 8) | apdu->p2;
+
+	if (apdu->p1 & 0x80)
+		return 0x6A81;
+	if (file == NULL || file->type != VFILE_EF)
+		return 0x6986;
+	if (!virtual_ac_ok(data, file->acl[0] & 0x0F))
+		return 0x6982;
+	if (offset + apdu->datalen > file->size)
+		return 0x6700;
+	memcpy(file->data + offset, apdu->data, apdu->datalen);
+	return 0x9000;
+}
+
+/* The PIN in the command is compared without its padding */
+static int virtual_pin_match(const u8 *value, size_t len, const u8 *in, size_t inlen)
+{
+	while (inlen > 0 && (in[inlen - 1] == 0xFF || in[inlen - 1] == 0x00))
+		inlen--;
+	return inlen == len && memcmp(value, in, len) == 0;
+}
+
+/* Splits "old || new" as sent by CHANGE REFERENCE DATA and RESET RETRY
+ * COUNTER, either padded to equal halves or unpadded */
+static size_t virtual_pin_split(const u8 *value, size_t len, const u8 *in, size_t inlen)
+{
+	if ((inlen & 1) == 0 && virtual_pin_match(value, len, in, inlen / 2))
+		return inlen / 2;
+	if (inlen >= len && memcmp(value, in, len) == 0)
+		return len;
+	return 0;
+}
+
+static unsigned int virtual_pin_failed(struct driver_data *data, struct vpin *pin)
+{
+	data->verified &= ~(1U << pin->ref);
+	if (pin->tries > 0)
+		pin->tries--;
+	if (pin->tries == 0)
+		return 0x6983;
+	return 0x63C0 | pin->tries;
+}
+
+static void virtual_pin_set(struct vpin *pin, const u8 *in, size_t inlen)
+{
+	while (inlen > 0 && (in[inlen - 1] == 0xFF || in[inlen - 1] == 0x00))
+		inlen--;
+	if (inlen > sizeof(pin->value))
+		inlen = sizeof(pin->value);
+	memcpy(pin->value, in, inlen);
+	pin->len = inlen;
+	pin->tries = pin->max_tries;
+}
+
+static unsigned int virtual_pin_cmd(struct driver_data *data, const sc_apdu_t *apdu)
+{
+	struct vpin *pin = virtual_find_pin(data, apdu->p2 & 0x7F);
+	const u8 *d = apdu->data;
+	size_t len = apdu->datalen, split;
+
+	if (pin == NULL)
+		return 0x6A88;
+
+	switch (apdu->ins) {
+	case 0x20:
+		if (len == 0) {
+			if ((data->verified >> pin->ref) & 1)
+				return 0x9000;
+			return pin->tries ? 0x63C0 | pin->tries : 0x6983;
+		}
+		if (pin->tries == 0)
+			return 0x6983;
+		if (!virtual_pin_match(pin->value, pin->len, d, len))
+			return virtual_pin_failed(data, pin);
+		pin->tries = pin->max_tries;
+		data->verified |= 1U << pin->ref;
+		return 0x9000;
+	case 0x24:
+		if (apdu->p1 == 0x01) {
+			if (!((data->verified >> pin->ref) & 1))
+				return 0x6982;
+			virtual_pin_set(pin, d, len);
+			return 0x9000;
+		}
+		if (pin->tries == 0)
+			return 0x6983;
+		split = virtual_pin_split(pin->value, pin->len, d, len);
+		if (split == 0 || split == len)
+			return virtual_pin_failed(data, pin);
+		virtual_pin_set(pin, d + split, len - split);
+		data->verified |= 1U << pin->ref;
+		return 0x9000;
+	case 0x2C:
+		if (apdu->p1 & 0x02) {
+			split = 0;
+		} else {
+			split = virtual_pin_split(pin->puk, pin->puk_len, d, len);
+			if (split == 0 && (pin->puk_len != 0 || len != 0))
+				return 0x6982;
+		}
+		if (!(apdu->p1 & 0x01))
+			virtual_pin_set(pin, d + split, len - split);
+		pin->tries = pin->max_tries;
+		return 0x9000;
+	}
+	return 0x6D00;
+}
+
+static unsigned int virtual_mse(struct driver_data *data, const sc_apdu_t *apdu)
+{
+	const u8 *p = apdu->data, *end = apdu->data + apdu->datalen;
+	unsigned int fid = 0;
+	int ref = -1;
+
+	if (apdu->p1 == 0xF3 || apdu->p1 == 0xF2)
+		return 0x9000;
+	if ((apdu->p1 & 0x0F) != 0x01)
+		return 0x6A86;
+
+	data->se_op = apdu->p2;
+	data->se_alg = 0;
+	data->se_key = NULL;
+	data->crgram_len = 0;
+	while (p + 2 <= end && p + 2 + p[1] <= end) {
+		switch (p[0]) {
+		case 0x80:
+			if (p[1] >= 1)
+				data->se_alg = p[2];
+			break;
+		case 0x81:
+			if (p[1] >= 2)
+				fid = (p[p[1]] << 8) | p[p[1] + 1];
+			break;
+		case 0x83:
+		case 0x84:
+			if (p[1] >= 1)
+				ref = p[2 + p[1] - 1];
+			break;
+		}
+		p += 2 + p[1];
+	}
+	if (fid == 0 && ref < 0)
+		return 0x9000;
+	/* MyEID sends a dummy 84 00 next to the file reference */
+	data->se_key = vfile_find_key(data->cur_df, fid, fid ? 0 : ref);
+	if (data->se_key == NULL && data->cur_df != data->mf)
+		data->se_key = vfile_find_key(data->mf, fid, fid ? 0 : ref);
+	return data->se_key != NULL ? 0x9000 : 0x6A88;
+}
+
+#ifdef ENABLE_OPENSSL
+static const u8 sha1_prefix[] = {
+	0x30, 0x21, 0x30, 0x09, 0x06, 0x05, 0x2B, 0x0E,
+	0x03, 0x02, 0x1A, 0x05, 0x00, 0x04, 0x14
+};
+
+static unsigned int virtual_sign(struct driver_data *data, const u8 *in, size_t inlen,
+		u8 *out, size_t *outlen, size_t outmax)
+{
+	EVP_PKEY *pkey = (EVP_PKEY *) data->se_key->key;
+	u8 buf[512];
+	int r;
+
+	if (EVP_PKEY_base_id(pkey) == EVP_PKEY_RSA) {
+		RSA *rsa = EVP_PKEY_get1_RSA(pkey);
+		size_t modlen = RSA_size(rsa);
+		int padding = RSA_NO_PADDING;
+
+		if (modlen > outmax || modlen > sizeof(buf)) {
+			RSA_free(rsa);
+			return 0x6700;
+		}
+		if ((data->se_alg & 0x10) && inlen == 20) {
+			memcpy(buf, sha1_prefix, sizeof(sha1_prefix));
+			memcpy(buf + sizeof(sha1_prefix), in, inlen);
+			in = buf;
+			inlen += sizeof(sha1_prefix);
+		}
+		if (data->se_alg & 0x02) {
+			padding = RSA_PKCS1_PADDING;
+		} else if (inlen < modlen) {
+			memmove(buf + modlen - inlen, in, inlen);
+			memset(buf, 0, modlen - inlen);
+			in = buf;
+			inlen = modlen;
+		}
+		r = RSA_private_encrypt(inlen, in, out, rsa, padding);
+		RSA_free(rsa);
+		if (r <= 0)
+			return 0x6A80;
+		*outlen = r;
+		return 0x9000;
+	}
+	if (EVP_PKEY_base_id(pkey) == EVP_PKEY_EC) {
+		EC_KEY *ec = EVP_PKEY_get1_EC_KEY(pkey);
+		size_t flen = (EC_GROUP_get_degree(EC_KEY_get0_group(ec)) + 7) / 8;
+		const BIGNUM *sr, *ss;
+		ECDSA_SIG *sig;
+
+		sig = ECDSA_do_sign(in, inlen, ec);
+		EC_KEY_free(ec);
+		if (sig == NULL)
+			return 0x6A80;
+		if (2 * flen > outmax) {
+			ECDSA_SIG_free(sig);
+			return 0x6700;
+		}
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+		ECDSA_SIG_get0(sig, &sr, &ss);
+#else
+		sr = sig->r;
+		ss = sig->s;
+#endif
+		memset(out, 0, 2 * flen);
+		BN_bn2bin(sr, out + flen - BN_num_bytes(sr));
+		BN_bn2bin(ss, out + 2 * flen - BN_num_bytes(ss));
+		ECDSA_SIG_free(sig);
+		*outlen = 2 * flen;
+		return 0x9000;
+	}
+	return 0x6A81;
+}
+
+static unsigned int virtual_decipher(struct driver_data *data, const u8 *in, size_t inlen,
+		u8 *out, size_t *outlen, size_t outmax)
+{
+	EVP_PKEY *pkey = (EVP_PKEY *) data->se_key->key;
+	u8 buf[512];
+	RSA *rsa;
+	int r;
+
+	if (inlen < 1 || EVP_PKEY_base_id(pkey) != EVP_PKEY_RSA)
+		return 0x6A80;
+	/* padding indicator: 0x81 and 0x82 carry the halves of a 2048 bit
+	 * cryptogram, which does not fit into one short APDU */
+	if (in[0] == 0x81) {
+		if (inlen - 1 > sizeof(data->crgram))
+			return 0x6700;
+		memcpy(data->crgram, in + 1, inlen - 1);
+		data->crgram_len = inlen - 1;
+		return 0x9000;
+	}
+	if (in[0] == 0x82) {
+		if (data->crgram_len == 0 || data->crgram_len + inlen - 1 > sizeof(buf))
+			return 0x6985;
+		memcpy(buf, data->crgram, data->crgram_len);
+		memcpy(buf + data->crgram_len, in + 1, inlen - 1);
+		inlen = data->crgram_len + inlen - 1;
+		data->crgram_len = 0;
+		in = buf;
+	} else {
+		in++;
+		inlen--;
+	}
+
+	rsa = EVP_PKEY_get1_RSA(pkey);
+	if ((size_t) RSA_size(rsa) > outmax) {
+		RSA_free(rsa);
+		return 0x6700;
+	}
+	r = RSA_private_decrypt(inlen, in, out, rsa,
+			(data->se_alg & 0x02) ? RSA_PKCS1_PADDING : RSA_NO_PADDING);
+	RSA_free(rsa);
+	if (r < 0)
+		return 0x6A80;
+	*outlen = r;
+	return 0x9000;
+}
+#endif
+
+static unsigned int virtual_pso(struct driver_data *data, const sc_apdu_t *apdu,
+		u8 *out, size_t *outlen, size_t outmax)
+{
+	struct vfile *key = data->se_key;
+	u8 buf[SC_MAX_APDU_BUFFER_SIZE];
+	const u8 *in = apdu->data;
+	size_t inlen = apdu->datalen;
+
+	if (key == NULL)
+		return 0x6985;
+	if (!virtual_ac_ok(data, key->acl[0] >> 4))
+		return 0x6982;
+	if (key->key == NULL)
+		return 0x6A81;
+
+#ifdef ENABLE_OPENSSL
+	if (apdu->p1 == 0x9E && data->se_op == 0xB6) {
+		/* MyEID passes the first byte of a 256 byte input in P2 */
+		if (apdu->p2 != 0x9A) {
+			if (inlen + 1 > sizeof(buf))
+				return 0x6700;
+			buf[0] = apdu->p2;
+			memcpy(buf + 1, in, inlen);
+			in = buf;
+			inlen++;
+		}
+		return virtual_sign(data, in, inlen, out, outlen, outmax);
+	}
+	if (apdu->p1 == 0x80 && apdu->p2 == 0x86 && data->se_op == 0xB8)
+		return virtual_decipher(data, in, inlen, out, outlen, outmax);
+	return 0x6A86;
+#else
+	(void) buf; (void) in; (void) inlen; (void) out; (void) outlen; (void) outmax;
+	return 0x6A81;
+#endif
+}
+
+static unsigned int virtual_get_data(struct driver_data *data, const sc_apdu_t *apdu,
+		u8 *out, size_t *outlen)
+{
+	struct vfile *f;
+	size_t n = 0;
+
+	if (apdu->p1 != 0x01)
+		return 0x6A88;
+	switch (apdu->p2) {
+	case 0xA0:
+		/* card info; the serial number sits at offset 10 */
+		if (apdu->le < 20)
+			return 0x6700;
+		memset(out, 0, 20);
+		memcpy(out + 10, data->serial, sizeof(data->serial));
+		*outlen = 20;
+		return 0x9000;
+	case 0xA1:
+		for (f = data->cur_df->children; f != NULL && n + 2 <= apdu->le; f = f->next) {
+			out[n++] = (f->id >> 8) & 0xFF;
+			out[n++] = f->id & 0xFF;
+		}
+		*outlen = n;
+		return 0x9000;
+	}
+	return 0x6A88;
+}
+
+static unsigned int virtual_get_challenge(const sc_apdu_t *apdu, u8 *out, size_t *outlen)
+{
+	size_t i;
+
+#ifdef ENABLE_OPENSSL
+	if (RAND_bytes(out, apdu->le) == 1) {
+		*outlen = apdu->le;
+		return 0x9000;
+	}
+#endif
+	for (i = 0; i < apdu->le; i++)
+		out[i] = rand() & 0xFF;
+	*outlen = apdu->le;
+	return 0x9000;
+}
+
+static unsigned int virtual_process(struct driver_data *data, const sc_apdu_t *apdu,
+		u8 *out, size_t *outlen, size_t outmax)
+{
+	*outlen = 0;
+	switch (apdu->ins) {
+	case 0xA4:
+		return virtual_select(data, apdu, out, outlen);
+	case 0xB0:
+		return virtual_read_binary(data, apdu, out, outlen);
+	case 0xD6:
+		return virtual_update_binary(data, apdu);
+	case 0x20:
+	case 0x24:
+	case 0x2C:
+		return virtual_pin_cmd(data, apdu);
+	case 0x22:
+		return virtual_mse(data, apdu);
+	case 0x2A:
+		return virtual_pso(data, apdu, out, outlen, outmax);
+	case 0x84:
+		return virtual_get_challenge(apdu, out, outlen);
+	case 0xCA:
+		return virtual_get_data(data, apdu, out, outlen);
+	}
+	return 0x6D00;
+}
+
+/*
+ * Trace replay
+ */
+
+static void vtrace_free(struct vtrace *trace)
+{
+	if (trace == NULL)
+		return;
+	free(trace->recs);
+	free(trace->buf);
+	free(trace);
+}
+
+static int virtual_load_trace(sc_reader_t *reader)
+{
+	struct driver_data *data = (struct driver_data *) reader->drv_data;
+	size_t magic = strlen(SC_APDU_TRACE_MAGIC), len, pos, n;
+	struct vtrace *trace;
+	scconf_block *conf_block;
+	int r;
+
+	if ((trace = calloc(1, sizeof(*trace))) == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	data->trace = trace;
+	r = image_read_file(data->image, &trace->buf, &len);
+	if (r < 0)
+		return r;
+	if (len < magic || memcmp(trace->buf, SC_APDU_TRACE_MAGIC, magic) != 0)
+		return SC_ERROR_INVALID_DATA;
+
+	/* count the records first, then index them */
+	for (n = 0, pos = magic; n < 2; n++) {
+		trace->count = 0;
+		for (pos = magic; pos + 9 <= len; ) {
+			const u8 *p = trace->buf + pos;
+			size_t l1 = (p[5] << 8) | p[6], l2;
+
+			if (pos + 9 + l1 > len)
+				break;
+			l2 = (p[7 + l1] << 8) | p[8 + l1];
+			if (pos + 9 + l1 + l2 > len)
+				break;
+			if (trace->recs != NULL) {
+				struct vtrace_rec *rec = &trace->recs[trace->count];
+
+				rec->type = p[0];
+				rec->usec = ((unsigned long) p[1] << 24) | (p[2] << 16) | (p[3] << 8) | p[4];
+				rec->v1 = p + 7;
+				rec->l1 = l1;
+				rec->v2 = p + 9 + l1;
+				rec->l2 = l2;
+			}
+			trace->count++;
+			pos += 9 + l1 + l2;
+		}
+		if (trace->recs == NULL
+		 && (trace->recs = calloc(trace->count + 1, sizeof(*trace->recs))) == NULL)
+			return SC_ERROR_OUT_OF_MEMORY;
+	}
+	if (pos != len)
+		sc_debug(reader->ctx, SC_LOG_DEBUG_NORMAL,
+			"trace %s truncated after %lu records", data->image,
+			(unsigned long) trace->count);
+
+	for (n = 0; n < trace->count; n++) {
+		if (trace->recs[n].type == SC_APDU_TRACE_CONNECT)
+			break;
+	}
+	if (n == trace->count || trace->recs[n].l2 > SC_MAX_ATR_SIZE)
+		return SC_ERROR_INVALID_DATA;
+	memcpy(reader->atr.value, trace->recs[n].v2, trace->recs[n].l2);
+	reader->atr.len = trace->recs[n].l2;
+
+	conf_block = sc_get_conf_block(reader->ctx, "reader_driver", "virtual", 1);
+	if (conf_block != NULL)
+		trace->timing = scconf_get_bool(conf_block, "replay_timing", 0);
+	return 0;
+}
+
+/* Every session starts at the next connect record of the trace */
+static void vtrace_connect(sc_reader_t *reader, struct vtrace *trace)
+{
+	size_t i;
+
+	for (i = trace->next; i < trace->count; i++) {
+		if (trace->recs[i].type != SC_APDU_TRACE_CONNECT)
+			continue;
+		if (trace->recs[i].l2 <= SC_MAX_ATR_SIZE) {
+			memcpy(reader->atr.value, trace->recs[i].v2, trace->recs[i].l2);
+			reader->atr.len = trace->recs[i].l2;
+		}
+		trace->next = i + 1;
+		break;
+	}
+}
+
+/* PIN values and key material are blanked in the trace, so those
+ * commands match on the header and the length only */
+static int vtrace_match(const struct vtrace_rec *rec, const u8 *cmd, size_t len)
+{
+	if (rec->type != SC_APDU_TRACE_TRANSMIT || rec->l1 != len)
+		return 0;
+	if (len > 4 && sc_apdu_trace_secret_cmd(cmd[1]))
+		return memcmp(rec->v1, cmd, 4) == 0;
+	return memcmp(rec->v1, cmd, len) == 0;
+}
+
+static int virtual_replay(sc_reader_t *reader, struct vtrace *trace, sc_apdu_t *apdu)
+{
+	const struct vtrace_rec *rec = NULL;
+	size_t ssize, i;
+	u8 *sbuf = NULL;
+	int r;
+
+	r = sc_apdu_get_octets(reader->ctx, apdu, &sbuf, &ssize, SC_PROTO_RAW);
+	if (r != SC_SUCCESS)
+		return r;
+	sc_apdu_log(reader->ctx, SC_LOG_DEBUG_NORMAL, sbuf, ssize, 1);
+
+	/* look ahead from the current position first, then wrap around */
+	for (i = trace->next; i < trace->count && rec == NULL; i++) {
+		if (vtrace_match(&trace->recs[i], sbuf, ssize))
+			rec = &trace->recs[i];
+	}
+	for (i = 0; i < trace->next && rec == NULL; i++) {
+		if (vtrace_match(&trace->recs[i], sbuf, ssize))
+			rec = &trace->recs[i];
+	}
+	sc_mem_clear(sbuf, ssize);
+	free(sbuf);
+	if (rec == NULL) {
+		trace->missed++;
+		sc_debug(reader->ctx, SC_LOG_DEBUG_NORMAL, "command not found in the trace");
+		return SC_ERROR_TRANSMIT_FAILED;
+	}
+	trace->replayed++;
+	trace->next = rec - trace->recs + 1;
+	if (trace->timing)
+		virtual_delay(rec->usec);
+
+	sc_apdu_log(reader->ctx, SC_LOG_DEBUG_NORMAL, rec->v2, rec->l2, 0);
+	return sc_apdu_set_resp(reader->ctx, apdu, rec->v2, rec->l2);
+}
+
+/*
+ * Reader operations
+ */
+
+static int virtual_add_reader(sc_context_t *ctx, const char *image, int is_trace)
+{
+	sc_reader_t *reader;
+	struct driver_data *data;
+	const char *base;
+	char name[128];
+	int r;
+
+	if (!(reader = calloc(1, sizeof(*reader)))
+	 || !(data = calloc(1, sizeof(*data)))) {
+		if (reader)
+			free(reader);
+		return SC_ERROR_OUT_OF_MEMORY;
+	}
+	base = strrchr(image, '/');
+	snprintf(name, sizeof(name), "Virtual reader (%s)", base ? base + 1 : image);
+
+	reader->driver = &virtual_reader_driver;
+	reader->ops = &virtual_ops;
+	reader->drv_data = data;
+	reader->ctx = ctx;
+	reader->name = strdup(name);
+	reader->supported_protocols = SC_PROTO_T1;
+	/* the emulated card takes any length, the card's ATR decides */
+	if (!is_trace)
+		reader->capabilities |= SC_READER_CAP_APDU_EXT;
+	data->image = strdup(image);
+	if (reader->name == NULL || data->image == NULL) {
+		r = SC_ERROR_OUT_OF_MEMORY;
+		goto err;
+	}
+
+	r = is_trace ? virtual_load_trace(reader) : virtual_load_image(reader);
+	if (r < 0) {
+		sc_debug(ctx, SC_LOG_DEBUG_NORMAL, "%s %s not loaded: %s",
+			is_trace ? "trace" : "card image", image, sc_strerror(r));
+		goto err;
+	}
+
+	if ((r = _sc_add_reader(ctx, reader)) < 0)
+		goto err;
+	return 0;
+err:
+	vfile_free(data->mf);
+	vtrace_free(data->trace);
+	free(data->image);
+	free(data);
+	free(reader->name);
+	free(reader);
+	return r;
+}
+
+static int virtual_init(sc_context_t *ctx)
+{
+	scconf_block *conf_block;
+	const scconf_list *list;
+
+	SC_FUNC_CALLED(ctx, SC_LOG_DEBUG_VERBOSE);
+
+	conf_block = sc_get_conf_block(ctx, "reader_driver", "virtual", 1);
+	if (conf_block == NULL)
+		return SC_SUCCESS;
+	for (list = scconf_find_list(conf_block, "card_image"); list != NULL; list = list->next)
+		virtual_add_reader(ctx, list->data, 0);
+	for (list = scconf_find_list(conf_block, "replay_trace"); list != NULL; list = list->next)
+		virtual_add_reader(ctx, list->data, 1);
+	return SC_SUCCESS;
+}
+
+static int virtual_finish(sc_context_t *ctx)
+{
+	SC_FUNC_CALLED(ctx, SC_LOG_DEBUG_VERBOSE);
+	return SC_SUCCESS;
+}
+
+static int virtual_release(sc_reader_t *reader)
+{
+	struct driver_data *data = (struct driver_data *) reader->drv_data;
+
+	SC_FUNC_CALLED(reader->ctx, SC_LOG_DEBUG_VERBOSE);
+	if (data) {
+		if (data->trace != NULL)
+			sc_debug(reader->ctx, SC_LOG_DEBUG_NORMAL,
+				"%s: %lu APDUs replayed, %lu not found in the trace",
+				reader->name, data->trace->replayed, data->trace->missed);
+		vfile_free(data->mf);
+		vtrace_free(data->trace);
+		free(data->image);
+		sc_mem_clear(data, sizeof(*data));
+		reader->drv_data = NULL;
+		free(data);
+	}
+	return SC_SUCCESS;
+}
+
+static int virtual_detect_card_presence(sc_reader_t *reader)
+{
+	reader->flags |= SC_READER_CARD_PRESENT;
+	return reader->flags;
+}
+
+/* Connecting resets the card: the security status is lost,
+ * file contents and PIN counters are kept */
+static int virtual_connect(sc_reader_t *reader)
+{
+	struct driver_data *data = (struct driver_data *) reader->drv_data;
+
+	SC_FUNC_CALLED(reader->ctx, SC_LOG_DEBUG_VERBOSE);
+	reader->active_protocol = SC_PROTO_T1;
+	if (data->trace != NULL) {
+		vtrace_connect(reader, data->trace);
+		return SC_SUCCESS;
+	}
+	data->cur_df = data->mf;
+	data->cur_ef = NULL;
+	data->verified = 0;
+	data->se_key = NULL;
+	data->crgram_len = 0;
+	return SC_SUCCESS;
+}
+
+static int virtual_disconnect(sc_reader_t *reader)
+{
+	SC_FUNC_CALLED(reader->ctx, SC_LOG_DEBUG_VERBOSE);
+	return SC_SUCCESS;
+}
+
+static int virtual_reset(sc_reader_t *reader, int do_cold_reset)
+{
+	return virtual_connect(reader);
+}
+
+static int virtual_transmit(sc_reader_t *reader, sc_apdu_t *apdu)
+{
+	struct driver_data *data = (struct driver_data *) reader->drv_data;
+	size_t ssize, rsize = 0, rbuflen;
+	u8 *sbuf = NULL, *rbuf;
+	unsigned int sw;
+	int r;
+
+	if (data->trace != NULL)
+		return virtual_replay(reader, data->trace, apdu);
+
+	/* room for the largest RSA block, whatever Le says */
+	rbuflen = (apdu->le > 512 ? apdu->le : 512) + 2;
+	rbuf = malloc(rbuflen);
+	if (rbuf == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	if (reader->ctx->debug >= SC_LOG_DEBUG_NORMAL
+	 && sc_apdu_get_octets(reader->ctx, apdu, &sbuf, &ssize, SC_PROTO_RAW) == SC_SUCCESS) {
+		sc_apdu_log(reader->ctx, SC_LOG_DEBUG_NORMAL, sbuf, ssize, 1);
+		sc_mem_clear(sbuf, ssize);
+		free(sbuf);
+	}
+
+	sw = virtual_process(data, apdu, rbuf, &rsize, rbuflen - 2);
+	if (rsize > apdu->le)
+		rsize = apdu->le;
+	rbuf[rsize++] = sw >> 8;
+	rbuf[rsize++] = sw & 0xFF;
+
+	virtual_delay(data->latency);
+	if (apdu->ins == 0x2A)
+		virtual_delay(data->crypto_latency);
+
+	sc_apdu_log(reader->ctx, SC_LOG_DEBUG_NORMAL, rbuf, rsize, 0);
+	r = sc_apdu_set_resp(reader->ctx, apdu, rbuf, rsize);
+	sc_mem_clear(rbuf, rbuflen);
+	free(rbuf);
+	return r;
+}
+
+static int virtual_lock(sc_reader_t *reader)
+{
+	return SC_SUCCESS;
+}
+
+static int virtual_unlock(sc_reader_t *reader)
+{
+	return SC_SUCCESS;
+}
+
+struct sc_reader_driver *sc_get_virtual_driver(void)
+{
+	virtual_ops.init = virtual_init;
+	virtual_ops.finish = virtual_finish;
+	virtual_ops.detect_readers = NULL;
+	virtual_ops.release = virtual_release;
+	virtual_ops.detect_card_presence = virtual_detect_card_presence;
+	virtual_ops.connect = virtual_connect;
+	virtual_ops.disconnect = virtual_disconnect;
+	virtual_ops.transmit = virtual_transmit;
+	virtual_ops.lock = virtual_lock;
+	virtual_ops.unlock = virtual_unlock;
+	virtual_ops.reset = virtual_reset;
+	virtual_ops.use_reader = NULL;
+
+	return &virtual_reader_driver;
+}
@@ -29,6 +29,14 @@
 
 #include "internal.h"
 
+#ifdef ENABLE_OPENSSL
+#include <openssl/sha.h>
+#endif
+
+/* GET_INFO answers that must agree before the behaviour of the card
+ * on SELECT is trusted without asking */
+#define SC_PIN_STATE_SAMPLES	3
+
 int sc_decipher(sc_card_t *card,
 		const u8 * crgram, size_t crgram_len, u8 * out, size_t outlen)
 {
@@ -56,6 +64,44 @@ int sc_compute_signature(sc_card_t *card,
         SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_VERBOSE, r);
 }
 
+/* Returns 1 if both environments would result in the same MSE */
+static int sc_security_env_equal(const sc_security_env_t *a,
+				 const sc_security_env_t *b)
+{
+	int i;
+
+	if (a->flags != b->flags || a->operation != b->operation)
+		return 0;
+	if ((a->flags & SC_SEC_ENV_ALG_PRESENT)
+			&& (a->algorithm != b->algorithm
+			 || a->algorithm_flags != b->algorithm_flags))
+		return 0;
+	if ((a->flags & SC_SEC_ENV_ALG_REF_PRESENT)
+			&& a->algorithm_ref != b->algorithm_ref)
+		return 0;
+	if ((a->flags & SC_SEC_ENV_FILE_REF_PRESENT)
+			&& (a->file_ref.len != b->file_ref.len
+			 || memcmp(a->file_ref.value, b->file_ref.value, a->file_ref.len) != 0))
+		return 0;
+	if ((a->flags & SC_SEC_ENV_KEY_REF_PRESENT)
+			&& (a->key_ref_len != b->key_ref_len
+			 || a->key_ref_len > sizeof(a->key_ref)
+			 || memcmp(a->key_ref, b->key_ref, a->key_ref_len) != 0))
+		return 0;
+	for (i = 0; i < SC_MAX_SUPPORTED_ALGORITHMS; i++) {
+		const struct sc_supported_algo_info *sa = &a->supported_algos[i];
+		const struct sc_supported_algo_info *sb = &b->supported_algos[i];
+
+		if (sa->reference != sb->reference
+				|| sa->mechanism != sb->mechanism
+				|| sa->operations != sb->operations
+				|| sa->algo_ref != sb->algo_ref
+				|| !sc_compare_oid(&sa->algo_id, &sb->algo_id))
+			return 0;
+	}
+	return 1;
+}
+
 int sc_set_security_env(sc_card_t *card,
 			const sc_security_env_t *env,
 			int se_num)
@@ -66,7 +112,25 @@ int sc_set_security_env(sc_card_t *card,
 	SC_FUNC_CALLED(card->ctx, SC_LOG_DEBUG_NORMAL);
 	if (card->ops->set_security_env == NULL)
 		SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_VERBOSE, SC_ERROR_NOT_SUPPORTED);
+	/* The environment is only known for sure while the reader
+	 * lock has been held since it was set, so the cache only pays
+	 * off for callers that keep the card locked across operations
+	 * (lock_login in the PKCS#11 module) */
+	if ((card->caps & SC_CARD_CAP_SE_CACHE)
+			&& card->lock_count > 0
+			&& card->cache.security_env_valid
+			&& card->cache.security_env_num == se_num
+			&& sc_security_env_equal(env, &card->cache.security_env)) {
+		sc_debug(card->ctx, SC_LOG_DEBUG_NORMAL, "security environment already set");
+		SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_VERBOSE, SC_SUCCESS);
+	}
+	sc_invalidate_security_env(card);
 	r = card->ops->set_security_env(card, env, se_num);
+	if (r == SC_SUCCESS && (card->caps & SC_CARD_CAP_SE_CACHE)) {
+		card->cache.security_env = *env;
+		card->cache.security_env_num = se_num;
+		card->cache.security_env_valid = 1;
+	}
         SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_VERBOSE, r);
 }
 
@@ -78,6 +142,7 @@ int sc_restore_security_env(sc_card_t *card, int se_num)
 	SC_FUNC_CALLED(card->ctx, SC_LOG_DEBUG_NORMAL);
 	if (card->ops->restore_security_env == NULL)
 		SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_VERBOSE, SC_ERROR_NOT_SUPPORTED);
+	sc_invalidate_security_env(card);
 	r = card->ops->restore_security_env(card, se_num);
 	SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_VERBOSE, r);
 }
@@ -99,6 +164,8 @@ int sc_verify(sc_card_t *card, unsigned int type, int ref,
 
 int sc_logout(sc_card_t *card)
 {
+	sc_invalidate_security_env(card);
+	sc_invalidate_login_state(card);
 	if (card->ops->logout == NULL)
 		return SC_ERROR_NOT_SUPPORTED;
 	return card->ops->logout(card);
@@ -141,6 +208,181 @@ int sc_reset_retry_counter(sc_card_t *card, unsigned int type, int ref,
 	return sc_pin_cmd(card, &data, NULL);
 }
 
+static struct sc_pin_login_state *
+find_login_state(sc_card_t *card, unsigned int type, int ref, int create)
+{
+	struct sc_card_login *login = &card->login;
+	int i;
+
+	for (i = 0; i < login->count; i++)
+		if (login->pins[i].type == type && login->pins[i].reference == ref)
+			return &login->pins[i];
+	if (!create)
+		return NULL;
+	if (login->count < SC_MAX_PIN_LOGIN_STATES)
+		i = login->count++;
+	else
+		i = SC_MAX_PIN_LOGIN_STATES - 1;
+	memset(&login->pins[i], 0, sizeof(login->pins[i]));
+	login->pins[i].type = type;
+	login->pins[i].reference = ref;
+	login->pins[i].state = SC_PIN_STATE_UNKNOWN;
+	login->pins[i].kept_on_select = SC_PIN_STATE_UNKNOWN;
+	return &login->pins[i];
+}
+
+void sc_invalidate_pin_state(sc_card_t *card, unsigned int type, int ref)
+{
+	struct sc_pin_login_state *pin = find_login_state(card, type, ref, 0);
+
+	if (pin == NULL)
+		return;
+	/* The card has lost a PIN that it was thought to keep across
+	 * the SELECTs since the VERIFY: learn its behaviour again */
+	if (pin->state == SC_PIN_STATE_LOGGED_IN
+			&& pin->select_count != card->login.select_count
+			&& pin->kept_on_select == SC_PIN_STATE_LOGGED_IN)
+		pin->kept_samples = 0;
+	pin->state = SC_PIN_STATE_UNKNOWN;
+	sc_mem_clear(pin->digest, sizeof(pin->digest));
+	pin->has_digest = 0;
+}
+
+/* Used to recognize a PIN value verified before, without keeping the
+ * value itself. Without OpenSSL, no digest is kept and no VERIFY is
+ * ever skipped. */
+static int pin_digest(const u8 *pin, size_t len, u8 digest[32])
+{
+#ifdef ENABLE_OPENSSL
+	SHA256(pin, len, digest);
+	return 1;
+#else
+	return 0;
+#endif
+}
+
+/* Compares in constant time */
+static int pin_digest_equal(const u8 *a, const u8 *b)
+{
+	u8 diff = 0;
+	int i;
+
+	for (i = 0; i < 32; i++)
+		diff |= a[i] ^ b[i];
+	return diff == 0;
+}
+
+/* Whether a VERIFY would only repeat one that the card has accepted
+ * while the reader has been locked, and the PIN is still verified */
+static int verify_is_redundant(sc_card_t *card, struct sc_pin_cmd_data *data)
+{
+	struct sc_pin_login_state *pin;
+	u8 digest[32];
+	int equal;
+
+	if (data->cmd != SC_PIN_CMD_VERIFY || !(data->flags & SC_PIN_CMD_SKIP_VERIFIED)
+			|| data->pin1.data == NULL || data->pin1.len <= 0
+			|| (data->flags & SC_PIN_CMD_USE_PINPAD) || card->lock_count == 0)
+		return 0;
+	pin = find_login_state(card, data->pin_type, data->pin_reference, 0);
+	if (pin == NULL || !pin->has_digest || pin->lock_epoch != card->login.lock_epoch)
+		return 0;
+	if (!pin_digest(data->pin1.data, data->pin1.len, digest))
+		return 0;
+	equal = pin_digest_equal(pin->digest, digest);
+	sc_mem_clear(digest, sizeof(digest));
+	if (!equal)
+		return 0;
+	return sc_pin_state(card, data->pin_type, data->pin_reference) == SC_PIN_STATE_LOGGED_IN;
+}
+
+/* Record what a PIN command has told about the state of the PIN */
+static void update_login_state(sc_card_t *card, struct sc_pin_cmd_data *data, int r)
+{
+	struct sc_card_login *login = &card->login;
+	struct sc_pin_login_state *pin;
+	int state = SC_PIN_STATE_UNKNOWN;
+	u8 digest[32];
+	int has_digest = 0;
+
+	switch (data->cmd) {
+	case SC_PIN_CMD_VERIFY:
+		if (r == SC_SUCCESS) {
+			state = SC_PIN_STATE_LOGGED_IN;
+			if (data->pin1.data != NULL && data->pin1.len > 0)
+				has_digest = pin_digest(data->pin1.data, data->pin1.len, digest);
+		}
+		else if (r == SC_ERROR_PIN_CODE_INCORRECT || r == SC_ERROR_AUTH_METHOD_BLOCKED)
+			state = SC_PIN_STATE_LOGGED_OUT;
+		break;
+	case SC_PIN_CMD_GET_INFO:
+		if (r != SC_SUCCESS || data->pin1.logged_in == SC_PIN_STATE_UNKNOWN)
+			return;
+		state = data->pin1.logged_in;
+		pin = find_login_state(card, data->pin_type, data->pin_reference, 0);
+		if (pin != NULL && state == SC_PIN_STATE_LOGGED_IN
+				&& pin->lock_epoch == login->lock_epoch && pin->has_digest) {
+			memcpy(digest, pin->digest, sizeof(digest));
+			has_digest = 1;
+		}
+		break;
+	}
+
+	pin = find_login_state(card, data->pin_type, data->pin_reference, 1);
+	pin->state = state;
+	pin->select_count = login->select_count;
+	pin->lock_epoch = login->lock_epoch;
+	if (has_digest)
+		memcpy(pin->digest, digest, sizeof(digest));
+	else
+		sc_mem_clear(pin->digest, sizeof(pin->digest));
+	pin->has_digest = has_digest;
+	sc_mem_clear(digest, sizeof(digest));
+}
+
+int sc_pin_state(sc_card_t *card, unsigned int type, int ref)
+{
+	struct sc_card_login *login = &card->login;
+	struct sc_pin_login_state *pin;
+	struct sc_pin_cmd_data data;
+	int r;
+
+	assert(card != NULL);
+	pin = find_login_state(card, type, ref, 0);
+	if (pin == NULL)
+		return SC_PIN_STATE_UNKNOWN;
+	if (pin->state != SC_PIN_STATE_LOGGED_IN)
+		return pin->state;
+	if (pin->select_count == login->select_count)
+		return SC_PIN_STATE_LOGGED_IN;
+	if (pin->kept_samples >= SC_PIN_STATE_SAMPLES)
+		return pin->kept_on_select;
+	if (login->no_state_info)
+		return SC_PIN_STATE_UNKNOWN;
+
+	/* A file has been selected since the PIN was verified: ask the
+	 * card, until it has given the same answer a few times in a row */
+	memset(&data, 0, sizeof(data));
+	data.cmd = SC_PIN_CMD_GET_INFO;
+	data.pin_type = type;
+	data.pin_reference = ref;
+	r = sc_pin_cmd(card, &data, NULL);
+	if (r != SC_SUCCESS || data.pin1.logged_in == SC_PIN_STATE_UNKNOWN) {
+		login->no_state_info = 1;
+		return SC_PIN_STATE_UNKNOWN;
+	}
+
+	/* sc_pin_cmd() has not touched the learned state */
+	if (pin->kept_on_select != data.pin1.logged_in) {
+		pin->kept_on_select = data.pin1.logged_in;
+		pin->kept_samples = 0;
+	}
+	if (++pin->kept_samples == SC_PIN_STATE_SAMPLES)
+		sc_log(card->ctx, "card %s PIN %d verified on SELECT",
+				pin->kept_on_select == SC_PIN_STATE_LOGGED_IN ? "keeps" : "drops", ref);
+	return data.pin1.logged_in;
+}
+
 /*
  * This is the new style pin command, which takes care of all PIN
  * operations.
@@ -155,6 +397,12 @@ int sc_pin_cmd(sc_card_t *card, struct sc_pin_cmd_data *data,
 
 	assert(card != NULL);
 	SC_FUNC_CALLED(card->ctx, SC_LOG_DEBUG_NORMAL);
+	if (data->cmd == SC_PIN_CMD_GET_INFO)
+		data->pin1.logged_in = SC_PIN_STATE_UNKNOWN;
+	if (verify_is_redundant(card, data)) {
+		sc_log(card->ctx, "PIN %d is verified already", data->pin_reference);
+		SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_VERBOSE, SC_SUCCESS);
+	}
 	if (card->ops->pin_cmd) {
 		r = card->ops->pin_cmd(card, data, tries_left);
 	} else if (!(data->flags & SC_PIN_CMD_USE_PINPAD)) {
@@ -201,6 +449,7 @@ int sc_pin_cmd(sc_card_t *card, struct sc_pin_cmd_data *data,
 		sc_debug(card->ctx, SC_LOG_DEBUG_NORMAL, "Use of pin pad not supported by card driver");
 		r = SC_ERROR_NOT_SUPPORTED;
 	}
+	update_login_state(card, data, r);
 	SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_VERBOSE, r);
 }
 
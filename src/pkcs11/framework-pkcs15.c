@@ -23,6 +23,10 @@
 
 #include <stdlib.h>
 #include <string.h>
+#ifdef ENABLE_OPENSSL
+#include <openssl/opensslv.h>
+#include <openssl/opensslconf.h> /* for OPENSSL_NO_* */
+#endif
 
 #include "sc-pkcs11.h"
 #ifdef USE_PKCS15_INIT
@@ -287,6 +291,9 @@ __pkcs15_release_object(struct pkcs15_any_object *obj)
 	if (--(obj->refcount) != 0)
 		return obj->refcount;
 	
+#ifdef ENABLE_OPENSSL
+	sc_pkcs11_free_pubkey(obj->base.pubkey);
+#endif
 	sc_mem_clear(obj, obj->size);
 	free(obj);
 
@@ -352,12 +359,32 @@ CK_RV C_GetTokenInfo(CK_SLOT_ID slotID, CK_TOKEN_INFO_PTR pInfo)
 		data.pin_type = SC_AC_CHV;
 		data.pin_reference = pin_info->attrs.pin.reference;
 
-		r = sc_pin_cmd(slot->card->card, &data, NULL);
+		/* Don't wait for a card in use by a session, the
+		 * PIN info from the last query is good enough */
+		r = SC_ERROR_NOT_ALLOWED;
+		if ((slot->lock == NULL || slot->lock->users == 0)
+				&& sc_pkcs11_lock_slot(slot) == CKR_OK) {
+			struct sc_card *card = slot->card->card;
+
+			/* While the card stays locked (lock_login), a PIN that
+			 * is known to be verified has all its tries left, so
+			 * there is nothing to ask the card */
+			if (card->lock_count > 0 && sc_pin_state(card, data.pin_type,
+					data.pin_reference) == SC_PIN_STATE_LOGGED_IN) {
+				if (pin_info->max_tries > 0)
+					pin_info->tries_left = pin_info->max_tries;
+			} else {
+				r = sc_pin_cmd(card, &data, NULL);
+			}
+			sc_pkcs11_unlock_slot(slot);
+		}
 		if (r == SC_SUCCESS) {
 			if (data.pin1.max_tries > 0)
 				pin_info->max_tries = data.pin1.max_tries;
-			/* tries_left must be supported or sc_pin_cmd should not return SC_SUCCESS */
-			pin_info->tries_left = data.pin1.tries_left;
+			/* tries_left is -1 when the card only reported that
+			 * the PIN is verified */
+			if (data.pin1.tries_left >= 0)
+				pin_info->tries_left = data.pin1.tries_left;
 		}
 
 		if (pin_info->tries_left >= 0) {
@@ -749,7 +776,8 @@ pkcs15_add_object(struct sc_pkcs11_slot *slot,
 	if (pHandle != NULL)
 		*pHandle = (CK_OBJECT_HANDLE)obj; /* cast pointer to long */
 
-	list_append(&slot->objects, obj);
+	if (slot_add_object(slot, (struct sc_pkcs11_object *)obj) != CKR_OK)
+		return;
 	sc_debug(context, SC_LOG_DEBUG_NORMAL, "Setting object handle of 0x%lx to 0x%lx", obj->base.handle, (CK_OBJECT_HANDLE)obj);
 	obj->base.handle = (CK_OBJECT_HANDLE)obj; /* cast pointer to long */
 	obj->base.flags |= SC_PKCS11_OBJECT_SEEN;
@@ -1043,6 +1071,10 @@ static CK_RV pkcs15_create_tokens(struct sc_pkcs11_card *p11card)
 		}
 	}
 	*/
+	/* Public objects have been read, the next process can take
+	 * them from the snapshot */
+	sc_pkcs15_save_snapshot(fw_data->p15_card);
+
 	sc_debug(context, SC_LOG_DEBUG_NORMAL, "All tokens created\n");
 	return CKR_OK;
 }
@@ -1388,6 +1420,8 @@ static CK_RV pkcs15_init_pin(struct sc_pkcs11_card *p11card,
 		return sc_to_cryptoki_error(rc, "C_InitPIN");
 	}
 
+	sc_pkcs15_drop_snapshot(fw_data->p15_card);
+
 	memset(&args, 0, sizeof(args));
 	args.label = "User PIN";
 	args.pin = pPin;
@@ -1832,6 +1866,7 @@ static CK_RV pkcs15_create_object(struct sc_pkcs11_card *p11card,
 		CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount,
 		CK_OBJECT_HANDLE_PTR phObject)
 {
+	struct pkcs15_fw_data *fw_data = (struct pkcs15_fw_data *) p11card->fw_data;
 	struct sc_profile *profile = NULL;
 	CK_OBJECT_CLASS	_class;
 	int rv, rc;
@@ -1851,6 +1886,8 @@ static CK_RV pkcs15_create_object(struct sc_pkcs11_card *p11card,
 		return sc_to_cryptoki_error(rc, "C_CreateObject");
 	}
 
+	sc_pkcs15_drop_snapshot(fw_data->p15_card);
+
 	switch (_class) {
 	case CKO_PRIVATE_KEY:
 		rv = pkcs15_create_private_key(p11card, slot, profile,
@@ -2162,12 +2199,14 @@ static CK_RV pkcs15_any_destroy(struct sc_pkcs11_session *session, void *object)
 		return sc_to_cryptoki_error(rv, "C_DestroyObject");
 	}
 
+	sc_pkcs15_drop_snapshot(fw_data->p15_card);
+
 	/* Delete object in smartcard */
 	rv = sc_pkcs15init_delete_object(fw_data->p15_card, profile, obj->base.p15_object);
 	if (rv >= 0) {
 		/* Oppose to pkcs15_add_object */
 		--any_obj->refcount; /* correct refcont */
-		list_delete(&session->slot->objects, any_obj);
+		slot_delete_object(session->slot, (struct sc_pkcs11_object *)any_obj);
 		/* Delete object in pkcs15 */
 		rv = __pkcs15_delete_object(fw_data, any_obj);
 	}
@@ -2239,6 +2278,8 @@ static CK_RV pkcs15_set_attrib(struct sc_pkcs11_session *session,
 		return sc_to_cryptoki_error(rc, "C_SetAttributeValue");
 	}
 
+	sc_pkcs15_drop_snapshot(fw_data->p15_card);
+
 	switch(attr->type) {
 	case CKA_LABEL:
 		rc = sc_pkcs15init_change_attrib(fw_data->p15_card, profile, p15_object,
@@ -3381,6 +3422,10 @@ static int register_ec_mechanisms(struct sc_pkcs11_card *p11card, int flags,
 		ec_flags |= CKF_EC_COMPRESS;
 
 	mech_info.flags = CKF_HW | CKF_SIGN; /* check for more */
+#if defined(ENABLE_OPENSSL) && OPENSSL_VERSION_NUMBER >= 0x10000000L && !defined(OPENSSL_NO_EC)
+	/* sc_pkcs11_verify_data() can check ECDSA signatures */
+	mech_info.flags |= CKF_VERIFY;
+#endif
 	mech_info.flags |= ec_flags;
 	mech_info.ulMinKeySize = min_key_size;
 	mech_info.ulMaxKeySize = max_key_size;
@@ -631,13 +631,65 @@ sc_pkcs11_verify_update(sc_pkcs11_operation_t *operation,
 	return CKR_OK;
 }
 
+/*
+ * Get an attribute of variable size; the caller frees attr->pValue
+ */
+static CK_RV
+get_attribute_value(struct sc_pkcs11_session *session,
+		struct sc_pkcs11_object *key, CK_ATTRIBUTE_PTR attr)
+{
+	CK_RV rv;
+
+	attr->pValue = NULL;
+	attr->ulValueLen = 0;
+	rv = key->ops->get_attribute(session, key, attr);
+	if (rv != CKR_OK)
+		return rv;
+	attr->pValue = malloc(attr->ulValueLen ? attr->ulValueLen : 1);
+	if (attr->pValue == NULL)
+		return CKR_HOST_MEMORY;
+	rv = key->ops->get_attribute(session, key, attr);
+	if (rv != CKR_OK) {
+		free(attr->pValue);
+		attr->pValue = NULL;
+	}
+	return rv;
+}
+
+/*
+ * Parse the public key of an object once and keep it with the object
+ */
+static CK_RV
+sc_pkcs11_get_verify_key(struct sc_pkcs11_session *session,
+		struct sc_pkcs11_object *key, CK_KEY_TYPE key_type)
+{
+	CK_ATTRIBUTE value = {CKA_VALUE, NULL, 0};
+	CK_ATTRIBUTE params = {CKA_EC_PARAMS, NULL, 0};
+	CK_RV rv;
+
+	if (key->pubkey != NULL)
+		return CKR_OK;
+
+	if (key_type == CKK_EC)
+		value.type = CKA_EC_POINT;
+	rv = get_attribute_value(session, key, &value);
+	if (rv == CKR_OK && key_type == CKK_EC)
+		rv = get_attribute_value(session, key, &params);
+	if (rv == CKR_OK)
+		rv = sc_pkcs11_parse_pubkey(key_type, value.pValue, value.ulValueLen,
+				params.pValue, params.ulValueLen, &key->pubkey);
+
+	free(value.pValue);
+	free(params.pValue);
+	return rv;
+}
+
 static CK_RV
 sc_pkcs11_verify_final(sc_pkcs11_operation_t *operation,
 			CK_BYTE_PTR pSignature, CK_ULONG ulSignatureLen)
 {
 	struct signature_data *data;
 	struct sc_pkcs11_object *key;
-	unsigned char *pubkey_value;
 	CK_KEY_TYPE key_type;
 	CK_BYTE params[9 /* GOST_PARAMS_OID_SIZE */] = { 0 };
 	CK_ATTRIBUTE attr = {CKA_VALUE, NULL, 0};
@@ -651,29 +703,33 @@ sc_pkcs11_verify_final(sc_pkcs11_operation_t *operation,
 		return CKR_ARGUMENTS_BAD;
 
 	key = data->key;
-	rv = key->ops->get_attribute(operation->session, key, &attr);
-	if (rv != CKR_OK)
-		return rv;
-	pubkey_value = malloc(attr.ulValueLen);
-	attr.pValue = pubkey_value;
-	rv = key->ops->get_attribute(operation->session, key, &attr);
+	rv = key->ops->get_attribute(operation->session, key, &attr_key_type);
 	if (rv != CKR_OK)
-		goto done;
+		key_type = CKK_RSA;
 
-	rv = key->ops->get_attribute(operation->session, key, &attr_key_type);
-	if (rv == CKR_OK && key_type == CKK_GOSTR3410) {
-		rv = key->ops->get_attribute(operation->session, key, &attr_key_params);
+	if (key_type != CKK_GOSTR3410) {
+		rv = sc_pkcs11_get_verify_key(operation->session, key, key_type);
 		if (rv != CKR_OK)
-			goto done;
+			return rv;
+		return sc_pkcs11_verify_pkey(key->pubkey,
+			operation->mechanism.mechanism, data->md,
+			data->buffer, data->buffer_len, pSignature, ulSignatureLen);
 	}
 
-	rv = sc_pkcs11_verify_data(pubkey_value, attr.ulValueLen,
+	rv = get_attribute_value(operation->session, key, &attr);
+	if (rv != CKR_OK)
+		return rv;
+	rv = key->ops->get_attribute(operation->session, key, &attr_key_params);
+	if (rv != CKR_OK)
+		goto done;
+
+	rv = sc_pkcs11_verify_data(attr.pValue, attr.ulValueLen,
 		params, sizeof(params),
 		operation->mechanism.mechanism, data->md,
 		data->buffer, data->buffer_len, pSignature, ulSignatureLen);
 
 done:
-	free(pubkey_value);
+	free(attr.pValue);
 
 	return rv;
 }
@@ -18,6 +18,7 @@
 #include <openssl/opensslconf.h> /* for OPENSSL_NO_* */
 #ifndef OPENSSL_NO_EC
 #include <openssl/ec.h>
+#include <openssl/ecdsa.h>
 #endif /* OPENSSL_NO_EC */
 #ifndef OPENSSL_NO_ENGINE
 #include <openssl/engine.h>
@@ -389,94 +390,252 @@ static CK_RV gostr3410_verify_data(const unsigned char *pubkey, int pubkey_len,
 }
 #endif /* OPENSSL_VERSION_NUMBER >= 0x10000000L && !defined(OPENSSL_NO_EC) */
 
-/* If no hash function was used, finish with RSA_public_decrypt().
- * If a hash function was used, we can make a big shortcut by
- *   finishing with EVP_VerifyFinal().
+/*
+ * Parse a public key for sc_pkcs11_verify_pkey(): RSA keys from their
+ * CKA_VALUE, EC keys from CKA_EC_POINT and CKA_EC_PARAMS.
  */
-CK_RV sc_pkcs11_verify_data(const unsigned char *pubkey, int pubkey_len,
-			const unsigned char *pubkey_params, int pubkey_params_len,
-			CK_MECHANISM_TYPE mech, sc_pkcs11_operation_t *md,
+CK_RV sc_pkcs11_parse_pubkey(CK_KEY_TYPE key_type,
+			const unsigned char *value, int value_len,
+			const unsigned char *params, int params_len,
+			void **out)
+{
+	EVP_PKEY *pkey = NULL;
+
+	switch (key_type) {
+	case CKK_RSA:
+		pkey = d2i_PublicKey(EVP_PKEY_RSA, NULL, &value, value_len);
+		break;
+#if OPENSSL_VERSION_NUMBER >= 0x10000000L && !defined(OPENSSL_NO_EC)
+	case CKK_EC: {
+		EC_GROUP *group;
+		EC_KEY *ec = NULL;
+		ASN1_OCTET_STRING *octet;
+		const unsigned char *point;
+
+		group = d2i_ECPKParameters(NULL, &params, params_len);
+		if (group == NULL)
+			break;
+		ec = EC_KEY_new();
+		octet = d2i_ASN1_OCTET_STRING(NULL, &value, value_len);
+		if (ec != NULL && octet != NULL && EC_KEY_set_group(ec, group) == 1) {
+			point = octet->data;
+			if (o2i_ECPublicKey(&ec, &point, octet->length) != NULL
+					&& (pkey = EVP_PKEY_new()) != NULL
+					&& EVP_PKEY_assign_EC_KEY(pkey, ec) == 1)
+				ec = NULL;
+			else if (pkey != NULL) {
+				EVP_PKEY_free(pkey);
+				pkey = NULL;
+			}
+		}
+		if (octet != NULL)
+			ASN1_OCTET_STRING_free(octet);
+		if (ec != NULL)
+			EC_KEY_free(ec);
+		EC_GROUP_free(group);
+		break;
+	}
+#endif
+	default:
+		return CKR_KEY_TYPE_INCONSISTENT;
+	}
+
+	if (pkey == NULL)
+		return CKR_GENERAL_ERROR;
+	*out = pkey;
+	return CKR_OK;
+}
+
+void sc_pkcs11_free_pubkey(void *pkey)
+{
+	if (pkey != NULL)
+		EVP_PKEY_free((EVP_PKEY *) pkey);
+}
+
+static CK_RV rsa_verify(EVP_PKEY *pkey, CK_MECHANISM_TYPE mech, int md_type,
 			unsigned char *data, int data_len,
 			unsigned char *signat, int signat_len)
 {
-	int res;
-	CK_RV rv = CKR_GENERAL_ERROR;
-	EVP_PKEY *pkey;
+	CK_RV rv;
+	RSA *rsa;
+	unsigned char *rsa_out = NULL, pad;
+	int rsa_outlen = 0, res;
+
+	rsa = EVP_PKEY_get1_RSA(pkey);
+	if (rsa == NULL)
+		return CKR_DEVICE_MEMORY;
+
+	/* If a hash function was used, check the signature on the digest */
+	if (md_type != NID_undef) {
+		res = RSA_verify(md_type, data, data_len, signat, signat_len, rsa);
+		RSA_free(rsa);
+		return res == 1 ? CKR_OK : CKR_SIGNATURE_INVALID;
+	}
+
+	switch(mech) {
+	case CKM_RSA_PKCS:
+	 	pad = RSA_PKCS1_PADDING;
+	 	break;
+	 case CKM_RSA_X_509:
+	 	pad = RSA_NO_PADDING;
+	 	break;
+	 default:
+		RSA_free(rsa);
+	 	return CKR_ARGUMENTS_BAD;
+	 }
+
+	rsa_out = malloc(RSA_size(rsa));
+	if (rsa_out == NULL) {
+		RSA_free(rsa);
+		return CKR_DEVICE_MEMORY;
+	}
+	
+	rsa_outlen = RSA_public_decrypt(signat_len, signat, rsa_out, rsa, pad);
+	RSA_free(rsa);
+	if(rsa_outlen <= 0) {
+		free(rsa_out);
+		sc_debug(context, SC_LOG_DEBUG_NORMAL, "RSA_public_decrypt() returned %d\n", rsa_outlen);
+		return CKR_GENERAL_ERROR;
+	}
+
+	if (rsa_outlen == data_len && memcmp(rsa_out, data, data_len) == 0)
+		rv = CKR_OK;
+	else
+		rv = CKR_SIGNATURE_INVALID;
+
+	free(rsa_out);
+	return rv;
+}
 
-	if (mech == CKM_GOSTR3410)
-	{
 #if OPENSSL_VERSION_NUMBER >= 0x10000000L && !defined(OPENSSL_NO_EC)
-		return gostr3410_verify_data(pubkey, pubkey_len,
-				pubkey_params, pubkey_params_len,
-				data, data_len, signat, signat_len);
+/* PKCS#11 ECDSA signatures are r and s concatenated */
+static CK_RV ecdsa_verify(EVP_PKEY *pkey, unsigned char *data, int data_len,
+			unsigned char *signat, int signat_len)
+{
+	EC_KEY *ec;
+	ECDSA_SIG *sig;
+	BIGNUM *r, *s;
+	int res;
+
+	if (signat_len <= 0 || signat_len % 2)
+		return CKR_SIGNATURE_LEN_RANGE;
+
+	sig = ECDSA_SIG_new();
+	if (sig == NULL)
+		return CKR_HOST_MEMORY;
+	r = BN_bin2bn(signat, signat_len / 2, NULL);
+	s = BN_bin2bn(signat + signat_len / 2, signat_len / 2, NULL);
+	if (r == NULL || s == NULL) {
+		BN_free(r);
+		BN_free(s);
+		ECDSA_SIG_free(sig);
+		return CKR_HOST_MEMORY;
+	}
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+	ECDSA_SIG_set0(sig, r, s);
 #else
-		(void)pubkey_params, (void)pubkey_params_len; /* no warning */
-		return CKR_FUNCTION_NOT_SUPPORTED;
+	BN_free(sig->r);
+	BN_free(sig->s);
+	sig->r = r;
+	sig->s = s;
 #endif
+
+	ec = EVP_PKEY_get1_EC_KEY(pkey);
+	if (ec == NULL) {
+		ECDSA_SIG_free(sig);
+		return CKR_DEVICE_MEMORY;
 	}
+	res = ECDSA_do_verify(data, data_len, sig, ec);
+	EC_KEY_free(ec);
+	ECDSA_SIG_free(sig);
+	if (res == 1)
+		return CKR_OK;
+	else if (res == 0)
+		return CKR_SIGNATURE_INVALID;
+	sc_debug(context, SC_LOG_DEBUG_NORMAL, "ECDSA_do_verify() returned %d\n", res);
+	return CKR_GENERAL_ERROR;
+}
+#endif
 
-	pkey = d2i_PublicKey(EVP_PKEY_RSA, NULL, &pubkey, pubkey_len);
-	if (pkey == NULL)
-		return CKR_GENERAL_ERROR;
+/*
+ * Verify a signature with a key from sc_pkcs11_parse_pubkey().
+ * If a hash operation is given, it is finished here and the signature
+ * checked on the digest, without setting up an EVP_PKEY_CTX per call.
+ */
+CK_RV sc_pkcs11_verify_pkey(void *key, CK_MECHANISM_TYPE mech,
+			sc_pkcs11_operation_t *md,
+			unsigned char *data, int data_len,
+			unsigned char *signat, int signat_len)
+{
+	EVP_PKEY *pkey = (EVP_PKEY *) key;
+	unsigned char digest[EVP_MAX_MD_SIZE];
+	unsigned int digest_len = 0;
+	int md_type = NID_undef;
 
 	if (md != NULL) {
 		EVP_MD_CTX *md_ctx = DIGEST_CTX(md);
 
-		res = EVP_VerifyFinal(md_ctx, signat, signat_len, pkey);
-		EVP_PKEY_free(pkey);
-		if (res == 1)
-			return CKR_OK;
-		else if (res == 0)
-			return CKR_SIGNATURE_INVALID;
-		else {
-			sc_debug(context, SC_LOG_DEBUG_NORMAL, "EVP_VerifyFinal() returned %d\n", res);
+		md_type = EVP_MD_type(EVP_MD_CTX_md(md_ctx));
+		if (!EVP_DigestFinal_ex(md_ctx, digest, &digest_len))
 			return CKR_GENERAL_ERROR;
-		}
+		data = digest;
+		data_len = digest_len;
 	}
-	else {
-		RSA *rsa;
-		unsigned char *rsa_out = NULL, pad;
-		int rsa_outlen = 0;
-
-		switch(mech) {
-		case CKM_RSA_PKCS:
-		 	pad = RSA_PKCS1_PADDING;
-		 	break;
-		 case CKM_RSA_X_509:
-		 	pad = RSA_NO_PADDING;
-		 	break;
-		 default:
-			EVP_PKEY_free(pkey);
-		 	return CKR_ARGUMENTS_BAD;
-		 }
-
-		rsa = EVP_PKEY_get1_RSA(pkey);
-		EVP_PKEY_free(pkey);
-		if (rsa == NULL)
-			return CKR_DEVICE_MEMORY;
-
-		rsa_out = malloc(RSA_size(rsa));
-		if (rsa_out == NULL) {
-			RSA_free(rsa);
-			return CKR_DEVICE_MEMORY;
+
+#if OPENSSL_VERSION_NUMBER >= 0x10000000L
+	switch (EVP_PKEY_base_id(pkey)) {
+#else
+	switch (EVP_PKEY_type(pkey->type)) {
+#endif
+	case EVP_PKEY_RSA:
+		return rsa_verify(pkey, mech, md_type, data, data_len, signat, signat_len);
+#if OPENSSL_VERSION_NUMBER >= 0x10000000L && !defined(OPENSSL_NO_EC)
+	case EVP_PKEY_EC:
+		if (md == NULL && mech == CKM_ECDSA_SHA1) {
+			/* The card hashes for CKM_ECDSA_SHA1, we have to do it here */
+			if (!EVP_Digest(data, data_len, digest, &digest_len, EVP_sha1(), NULL))
+				return CKR_GENERAL_ERROR;
+			data = digest;
+			data_len = digest_len;
 		}
-		
-		rsa_outlen = RSA_public_decrypt(signat_len, signat, rsa_out, rsa, pad);
-		RSA_free(rsa);
-		if(rsa_outlen <= 0) {
-			free(rsa_out);
-			sc_debug(context, SC_LOG_DEBUG_NORMAL, "RSA_public_decrypt() returned %d\n", rsa_outlen);
-			return CKR_GENERAL_ERROR;
+		else if (md == NULL && mech != CKM_ECDSA) {
+			return CKR_ARGUMENTS_BAD;
 		}
+		return ecdsa_verify(pkey, data, data_len, signat, signat_len);
+#endif
+	}
+	return CKR_KEY_TYPE_INCONSISTENT;
+}
 
-		if (rsa_outlen == data_len && memcmp(rsa_out, data, data_len) == 0)
-			rv = CKR_OK;
-		else
-			rv = CKR_SIGNATURE_INVALID;
+/*
+ * Verify a signature with a public key given by its raw CKA_VALUE.
+ */
+CK_RV sc_pkcs11_verify_data(const unsigned char *pubkey, int pubkey_len,
+			const unsigned char *pubkey_params, int pubkey_params_len,
+			CK_MECHANISM_TYPE mech, sc_pkcs11_operation_t *md,
+			unsigned char *data, int data_len,
+			unsigned char *signat, int signat_len)
+{
+	void *pkey = NULL;
+	CK_RV rv;
 
-		free(rsa_out);
+	if (mech == CKM_GOSTR3410)
+	{
+#if OPENSSL_VERSION_NUMBER >= 0x10000000L && !defined(OPENSSL_NO_EC)
+		return gostr3410_verify_data(pubkey, pubkey_len,
+				pubkey_params, pubkey_params_len,
+				data, data_len, signat, signat_len);
+#else
+		(void)pubkey_params, (void)pubkey_params_len; /* no warning */
+		return CKR_FUNCTION_NOT_SUPPORTED;
+#endif
 	}
 
+	rv = sc_pkcs11_parse_pubkey(CKK_RSA, pubkey, pubkey_len, NULL, 0, &pkey);
+	if (rv != CKR_OK)
+		return rv;
+	rv = sc_pkcs11_verify_pkey(pkey, mech, md, data, data_len, signat, signat_len);
+	sc_pkcs11_free_pubkey(pkey);
 	return rv;
 }
 #endif
@@ -28,6 +28,16 @@
 
 #include "sc-pkcs11.h"
 
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+#ifndef _WIN32
+#include <unistd.h>
+#define msleep(t)	usleep((t) * 1000)
+#else
+#define msleep(t)	Sleep(t)
+#endif
+
 sc_context_t *context = NULL;
 struct sc_pkcs11_config sc_pkcs11_conf;
 list_t sessions;
@@ -38,11 +48,25 @@ pid_t initialized_pid = (pid_t)-1;
 static int in_finalize = 0;
 extern CK_FUNCTION_LIST pkcs11_function_list;
 
+/* Slot state snapshot used by C_GetSlotList. While a thread is blocked
+ * in C_WaitForSlotEvent it refreshes the slots on every reader event,
+ * otherwise the snapshot is refreshed when it is older than a second.
+ * Protected by the global lock. */
+static sc_timestamp_t slot_list_expires = 0;
+static unsigned int slot_event_waiters = 0;
+/* Threads blocked in sc_wait_for_event(). C_Finalize cancels the wait
+ * and waits for the last one to leave before it releases the context.
+ * The cancel is repeated after an interval, in case it came before the
+ * waiter had entered the reader driver. */
+static unsigned int slot_event_waiting = 0;
+#define SLOT_EVENT_CANCEL_INTERVAL	100	/* ms */
+static int readers_changed = 0;
+static sc_timestamp_t get_current_time(void);
+
 #if defined(HAVE_PTHREAD) && defined(PKCS11_THREAD_LOCKING)
-#include <pthread.h>
 CK_RV mutex_create(void **mutex)
 {
-	pthread_mutex_t *m = malloc(sizeof(*mutex));
+	pthread_mutex_t *m = malloc(sizeof(*m));
 	if (m == NULL)
 		return CKR_GENERAL_ERROR;;
 	pthread_mutex_init(m, NULL);
@@ -114,6 +138,9 @@ static CK_C_INITIALIZE_ARGS _def_locks = {
 
 static CK_C_INITIALIZE_ARGS_PTR	global_locking;
 static void *			global_lock = NULL;
+static void *			wait_lock = NULL;
+static void __sc_pkcs11_lock(void *lock);
+static void __sc_pkcs11_unlock(void *lock);
 #if (defined(HAVE_PTHREAD) || defined(_WIN32)) && defined(PKCS11_THREAD_LOCKING)
 #define HAVE_OS_LOCKING
 static CK_C_INITIALIZE_ARGS_PTR default_mutex_funcs = &_def_locks;
@@ -121,6 +148,122 @@ static CK_C_INITIALIZE_ARGS_PTR default_mutex_funcs = &_def_locks;
 static CK_C_INITIALIZE_ARGS_PTR default_mutex_funcs = NULL;
 #endif
 
+/*
+ * Waiters in C_WaitForSlotEvent
+ */
+#ifdef HAVE_PTHREAD
+static pthread_mutex_t slot_event_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t slot_event_left = PTHREAD_COND_INITIALIZER;
+
+static int slot_event_wait_enter(void)
+{
+	int r = 0;
+
+	pthread_mutex_lock(&slot_event_lock);
+	if (in_finalize == 0) {
+		slot_event_waiting++;
+		r = 1;
+	}
+	pthread_mutex_unlock(&slot_event_lock);
+	return r;
+}
+
+/* Returns 1 if C_Finalize is in progress; the reader states are then
+ * released while the context is still there */
+static int slot_event_wait_leave(void **reader_states)
+{
+	int r;
+
+	pthread_mutex_lock(&slot_event_lock);
+	r = in_finalize;
+	if (r && *reader_states)
+		sc_wait_for_event(context, 0, NULL, NULL, -1, reader_states);
+	if (--slot_event_waiting == 0)
+		pthread_cond_broadcast(&slot_event_left);
+	pthread_mutex_unlock(&slot_event_lock);
+	return r;
+}
+
+static void slot_event_wait_drain(void)
+{
+	struct timeval now;
+	struct timespec until;
+
+	pthread_mutex_lock(&slot_event_lock);
+	in_finalize = 1;
+	while (slot_event_waiting > 0) {
+		sc_cancel(context);
+		gettimeofday(&now, NULL);
+		until.tv_sec = now.tv_sec;
+		until.tv_nsec = (now.tv_usec + SLOT_EVENT_CANCEL_INTERVAL * 1000) * 1000;
+		until.tv_sec += until.tv_nsec / 1000000000;
+		until.tv_nsec %= 1000000000;
+		pthread_cond_timedwait(&slot_event_left, &slot_event_lock, &until);
+	}
+	pthread_mutex_unlock(&slot_event_lock);
+}
+#else
+#ifdef _WIN32
+/* Manual reset event, signalled while no thread waits */
+static HANDLE slot_event_idle = NULL;
+#endif
+
+static int slot_event_wait_enter(void)
+{
+	int r = 0;
+
+	__sc_pkcs11_lock(wait_lock);
+	if (in_finalize == 0) {
+#ifdef _WIN32
+		if (slot_event_idle == NULL)
+			slot_event_idle = CreateEvent(NULL, TRUE, TRUE, NULL);
+		if (slot_event_waiting == 0 && slot_event_idle != NULL)
+			ResetEvent(slot_event_idle);
+#endif
+		slot_event_waiting++;
+		r = 1;
+	}
+	__sc_pkcs11_unlock(wait_lock);
+	return r;
+}
+
+static int slot_event_wait_leave(void **reader_states)
+{
+	int r;
+
+	__sc_pkcs11_lock(wait_lock);
+	r = in_finalize;
+	if (r && *reader_states)
+		sc_wait_for_event(context, 0, NULL, NULL, -1, reader_states);
+	slot_event_waiting--;
+#ifdef _WIN32
+	if (slot_event_waiting == 0 && slot_event_idle != NULL)
+		SetEvent(slot_event_idle);
+#endif
+	__sc_pkcs11_unlock(wait_lock);
+	return r;
+}
+
+static void slot_event_wait_drain(void)
+{
+	__sc_pkcs11_lock(wait_lock);
+	in_finalize = 1;
+	while (slot_event_waiting > 0) {
+		__sc_pkcs11_unlock(wait_lock);
+		sc_cancel(context);
+#ifdef _WIN32
+		if (slot_event_idle != NULL)
+			WaitForSingleObject(slot_event_idle, SLOT_EVENT_CANCEL_INTERVAL);
+		else
+#endif
+		/* no condition to wait on with application supplied locks */
+		msleep(SLOT_EVENT_CANCEL_INTERVAL);
+		__sc_pkcs11_lock(wait_lock);
+	}
+	__sc_pkcs11_unlock(wait_lock);
+}
+#endif
+
 /* wrapper for the locking functions for libopensc */
 static int sc_create_mutex(void **m)
 {
@@ -248,6 +391,10 @@ CK_RV C_Initialize(CK_VOID_PTR pInitArgs)
 		initialize_reader(sc_ctx_get_reader(context, i));
 	}
 
+	slot_list_expires = 0;
+	slot_event_waiters = 0;
+	readers_changed = 0;
+
 	/* Set initial event state on slots */
 	for (i=0; i<list_size(&virtual_slots); i++) {
 		sc_pkcs11_slot_t *slot = (sc_pkcs11_slot_t *) list_get_at(&virtual_slots, i);
@@ -283,15 +430,16 @@ CK_RV C_Finalize(CK_VOID_PTR pReserved)
 	if (context == NULL)
 		return CKR_CRYPTOKI_NOT_INITIALIZED;
 
+	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_Finalize()");
+
+	/* cancel pending calls, and wait for a blocked C_WaitForSlotEvent
+	 * to let go of the context; in_finalize keeps new ones out */
+	slot_event_wait_drain();
+
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
 		return rv;
 
-	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_Finalize()");
-	
-	/* cancel pending calls */
-	in_finalize = 1;
-	sc_cancel(context);
 	/* remove all cards from readers */
 	for (i=0; i < (int)sc_ctx_get_reader_count(context); i++)
 		card_removed(sc_ctx_get_reader(context, i));
@@ -301,7 +449,9 @@ CK_RV C_Finalize(CK_VOID_PTR pReserved)
 	list_destroy(&sessions);
 
 	while ((slot = list_fetch(&virtual_slots))) {
+		slot_index_clear(slot);
 		list_destroy(&slot->objects);
+		sc_pkcs11_release_slot_lock(slot->lock);
 		free(slot);
 	}
 	list_destroy(&virtual_slots);
@@ -362,6 +512,8 @@ CK_RV C_GetSlotList(CK_BBOOL       tokenPresent,  /* only slots with token prese
 	CK_ULONG numMatches;
 	sc_pkcs11_slot_t *slot;
 	sc_reader_t *prev_reader = NULL;
+	sc_timestamp_t now;
+	int refresh;
 	CK_RV rv;
 
 	if (pulCount == NULL_PTR)
@@ -374,15 +526,28 @@ CK_RV C_GetSlotList(CK_BBOOL       tokenPresent,  /* only slots with token prese
 	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_GetSlotList(token=%d, %s)", tokenPresent,
 		 (pSlotList==NULL_PTR && sc_pkcs11_conf.plug_and_play)? "plug-n-play":"refresh");
 
+	now = get_current_time();
+	refresh = slot_event_waiters == 0 && (now >= slot_list_expires || now == 0);
+
 	/* Slot list can only change in v2.20 */
 	if (pSlotList == NULL_PTR && sc_pkcs11_conf.plug_and_play) {
 		/* Trick NSS into updating the slot list by changing the hotplug slot ID */
 		sc_pkcs11_slot_t *hotplug_slot = list_get_at(&virtual_slots, 0);
 		hotplug_slot->id--;
-		sc_ctx_detect_readers(context); 
+		if (refresh || readers_changed) {
+			sc_ctx_detect_readers(context);
+			readers_changed = 0;
+			refresh = 1;
+		}
 	}
 
-	card_detect_all();
+	if (refresh) {
+		card_detect_all();
+		/* Don't ask again within the next second */
+		slot_list_expires = now + 1000;
+	} else {
+		sc_debug(context, SC_LOG_DEBUG_NORMAL, "using cached slot states");
+	}
 
 	found = malloc(list_size(&virtual_slots) * sizeof(CK_SLOT_ID));
 
@@ -484,7 +649,10 @@ CK_RV C_GetSlotInfo(CK_SLOT_ID slotID, CK_SLOT_INFO_PTR pInfo)
 			rv = CKR_TOKEN_NOT_PRESENT;
 		else {
 			now = get_current_time();
-			if (now >= slot->slot_state_expires || now == 0) {
+			/* Don't wait for a card that another session is using,
+			 * it is there and the cached state is accurate */
+			if ((now >= slot->slot_state_expires || now == 0)
+					&& (slot->lock == NULL || slot->lock->users == 0)) {
 				/* Update slot status */
 				rv = card_detect(slot->reader);
 				/* Don't ask again within the next second */
@@ -564,19 +732,29 @@ CK_RV C_InitToken(CK_SLOT_ID slotID,
 	rv = slot_get_token(slotID, &slot);
 	if (rv != CKR_OK)
 		goto out;
-	
+
+	/* The token may change while waiting for the card, so
+	 * check it with the slot lock held */
+	rv = sc_pkcs11_lock_slot_global(slot);
+	if (rv != CKR_OK)
+		goto out;
+	if (slot->card == NULL || !(slot->slot_info.flags & CKF_TOKEN_PRESENT)) {
+		rv = CKR_TOKEN_NOT_PRESENT;
+		goto unlock;
+	}
+
 	/* Make sure there's no open session for this token */
 	for (i=0; i<list_size(&sessions); i++) {
 		session = (struct sc_pkcs11_session*)list_get_at(&sessions, i);
 		if (session->slot == slot) {
 			rv = CKR_SESSION_EXISTS;
-			goto out;
+			goto unlock;
 		}
 	}
 
 	if (slot->card->framework->init_token == NULL) {
 		rv = CKR_FUNCTION_NOT_SUPPORTED;
-		goto out;
+		goto unlock;
 	}
 	rv = slot->card->framework->init_token(slot->card,
 				 slot->fw_data, pPin, ulPinLen, pLabel);
@@ -586,6 +764,7 @@ CK_RV C_InitToken(CK_SLOT_ID slotID,
 		 * corresponding function vector and flags */
 	}
 
+unlock:	sc_pkcs11_unlock_slot_global(slot);
 out:	sc_pkcs11_unlock();
 	return rv;
 }
@@ -601,18 +780,15 @@ CK_RV C_WaitForSlotEvent(CK_FLAGS flags,   /* blocking/nonblocking flag */
 	CK_RV rv;
 	int r;
 	
-	if (pReserved != NULL_PTR)
+	if (pReserved != NULL_PTR || pSlot == NULL_PTR)
 		return  CKR_ARGUMENTS_BAD;
 
-	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_WaitForSlotEvent(block=%d)", !(flags & CKF_DONT_BLOCK));
-	/* Not all pcsc-lite versions implement consistently used functions as they are */
-	/* FIXME: add proper checking into build to check correct pcsc-lite version for SCardStatusChange/SCardCancel */
-	if (!(flags & CKF_DONT_BLOCK))
-		return CKR_FUNCTION_NOT_SUPPORTED;
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
 		return rv;
 
+	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_WaitForSlotEvent(block=%d)", !(flags & CKF_DONT_BLOCK));
+
 	mask = SC_EVENT_CARD_EVENTS;
 
 	/* Detect and add new slots for added readers v2.20 */
@@ -626,26 +802,26 @@ CK_RV C_WaitForSlotEvent(CK_FLAGS flags,   /* blocking/nonblocking flag */
 
 again:
 	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_WaitForSlotEvent() reader_states:%p", reader_states);
+	/* Wait without the global lock, so that other threads can use
+	 * the tokens meanwhile. C_Finalize cancels the wait and waits for
+	 * the waiters to leave before it takes the global lock, so the
+	 * global lock is taken again before leaving. */
+	if (!slot_event_wait_enter()) {
+		rv = CKR_CRYPTOKI_NOT_INITIALIZED;
+		goto out;
+	}
+	slot_event_waiters++;
 	sc_pkcs11_unlock();
+
+	events = 0;
 	r = sc_wait_for_event(context, mask, &found, &events, -1, &reader_states);
-	if (sc_pkcs11_conf.plug_and_play && events & SC_EVENT_READER_ATTACHED) {
-		/* NSS/Firefox Triggers a C_GetSlotList(NULL) only if a slot ID is returned that it does not know yet
-		   Change the first hotplug slot id on every call to make this happen. */
-		sc_pkcs11_slot_t *hotplug_slot = list_get_at(&virtual_slots, 0);
-		*pSlot= hotplug_slot->id -1;
-	
-		rv = sc_pkcs11_lock();
-		if (rv != CKR_OK)
-			return rv;
 
+	__sc_pkcs11_lock(global_lock);
+	slot_event_waiters--;
+	if (slot_event_wait_leave(&reader_states)) {
+		rv = CKR_CRYPTOKI_NOT_INITIALIZED;
 		goto out;
 	}
-	/* Was C_Finalize called ? */
-	if (in_finalize == 1)
-		return CKR_CRYPTOKI_NOT_INITIALIZED;
-
-	if ((rv = sc_pkcs11_lock()) != CKR_OK)
-		return rv;
 
 	if (r != SC_SUCCESS) {
 		sc_debug(context, SC_LOG_DEBUG_NORMAL, "sc_wait_for_event() returned %d\n",  r);
@@ -653,6 +829,15 @@ again:
 		goto out;
 	}
 
+	if (sc_pkcs11_conf.plug_and_play && events & SC_EVENT_READER_ATTACHED) {
+		/* NSS/Firefox Triggers a C_GetSlotList(NULL) only if a slot ID is returned that it does not know yet
+		   Change the first hotplug slot id on every call to make this happen. */
+		sc_pkcs11_slot_t *hotplug_slot = list_get_at(&virtual_slots, 0);
+		slot_id = hotplug_slot->id - 1;
+		readers_changed = 1;
+		goto out;
+	}
+
 	/* If no changed slot was found (maybe an unsupported card
 	 * was inserted/removed) then go waiting again */
 	rv = slot_find_changed(&slot_id, mask);
@@ -660,7 +845,7 @@ again:
 		goto again;
 
 out:	
-	if (pSlot)
+	if (rv == CKR_OK)
 		*pSlot = slot_id;
 
 	/* Free allocated readers states holder */
@@ -725,22 +910,30 @@ sc_pkcs11_init_lock(CK_C_INITIALIZE_ARGS_PTR args)
 	if (global_locking != NULL) {
 		/* create mutex */
 		rv = global_locking->CreateMutex(&global_lock);
+		if (rv == CKR_OK)
+			rv = global_locking->CreateMutex(&wait_lock);
 	}
 
 	return rv;
 }
 
+static void
+__sc_pkcs11_lock(void *lock)
+{
+	if (!lock)
+		return;
+	if (global_locking) {
+		while (global_locking->LockMutex(lock) != CKR_OK)
+			;
+	}
+}
+
 CK_RV sc_pkcs11_lock(void)
 {
 	if (context == NULL)
 		return CKR_CRYPTOKI_NOT_INITIALIZED;
 
-	if (!global_lock)
-		return CKR_OK;
-	if (global_locking)  {
-		while (global_locking->LockMutex(global_lock) != CKR_OK)
-			;
-	} 
+	__sc_pkcs11_lock(global_lock);
 
 	return CKR_OK;
 }
@@ -783,9 +976,93 @@ void sc_pkcs11_free_lock(void)
 
 	if (global_locking)
 		global_locking->DestroyMutex(tempLock);
+
+	if (wait_lock && global_locking)
+		global_locking->DestroyMutex(wait_lock);
+	wait_lock = NULL;
 	global_locking = NULL;
 }
 
+/*
+ * Slot locks serialize the use of one card, so that a long operation
+ * on one reader does not hold up the other readers. The lock order is
+ * global lock -> slot lock; never take the global lock while holding
+ * a slot lock.
+ */
+struct sc_pkcs11_slot_lock *sc_pkcs11_new_slot_lock(void)
+{
+	struct sc_pkcs11_slot_lock *lock;
+
+	lock = (struct sc_pkcs11_slot_lock *)calloc(1, sizeof(struct sc_pkcs11_slot_lock));
+	if (lock == NULL)
+		return NULL;
+
+	if (global_locking != NULL && global_locking->CreateMutex(&lock->mutex) != CKR_OK) {
+		free(lock);
+		return NULL;
+	}
+	lock->refs = 1;
+	return lock;
+}
+
+void sc_pkcs11_release_slot_lock(struct sc_pkcs11_slot_lock *lock)
+{
+	if (lock == NULL || --lock->refs > 0)
+		return;
+
+	if (lock->mutex && global_locking)
+		global_locking->DestroyMutex(lock->mutex);
+	free(lock);
+}
+
+CK_RV sc_pkcs11_lock_slot(struct sc_pkcs11_slot *slot)
+{
+	if (slot->lock == NULL || slot->lock->mutex == NULL || global_locking == NULL)
+		return CKR_OK;
+
+	return global_locking->LockMutex(slot->lock->mutex);
+}
+
+void sc_pkcs11_unlock_slot(struct sc_pkcs11_slot *slot)
+{
+	if (slot->lock == NULL)
+		return;
+
+	__sc_pkcs11_unlock(slot->lock->mutex);
+}
+
+/* Take the slot lock from a function holding the global lock. The
+ * global lock is released while waiting for the card, so callers on
+ * other slots are not held up; anything looked up under the global
+ * lock before must be checked again. */
+CK_RV sc_pkcs11_lock_slot_global(struct sc_pkcs11_slot *slot)
+{
+	CK_RV rv;
+
+	if (slot->lock == NULL || slot->lock->mutex == NULL || global_locking == NULL)
+		return CKR_OK;
+
+	/* Card detection skips the slot while it has users */
+	slot->lock->users++;
+	sc_pkcs11_unlock();
+	rv = sc_pkcs11_lock_slot(slot);
+	__sc_pkcs11_lock(global_lock);
+	if (rv != CKR_OK)
+		slot->lock->users--;
+	return rv;
+}
+
+/* Release a slot lock taken with sc_pkcs11_lock_slot_global(), with
+ * the global lock held */
+void sc_pkcs11_unlock_slot_global(struct sc_pkcs11_slot *slot)
+{
+	if (slot->lock == NULL || slot->lock->mutex == NULL || global_locking == NULL)
+		return;
+
+	sc_pkcs11_unlock_slot(slot);
+	slot->lock->users--;
+}
+
 CK_FUNCTION_LIST pkcs11_function_list = {
 	{ 2, 11 }, /* Note: NSS/Firefox ignores this version number and uses C_GetInfo() */
 	C_Initialize,
@@ -64,20 +64,13 @@ static void sc_find_release(sc_pkcs11_operation_t *operation)
 	}
 }
 
-static CK_RV get_object_from_session(CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hObject,
-				     struct sc_pkcs11_session **session,
+static CK_RV get_object_from_session(struct sc_pkcs11_session *session,
+				     CK_OBJECT_HANDLE hObject,
 				     struct sc_pkcs11_object **object)
 {
-	CK_RV rv;
-	struct sc_pkcs11_session *sess;
-	rv = get_session(hSession, &sess);
-	if (rv != CKR_OK)
-		return rv;
-
-	*object = list_seek(&sess->slot->objects, &hObject);
+	*object = list_seek(&session->slot->objects, &hObject);
 	if (!*object)
 		return CKR_OBJECT_HANDLE_INVALID;
-	*session = sess;
 	return CKR_OK;
 }
 
@@ -93,7 +86,7 @@ CK_RV C_CreateObject(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (pTemplate == NULL_PTR || ulCount == 0)
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 	SC_FUNC_CALLED(context, SC_LOG_DEBUG_VERBOSE);
@@ -101,12 +94,6 @@ CK_RV C_CreateObject(CK_SESSION_HANDLE hSession,	/* the session's handle */
 
 	dump_template(SC_LOG_DEBUG_NORMAL, "C_CreateObject()", pTemplate, ulCount);
 
-	session = list_seek(&sessions, &hSession);
-	if (!session) {
-		rv = CKR_SESSION_HANDLE_INVALID;
-		goto out;
-	}
-
 	if (!(session->flags & CKF_RW_SESSION)) {
 		rv = CKR_SESSION_READ_ONLY;
 		goto out;
@@ -119,7 +106,7 @@ CK_RV C_CreateObject(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		rv = card->framework->create_object(card, session->slot,
 				pTemplate, ulCount, phObject);
 
-out:	sc_pkcs11_unlock();
+out:	sc_pkcs11_unlock_session(session);
 	SC_FUNC_RETURN(context, SC_LOG_DEBUG_VERBOSE, rv);
 }
 
@@ -139,13 +126,13 @@ CK_RV C_DestroyObject(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	struct sc_pkcs11_session *session;
 	struct sc_pkcs11_object *object;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
 	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_DestroyObject(hSession=0x%lx, hObject=0x%lx)", hSession, hObject);
 
-	rv = get_object_from_session(hSession, hObject, &session, &object);
+	rv = get_object_from_session(session, hObject, &object);
 	if (rv != CKR_OK)
 		goto out;
 
@@ -159,7 +146,7 @@ CK_RV C_DestroyObject(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	else
 		rv = object->ops->destroy_object(session, object);
 
-out:	sc_pkcs11_unlock();
+out:	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -193,11 +180,11 @@ CK_RV C_GetAttributeValue(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (pTemplate == NULL_PTR || ulCount == 0)
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_object_from_session(hSession, hObject, &session, &object);
+	rv = get_object_from_session(session, hObject, &object);
 	if (rv != CKR_OK)
 		goto out;
 
@@ -233,7 +220,7 @@ CK_RV C_GetAttributeValue(CK_SESSION_HANDLE hSession,	/* the session's handle */
 
 out:	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_GetAttributeValue(hSession=0x%lx, hObject=0x%lx) = %s",
 			hSession, hObject, lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -250,13 +237,13 @@ CK_RV C_SetAttributeValue(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (pTemplate == NULL_PTR || ulCount == 0)
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
 	dump_template(SC_LOG_DEBUG_NORMAL, "C_SetAttributeValue", pTemplate, ulCount);
 
-	rv = get_object_from_session(hSession, hObject, &session, &object);
+	rv = get_object_from_session(session, hObject, &object);
 	if (rv != CKR_OK)
 		goto out;
 
@@ -273,37 +260,101 @@ CK_RV C_SetAttributeValue(CK_SESSION_HANDLE hSession,	/* the session's handle */
 			if (rv != CKR_OK)
 				break;
 		}
+		/* Keep the search index in sync, even after a partial update */
+		for (i = 0; i < ulCount; i++) {
+			if (slot_index_key(pTemplate[i].type) >= 0) {
+				slot_index_object(session, object);
+				break;
+			}
+		}
 	}
 
-out:	sc_pkcs11_unlock();
+out:	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
+/* Adds object to the find operation if it matches the template.
+ * private_obj is the object's CKA_PRIVATE value if known, else -1. */
+static CK_RV find_match(struct sc_pkcs11_session *session,
+			struct sc_pkcs11_find_operation *operation,
+			struct sc_pkcs11_object *object, int private_obj,
+			int hide_private,
+			CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount)
+{
+	CK_BBOOL is_private = TRUE;
+	CK_ATTRIBUTE private_attribute = { CKA_PRIVATE, &is_private, sizeof(is_private) };
+	struct sc_pkcs11_slot *slot = session->slot;
+	unsigned int j;
+
+	sc_debug(context, SC_LOG_DEBUG_NORMAL, "Object with handle 0x%lx", object->handle);
+
+	/* User not logged in and private object? */ 
+	if (hide_private) {
+		if (private_obj < 0) {
+			if (object->ops->get_attribute(session, object, &private_attribute) != CKR_OK)
+				return CKR_OK;
+			private_obj = is_private;
+		}
+		if (private_obj) {
+			sc_debug(context, SC_LOG_DEBUG_NORMAL,
+				 "Object %d/%d: Private object and not logged in.\n",
+				 slot->id, object->handle);
+			return CKR_OK;
+		}
+	}
+
+	/* Try to match every attribute */
+	for (j = 0; j < ulCount; j++) {
+		if (object->ops->cmp_attribute(session, object, &pTemplate[j]) == 0) {
+			sc_debug(context, SC_LOG_DEBUG_NORMAL,
+				 "Object %d/%d: Attribute 0x%x does NOT match.\n",
+				 slot->id, object->handle, pTemplate[j].type);
+			return CKR_OK;
+		}
+
+		if (context->debug >= 4) {
+			sc_debug(context, SC_LOG_DEBUG_NORMAL, "Object %d/%d: Attribute 0x%x matches.\n",
+				 slot->id, object->handle, pTemplate[j].type);
+		}
+	}
+
+	sc_debug(context, SC_LOG_DEBUG_NORMAL, "Object %d/%d matches\n", slot->id, object->handle);
+	/* Realloc handles - remove restriction on only 32 matching objects -dee */
+	if (operation->num_handles >= operation->allocated_handles) {
+		operation->allocated_handles += SC_PKCS11_FIND_INC_HANDLES;
+		sc_debug(context, SC_LOG_DEBUG_NORMAL, "realloc for %d handles",
+			 operation->allocated_handles);
+		operation->handles = realloc(operation->handles, 
+			sizeof(CK_OBJECT_HANDLE) * operation->allocated_handles);
+		if (operation->handles == NULL)
+			return CKR_HOST_MEMORY;
+	}
+	operation->handles[operation->num_handles++] = object->handle;
+	return CKR_OK;
+}
+
 CK_RV C_FindObjectsInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 			CK_ATTRIBUTE_PTR pTemplate,	/* attribute values to match */
 			CK_ULONG ulCount)
 {				/* attributes in search template */
 	CK_RV rv;
-	CK_BBOOL is_private = TRUE;
-	CK_ATTRIBUTE private_attribute = { CKA_PRIVATE, &is_private, sizeof(is_private) };
-	int match, hide_private;
-	unsigned int i, j;
+	int hide_private, k, key = -1;
+	unsigned int i;
+	CK_ATTRIBUTE_PTR key_attr = NULL;
 	struct sc_pkcs11_session *session;
 	struct sc_pkcs11_object *object;
 	struct sc_pkcs11_find_operation *operation;
 	struct sc_pkcs11_slot *slot;
+	struct sc_pkcs11_index_record *rec;
+	struct sc_pkcs11_index_node *pos = NULL;
 
 	if (pTemplate == NULL_PTR && ulCount > 0)
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
-	if (rv != CKR_OK)
-		goto out;
-
 	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_FindObjectsInit(slot = %d)\n", session->slot->id);
 	dump_template(SC_LOG_DEBUG_NORMAL, "C_FindObjectsInit()", pTemplate, ulCount);
 
@@ -322,64 +373,41 @@ CK_RV C_FindObjectsInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	hide_private = 0;
 	if (slot->login_user != CKU_USER && (slot->token_info.flags & CKF_LOGIN_REQUIRED))
 		hide_private = 1;
-        
-	/* For each object in token do */
-	for (i=0; i<list_size(&slot->objects); i++) {
-		object = (struct sc_pkcs11_object *)list_get_at(&slot->objects, i);
-		sc_debug(context, SC_LOG_DEBUG_NORMAL, "Object with handle 0x%lx", object->handle);
-
-		/* User not logged in and private object? */ 
-		if (hide_private) {
-			if (object->ops->get_attribute(session, object, &private_attribute) != CKR_OK)
-			        continue;
-			if (is_private) {
-				sc_debug(context, SC_LOG_DEBUG_NORMAL,
-					 "Object %d/%d: Private object and not logged in.\n",
-					 slot->id, object->handle);
-				continue;
-			}
-		}
 
-		/* Try to match every attribute */
-		match = 1;
-		for (j = 0; j < ulCount; j++) {
-			rv = object->ops->cmp_attribute(session, object, &pTemplate[j]);
-			if (rv == 0) {
-				sc_debug(context, SC_LOG_DEBUG_NORMAL,
-					 "Object %d/%d: Attribute 0x%x does NOT match.\n",
-					 slot->id, object->handle, pTemplate[j].type);
-				match = 0;
-				break;
-			}
-
-			if (context->debug >= 4) {
-				sc_debug(context, SC_LOG_DEBUG_NORMAL, "Object %d/%d: Attribute 0x%x matches.\n",
-					 slot->id, object->handle, pTemplate[j].type);
-			}
+	/* Look up the most selective indexed attribute of the template */
+	for (i = 0; i < ulCount; i++) {
+		k = slot_index_key(pTemplate[i].type);
+		if (k >= 0 && (key < 0 || k < key)) {
+			key = k;
+			key_attr = &pTemplate[i];
 		}
-
-		if (match) {
-			sc_debug(context, SC_LOG_DEBUG_NORMAL, "Object %d/%d matches\n", slot->id, object->handle);
-			/* Realloc handles - remove restriction on only 32 matching objects -dee */
-			if (operation->num_handles >= operation->allocated_handles) {
-				operation->allocated_handles += SC_PKCS11_FIND_INC_HANDLES;
-				sc_debug(context, SC_LOG_DEBUG_NORMAL, "realloc for %d handles",
-					 operation->allocated_handles);
-				operation->handles = realloc(operation->handles, 
-					sizeof(CK_OBJECT_HANDLE) * operation->allocated_handles);
-				if (operation->handles == NULL) {
-					rv = CKR_HOST_MEMORY;
-					break;
-				}
-			}
-			operation->handles[operation->num_handles++] = object->handle;
+	}
+	if (key_attr != NULL && slot_index_update(session) != CKR_OK)
+		key_attr = NULL;
+
+	if (key_attr != NULL) {
+		sc_debug(context, SC_LOG_DEBUG_NORMAL, "Searching index by attribute 0x%lx", key_attr->type);
+		while (rv == CKR_OK && (rec = slot_index_find(slot, key_attr, &pos)) != NULL)
+			rv = find_match(session, operation, rec->object, rec->private_obj,
+					hide_private, pTemplate, ulCount);
+		/* Objects whose keys could not be read */
+		for (rec = slot->index.records; rv == CKR_OK && slot->index.unindexed && rec; rec = rec->next)
+			if (rec->unindexed)
+				rv = find_match(session, operation, rec->object, rec->private_obj,
+						hide_private, pTemplate, ulCount);
+	} else {
+		/* For each object in token do */
+		for (i = 0; rv == CKR_OK && i < list_size(&slot->objects); i++) {
+			object = (struct sc_pkcs11_object *)list_get_at(&slot->objects, i);
+			rv = find_match(session, operation, object, -1,
+					hide_private, pTemplate, ulCount);
 		}
 	}
 	rv = CKR_OK;
 
 	sc_debug(context, SC_LOG_DEBUG_NORMAL, "%d matching objects\n", operation->num_handles);
 
-out:	sc_pkcs11_unlock();
+out:	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -396,14 +424,10 @@ CK_RV C_FindObjects(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (phObject == NULL_PTR || ulMaxObjectCount == 0 || pulObjectCount == NULL_PTR)
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
-	if (rv != CKR_OK)
-		goto out;
-
 	rv = session_get_operation(session, SC_PKCS11_OPERATION_FIND,
 				   (sc_pkcs11_operation_t **) & operation);
 	if (rv != CKR_OK)
@@ -421,7 +445,7 @@ CK_RV C_FindObjects(CK_SESSION_HANDLE hSession,	/* the session's handle */
 
 	operation->current_handle += to_return;
 
-out:	sc_pkcs11_unlock();
+out:	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -430,19 +454,15 @@ CK_RV C_FindObjectsFinal(CK_SESSION_HANDLE hSession)
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
-	if (rv != CKR_OK)
-		goto out;
-
 	rv = session_get_operation(session, SC_PKCS11_OPERATION_FIND, NULL);
 	if (rv == CKR_OK)
 		session_stop_operation(session, SC_PKCS11_OPERATION_FIND);
 
-out:	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -460,17 +480,15 @@ CK_RV C_DigestInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (pMechanism == NULL_PTR)
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
 	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_DigestInit(hSession=0x%lx)", hSession);
-	rv = get_session(hSession, &session);
-	if (rv == CKR_OK)
-		rv = sc_pkcs11_md_init(session, pMechanism);
+	rv = sc_pkcs11_md_init(session, pMechanism);
 
 	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_DigestInit() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -483,21 +501,17 @@ CK_RV C_Digest(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
 	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_Digest(hSession=0x%lx)", hSession);
-	rv = get_session(hSession, &session);
-	if (rv != CKR_OK)
-		goto out;
-
 	rv = sc_pkcs11_md_update(session, pData, ulDataLen);
 	if (rv == CKR_OK)
 		rv = sc_pkcs11_md_final(session, pDigest, pulDigestLen);
 
-out:	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_Digest() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_Digest() = %s", lookup_enum ( RV_T, rv ));
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -508,16 +522,14 @@ CK_RV C_DigestUpdate(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
-	if (rv == CKR_OK)
-		rv = sc_pkcs11_md_update(session, pPart, ulPartLen);
+	rv = sc_pkcs11_md_update(session, pPart, ulPartLen);
 
 	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_DigestUpdate() == %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -534,16 +546,14 @@ CK_RV C_DigestFinal(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
-	if (rv == CKR_OK)
-		rv = sc_pkcs11_md_final(session, pDigest, pulDigestLen);
+	rv = sc_pkcs11_md_final(session, pDigest, pulDigestLen);
 
 	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_DigestFinal() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -562,11 +572,11 @@ CK_RV C_SignInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (pMechanism == NULL_PTR)
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_object_from_session(hSession, hKey, &session, &object);
+	rv = get_object_from_session(session, hKey, &object);
 	if (rv != CKR_OK) {
 		if (rv == CKR_OBJECT_HANDLE_INVALID)
 			rv = CKR_KEY_HANDLE_INVALID;
@@ -592,7 +602,7 @@ CK_RV C_SignInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	rv = sc_pkcs11_sign_init(session, pMechanism, object, key_type);
 
 out:	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_SignInit() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -606,14 +616,10 @@ CK_RV C_Sign(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	struct sc_pkcs11_session *session;
 	CK_ULONG length;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
-	if (rv != CKR_OK)
-		goto out;
-
 	/* According to the pkcs11 specs, we must not do any calls that
 	 * change our crypto state if the caller is just asking for the
 	 * signature buffer size, or if the result would be
@@ -633,7 +639,7 @@ CK_RV C_Sign(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		rv = sc_pkcs11_sign_final(session, pSignature, pulSignatureLen);
 
 out:	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_Sign() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -644,16 +650,14 @@ CK_RV C_SignUpdate(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
-	if (rv == CKR_OK)
-		rv = sc_pkcs11_sign_update(session, pPart, ulPartLen);
+	rv = sc_pkcs11_sign_update(session, pPart, ulPartLen);
 
 	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_SignUpdate() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -665,14 +669,10 @@ CK_RV C_SignFinal(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	CK_ULONG length;
 	CK_RV rv;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
-	if (rv != CKR_OK)
-		goto out;
-
 	/* According to the pkcs11 specs, we must not do any calls that
 	 * change our crypto state if the caller is just asking for the
 	 * signature buffer size, or if the result would be
@@ -689,7 +689,7 @@ CK_RV C_SignFinal(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	}
 
 out:	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_SignFinal() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -711,11 +711,11 @@ CK_RV C_SignRecoverInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (pMechanism == NULL_PTR)
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_object_from_session(hSession, hKey, &session, &object);
+	rv = get_object_from_session(session, hKey, &object);
 	if (rv != CKR_OK) {
 		if (rv == CKR_OBJECT_HANDLE_INVALID)
 			rv = CKR_KEY_HANDLE_INVALID;
@@ -745,7 +745,7 @@ CK_RV C_SignRecoverInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	rv = sc_pkcs11_sign_init(session, pMechanism, object, key_type);
 
 out:	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_SignRecoverInit() = %sn", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -805,11 +805,11 @@ CK_RV C_DecryptInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (pMechanism == NULL_PTR)
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_object_from_session(hSession, hKey, &session, &object);
+	rv = get_object_from_session(session, hKey, &object);
 	if (rv != CKR_OK) {
 		if (rv == CKR_OBJECT_HANDLE_INVALID)
 			rv = CKR_KEY_HANDLE_INVALID;
@@ -835,7 +835,7 @@ CK_RV C_DecryptInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	rv = sc_pkcs11_decr_init(session, pMechanism, object, key_type);
 
 out:	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_DecryptInit() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -848,17 +848,15 @@ CK_RV C_Decrypt(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
-	if (rv == CKR_OK)
-		rv = sc_pkcs11_decr(session, pEncryptedData, ulEncryptedDataLen,
-				pData, pulDataLen);
+	rv = sc_pkcs11_decr(session, pEncryptedData, ulEncryptedDataLen,
+			pData, pulDataLen);
 
 	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_Decrypt() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -941,17 +939,13 @@ CK_RV C_GenerateKeyPair(CK_SESSION_HANDLE hSession,	/* the session's handle */
 			|| (pPrivateKeyTemplate == NULL_PTR && ulPrivateKeyAttributeCount > 0))
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
 	dump_template(SC_LOG_DEBUG_NORMAL, "C_GenerateKeyPair(), PrivKey attrs", pPrivateKeyTemplate, ulPrivateKeyAttributeCount);
 	dump_template(SC_LOG_DEBUG_NORMAL, "C_GenerateKeyPair(), PubKey attrs", pPublicKeyTemplate, ulPublicKeyAttributeCount);
 
-	rv = get_session(hSession, &session);
-	if (rv != CKR_OK)
-		goto out;
-
 	if (!(session->flags & CKF_RW_SESSION)) {
 		rv = CKR_SESSION_READ_ONLY;
 		goto out;
@@ -969,7 +963,7 @@ CK_RV C_GenerateKeyPair(CK_SESSION_HANDLE hSession,	/* the session's handle */
 							phPrivateKey);
 	}
 
-out:	sc_pkcs11_unlock();
+out:	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -1021,20 +1015,17 @@ CK_RV C_GenerateRandom(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	struct sc_pkcs11_session *session;
 	struct sc_pkcs11_slot *slot;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
-	if (rv == CKR_OK) {
-		slot = session->slot;
-		if (slot->card->framework->get_random == NULL)
-			rv = CKR_RANDOM_NO_RNG;
-		else
-			rv = slot->card->framework->get_random(slot->card, RandomData, ulRandomLen);
-	}
+	slot = session->slot;
+	if (slot->card->framework->get_random == NULL)
+		rv = CKR_RANDOM_NO_RNG;
+	else
+		rv = slot->card->framework->get_random(slot->card, RandomData, ulRandomLen);
 
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -1068,12 +1059,12 @@ CK_RV C_VerifyInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (pMechanism == NULL_PTR)
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
 
-	rv = get_object_from_session(hSession, hKey, &session, &object);
+	rv = get_object_from_session(session, hKey, &object);
 	if (rv != CKR_OK) {
 		if (rv == CKR_OBJECT_HANDLE_INVALID)
 			rv = CKR_KEY_HANDLE_INVALID;
@@ -1095,7 +1086,7 @@ CK_RV C_VerifyInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	rv = sc_pkcs11_verif_init(session, pMechanism, object, key_type);
 
 out:	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_VerifyInit() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 #endif
 }
@@ -1112,20 +1103,16 @@ CK_RV C_Verify(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
-	if (rv != CKR_OK)
-		goto out;
-
 	rv = sc_pkcs11_verif_update(session, pData, ulDataLen);
 	if (rv == CKR_OK)
 		rv = sc_pkcs11_verif_final(session, pSignature, ulSignatureLen);
 
-out:	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_Verify() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_Verify() = %s", lookup_enum ( RV_T, rv ));
+	sc_pkcs11_unlock_session(session);
 	return rv;
 #endif
 }
@@ -1140,16 +1127,14 @@ CK_RV C_VerifyUpdate(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
-	if (rv == CKR_OK)
-		rv = sc_pkcs11_verif_update(session, pPart, ulPartLen);
+	rv = sc_pkcs11_verif_update(session, pPart, ulPartLen);
 
 	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_VerifyUpdate() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 #endif
 }
@@ -1164,16 +1149,14 @@ CK_RV C_VerifyFinal(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
-	if (rv == CKR_OK)
-		rv = sc_pkcs11_verif_final(session, pSignature, ulSignatureLen);
+	rv = sc_pkcs11_verif_final(session, pSignature, ulSignatureLen);
 
 	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_VerifyFinal() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 #endif
 }
@@ -34,6 +34,65 @@ CK_RV get_session(CK_SESSION_HANDLE hSession, struct sc_pkcs11_session **session
 	return CKR_OK;
 }
 
+/* Drop a reference taken by sc_pkcs11_lock_session() */
+static void release_session(struct sc_pkcs11_session *session)
+{
+	struct sc_pkcs11_slot *slot = session->slot;
+
+	/* Slots live until C_Finalize, the session until its last user is done */
+	if (sc_pkcs11_lock() != CKR_OK)
+		return;
+	if (slot->lock)
+		slot->lock->users--;
+	if (--session->refs == 0 && session->closed)
+		free(session);
+	sc_pkcs11_unlock();
+}
+
+/* Look up a session and take the lock of its slot. The global lock
+ * is only held for the lookup, so that sessions on other readers
+ * are not held up while the card works. */
+CK_RV sc_pkcs11_lock_session(CK_SESSION_HANDLE hSession, struct sc_pkcs11_session **session)
+{
+	struct sc_pkcs11_session *sess;
+	CK_RV rv;
+
+	rv = sc_pkcs11_lock();
+	if (rv != CKR_OK)
+		return rv;
+
+	rv = get_session(hSession, &sess);
+	if (rv == CKR_OK) {
+		sess->refs++;
+		if (sess->slot->lock)
+			sess->slot->lock->users++;
+	}
+	sc_pkcs11_unlock();
+	if (rv != CKR_OK)
+		return rv;
+
+	rv = sc_pkcs11_lock_slot(sess->slot);
+	if (rv != CKR_OK) {
+		release_session(sess);
+		return rv;
+	}
+
+	/* The session may have been closed while we were waiting */
+	if (sess->closed) {
+		sc_pkcs11_unlock_session(sess);
+		return CKR_SESSION_HANDLE_INVALID;
+	}
+
+	*session = sess;
+	return CKR_OK;
+}
+
+void sc_pkcs11_unlock_session(struct sc_pkcs11_session *session)
+{
+	sc_pkcs11_unlock_slot(session->slot);
+	release_session(session);
+}
+
 CK_RV C_OpenSession(CK_SLOT_ID slotID,	/* the slot's ID */
 		    CK_FLAGS flags,	/* defined in CK_SESSION_INFO */
 		    CK_VOID_PTR pApplication,	/* pointer passed to callback */
@@ -89,7 +148,7 @@ out:
 }
 
 /* Internal version of C_CloseSession that gets called with
- * the global lock held */
+ * the global lock held, and the slot lock if it has to log out */
 static CK_RV sc_pkcs11_close_session(CK_SESSION_HANDLE hSession)
 {
 	struct sc_pkcs11_slot *slot;
@@ -112,12 +171,15 @@ static CK_RV sc_pkcs11_close_session(CK_SESSION_HANDLE hSession)
 
 	if (list_delete(&sessions, session) != 0)
 		sc_debug(context, SC_LOG_DEBUG_NORMAL, "Could not delete session from list!");
-	free(session);
+	/* Calls still waiting for the slot free the session when they see it closed */
+	session->closed = 1;
+	if (session->refs == 0)
+		free(session);
 	return CKR_OK;
 }
 
 /* Internal version of C_CloseAllSessions that gets called with
- * the global lock held */
+ * the global lock and the slot lock held */
 CK_RV sc_pkcs11_close_all_sessions(CK_SLOT_ID slotID)
 {
 	CK_RV rv = CKR_OK;
@@ -136,6 +198,9 @@ CK_RV sc_pkcs11_close_all_sessions(CK_SLOT_ID slotID)
 CK_RV C_CloseSession(CK_SESSION_HANDLE hSession)
 {				/* the session's handle */
 	CK_RV rv;
+	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_slot *slot;
+	int last;
 
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
@@ -143,9 +208,25 @@ CK_RV C_CloseSession(CK_SESSION_HANDLE hSession)
 
 	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_CloseSession(0x%lx)\n", hSession);
 
-	rv = sc_pkcs11_close_session(hSession);
+	rv = get_session(hSession, &session);
+	if (rv == CKR_OK) {
+		/* Closing the last session may log out, which needs the
+		 * card; the session may be gone once we have it */
+		slot = session->slot;
+		last = slot->nsessions == 1;
+		if (last) {
+			rv = sc_pkcs11_lock_slot_global(slot);
+			if (rv != CKR_OK)
+				goto out;
+			rv = get_session(hSession, &session);
+		}
+		if (rv == CKR_OK)
+			rv = sc_pkcs11_close_session(hSession);
+		if (last)
+			sc_pkcs11_unlock_slot_global(slot);
+	}
 
-	sc_pkcs11_unlock();
+      out:sc_pkcs11_unlock();
 	return rv;
 }
 
@@ -164,7 +245,11 @@ CK_RV C_CloseAllSessions(CK_SLOT_ID slotID)
 	if (rv != CKR_OK)
 		goto out;
 
+	rv = sc_pkcs11_lock_slot_global(slot);
+	if (rv != CKR_OK)
+		goto out;
 	rv = sc_pkcs11_close_all_sessions(slotID);
+	sc_pkcs11_unlock_slot_global(slot);
 
       out:sc_pkcs11_unlock();
 	return rv;
@@ -197,6 +282,10 @@ CK_RV C_GetSessionInfo(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	pInfo->flags = session->flags;
 	pInfo->ulDeviceError = 0;
 
+	/* login_user is changed with the slot lock held, which would have
+	 * this wait for the card; a stale value is only the state from just
+	 * before a concurrent C_Login or C_Logout, which the caller cannot
+	 * order against this call anyway */
 	slot = session->slot;
 	if (slot->login_user == CKU_SO) {
 		pInfo->state = CKS_RW_SO_FUNCTIONS;
@@ -242,20 +331,13 @@ CK_RV C_Login(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (pPin == NULL_PTR && ulPinLen > 0)
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
+	if (userType != CKU_USER && userType != CKU_SO && userType != CKU_CONTEXT_SPECIFIC)
+		return CKR_USER_TYPE_INVALID;
+
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	if (userType != CKU_USER && userType != CKU_SO && userType != CKU_CONTEXT_SPECIFIC) {
-		rv = CKR_USER_TYPE_INVALID;
-		goto out;
-	}
-	session = list_seek(&sessions, &hSession);
-	if (!session) {
-		rv = CKR_SESSION_HANDLE_INVALID;
-		goto out;
-	}
-
 	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_Login(0x%lx, %d)", hSession, userType);
 
 	slot = session->slot;
@@ -286,7 +368,7 @@ CK_RV C_Login(CK_SESSION_HANDLE hSession,	/* the session's handle */
 			slot->login_user = userType;
 	}
 
-      out:sc_pkcs11_unlock();
+      out:sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -296,16 +378,10 @@ CK_RV C_Logout(CK_SESSION_HANDLE hSession)
 	struct sc_pkcs11_session *session;
 	struct sc_pkcs11_slot *slot;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	session = list_seek(&sessions, &hSession);
-	if (!session) {
-		rv = CKR_SESSION_HANDLE_INVALID;
-		goto out;
-	}
-
 	sc_debug(context, SC_LOG_DEBUG_NORMAL, "C_Logout(0x%lx)", hSession);
 
 	slot = session->slot;
@@ -316,7 +392,7 @@ CK_RV C_Logout(CK_SESSION_HANDLE hSession)
 	} else
 		rv = CKR_USER_NOT_LOGGED_IN;
 
-      out:sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -329,16 +405,10 @@ CK_RV C_InitPIN(CK_SESSION_HANDLE hSession, CK_CHAR_PTR pPin, CK_ULONG ulPinLen)
 	if (pPin == NULL_PTR && ulPinLen > 0)
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	session = list_seek(&sessions, &hSession);
-	if (!session) {
-		rv = CKR_SESSION_HANDLE_INVALID;
-		goto out;
-	}
-
 	if (!(session->flags & CKF_RW_SESSION)) {
 		rv = CKR_SESSION_READ_ONLY;
 		goto out;
@@ -353,7 +423,7 @@ CK_RV C_InitPIN(CK_SESSION_HANDLE hSession, CK_CHAR_PTR pPin, CK_ULONG ulPinLen)
 		rv = slot->card->framework->init_pin(slot->card, slot, pPin, ulPinLen);
 	}
 
-      out:sc_pkcs11_unlock();
+      out:sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -368,16 +438,10 @@ CK_RV C_SetPIN(CK_SESSION_HANDLE hSession,
 	    || (pNewPin == NULL_PTR && ulNewLen > 0))
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	session = list_seek(&sessions, &hSession);
-	if (!session) {
-		rv = CKR_SESSION_HANDLE_INVALID;
-		goto out;
-	}
-
 	slot = session->slot;
 	sc_debug(context, SC_LOG_DEBUG_NORMAL, "Changing PIN (session 0x%lx; login user %d)\n", hSession,
 		 slot->login_user);
@@ -391,6 +455,6 @@ CK_RV C_SetPIN(CK_SESSION_HANDLE hSession,
 					       slot->login_user, pOldPin, ulOldLen, pNewPin,
 					       ulNewLen);
 
-      out:sc_pkcs11_unlock();
+      out:sc_pkcs11_unlock_session(session);
 	return rv;
 }
@@ -120,6 +120,10 @@ struct sc_pkcs11_object {
 	CK_OBJECT_HANDLE handle;
 	int flags;
 	struct sc_pkcs11_object_ops *ops;
+#ifdef ENABLE_OPENSSL
+	/* public key parsed for verification, freed with the object */
+	void *pubkey;
+#endif
 };
 
 #define SC_PKCS11_OBJECT_SEEN	0x0001
@@ -195,6 +199,48 @@ struct sc_pkcs11_card {
 	unsigned int nmechanisms;
 };
 
+/* Serializes access to the card in a reader. All virtual slots of a
+ * reader share one, so operations on different readers can run in
+ * parallel while the global lock is only held for bookkeeping. */
+struct sc_pkcs11_slot_lock {
+	void *mutex;
+	unsigned int refs; /* Number of slots sharing this lock */
+	unsigned int users; /* Callers using or waiting for the card; protected by the global lock */
+};
+
+/* Hash index over the attributes C_FindObjectsInit is usually asked
+ * for. Objects are appended to slot->objects, so the first nindexed
+ * entries of that list are indexed and the rest are picked up on the
+ * next search. Only hashes are kept; matches are confirmed with
+ * cmp_attribute. */
+#define SC_PKCS11_INDEX_KEYS	4
+
+struct sc_pkcs11_index_record;
+
+struct sc_pkcs11_index_node {
+	struct sc_pkcs11_index_record *record; /* NULL if the key is not set */
+	CK_ATTRIBUTE_TYPE type;
+	unsigned long hash;
+	struct sc_pkcs11_index_node *next; /* Next node in the bucket */
+};
+
+struct sc_pkcs11_index_record {
+	struct sc_pkcs11_object *object;
+	int private_obj; /* CKA_PRIVATE value, -1 if unknown */
+	int unindexed; /* Keys could not be read, always a candidate */
+	struct sc_pkcs11_index_node keys[SC_PKCS11_INDEX_KEYS];
+	struct sc_pkcs11_index_record *next;
+};
+
+struct sc_pkcs11_object_index {
+	struct sc_pkcs11_index_node **buckets;
+	unsigned int nbuckets; /* Power of two */
+	unsigned int nnodes;
+	unsigned int nindexed; /* Leading entries of slot->objects in the index */
+	unsigned int unindexed; /* Records with unreadable keys */
+	struct sc_pkcs11_index_record *records;
+};
+
 struct sc_pkcs11_slot {
 	CK_SLOT_ID id; /* ID of the slot */
 	int login_user; /* Currently logged in user */
@@ -207,6 +253,8 @@ struct sc_pkcs11_slot {
 	list_t objects; /* Objects in this slot */
 	unsigned int nsessions; /* Number of sessions using this slot */
 	sc_timestamp_t slot_state_expires;
+	struct sc_pkcs11_slot_lock *lock; /* Shared by all slots of the reader */
+	struct sc_pkcs11_object_index index; /* Lookup index over objects */
 };
 typedef struct sc_pkcs11_slot sc_pkcs11_slot_t;
 
@@ -298,6 +346,10 @@ struct sc_pkcs11_session {
 	CK_VOID_PTR notify_data;
 	/* Active operations - one per type */
 	struct sc_pkcs11_operation *operation[SC_PKCS11_OPERATION_MAX];
+	/* Calls in progress; the session is freed by the last of them
+	 * once it has been closed. Protected by the global lock */
+	unsigned int refs;
+	int closed;
 };
 typedef struct sc_pkcs11_session sc_pkcs11_session_t;
 
@@ -331,9 +383,19 @@ CK_RV slot_get_token(CK_SLOT_ID id, struct sc_pkcs11_slot **);
 CK_RV slot_token_removed(CK_SLOT_ID id);
 CK_RV slot_allocate(struct sc_pkcs11_slot **, struct sc_pkcs11_card *);
 CK_RV slot_find_changed(CK_SLOT_ID_PTR idp, int mask);
+CK_RV slot_add_object(struct sc_pkcs11_slot *, struct sc_pkcs11_object *);
+CK_RV slot_delete_object(struct sc_pkcs11_slot *, struct sc_pkcs11_object *);
+void slot_index_clear(struct sc_pkcs11_slot *);
+CK_RV slot_index_update(struct sc_pkcs11_session *);
+CK_RV slot_index_object(struct sc_pkcs11_session *, struct sc_pkcs11_object *);
+int slot_index_key(CK_ATTRIBUTE_TYPE);
+struct sc_pkcs11_index_record *slot_index_find(struct sc_pkcs11_slot *,
+		CK_ATTRIBUTE_PTR, struct sc_pkcs11_index_node **);
 
 /* Session manipulation */
 CK_RV get_session(CK_SESSION_HANDLE hSession, struct sc_pkcs11_session ** session);
+CK_RV sc_pkcs11_lock_session(CK_SESSION_HANDLE hSession, struct sc_pkcs11_session ** session);
+void sc_pkcs11_unlock_session(struct sc_pkcs11_session *session);
 CK_RV session_start_operation(struct sc_pkcs11_session *,
 			int, sc_pkcs11_mechanism_type_t *,
 			struct sc_pkcs11_operation **);
@@ -404,6 +466,15 @@ CK_RV sc_pkcs11_verify_data(const unsigned char *pubkey, int pubkey_len,
 	CK_MECHANISM_TYPE mech, sc_pkcs11_operation_t *md,
 	unsigned char *inp, int inp_len,
 	unsigned char *signat, int signat_len);
+CK_RV sc_pkcs11_parse_pubkey(CK_KEY_TYPE key_type,
+	const unsigned char *value, int value_len,
+	const unsigned char *params, int params_len,
+	void **pubkey);
+void sc_pkcs11_free_pubkey(void *pubkey);
+CK_RV sc_pkcs11_verify_pkey(void *pubkey, CK_MECHANISM_TYPE mech,
+	sc_pkcs11_operation_t *md,
+	unsigned char *inp, int inp_len,
+	unsigned char *signat, int signat_len);
 #endif
 
 /* Load configuration defaults */
@@ -414,6 +485,12 @@ CK_RV sc_pkcs11_init_lock(CK_C_INITIALIZE_ARGS_PTR);
 CK_RV sc_pkcs11_lock(void);
 void sc_pkcs11_unlock(void);
 void sc_pkcs11_free_lock(void);
+struct sc_pkcs11_slot_lock *sc_pkcs11_new_slot_lock(void);
+void sc_pkcs11_release_slot_lock(struct sc_pkcs11_slot_lock *);
+CK_RV sc_pkcs11_lock_slot(struct sc_pkcs11_slot *);
+void sc_pkcs11_unlock_slot(struct sc_pkcs11_slot *);
+CK_RV sc_pkcs11_lock_slot_global(struct sc_pkcs11_slot *);
+void sc_pkcs11_unlock_slot_global(struct sc_pkcs11_slot *);
 
 #ifdef __cplusplus
 }
@@ -75,7 +75,7 @@ static int object_list_seeker(const void *el, const void *key)
 								
 CK_RV create_slot(sc_reader_t *reader)
 {
-	struct sc_pkcs11_slot *slot;
+	struct sc_pkcs11_slot *slot, *reader_slot = NULL;
 
 	if (list_size(&virtual_slots) >= sc_pkcs11_conf.max_virtual_slots)
 		return CKR_FUNCTION_FAILED;
@@ -84,6 +84,20 @@ CK_RV create_slot(sc_reader_t *reader)
 	if (!slot)
 		return CKR_HOST_MEMORY;
 
+	/* All slots of a reader share the card, and so the lock */
+	if (reader != NULL)
+		reader_slot = reader_get_slot(reader);
+	if (reader_slot != NULL) {
+		slot->lock = reader_slot->lock;
+		slot->lock->refs++;
+	} else if (reader != NULL) {
+		slot->lock = sc_pkcs11_new_slot_lock();
+		if (!slot->lock) {
+			free(slot);
+			return CKR_HOST_MEMORY;
+		}
+	}
+
 	list_append(&virtual_slots, slot);
 	slot->login_user = -1;
 	slot->id = (CK_SLOT_ID) list_locate(&virtual_slots, slot);
@@ -136,7 +150,9 @@ CK_RV initialize_reader(sc_reader_t *reader)
 }
 
 
-CK_RV card_removed(sc_reader_t * reader)
+/* Internal version of card_removed that gets called with the slot
+ * lock of the reader held */
+static CK_RV __card_removed(sc_reader_t * reader)
 {
 	unsigned int i;
 	struct sc_pkcs11_card *card = NULL;
@@ -176,8 +192,26 @@ CK_RV card_removed(sc_reader_t * reader)
 	return CKR_OK;
 }
 
+CK_RV card_removed(sc_reader_t * reader)
+{
+	struct sc_pkcs11_slot *slot = reader_get_slot(reader);
+	CK_RV rv;
 
-CK_RV card_detect(sc_reader_t *reader)
+	if (slot == NULL)
+		return CKR_OK;
+
+	rv = sc_pkcs11_lock_slot(slot);
+	if (rv != CKR_OK)
+		return rv;
+	rv = __card_removed(reader);
+	sc_pkcs11_unlock_slot(slot);
+	return rv;
+}
+
+
+/* Internal version of card_detect that gets called with the slot
+ * lock of the reader held */
+static CK_RV __card_detect(sc_reader_t *reader)
 {
 	struct sc_pkcs11_card *p11card = NULL;
 	int rc, rv;
@@ -194,7 +228,7 @@ CK_RV card_detect(sc_reader_t *reader)
 	}
 	if (rc == 0) {
 		sc_debug(context, SC_LOG_DEBUG_NORMAL, "%s: card absent\n", reader->name);
-		card_removed(reader);	/* Release all resources */
+		__card_removed(reader);	/* Release all resources */
 		return CKR_TOKEN_NOT_PRESENT;
 	}
 
@@ -206,7 +240,7 @@ CK_RV card_detect(sc_reader_t *reader)
 		 * So better be fussy. 
 		if (!retry--)
 			return CKR_TOKEN_NOT_PRESENT; */
-		card_removed(reader);
+		__card_removed(reader);
 		goto again;
 	}
 
@@ -262,14 +296,37 @@ CK_RV card_detect(sc_reader_t *reader)
 	return CKR_OK;
 }
 
+CK_RV card_detect(sc_reader_t *reader)
+{
+	struct sc_pkcs11_slot *slot = reader_get_slot(reader);
+	CK_RV rv;
+
+	if (slot == NULL)
+		return __card_detect(reader);
+
+	rv = sc_pkcs11_lock_slot(slot);
+	if (rv != CKR_OK)
+		return rv;
+	rv = __card_detect(reader);
+	sc_pkcs11_unlock_slot(slot);
+	return rv;
+}
+
 CK_RV card_detect_all(void) {
 	 unsigned int i;
 
 	 /* Detect cards in all initialized readers */
 	 for (i=0; i< sc_ctx_get_reader_count(context); i++) {
 		 sc_reader_t *reader = sc_ctx_get_reader(context, i);
-		 if (!reader_get_slot(reader))
+		 struct sc_pkcs11_slot *slot = reader_get_slot(reader);
+		 if (!slot) {
 			 initialize_reader(reader);
+		 } else if (slot->lock && slot->lock->users) {
+			 /* The card is in use by a session, so it is present;
+			  * don't hold up everybody else waiting for it */
+			 sc_debug(context, SC_LOG_DEBUG_NORMAL, "%s: busy, skipping detection", reader->name);
+			 continue;
+		 }
 		 card_detect(sc_ctx_get_reader(context, i));
 	 }
 	 return CKR_OK;			
@@ -319,6 +376,9 @@ CK_RV slot_get_token(CK_SLOT_ID id, struct sc_pkcs11_slot ** slot)
 	if (!((*slot)->slot_info.flags & CKF_TOKEN_PRESENT)) {
 		if ((*slot)->reader == NULL)	
 			return CKR_TOKEN_NOT_PRESENT;
+		/* Don't wait for the card with the global lock held */
+		if ((*slot)->lock && (*slot)->lock->users)
+			return CKR_TOKEN_NOT_PRESENT;
 		rv = card_detect((*slot)->reader);
 		if (rv != CKR_OK)
 			return rv;
@@ -347,6 +407,7 @@ CK_RV slot_token_removed(CK_SLOT_ID id)
 	/* Terminate active sessions */
 	sc_pkcs11_close_all_sessions(id);
 
+	slot_index_clear(slot);
 	while ((object = list_fetch(&slot->objects))) {
 		if (object->ops->release)
 			object->ops->release(object);
@@ -395,3 +456,280 @@ CK_RV slot_find_changed(CK_SLOT_ID_PTR idp, int mask)
 	}
 	SC_FUNC_RETURN(context, SC_LOG_DEBUG_VERBOSE, CKR_NO_EVENT);
 }
+
+/* Attributes kept in the object index, most selective first */
+static const CK_ATTRIBUTE_TYPE index_keys[SC_PKCS11_INDEX_KEYS] = {
+	CKA_ID, CKA_LABEL, CKA_KEY_TYPE, CKA_CLASS
+};
+
+#define SC_PKCS11_INDEX_MIN_BUCKETS	16
+
+/* Returns the position of an attribute type in index_keys, or -1 */
+int slot_index_key(CK_ATTRIBUTE_TYPE type)
+{
+	int i;
+
+	for (i = 0; i < SC_PKCS11_INDEX_KEYS; i++)
+		if (index_keys[i] == type)
+			return i;
+	return -1;
+}
+
+/* FNV-1a over type, length and value */
+static unsigned long index_hash(CK_ATTRIBUTE_TYPE type, const void *value, CK_ULONG len)
+{
+	const unsigned char *p = (const unsigned char *)value;
+	unsigned long hash = 2166136261UL;
+	CK_ULONG i, n;
+
+	for (i = 0; i < sizeof(type); i++, type >>= 8)
+		hash = ((hash ^ (type & 0xFF)) * 16777619UL) & 0xFFFFFFFFUL;
+	for (i = 0, n = len; i < sizeof(n); i++, n >>= 8)
+		hash = ((hash ^ (n & 0xFF)) * 16777619UL) & 0xFFFFFFFFUL;
+	for (i = 0; p != NULL && i < len; i++)
+		hash = ((hash ^ p[i]) * 16777619UL) & 0xFFFFFFFFUL;
+	return hash;
+}
+
+static void index_unlink(struct sc_pkcs11_object_index *index,
+		struct sc_pkcs11_index_record *rec)
+{
+	struct sc_pkcs11_index_node **np, *node;
+	int i;
+
+	for (i = 0; i < SC_PKCS11_INDEX_KEYS; i++) {
+		node = &rec->keys[i];
+		if (node->record == NULL)
+			continue;
+		np = &index->buckets[node->hash & (index->nbuckets - 1)];
+		while (*np != NULL && *np != node)
+			np = &(*np)->next;
+		if (*np != NULL)
+			*np = node->next;
+		node->record = NULL;
+		node->next = NULL;
+		index->nnodes--;
+	}
+	if (rec->unindexed) {
+		rec->unindexed = 0;
+		index->unindexed--;
+	}
+}
+
+static CK_RV index_grow(struct sc_pkcs11_object_index *index)
+{
+	struct sc_pkcs11_index_node **buckets, *node, *next;
+	unsigned int i, n;
+
+	n = index->nbuckets ? 2 * index->nbuckets : SC_PKCS11_INDEX_MIN_BUCKETS;
+	buckets = (struct sc_pkcs11_index_node **)calloc(n, sizeof(*buckets));
+	if (buckets == NULL)
+		return CKR_HOST_MEMORY;
+
+	for (i = 0; i < index->nbuckets; i++) {
+		for (node = index->buckets[i]; node != NULL; node = next) {
+			next = node->next;
+			node->next = buckets[node->hash & (n - 1)];
+			buckets[node->hash & (n - 1)] = node;
+		}
+	}
+	free(index->buckets);
+	index->buckets = buckets;
+	index->nbuckets = n;
+	return CKR_OK;
+}
+
+/* Reads the index keys of an object into its record and links them */
+static CK_RV index_record(struct sc_pkcs11_session *session,
+		struct sc_pkcs11_object_index *index,
+		struct sc_pkcs11_index_record *rec)
+{
+	struct sc_pkcs11_object *object = rec->object;
+	struct sc_pkcs11_index_node *node;
+	CK_BBOOL is_private = TRUE;
+	CK_ATTRIBUTE attr;
+	u8 buf[256], *value;
+	CK_RV rv;
+	int i;
+
+	while (index->nnodes + SC_PKCS11_INDEX_KEYS > 2 * index->nbuckets) {
+		rv = index_grow(index);
+		if (rv != CKR_OK)
+			return rv;
+	}
+
+	attr.type = CKA_PRIVATE;
+	attr.pValue = &is_private;
+	attr.ulValueLen = sizeof(is_private);
+	if (object->ops->get_attribute(session, object, &attr) == CKR_OK)
+		rec->private_obj = is_private ? 1 : 0;
+	else
+		rec->private_obj = -1;
+
+	for (i = 0; i < SC_PKCS11_INDEX_KEYS; i++) {
+		attr.type = index_keys[i];
+		attr.pValue = NULL;
+		attr.ulValueLen = 0;
+		rv = object->ops->get_attribute(session, object, &attr);
+		if (rv == CKR_ATTRIBUTE_TYPE_INVALID)
+			continue;	/* can never match, leave it out */
+		if (rv != CKR_OK)
+			break;
+
+		value = NULL;
+		if (attr.ulValueLen > 0) {
+			value = attr.ulValueLen <= sizeof(buf) ? buf : malloc(attr.ulValueLen);
+			if (value == NULL) {
+				rv = CKR_HOST_MEMORY;
+				break;
+			}
+			attr.pValue = value;
+			rv = object->ops->get_attribute(session, object, &attr);
+		}
+		if (rv == CKR_OK) {
+			node = &rec->keys[i];
+			node->record = rec;
+			node->type = attr.type;
+			node->hash = index_hash(attr.type, value, attr.ulValueLen);
+			node->next = index->buckets[node->hash & (index->nbuckets - 1)];
+			index->buckets[node->hash & (index->nbuckets - 1)] = node;
+			index->nnodes++;
+		}
+		if (value != NULL && value != buf)
+			free(value);
+		if (rv != CKR_OK)
+			break;
+	}
+
+	if (i < SC_PKCS11_INDEX_KEYS) {
+		/* Not sure what the object would match; check it on every search */
+		sc_debug(context, SC_LOG_DEBUG_NORMAL, "Object 0x%lx: attribute 0x%lx not indexed (0x%lx)",
+			 object->handle, index_keys[i], rv);
+		index_unlink(index, rec);
+		rec->unindexed = 1;
+		index->unindexed++;
+	}
+	return CKR_OK;
+}
+
+static struct sc_pkcs11_index_record *
+index_get_record(struct sc_pkcs11_object_index *index, struct sc_pkcs11_object *object,
+		struct sc_pkcs11_index_record ***prev)
+{
+	struct sc_pkcs11_index_record **rp;
+
+	for (rp = &index->records; *rp != NULL; rp = &(*rp)->next)
+		if ((*rp)->object == object)
+			break;
+	if (prev != NULL)
+		*prev = rp;
+	return *rp;
+}
+
+CK_RV slot_add_object(struct sc_pkcs11_slot *slot, struct sc_pkcs11_object *object)
+{
+	/* Indexed by slot_index_update() on the next search */
+	if (list_append(&slot->objects, object) < 0)
+		return CKR_HOST_MEMORY;
+	return CKR_OK;
+}
+
+CK_RV slot_delete_object(struct sc_pkcs11_slot *slot, struct sc_pkcs11_object *object)
+{
+	struct sc_pkcs11_index_record *rec, **prev;
+	int pos;
+
+	pos = list_locate(&slot->objects, object);
+	if (pos < 0)
+		return CKR_OBJECT_HANDLE_INVALID;
+
+	if ((unsigned int)pos < slot->index.nindexed) {
+		rec = index_get_record(&slot->index, object, &prev);
+		if (rec != NULL) {
+			index_unlink(&slot->index, rec);
+			*prev = rec->next;
+			free(rec);
+		}
+		slot->index.nindexed--;
+	}
+	list_delete_at(&slot->objects, pos);
+	return CKR_OK;
+}
+
+void slot_index_clear(struct sc_pkcs11_slot *slot)
+{
+	struct sc_pkcs11_index_record *rec;
+
+	while ((rec = slot->index.records) != NULL) {
+		slot->index.records = rec->next;
+		free(rec);
+	}
+	free(slot->index.buckets);
+	memset(&slot->index, 0, sizeof(slot->index));
+}
+
+/* Indexes the objects added since the last search */
+CK_RV slot_index_update(struct sc_pkcs11_session *session)
+{
+	struct sc_pkcs11_slot *slot = session->slot;
+	struct sc_pkcs11_object_index *index = &slot->index;
+	struct sc_pkcs11_index_record *rec;
+	CK_RV rv;
+
+	while (index->nindexed < list_size(&slot->objects)) {
+		rec = (struct sc_pkcs11_index_record *)calloc(1, sizeof(*rec));
+		if (rec == NULL)
+			return CKR_HOST_MEMORY;
+		rec->object = (struct sc_pkcs11_object *)list_get_at(&slot->objects, index->nindexed);
+		rv = index_record(session, index, rec);
+		if (rv != CKR_OK) {
+			free(rec);
+			return rv;
+		}
+		rec->next = index->records;
+		index->records = rec;
+		index->nindexed++;
+	}
+	return CKR_OK;
+}
+
+/* Re-reads the keys of an object after its attributes changed */
+CK_RV slot_index_object(struct sc_pkcs11_session *session, struct sc_pkcs11_object *object)
+{
+	struct sc_pkcs11_object_index *index = &session->slot->index;
+	struct sc_pkcs11_index_record *rec;
+	CK_RV rv;
+
+	rec = index_get_record(index, object, NULL);
+	if (rec == NULL)
+		return CKR_OK;	/* not indexed yet */
+	index_unlink(index, rec);
+	rv = index_record(session, index, rec);
+	if (rv != CKR_OK) {
+		rec->unindexed = 1;
+		index->unindexed++;
+	}
+	return rv;
+}
+
+/* Iterates over the indexed objects that may match attr. *pos must be
+ * NULL on the first call; candidates still need cmp_attribute. */
+struct sc_pkcs11_index_record *
+slot_index_find(struct sc_pkcs11_slot *slot, CK_ATTRIBUTE_PTR attr,
+		struct sc_pkcs11_index_node **pos)
+{
+	struct sc_pkcs11_object_index *index = &slot->index;
+	struct sc_pkcs11_index_node *node;
+	unsigned long hash;
+
+	if (index->nbuckets == 0)
+		return NULL;
+
+	hash = index_hash(attr->type, attr->pValue, attr->ulValueLen);
+	node = *pos ? (*pos)->next : index->buckets[hash & (index->nbuckets - 1)];
+	for (; node != NULL; node = node->next)
+		if (node->hash == hash && node->type == attr->type)
+			break;
+	*pos = node;
+	return node ? node->record : NULL;
+}
@@ -352,6 +352,8 @@ extern int	sc_pkcs15init_delete_by_path(struct sc_profile *,
 				struct sc_pkcs15_card *, const struct sc_path *);
 extern int	sc_pkcs15init_update_any_df(struct sc_pkcs15_card *, struct sc_profile *, 
 			struct sc_pkcs15_df *, int);
+extern int	sc_pkcs15init_begin_batch(struct sc_profile *);
+extern int	sc_pkcs15init_end_batch(struct sc_pkcs15_card *, struct sc_profile *);
 
 /* Erasing the card structure via rm -rf */
 extern int	sc_pkcs15init_erase_card_recursively(struct sc_pkcs15_card *,
@@ -98,6 +98,11 @@ static int	sc_pkcs15init_update_tokeninfo(struct sc_pkcs15_card *,
 			struct sc_profile *profile);
 static int	sc_pkcs15init_update_odf(struct sc_pkcs15_card *,
 			struct sc_profile *profile);
+static int	sc_pkcs15init_flush_batch(struct sc_pkcs15_card *,
+			struct sc_profile *profile);
+static void	df_image_forget(struct sc_profile *, const struct sc_path *);
+static int	sc_pkcs15init_update_df_file(struct sc_profile *, struct sc_pkcs15_card *,
+			struct sc_file *, unsigned char *, size_t);
 static int	sc_pkcs15init_map_usage(unsigned long, int);
 static int	do_select_parent(struct sc_profile *, struct sc_pkcs15_card *,
 			struct sc_file *, struct sc_file **);
@@ -386,6 +391,12 @@ sc_pkcs15init_unbind(struct sc_profile *profile)
 	int r;
 	struct sc_context *ctx = profile->card->ctx;
 
+	if (profile->batch && profile->p15_data != NULL) {
+		profile->batch = 0;
+		r = sc_pkcs15init_flush_batch(profile->p15_data, profile);
+		if (r < 0)
+			sc_log(ctx, "Failed to update xDFs: %s", sc_strerror(r));
+	}
 	if (profile->dirty != 0 && profile->p15_data != NULL && profile->pkcs15.do_last_update) {
 		r = sc_pkcs15init_update_tokeninfo(profile->p15_data, profile);
 		if (r < 0)
@@ -439,6 +450,9 @@ sc_pkcs15init_set_p15card(struct sc_profile *profile,
 			sc_file_free(file);
 	}
 
+	/* The token is about to change, its snapshot would go stale */
+	sc_pkcs15_drop_snapshot(p15card);
+
 	profile->p15_data = p15card;
 	sc_log(ctx, "sc_pkcs15init_set_p15card() returns");
 }
@@ -472,6 +486,7 @@ sc_pkcs15init_erase_card(struct sc_pkcs15_card *p15card, struct sc_profile *prof
 
 	if (profile->ops->erase_card == NULL)
 		LOG_FUNC_RETURN(ctx, SC_ERROR_NOT_SUPPORTED);
+	df_image_forget(profile, NULL);
 
 	rv = profile->ops->erase_card(profile, p15card);
 
@@ -486,6 +501,8 @@ sc_pkcs15init_erase_card_recursively(struct sc_pkcs15_card *p15card,
 	struct sc_file	*df = profile->df_info->file, *dir;
 	int		r;
 
+	df_image_forget(profile, NULL);
+
 	/* Delete EF(DIR). This may not be very nice
 	 * against other applications that use this file, but
 	 * extremely useful for testing :)
@@ -526,6 +543,7 @@ sc_pkcs15init_delete_by_path(struct sc_profile *profile,
 
 	LOG_FUNC_CALLED(ctx);
 	sc_log(ctx, "trying to delete '%s'", sc_print_path(file_path));
+	df_image_forget(profile, file_path);
 
 	/* For some cards, to delete file should be satisfied the 'DELETE' ACL of the file itself,
 	 * for the others the 'DELETE' ACL of parent.
@@ -2465,6 +2483,144 @@ sc_pkcs15init_update_tokeninfo(struct sc_pkcs15_card *p15card,
 	return r;
 }
 
+/*
+ * Images of the directory files as last written, see struct df_image.
+ */
+static struct df_image *
+df_image_find(struct sc_profile *profile, const struct sc_path *path, int create)
+{
+	struct df_image *di;
+
+	for (di = profile->df_images; di != NULL; di = di->next)
+		if (sc_compare_path(&di->path, path))
+			return di;
+	if (!create)
+		return NULL;
+
+	di = calloc(1, sizeof(*di));
+	if (di == NULL)
+		return NULL;
+	di->path = *path;
+	di->next = profile->df_images;
+	profile->df_images = di;
+	return di;
+}
+
+/*
+ * Forget the contents of the files at or below path, or of all files
+ * if path is NULL, e.g. because they have been deleted or rewritten.
+ */
+static void
+df_image_forget(struct sc_profile *profile, const struct sc_path *path)
+{
+	struct df_image *di;
+
+	for (di = profile->df_images; di != NULL; di = di->next) {
+		if (path != NULL && !sc_compare_path_prefix(path, &di->path))
+			continue;
+		if (di->data)
+			free(di->data);
+		di->data = NULL;
+		di->len = 0;
+	}
+}
+
+/*
+ * Write a directory file.  If its previous contents are known, only
+ * the range of bytes which changed is written.
+ */
+static int
+sc_pkcs15init_update_df_file(struct sc_profile *profile,
+		struct sc_pkcs15_card *p15card, struct sc_file *file,
+		unsigned char *buf, size_t bufsize)
+{
+	struct sc_context *ctx = p15card->card->ctx;
+	struct sc_file	*selected_file = NULL;
+	struct df_image	*di;
+	unsigned char	*copy, *tmp = NULL;
+	size_t		first, end, ii;
+	int		r, created;
+
+	LOG_FUNC_CALLED(ctx);
+	copy = malloc(bufsize ? bufsize : 1);
+	if (copy == NULL)
+		LOG_FUNC_RETURN(ctx, SC_ERROR_OUT_OF_MEMORY);
+	memcpy(copy, buf, bufsize);
+
+	di = df_image_find(profile, &file->path, 0);
+	if (di == NULL || di->data == NULL)
+		goto full;
+
+	/* The card holds zeros after the previous contents, as images
+	 * are only kept of files zapped by a full write */
+	for (first = 0; first < bufsize && first < di->len; first++)
+		if (buf[first] != di->data[first])
+			break;
+	if (bufsize > di->len) {
+		end = bufsize;
+	}
+	else {
+		for (end = di->len; end > first; end--)
+			if ((end <= bufsize ? buf[end - 1] : 0) != di->data[end - 1])
+				break;
+	}
+	sc_log(ctx, "path:%s; changed %u..%u of %u bytes", sc_print_path(&file->path),
+			(unsigned) first, (unsigned) end, (unsigned) bufsize);
+	if (first == end) {
+		free(copy);
+		LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+	}
+
+	r = sc_select_file(p15card->card, &file->path, &selected_file);
+	if (r < 0 || selected_file->size < end) {
+		if (selected_file)
+			sc_file_free(selected_file);
+		goto full;
+	}
+	sc_file_free(selected_file);
+
+	tmp = calloc(1, end - first);
+	if (tmp == NULL) {
+		free(copy);
+		LOG_FUNC_RETURN(ctx, SC_ERROR_OUT_OF_MEMORY);
+	}
+	for (ii = first; ii < end && ii < bufsize; ii++)
+		tmp[ii - first] = buf[ii];
+
+	r = sc_pkcs15init_authenticate(profile, p15card, file, SC_AC_OP_UPDATE);
+	if (r >= 0)
+		r = sc_update_binary(p15card->card, first, tmp, end - first, 0);
+	free(tmp);
+	if (r < 0) {
+		/* Contents unknown now */
+		df_image_forget(profile, &file->path);
+		free(copy);
+		LOG_FUNC_RETURN(ctx, r);
+	}
+	goto done;
+
+full:
+	/* sc_pkcs15init_update_file() zaps the rest of an existing file,
+	 * but a file it creates holds whatever the card put there */
+	created = sc_select_file(p15card->card, &file->path, NULL) == SC_ERROR_FILE_NOT_FOUND;
+	r = sc_pkcs15init_update_file(profile, p15card, file, buf, bufsize);
+	if (r < 0) {
+		free(copy);
+		LOG_FUNC_RETURN(ctx, r);
+	}
+	di = created ? NULL : df_image_find(profile, &file->path, 1);
+	if (di == NULL) {
+		free(copy);
+		LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+	}
+done:
+	if (di->data)
+		free(di->data);
+	di->data = copy;
+	di->len = bufsize;
+	LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+}
+
 static int
 sc_pkcs15init_update_odf(struct sc_pkcs15_card *p15card,
 		struct sc_profile *profile)
@@ -2475,9 +2631,14 @@ sc_pkcs15init_update_odf(struct sc_pkcs15_card *p15card,
 	int		r;
 
 	LOG_FUNC_CALLED(ctx);
+	if (profile->batch) {
+		profile->batch_odf = 1;
+		LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+	}
+
 	r = sc_pkcs15_encode_odf(ctx, p15card, &buf, &size);
 	if (r >= 0)
-		r = sc_pkcs15init_update_file(profile, p15card,
+		r = sc_pkcs15init_update_df_file(profile, p15card,
 			       p15card->file_odf, buf, size);
 	if (buf)
 		free(buf);
@@ -2485,20 +2646,21 @@ sc_pkcs15init_update_odf(struct sc_pkcs15_card *p15card,
 }
 
 /*
- * Update any PKCS15 DF file (except ODF and DIR)
+ * Write a PKCS15 DF file; *update_odf is set if the ODF has to be
+ * written as well because the length of the DF is recorded there
  */
-int
-sc_pkcs15init_update_any_df(struct sc_pkcs15_card *p15card, 
+static int
+sc_pkcs15init_write_df(struct sc_pkcs15_card *p15card,
 		struct sc_profile *profile,
 		struct sc_pkcs15_df *df,
-		int is_new)
+		int *update_odf)
 {
 	struct sc_context	*ctx = p15card->card->ctx;
 	struct sc_card	*card = p15card->card;
 	struct sc_file	*file = NULL;
 	unsigned char	*buf = NULL;
 	size_t		bufsize;
-	int		update_odf = is_new, r = 0;
+	int		r = 0;
 
 	LOG_FUNC_CALLED(ctx);
 	sc_profile_get_file_by_path(profile, &df->path, &file);
@@ -2507,7 +2669,7 @@ sc_pkcs15init_update_any_df(struct sc_pkcs15_card *p15card,
 
 	r = sc_pkcs15_encode_df(card->ctx, p15card, df, &buf, &bufsize);
 	if (r >= 0) {
-		r = sc_pkcs15init_update_file(profile, p15card, file, buf, bufsize);
+		r = sc_pkcs15init_update_df_file(profile, p15card, file, buf, bufsize);
 
 		/* For better performance and robustness, we want
 		 * to note which portion of the file actually
@@ -2521,7 +2683,7 @@ sc_pkcs15init_update_any_df(struct sc_pkcs15_card *p15card,
 		if (profile->pkcs15.encode_df_length) {
 			df->path.count = bufsize;
 			df->path.index = 0;
-			update_odf = 1;
+			*update_odf = 1;
 		}
 		free(buf);
 	}
@@ -2529,6 +2691,36 @@ sc_pkcs15init_update_any_df(struct sc_pkcs15_card *p15card,
 		sc_file_free(file);
 
 	LOG_TEST_RET(ctx, r, "Failed to encode or update xDF");
+	LOG_FUNC_RETURN(ctx, r);
+}
+
+/*
+ * Update any PKCS15 DF file (except ODF and DIR)
+ */
+int
+sc_pkcs15init_update_any_df(struct sc_pkcs15_card *p15card, 
+		struct sc_profile *profile,
+		struct sc_pkcs15_df *df,
+		int is_new)
+{
+	struct sc_context	*ctx = p15card->card->ctx;
+	int		update_odf = is_new, r = 0;
+
+	LOG_FUNC_CALLED(ctx);
+	if (profile->batch) {
+		struct df_image *di = df_image_find(profile, &df->path, 1);
+
+		if (di == NULL)
+			LOG_FUNC_RETURN(ctx, SC_ERROR_OUT_OF_MEMORY);
+		sc_log(ctx, "update of %s deferred", sc_print_path(&df->path));
+		di->pending = 1;
+		if (is_new)
+			profile->batch_odf = 1;
+		LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+	}
+
+	r = sc_pkcs15init_write_df(p15card, profile, df, &update_odf);
+	LOG_TEST_RET(ctx, r, "Failed to encode or update xDF");
 
 	/* Now update the ODF if we have to */
 	if (update_odf)
@@ -2538,6 +2730,64 @@ sc_pkcs15init_update_any_df(struct sc_pkcs15_card *p15card,
 	LOG_FUNC_RETURN(ctx, r);
 }
 
+/*
+ * Batch updates of the directory files: between begin and end,
+ * objects are added to and removed from p15card as usual, but the
+ * xDFs and the ODF are only written once, by sc_pkcs15init_end_batch().
+ * Batches may be nested.
+ */
+int
+sc_pkcs15init_begin_batch(struct sc_profile *profile)
+{
+	profile->batch++;
+	return SC_SUCCESS;
+}
+
+static int
+sc_pkcs15init_flush_batch(struct sc_pkcs15_card *p15card,
+		struct sc_profile *profile)
+{
+	struct sc_context *ctx = p15card->card->ctx;
+	struct sc_pkcs15_df *df;
+	struct df_image *di;
+	int r, rv = SC_SUCCESS;
+
+	LOG_FUNC_CALLED(ctx);
+	/* Defer the ODF until all xDFs have been written */
+	profile->batch = 0;
+	for (df = p15card->df_list; df != NULL; df = df->next) {
+		di = df_image_find(profile, &df->path, 0);
+		if (di == NULL || !di->pending)
+			continue;
+		/* A failed update stays pending */
+		r = sc_pkcs15init_write_df(p15card, profile, df, &profile->batch_odf);
+		if (r >= 0)
+			di->pending = 0;
+		else if (rv == SC_SUCCESS)
+			rv = r;
+	}
+
+	if (profile->batch_odf) {
+		r = sc_pkcs15init_update_odf(p15card, profile);
+		if (r >= 0)
+			profile->batch_odf = 0;
+		else if (rv == SC_SUCCESS)
+			rv = r;
+	}
+	LOG_FUNC_RETURN(ctx, rv);
+}
+
+int
+sc_pkcs15init_end_batch(struct sc_pkcs15_card *p15card,
+		struct sc_profile *profile)
+{
+	if (profile->batch == 0)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	if (--profile->batch)
+		return SC_SUCCESS;
+	return sc_pkcs15init_flush_batch(p15card, profile);
+}
+
 /*
  * Add an object to one of the pkcs15 directory files.
  */
@@ -2707,7 +2957,7 @@ sc_pkcs15init_change_attrib(struct sc_pkcs15_card *p15card, struct sc_profile *p
 			r = sc_profile_get_file_by_path(profile, &df->path, &file);
 			LOG_TEST_RET(ctx, r, "Cannot instantiate file by path");
 
-			r = sc_pkcs15init_update_file(profile, p15card, file, buf, bufsize);
+			r = sc_pkcs15init_update_df_file(profile, p15card, file, buf, bufsize);
 			free(buf);
 			sc_file_free(file);
 		}
@@ -3107,7 +3357,7 @@ sc_pkcs15init_verify_secret(struct sc_profile *profile, struct sc_pkcs15_card *p
 
 found: 	
 	if (pin_obj)   {
-		r = sc_pkcs15_verify_pin(p15card, pin_obj, pinsize ? pinbuf : NULL, pinsize);
+		r = sc_pkcs15_verify_pin_once(p15card, pin_obj, pinsize ? pinbuf : NULL, pinsize);
 		LOG_TEST_RET(ctx, r, "Cannot validate pkcs15 PIN");
 	}
 
@@ -3121,6 +3371,7 @@ found:
 
 		memset(&pin_cmd, 0, sizeof(pin_cmd));
 		pin_cmd.cmd = SC_PIN_CMD_VERIFY;
+		pin_cmd.flags = SC_PIN_CMD_SKIP_VERIFIED;
 		pin_cmd.pin_type = type;
 		pin_cmd.pin_reference = reference;
 		pin_cmd.pin1.data = use_pinpad ? NULL : pinbuf;
@@ -3252,6 +3503,7 @@ sc_pkcs15init_create_file(struct sc_profile *profile, struct sc_pkcs15_card *p15
 
 	LOG_FUNC_CALLED(ctx);
 	sc_log(ctx, "create file '%s'", sc_print_path(&file->path));
+	df_image_forget(profile, &file->path);
 	/* Select parent DF and verify PINs/key as necessary */
 	r = do_select_parent(profile, p15card, file, &parent);
 	LOG_TEST_RET(ctx, r, "Cannot create file: select parent error");
@@ -3289,6 +3541,7 @@ sc_pkcs15init_update_file(struct sc_profile *profile,
 
 	LOG_FUNC_CALLED(ctx);
 	sc_log(ctx, "path:%s; datalen:%i", sc_print_path(&file->path), datalen);
+	df_image_forget(profile, &file->path);
 
 	r = sc_select_file(p15card->card, &file->path, &selected_file);
 	if (!r)   {
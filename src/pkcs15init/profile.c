@@ -444,6 +444,7 @@ sc_profile_free(struct sc_profile *profile)
 {
 	struct auth_info *ai;
 	struct pin_info *pi;
+	struct df_image *di;
 	sc_macro_t	*mi;
 	sc_template_t	*ti;
 
@@ -480,6 +481,13 @@ sc_profile_free(struct sc_profile *profile)
 		free(pi);
 	}
 
+	while ((di = profile->df_images) != NULL) {
+		profile->df_images = di->next;
+		if (di->data)
+			free(di->data);
+		free(di);
+	}
+
 	if (profile->p15_spec)
 		sc_pkcs15_card_free(profile->p15_spec);
 	memset(profile, 0, sizeof(*profile));
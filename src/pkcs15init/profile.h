@@ -78,6 +78,18 @@ typedef struct sc_template {
 	struct file_info *	file;
 } sc_template_t;
 
+/* Contents of a directory file (xDF or ODF) as last written
+ * to the card, so that later updates only write what changed.
+ */
+struct df_image {
+	struct df_image *	next;
+	sc_path_t		path;
+	unsigned char *		data;
+	size_t			len;
+	/* update deferred by sc_pkcs15init_begin_batch() */
+	int			pending;
+};
+
 #define SC_PKCS15INIT_MAX_OPTIONS 16
 struct sc_profile {
 	char *			name;
@@ -124,6 +136,11 @@ struct sc_profile {
 
 	/* PKCS15 object ID style */
 	unsigned int id_style;
+
+	struct df_image *	df_images;
+	/* xDF and ODF updates are deferred while non-zero */
+	int			batch;
+	int			batch_odf;
 };
 
 struct sc_profile *sc_profile_new(void);
@@ -23,6 +23,15 @@
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/time.h>
+#endif
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
 #ifdef ENABLE_OPENSSL
 #include <openssl/opensslv.h>
 #if OPENSSL_VERSION_NUMBER >= 0x10000000L
@@ -83,7 +92,11 @@ enum {
 	OPT_PUK,
 	OPT_NEW_PIN,
 	OPT_LOGIN_TYPE,
-	OPT_TEST_EC
+	OPT_TEST_EC,
+	OPT_BENCHMARK,
+	OPT_BENCHMARK_OPS,
+	OPT_THREADS,
+	OPT_ITERATIONS
 };
 
 static const struct option options[] = {
@@ -133,6 +146,10 @@ static const struct option options[] = {
 	{ "verbose",		0, NULL,		'v' },
 	{ "private",		0, NULL,		OPT_PRIVATE },
 	{ "test-ec",		0, NULL,		OPT_TEST_EC },
+	{ "benchmark",		0, NULL,		OPT_BENCHMARK },
+	{ "benchmark-ops",	1, NULL,		OPT_BENCHMARK_OPS },
+	{ "threads",		1, NULL,		OPT_THREADS },
+	{ "iterations",		1, NULL,		OPT_ITERATIONS },
 	{ NULL, 0, NULL, 0 }
 };
 
@@ -182,7 +199,11 @@ static const char *option_help[] = {
 	"Test Mozilla-like keypair gen and cert req, <arg>=certfile",
 	"Verbose operation. (Set OPENSC_DEBUG to enable OpenSC specific debugging)",
 	"Set the CKA_PRIVATE attribute (object is only viewable after a login)",
-	"Test EC (best used with the --login or --pin option)"
+	"Test EC (best used with the --login or --pin option)",
+	"Measure the throughput and latency of the token (use with --pin; APDUs are counted from OPENSC_APDU_TRACE)",
+	"Comma separated benchmark operations as op[:mechanism] (login, find, sign, verify, decrypt, digest; default: all)",
+	"Number of benchmark threads, spread over all slots with a token unless a slot is given (default: 1)",
+	"Number of iterations of each benchmark operation per thread (default: 10)"
 };
 
 static const char *	app_name = "pkcs11-tool"; /* for utils.c */
@@ -216,6 +237,9 @@ static char *		opt_key_type = NULL;
 static int		opt_is_private = 0;
 static int		opt_test_hotplug = 0;
 static int		opt_login_type = -1;
+static const char *	opt_benchmark_ops = NULL;
+static int		opt_threads = 1;
+static int		opt_iterations = 10;
 
 static void *module = NULL;
 static CK_FUNCTION_LIST_PTR p11 = NULL;
@@ -315,6 +339,7 @@ static CK_RV find_object_with_attributes(
 		CK_ATTRIBUTE *attrs, CK_ULONG attrsLen,
 		CK_ULONG obj_index);
 static CK_ULONG		get_private_key_length(CK_SESSION_HANDLE sess, CK_OBJECT_HANDLE prkey);
+static int		benchmark(int all_slots);
 
 /* win32 needs this in open(2) */
 #ifndef O_BINARY
@@ -341,6 +366,8 @@ int main(int argc, char * argv[])
 	int do_test = 0;
 	int do_test_kpgen_certwrite = 0;
 	int do_test_ec = 0;
+	int do_benchmark = 0;
+	int bench_all_slots;
 	int need_session = 0;
 	int opt_login = 0;
 	int do_init_token = 0;
@@ -576,6 +603,24 @@ int main(int argc, char * argv[])
 			do_test_ec = 1;
 			action_count++;
 			break;
+		case OPT_BENCHMARK:
+			need_session |= NEED_SESSION_RO;
+			do_benchmark = 1;
+			action_count++;
+			break;
+		case OPT_BENCHMARK_OPS:
+			opt_benchmark_ops = optarg;
+			break;
+		case OPT_THREADS:
+			opt_threads = atoi(optarg);
+			if (opt_threads < 1)
+				util_fatal("Invalid number of threads: %s\n", optarg);
+			break;
+		case OPT_ITERATIONS:
+			opt_iterations = atoi(optarg);
+			if (opt_iterations < 1)
+				util_fatal("Invalid number of iterations: %s\n", optarg);
+			break;
 		default:
 			util_print_usage_and_die(app_name, options, option_help);
 		}
@@ -591,7 +636,21 @@ int main(int argc, char * argv[])
 	if (module == NULL)
 		util_fatal("Failed to load pkcs11 module");
 
-	rv = p11->C_Initialize(NULL);
+#ifndef HAVE_PTHREAD
+	if (opt_threads > 1) {
+		fprintf(stderr, "No thread support, running the benchmark in a single thread\n");
+		opt_threads = 1;
+	}
+#endif
+	if (do_benchmark && opt_threads > 1) {
+		CK_C_INITIALIZE_ARGS init_args;
+
+		memset(&init_args, 0, sizeof(init_args));
+		init_args.flags = CKF_OS_LOCKING_OK;
+		rv = p11->C_Initialize(&init_args);
+	} else {
+		rv = p11->C_Initialize(NULL);
+	}
 	if (rv != CKR_OK)
 		p11_fatal("C_Initialize", rv);
 
@@ -611,6 +670,9 @@ int main(int argc, char * argv[])
 		goto end;
 	}
 
+	bench_all_slots = !opt_slot_set && !opt_slot_description
+		&& !opt_token_label && !opt_slot_index_set;
+
 	if (!opt_slot_set && (action_count > do_list_slots)) {
 		if (opt_slot_description) {
 			if (!find_slot_by_description(opt_slot_description, &opt_slot)) {
@@ -786,6 +848,9 @@ int main(int argc, char * argv[])
 	if (do_test_ec) 
 		test_ec(opt_slot, session);
 
+	if (do_benchmark)
+		err = benchmark(bench_all_slots);
+
 end:
 	if (session != CK_INVALID_HANDLE) {
 		rv = p11->C_CloseSession(session);
@@ -4106,6 +4171,520 @@ static void test_ec(CK_SLOT_ID slot, CK_SESSION_HANDLE session)
 
 
 
+/*
+ * Benchmark: every selected operation is run by opt_threads threads,
+ * opt_iterations times each, one operation at a time. Each thread has
+ * its own session; threads are spread over the slots round robin.
+ */
+#define BENCH_LOGIN	0
+#define BENCH_FIND	1
+#define BENCH_SIGN	2
+#define BENCH_VERIFY	3
+#define BENCH_DECRYPT	4
+#define BENCH_DIGEST	5
+#define BENCH_OPS	6
+
+static const char *bench_op_names[BENCH_OPS] = {
+	"login", "find", "sign", "verify", "decrypt", "digest"
+};
+
+struct bench_key {
+	CK_SLOT_ID		slot;
+	CK_SESSION_HANDLE	session;
+	CK_OBJECT_HANDLE	priv, pub;
+	unsigned char		*id;
+	CK_ULONG		id_len;
+	CK_KEY_TYPE		type;
+	CK_ULONG		bits;
+	CK_MECHANISM_TYPE	mech[BENCH_OPS];
+	unsigned char		sig[512];
+	CK_ULONG		sig_len;
+	unsigned char		cipher[512];
+	CK_ULONG		cipher_len;
+#ifdef HAVE_PTHREAD
+	/* The login state is shared by all sessions of the token */
+	pthread_mutex_t		login_lock;
+#endif
+};
+
+struct bench_thread {
+	struct bench_key	*key;
+	CK_SESSION_HANDLE	session;
+	int			op;
+	double			*lat;
+	int			done;
+	int			errors;
+	CK_RV			first_error;
+};
+
+static unsigned char bench_data[1024];
+
+static double bench_now(void)
+{
+#ifdef _WIN32
+	LARGE_INTEGER freq, count;
+
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&count);
+	return (double) count.QuadPart / freq.QuadPart;
+#else
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+#endif
+}
+
+/* Magic at the start of an APDU trace file, as written by libopensc */
+#define BENCH_TRACE_MAGIC	"OSCTRC01"
+
+/* Count the transmitted APDUs appended to the trace since the last call */
+static long bench_count_apdus(const char *path, long *offset)
+{
+	unsigned char hdr[7], len[2];
+	const long fixed = sizeof(hdr) + sizeof(len);
+	long count = 0, pos, size, n1, n2;
+	FILE *f;
+
+	f = fopen(path, "rb");
+	if (f == NULL)
+		return -1;
+	pos = *offset ? *offset : (long) strlen(BENCH_TRACE_MAGIC);
+	if (fseek(f, 0, SEEK_END) != 0 || (size = ftell(f)) < pos)
+		goto out;
+	fseek(f, pos, SEEK_SET);
+	/* type, time, command and response; stop at a partial record */
+	while (pos + fixed <= size && fread(hdr, 1, sizeof(hdr), f) == sizeof(hdr)) {
+		n1 = (hdr[5] << 8) | hdr[6];
+		if (pos + fixed + n1 > size || fseek(f, n1, SEEK_CUR) != 0
+				|| fread(len, 1, sizeof(len), f) != sizeof(len))
+			break;
+		n2 = (len[0] << 8) | len[1];
+		if (pos + fixed + n1 + n2 > size || fseek(f, n2, SEEK_CUR) != 0)
+			break;
+		pos += fixed + n1 + n2;
+		if (hdr[0] == 'T')
+			count++;
+	}
+out:
+	fclose(f);
+	*offset = pos;
+	return count;
+}
+
+static CK_RV bench_op(struct bench_thread *t)
+{
+	struct bench_key *key = t->key;
+	CK_MECHANISM mech = { key->mech[t->op], NULL, 0 };
+	unsigned char out[512];
+	CK_ULONG out_len = sizeof(out), count;
+	CK_OBJECT_CLASS cls = CKO_PRIVATE_KEY;
+	CK_ATTRIBUTE attrs[2];
+	CK_OBJECT_HANDLE obj;
+	CK_RV rv;
+
+	switch (t->op) {
+	case BENCH_LOGIN:
+		/* CKR_USER_ALREADY_LOGGED_IN is not a login */
+		return p11->C_Login(t->session, CKU_USER, (CK_UTF8CHAR *) opt_pin,
+				opt_pin ? strlen(opt_pin) : 0);
+	case BENCH_FIND:
+		attrs[0].type = CKA_CLASS;
+		attrs[0].pValue = &cls;
+		attrs[0].ulValueLen = sizeof(cls);
+		attrs[1].type = CKA_ID;
+		attrs[1].pValue = key->id;
+		attrs[1].ulValueLen = key->id_len;
+		rv = p11->C_FindObjectsInit(t->session, attrs, 2);
+		if (rv != CKR_OK)
+			return rv;
+		rv = p11->C_FindObjects(t->session, &obj, 1, &count);
+		p11->C_FindObjectsFinal(t->session);
+		if (rv == CKR_OK && count == 0)
+			rv = CKR_OBJECT_HANDLE_INVALID;
+		return rv;
+	case BENCH_SIGN:
+		rv = p11->C_SignInit(t->session, &mech, key->priv);
+		if (rv == CKR_OK)
+			rv = p11->C_Sign(t->session, bench_data, 20, out, &out_len);
+		return rv;
+	case BENCH_VERIFY:
+		rv = p11->C_VerifyInit(t->session, &mech, key->pub);
+		if (rv == CKR_OK)
+			rv = p11->C_Verify(t->session, bench_data, 20,
+					key->sig, key->sig_len);
+		return rv;
+	case BENCH_DECRYPT:
+		rv = p11->C_DecryptInit(t->session, &mech, key->priv);
+		if (rv == CKR_OK)
+			rv = p11->C_Decrypt(t->session, key->cipher,
+					key->cipher_len, out, &out_len);
+		return rv;
+	case BENCH_DIGEST:
+		rv = p11->C_DigestInit(t->session, &mech);
+		if (rv == CKR_OK)
+			rv = p11->C_Digest(t->session, bench_data,
+					sizeof(bench_data), out, &out_len);
+		return rv;
+	}
+	return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+static void *bench_thread_main(void *arg)
+{
+	struct bench_thread *t = (struct bench_thread *) arg;
+	double start, end;
+	CK_RV rv;
+	int i;
+
+	for (i = 0; i < opt_iterations; i++) {
+		/* Log out and in again without the other threads of the
+		 * token in between; only the login itself is timed */
+		if (t->op == BENCH_LOGIN) {
+#ifdef HAVE_PTHREAD
+			pthread_mutex_lock(&t->key->login_lock);
+#endif
+			p11->C_Logout(t->session);
+		}
+		start = bench_now();
+		rv = bench_op(t);
+		end = bench_now();
+#ifdef HAVE_PTHREAD
+		if (t->op == BENCH_LOGIN)
+			pthread_mutex_unlock(&t->key->login_lock);
+#endif
+		if (rv != CKR_OK) {
+			if (t->errors++ == 0)
+				t->first_error = rv;
+			continue;
+		}
+		t->lat[t->done++] = end - start;
+	}
+	return NULL;
+}
+
+static int bench_cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Parse the key type filter of --key-type, e.g. "rsa:2048" or "EC" */
+static int bench_key_matches(struct bench_key *key)
+{
+	const char *size;
+
+	if (opt_key_type == NULL)
+		return key->type == CKK_RSA || key->type == CKK_EC;
+	size = strchr(opt_key_type, ':');
+	if (!strncasecmp(opt_key_type, "rsa", 3) && key->type == CKK_RSA)
+		return size == NULL || key->bits == strtoul(size + 1, NULL, 10);
+	if (!strncasecmp(opt_key_type, "ec", 2) && key->type == CKK_EC)
+		return 1;
+	return 0;
+}
+
+static int bench_setup_key(CK_SLOT_ID slot, struct bench_key *key)
+{
+	CK_TOKEN_INFO info;
+	CK_RV rv;
+	int i, j;
+
+	memset(key, 0, sizeof(*key));
+	key->slot = slot;
+	rv = p11->C_OpenSession(slot, CKF_SERIAL_SESSION, NULL, NULL, &key->session);
+	if (rv != CKR_OK) {
+		p11_warn("C_OpenSession", rv);
+		return -1;
+	}
+
+	/* stay logged in for the whole run, the login benchmark
+	 * logs out and in again */
+	get_token_info(slot, &info);
+	if (opt_pin != NULL || (info.flags & CKF_LOGIN_REQUIRED)) {
+		if (opt_pin == NULL && !(info.flags & CKF_PROTECTED_AUTHENTICATION_PATH)) {
+			size_t len = 0;
+
+			printf("Please enter User PIN: ");
+			if (util_getpass(&opt_pin, &len, stdin) < 0)
+				util_fatal("No PIN entered, exiting!\n");
+		}
+		rv = p11->C_Login(key->session, CKU_USER, (CK_UTF8CHAR *) opt_pin,
+				opt_pin ? strlen(opt_pin) : 0);
+		if (rv != CKR_OK && rv != CKR_USER_ALREADY_LOGGED_IN)
+			p11_fatal("C_Login", rv);
+	}
+
+	for (j = 0; find_object(key->session, CKO_PRIVATE_KEY, &key->priv,
+			opt_object_id_len ? opt_object_id : NULL,
+			opt_object_id_len, j); j++) {
+		key->type = getKEY_TYPE(key->session, key->priv);
+		key->bits = key->type == CKK_RSA ?
+			get_private_key_length(key->session, key->priv) : 0;
+		if (bench_key_matches(key))
+			break;
+	}
+	if (key->priv == CK_INVALID_HANDLE || !bench_key_matches(key)) {
+		fprintf(stderr, "No matching private key in slot 0x%lx\n", slot);
+		return -1;
+	}
+	key->id = getID(key->session, key->priv, &key->id_len);
+	if (key->id != NULL)
+		find_object(key->session, CKO_PUBLIC_KEY, &key->pub,
+				key->id, key->id_len, 0);
+
+	for (i = 0; i < BENCH_OPS; i++)
+		key->mech[i] = CKM_RSA_PKCS;
+	if (opt_mechanism_used)
+		key->mech[BENCH_SIGN] = key->mech[BENCH_VERIFY] = opt_mechanism;
+	else if (key->type == CKK_EC)
+		key->mech[BENCH_SIGN] = key->mech[BENCH_VERIFY] = CKM_ECDSA;
+	key->mech[BENCH_DIGEST] = CKM_SHA_1;
+	return 0;
+}
+
+/* Prepare the signature and the ciphertext for verify and decrypt */
+static void bench_prepare_key(struct bench_key *key)
+{
+	CK_MECHANISM mech = { key->mech[BENCH_VERIFY], NULL, 0 };
+	CK_RV rv;
+
+	key->sig_len = sizeof(key->sig);
+	rv = p11->C_SignInit(key->session, &mech, key->priv);
+	if (rv == CKR_OK)
+		rv = p11->C_Sign(key->session, bench_data, 20, key->sig, &key->sig_len);
+	if (rv != CKR_OK)
+		key->sig_len = 0;
+
+#ifdef ENABLE_OPENSSL
+	if (key->type == CKK_RSA && key->mech[BENCH_DECRYPT] == CKM_RSA_PKCS) {
+		EVP_PKEY *pkey = get_public_key(key->session, key->priv);
+		int r = -1;
+
+		if (pkey != NULL && EVP_PKEY_size(pkey) <= (int) sizeof(key->cipher))
+#if OPENSSL_VERSION_NUMBER >= 0x00909000L
+			r = EVP_PKEY_encrypt_old(key->cipher, bench_data, 20, pkey);
+#else
+			r = EVP_PKEY_encrypt(key->cipher, bench_data, 20, pkey);
+#endif
+		key->cipher_len = r > 0 ? r : 0;
+		if (pkey != NULL)
+			EVP_PKEY_free(pkey);
+	}
+#endif
+}
+
+static void bench_report(int op, struct bench_key *key, struct bench_thread *threads,
+		double elapsed, long apdus)
+{
+	double *lat;
+	int i, n = 0, errors = 0;
+	CK_RV first_error = CKR_OK;
+
+	lat = calloc(opt_threads * opt_iterations, sizeof(double));
+	if (lat == NULL)
+		util_fatal("out of memory");
+	for (i = 0; i < opt_threads; i++) {
+		if (threads[i].key != key)
+			continue;
+		memcpy(lat + n, threads[i].lat, threads[i].done * sizeof(double));
+		n += threads[i].done;
+		if (threads[i].errors && first_error == CKR_OK)
+			first_error = threads[i].first_error;
+		errors += threads[i].errors;
+	}
+	qsort(lat, n, sizeof(double), bench_cmp_double);
+
+	printf("%-8s %-18s %6d %6d", bench_op_names[op],
+			op == BENCH_LOGIN || op == BENCH_FIND ? "-" :
+			p11_mechanism_to_name(key->mech[op]), n, errors);
+	if (n > 0)
+		printf(" %9.2f %8.2f %8.2f", n / elapsed,
+				lat[(n - 1) * 50 / 100] * 1000,
+				lat[(n - 1) * 99 / 100] * 1000);
+	else
+		printf(" %9s %8s %8s", "-", "-", "-");
+	if (apdus >= 0 && n + errors > 0)
+		printf(" %8.2f", (double) apdus / (n + errors));
+	if (errors)
+		printf("  (%s)", CKR2Str(first_error));
+	printf("\n");
+	free(lat);
+}
+
+static int benchmark(int all_slots)
+{
+	struct bench_key *keys;
+	struct bench_thread *threads;
+	const char *trace = getenv("OPENSC_APDU_TRACE");
+	int ops[BENCH_OPS], verify_mech = 0, nkeys = 0, i, op, err = 0;
+	long trace_offset = 0, apdus;
+	CK_RV rv;
+	double start, elapsed;
+
+	for (i = 0; i < (int) sizeof(bench_data); i++)
+		bench_data[i] = i;
+
+	keys = calloc(all_slots ? p11_num_slots : 1, sizeof(*keys));
+	threads = calloc(opt_threads, sizeof(*threads));
+	if (keys == NULL || threads == NULL)
+		util_fatal("out of memory");
+
+	if (all_slots) {
+		CK_ULONG n;
+
+		for (n = 0; n < p11_num_slots; n++) {
+			CK_SLOT_INFO info;
+
+			rv = p11->C_GetSlotInfo(p11_slots[n], &info);
+			if (rv == CKR_OK && (info.flags & CKF_TOKEN_PRESENT)
+					&& bench_setup_key(p11_slots[n], &keys[nkeys]) == 0)
+				nkeys++;
+		}
+	} else if (bench_setup_key(opt_slot, &keys[0]) == 0) {
+		nkeys = 1;
+	}
+	if (nkeys == 0) {
+		fprintf(stderr, "No key to benchmark\n");
+		return 1;
+	}
+
+	/* --benchmark-ops login,sign:SHA1-RSA-PKCS,... */
+	memset(ops, 0, sizeof(ops));
+	if (opt_benchmark_ops == NULL) {
+		for (op = 0; op < BENCH_OPS; op++)
+			ops[op] = 1;
+	} else {
+		char *list = strdup(opt_benchmark_ops), *name, *mech;
+
+		if (list == NULL)
+			util_fatal("out of memory");
+		for (name = strtok(list, ","); name; name = strtok(NULL, ",")) {
+			if ((mech = strchr(name, ':')) != NULL)
+				*mech++ = '\0';
+			for (op = 0; op < BENCH_OPS; op++)
+				if (!strcmp(name, bench_op_names[op]))
+					break;
+			if (op == BENCH_OPS)
+				util_fatal("Unknown benchmark operation \"%s\"\n", name);
+			ops[op] = 1;
+			if (mech == NULL)
+				continue;
+			for (i = 0; i < nkeys; i++)
+				keys[i].mech[op] = p11_name_to_mechanism(mech);
+			if (op == BENCH_VERIFY)
+				verify_mech = 1;
+		}
+		free(list);
+		/* verify the signatures made with the sign mechanism by default */
+		if (!verify_mech)
+			for (i = 0; i < nkeys; i++)
+				keys[i].mech[BENCH_VERIFY] = keys[i].mech[BENCH_SIGN];
+	}
+
+	printf("Benchmark: %d thread(s) x %d iteration(s) on %d slot(s)\n",
+			opt_threads, opt_iterations, nkeys);
+	for (i = 0; i < nkeys; i++) {
+		if (ops[BENCH_VERIFY] || ops[BENCH_DECRYPT])
+			bench_prepare_key(&keys[i]);
+		printf("  slot 0x%lx: %s key", keys[i].slot,
+				keys[i].type == CKK_RSA ? "RSA" : "EC");
+		if (keys[i].bits)
+			printf(" %lu bits", keys[i].bits);
+		printf("\n");
+	}
+
+#ifdef HAVE_PTHREAD
+	for (i = 0; i < nkeys; i++)
+		pthread_mutex_init(&keys[i].login_lock, NULL);
+#endif
+	for (i = 0; i < opt_threads; i++) {
+		threads[i].key = &keys[i % nkeys];
+		threads[i].lat = calloc(opt_iterations, sizeof(double));
+		if (threads[i].lat == NULL)
+			util_fatal("out of memory");
+		rv = p11->C_OpenSession(threads[i].key->slot, CKF_SERIAL_SESSION,
+				NULL, NULL, &threads[i].session);
+		if (rv != CKR_OK)
+			p11_fatal("C_OpenSession", rv);
+	}
+
+	if (trace != NULL)
+		bench_count_apdus(trace, &trace_offset);
+
+	printf("%-8s %-18s %6s %6s %9s %8s %8s %8s\n", "op", "mechanism",
+			"ok", "failed", "ops/sec", "p50 ms", "p99 ms",
+			trace ? "APDUs/op" : "");
+	for (op = 0; op < BENCH_OPS; op++) {
+		if (!ops[op])
+			continue;
+		for (i = 0; i < nkeys; i++)
+			if ((op == BENCH_VERIFY && (keys[i].pub == CK_INVALID_HANDLE
+						|| keys[i].sig_len == 0))
+					|| (op == BENCH_DECRYPT && keys[i].cipher_len == 0))
+				break;
+		if (i < nkeys) {
+			printf("%-8s skipped, no %s to work with\n", bench_op_names[op],
+					op == BENCH_VERIFY ? "public key or signature" : "ciphertext");
+			continue;
+		}
+
+		for (i = 0; i < opt_threads; i++) {
+			threads[i].op = op;
+			threads[i].done = threads[i].errors = 0;
+			threads[i].first_error = CKR_OK;
+		}
+
+		start = bench_now();
+#ifdef HAVE_PTHREAD
+		if (opt_threads > 1) {
+			pthread_t *tids = calloc(opt_threads, sizeof(pthread_t));
+
+			if (tids == NULL)
+				util_fatal("out of memory");
+			for (i = 0; i < opt_threads; i++)
+				if (pthread_create(&tids[i], NULL, bench_thread_main, &threads[i]) != 0)
+					util_fatal("Cannot create benchmark thread");
+			for (i = 0; i < opt_threads; i++)
+				pthread_join(tids[i], NULL);
+			free(tids);
+		} else
+#endif
+			bench_thread_main(&threads[0]);
+
+		elapsed = bench_now() - start;
+		apdus = trace ? bench_count_apdus(trace, &trace_offset) : -1;
+		/* one line per key; the trace can't tell the slots apart */
+		for (i = 0; i < nkeys; i++)
+			bench_report(op, &keys[i], threads, elapsed, nkeys == 1 ? apdus : -1);
+		for (i = 0; i < opt_threads; i++)
+			if (threads[i].errors)
+				err = 1;
+
+		/* a failed login leaves the token logged out */
+		if (op == BENCH_LOGIN)
+			for (i = 0; i < nkeys; i++)
+				p11->C_Login(keys[i].session, CKU_USER, (CK_UTF8CHAR *) opt_pin,
+						opt_pin ? strlen(opt_pin) : 0);
+	}
+
+	for (i = 0; i < opt_threads; i++) {
+		p11->C_CloseSession(threads[i].session);
+		free(threads[i].lat);
+	}
+	for (i = 0; i < nkeys; i++) {
+		p11->C_CloseSession(keys[i].session);
+		free(keys[i].id);
+#ifdef HAVE_PTHREAD
+		pthread_mutex_destroy(&keys[i].login_lock);
+#endif
+	}
+	free(threads);
+	free(keys);
+	return err;
+}
+
 static const char *p11_flag_names(struct flag_info *list, CK_FLAGS value)
 {
 	static char	buffer[1024];
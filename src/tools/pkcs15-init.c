@@ -833,7 +833,7 @@ do_store_private_key(struct sc_profile *profile)
 	struct sc_pkcs15init_prkeyargs args;
 	EVP_PKEY	*pkey = NULL;
 	X509		*cert[MAX_CERTS];
-	int		r, i, ncerts;
+	int		r, rv, i, ncerts;
 
 	if ((r = init_keyargs(&args)) < 0)
 		return r;
@@ -886,10 +886,10 @@ do_store_private_key(struct sc_profile *profile)
 		args.x509_usage = opt_x509_usage? opt_x509_usage : usage;
 	}
 
-	r = sc_pkcs15init_store_private_key(p15card, profile, &args, NULL);
+	/* Write the xDFs once, after storing the key and all certificates */
+	sc_pkcs15init_begin_batch(profile);
 
-	if (r < 0)
-		return r;
+	r = sc_pkcs15init_store_private_key(p15card, profile, &args, NULL);
 
 	/* If there are certificate as well (e.g. when reading the
 	 * private key from a PKCS #12 file) store them, too.
@@ -902,7 +902,7 @@ do_store_private_key(struct sc_profile *profile)
 
 		/* Encode the cert */
 		if ((r = do_convert_cert(&cargs.der_encoded, cert[i])) < 0)
-			return r;
+			break;
 
 		X509_check_purpose(cert[i], -1, -1);
 		cargs.x509_usage = cert[i]->ex_kusage;
@@ -932,10 +932,14 @@ next_cert:
 	}
 	
 	/* No certificates - store the public key */
-	if (ncerts == 0) {
+	if (ncerts == 0 && r >= 0) {
 		r = do_store_public_key(profile, pkey);
 	}
 
+	/* Write what has been stored, even after an error */
+	rv = sc_pkcs15init_end_batch(p15card, profile);
+	if (r >= 0)
+		r = rv;
 	return r;
 }
 
@@ -1215,6 +1219,7 @@ static int get_cert_info(sc_pkcs15_card_t *myp15card, sc_pkcs15_object_t *certob
 		*stop = 1; /* root -> no parent and hence no siblings */
 		goto done;
 	}
+	sc_pkcs15_decode_df_entries(myp15card, NULL);
 	for (otherobj = myp15card->obj_list; otherobj != NULL; otherobj = otherobj->next) {
 		if ((otherobj == certobj) ||
 			!((otherobj->type & SC_PKCS15_TYPE_CLASS_MASK) == SC_PKCS15_TYPE_CERT))